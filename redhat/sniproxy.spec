@@ -39,9 +39,11 @@ rm -rf $RPM_BUILD_ROOT
 %files
 %defattr(-,root,root,-)
 %{_sbindir}/sniproxy
+%{_bindir}/sniproxy-logdump
 %doc
 %{_mandir}/man8/sniproxy.8.gz
 %{_mandir}/man5/sniproxy.conf.5.gz
+%{_mandir}/man1/sniproxy-logdump.1.gz
 
 
 
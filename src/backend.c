@@ -28,14 +28,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/queue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <assert.h>
 #include "backend.h"
 #include "address.h"
 #include "logger.h"
+#include "proxy_protocol.h"
+#include "metrics.h"
+#include "probes.h"
 
 
 static void free_backend(struct Backend *);
-static const char *backend_config_options(const struct Backend *);
+static int init_backend_pool(struct Backend *, size_t);
+static int same_alpn(const struct Backend *, const struct Backend *);
+static int alpn_offered(const char *, size_t, const char *);
 
 
 struct Backend *
@@ -77,9 +84,43 @@ accept_backend_arg(struct Backend *backend, const char *arg) {
             err("Invalid port: %s", arg);
             return -1;
         }
-    } else if (backend->use_proxy_header == 0 &&
+    } else if (backend->use_proxy_header == PROXY_HEADER_NONE &&
         strcasecmp(arg, "proxy_protocol") == 0) {
-        backend->use_proxy_header = 1;
+        backend->use_proxy_header = PROXY_HEADER_V1;
+    } else if (backend->use_proxy_header == PROXY_HEADER_NONE &&
+        strcasecmp(arg, "proxy_protocol_v2") == 0) {
+        backend->use_proxy_header = PROXY_HEADER_V2;
+    } else if (backend->use_fastopen == 0 &&
+        strcasecmp(arg, "fastopen") == 0) {
+#ifndef TCP_FASTOPEN_CONNECT
+        err("TCP Fast Open to backends not supported in this build");
+        return -1;
+#endif
+        backend->use_fastopen = 1;
+    } else if (backend->affinity == AFFINITY_CLIENT &&
+        strcasecmp(arg, "affinity_hostname") == 0) {
+        backend->affinity = AFFINITY_HOSTNAME;
+    } else if (backend->health_check == HEALTH_CHECK_NONE &&
+        strcasecmp(arg, "health_check") == 0) {
+        backend->health_check = HEALTH_CHECK_TCP;
+    } else if (backend->health_check == HEALTH_CHECK_NONE &&
+        strcasecmp(arg, "health_check_tls") == 0) {
+        backend->health_check = HEALTH_CHECK_TLS;
+    } else if (backend->prewarm == 0 &&
+        strcasecmp(arg, "prewarm") == 0) {
+        backend->prewarm = PREWARM_DEFAULT_SIZE;
+    } else if (backend->alpn == NULL &&
+        strncasecmp(arg, "alpn=", 5) == 0) {
+        size_t len = strlen(arg + 5);
+        if (len == 0 || len > 255) {
+            err("Invalid ALPN protocol: %s", arg + 5);
+            return -1;
+        }
+        backend->alpn = strdup(arg + 5);
+        if (backend->alpn == NULL) {
+            err("strdup failed");
+            return -1;
+        }
     } else {
         err("Unexpected table backend argument: %s", arg);
         return -1;
@@ -101,8 +142,9 @@ init_backend(struct Backend *backend) {
         int reerr;
         size_t reerroffset;
 
+        /* Hostnames are looked up in lower case, patterns may be either */
         backend->pattern_re =
-            pcre2_compile((const uint8_t *)backend->pattern, PCRE2_ZERO_TERMINATED, 0, &reerr, &reerroffset, NULL);
+            pcre2_compile((const uint8_t *)backend->pattern, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS, &reerr, &reerroffset, NULL);
         if (backend->pattern_re == NULL) {
             err("Regex compilation of \"%s\" failed: %d, offset %zu",
                     backend->pattern, reerr, reerroffset);
@@ -112,8 +154,9 @@ init_backend(struct Backend *backend) {
         const char *reerr;
         int reerroffset;
 
+        /* Hostnames are looked up in lower case, patterns may be either */
         backend->pattern_re =
-            pcre_compile(backend->pattern, 0, &reerr, &reerroffset, NULL);
+            pcre_compile(backend->pattern, PCRE_CASELESS, &reerr, &reerroffset, NULL);
         if (backend->pattern_re == NULL) {
             err("Regex compilation of \"%s\" failed: %s, offset %d",
                     backend->pattern, reerr, reerroffset);
@@ -128,11 +171,164 @@ init_backend(struct Backend *backend) {
                     address, sizeof(address)));
     }
 
+    /* Health is tracked per address, which is meaningless for wildcards */
+    if (backend->health == NULL && !address_is_wildcard(backend->address)) {
+        backend->health = backend_health_ref_get(
+                obtain_backend_health(backend->address, backend->health_check));
+        if (backend->health == NULL)
+            return 0;
+    }
+
+    /* Like health, counted per address */
+    if (backend->metrics == NULL) {
+        char name[ADDRESS_BUFFER_SIZE];
+        backend->metrics = metrics_ref_get(obtain_metrics(METRICS_BACKEND,
+                    display_address(backend->address, name, sizeof(name))));
+        if (backend->metrics == NULL)
+            return 0;
+    }
+
+    /* A pre-warmed connection has already been opened when the PROXY
+     * header would need to be its first bytes, so the two are exclusive */
+    if (backend->prewarm > 0 && backend->prewarm_pool == NULL) {
+        if (backend->use_proxy_header)
+            warn("Pre-warming is incompatible with proxy_protocol, "
+                    "disabled for %s", backend->pattern);
+        else
+            backend->prewarm_pool = prewarm_pool_ref_get(
+                    obtain_prewarm_pool(backend->address, backend->prewarm));
+    }
+
+    return 1;
+}
+
+/*
+ * Group consecutive backends with identical patterns and ALPN protocols into
+ * pools and build each pool's Maglev lookup table. Only the first backend of
+ * a pool is ever returned by lookup_backend(), select_pool_backend() then
+ * picks the member.
+ *
+ * Returns 1 on success or 0 on error
+ */
+int
+init_backend_pools(struct Backend_head *head) {
+    struct Backend *iter = STAILQ_FIRST(head);
+    int result = 1;
+
+    while (iter != NULL) {
+        struct Backend *next = STAILQ_NEXT(iter, entries);
+        size_t pool_len = 1;
+
+        while (next != NULL && strcmp(iter->pattern, next->pattern) == 0 &&
+                same_alpn(iter, next)) {
+            next = STAILQ_NEXT(next, entries);
+            pool_len++;
+        }
+
+        if (pool_len > 1 && iter->pool == NULL &&
+                !init_backend_pool(iter, pool_len))
+            result = 0;
+
+        iter = next;
+    }
+
+    return result;
+}
+
+static int
+init_backend_pool(struct Backend *first, size_t pool_len) {
+    char (*names)[ADDRESS_BUFFER_SIZE] = calloc(pool_len, sizeof(*names));
+    const char **name_ptrs = calloc(pool_len, sizeof(char *));
+    struct Backend **pool = calloc(pool_len, sizeof(struct Backend *));
+    if (names == NULL || name_ptrs == NULL || pool == NULL) {
+        err("%s: calloc", __func__);
+        free(names);
+        free(name_ptrs);
+        free(pool);
+        return 0;
+    }
+
+    struct Backend *iter = first;
+    for (size_t i = 0; i < pool_len; i++) {
+        pool[i] = iter;
+        /* Permutations are seeded by the member address so a reload
+         * reproduces the same table for the same set of members */
+        name_ptrs[i] = display_address(iter->address, names[i], sizeof(names[i]));
+        iter = STAILQ_NEXT(iter, entries);
+    }
+
+    first->maglev = new_maglev(name_ptrs, pool_len);
+    free(names);
+    free(name_ptrs);
+    if (first->maglev == NULL) {
+        free(pool);
+        return 0;
+    }
+
+    first->pool = pool;
+    first->pool_len = pool_len;
+
+    debug("Pooled %zu backends for %s", pool_len, first->pattern);
+
     return 1;
 }
 
+/*
+ * Select the member of a backend pool for this client, backends not heading
+ * a pool are returned as is.
+ *
+ * Unhealthy members are skipped by rehashing the key with a different seed,
+ * so their clients are spread over the remaining members while every other
+ * client keeps its member. Should every rehash land on an unhealthy member
+ * the pool is scanned in order, and only when no member is healthy is the
+ * first choice returned, it may have recovered.
+ */
+const struct Backend *
+select_pool_backend(const struct Backend *backend,
+        const struct sockaddr *client_addr, const char *name, size_t name_len) {
+    const void *key = NULL;
+    size_t key_len = 0;
+
+    if (backend->pool == NULL)
+        return backend;
+
+    if (backend->affinity == AFFINITY_HOSTNAME) {
+        key = name;
+        key_len = name != NULL ? name_len : 0;
+    } else if (client_addr != NULL && client_addr->sa_family == AF_INET) {
+        key = &((const struct sockaddr_in *)client_addr)->sin_addr;
+        key_len = sizeof(struct in_addr);
+    } else if (client_addr != NULL && client_addr->sa_family == AF_INET6) {
+        key = &((const struct sockaddr_in6 *)client_addr)->sin6_addr;
+        key_len = sizeof(struct in6_addr);
+    }
+
+    const struct Backend *first = backend->pool[maglev_lookup(backend->maglev,
+            maglev_hash(key, key_len, 0))];
+    if (backend_is_healthy(first->health))
+        return first;
+
+    for (uint64_t seed = 1; seed <= 2 * backend->pool_len; seed++) {
+        const struct Backend *member = backend->pool[maglev_lookup(
+                backend->maglev, maglev_hash(key, key_len, seed))];
+        if (backend_is_healthy(member->health))
+            return member;
+    }
+
+    for (size_t i = 0; i < backend->pool_len; i++)
+        if (backend_is_healthy(backend->pool[i]->health))
+            return backend->pool[i];
+
+    return first;
+}
+
+/*
+ * Find the first backend whose pattern matches name and, if it has an ALPN
+ * protocol, which the client offered in the ALPN protocol name list alpn
+ */
 struct Backend *
-lookup_backend(const struct Backend_head *head, const char *name, size_t name_len) {
+lookup_backend(const struct Backend_head *head, const char *name,
+        size_t name_len, const char *alpn, size_t alpn_len) {
     struct Backend *iter;
 
     if (name == NULL) {
@@ -142,19 +338,27 @@ lookup_backend(const struct Backend_head *head, const char *name, size_t name_le
 
     STAILQ_FOREACH(iter, head, entries) {
         assert(iter->pattern_re != NULL);
+        if (iter->alpn != NULL && !alpn_offered(alpn, alpn_len, iter->alpn))
+            continue;
+
 #if defined(HAVE_LIBPCRE2_8)
 	pcre2_match_data *md = pcre2_match_data_create_from_pattern(iter->pattern_re, NULL);
 	int ret = pcre2_match(iter->pattern_re, (const uint8_t *)name, name_len, 0, 0, md, NULL);
 	pcre2_match_data_free(md);
-	if (ret >= 0)
+	if (ret >= 0) {
+            PROBE2(table_match, name, iter->pattern);
             return iter;
+        }
 #elif defined(HAVE_LIBPCRE)
         if (pcre_exec(iter->pattern_re, NULL,
-                    name, name_len, 0, 0, NULL, 0) >= 0)
+                    name, name_len, 0, 0, NULL, 0) >= 0) {
+            PROBE2(table_match, name, iter->pattern);
             return iter;
+        }
 #endif
     }
 
+    PROBE1(table_miss, name);
     return NULL;
 }
 
@@ -162,18 +366,33 @@ void
 print_backend_config(FILE *file, const struct Backend *backend) {
     char address[ADDRESS_BUFFER_SIZE];
 
-    fprintf(file, "\t%s %s%s\n",
+    fprintf(file, "\t%s %s",
             backend->pattern,
-            display_address(backend->address, address, sizeof(address)),
-            backend_config_options(backend));
-}
+            display_address(backend->address, address, sizeof(address)));
+
+    if (backend->use_proxy_header == PROXY_HEADER_V1)
+        fprintf(file, " proxy_protocol");
+    else if (backend->use_proxy_header == PROXY_HEADER_V2)
+        fprintf(file, " proxy_protocol_v2");
+
+    if (backend->use_fastopen)
+        fprintf(file, " fastopen");
+
+    if (backend->affinity == AFFINITY_HOSTNAME)
+        fprintf(file, " affinity_hostname");
 
-static const char *
-backend_config_options(const struct Backend *backend) {
-    if (backend->use_proxy_header)
-        return " proxy_protocol";
-    else
-        return "";
+    if (backend->health_check == HEALTH_CHECK_TCP)
+        fprintf(file, " health_check");
+    else if (backend->health_check == HEALTH_CHECK_TLS)
+        fprintf(file, " health_check_tls");
+
+    if (backend->prewarm > 0)
+        fprintf(file, " prewarm");
+
+    if (backend->alpn != NULL)
+        fprintf(file, " alpn=%s", backend->alpn);
+
+    fprintf(file, "\n");
 }
 
 void
@@ -189,6 +408,7 @@ free_backend(struct Backend *backend) {
 
     free(backend->pattern);
     free(backend->address);
+    free(backend->alpn);
 #if defined(HAVE_LIBPCRE2_8)
     if (backend->pattern_re != NULL)
         pcre2_code_free(backend->pattern_re);
@@ -196,5 +416,39 @@ free_backend(struct Backend *backend) {
     if (backend->pattern_re != NULL)
         pcre_free(backend->pattern_re);
 #endif
+    free(backend->pool);
+    free_maglev(backend->maglev);
+    backend_health_ref_put(backend->health);
+    prewarm_pool_ref_put(backend->prewarm_pool);
+    metrics_ref_put(backend->metrics);
     free(backend);
 }
+
+static int
+same_alpn(const struct Backend *a, const struct Backend *b) {
+    if (a->alpn == NULL || b->alpn == NULL)
+        return a->alpn == b->alpn;
+
+    return strcmp(a->alpn, b->alpn) == 0;
+}
+
+/* ALPN protocol identifiers are compared byte for byte, RFC 7301 3.1 */
+static int
+alpn_offered(const char *list, size_t list_len, const char *protocol) {
+    size_t protocol_len = strlen(protocol);
+    size_t pos = 0;
+
+    while (pos < list_len) {
+        size_t len = (uint8_t)list[pos];
+
+        if (pos + 1 + len > list_len)
+            break;
+        if (len == protocol_len &&
+                memcmp(list + pos + 1, protocol, len) == 0)
+            return 1;
+
+        pos += 1 + len;
+    }
+
+    return 0;
+}
@@ -37,6 +37,9 @@
 #endif
 
 #include "address.h"
+#include "maglev.h"
+#include "health.h"
+#include "prewarm.h"
 
 STAILQ_HEAD(Backend_head, Backend);
 
@@ -44,6 +47,14 @@ struct Backend {
     char *pattern;
     struct Address *address;
     int use_proxy_header;
+    int use_fastopen;
+    enum BackendAffinity {
+        AFFINITY_CLIENT,    /* hash on client address */
+        AFFINITY_HOSTNAME,  /* hash on requested hostname */
+    } affinity;
+    enum HealthCheck health_check;
+    size_t prewarm;     /* idle connections to keep open, 0 to disable */
+    char *alpn;         /* only match clients offering this protocol */
 
     /* Runtime fields */
 #if defined(HAVE_LIBPCRE2_8)
@@ -51,12 +62,24 @@ struct Backend {
 #elif defined(HAVE_LIBPCRE)
     pcre *pattern_re;
 #endif
+    /* Consecutive backends sharing a pattern form a pool, these are only
+     * set on the first backend of the pool */
+    struct Backend **pool;
+    size_t pool_len;
+    struct Maglev *maglev;
+    struct BackendHealth *health;
+    struct PrewarmPool *prewarm_pool;
+    struct Metrics *metrics;
     STAILQ_ENTRY(Backend) entries;
 };
 
 void add_backend(struct Backend_head *, struct Backend *);
 int init_backend(struct Backend *);
-struct Backend *lookup_backend(const struct Backend_head *, const char *, size_t);
+int init_backend_pools(struct Backend_head *);
+struct Backend *lookup_backend(const struct Backend_head *, const char *, size_t,
+        const char *, size_t);
+const struct Backend *select_pool_backend(const struct Backend *,
+        const struct sockaddr *, const char *, size_t);
 void print_backend_config(FILE *, const struct Backend *);
 void remove_backend(struct Backend_head *, struct Backend *);
 struct Backend *new_backend();
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include "binary_log.h"
+
+
+const struct BinaryLogFileHeader binary_log_file_header = {
+    .magic = BINARY_LOG_MAGIC,
+    .version = BINARY_LOG_VERSION,
+    .byte_order = BINARY_LOG_BYTE_ORDER,
+};
+
+const char *const binary_log_stage_names[BINARY_LOG_STAGES] = {
+    [BINARY_LOG_STAGE_PARSED] = "parsed",
+    [BINARY_LOG_STAGE_RESOLVING] = "resolving",
+    [BINARY_LOG_STAGE_RESOLVED] = "resolved",
+    [BINARY_LOG_STAGE_CONNECTED] = "connected",
+    [BINARY_LOG_STAGE_FIRST_BYTE_UP] = "first_byte_up",
+    [BINARY_LOG_STAGE_FIRST_BYTE_DOWN] = "first_byte_down",
+};
+
+
+void
+binary_log_address(struct BinaryLogAddress *dst, const struct sockaddr *sa) {
+    memset(dst, 0, sizeof(*dst));
+
+    if (sa == NULL)
+        return;
+
+    switch (sa->sa_family) {
+        case AF_INET:
+            dst->family = BINARY_LOG_AF_INET;
+            dst->port = ((const struct sockaddr_in *)sa)->sin_port;
+            memcpy(dst->addr, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+            break;
+        case AF_INET6:
+            dst->family = BINARY_LOG_AF_INET6;
+            dst->port = ((const struct sockaddr_in6 *)sa)->sin6_port;
+            dst->scope_id = ((const struct sockaddr_in6 *)sa)->sin6_scope_id;
+            memcpy(dst->addr, &((const struct sockaddr_in6 *)sa)->sin6_addr, 16);
+            break;
+        case AF_UNIX:
+            /* the path is not recorded */
+            dst->family = BINARY_LOG_AF_UNIX;
+            break;
+        default:
+            dst->family = BINARY_LOG_AF_UNSPEC;
+    }
+}
+
+/*
+ * Convert a logged address back to a socket address, for display_sockaddr()
+ */
+void
+binary_log_sockaddr(struct sockaddr_storage *dst, const struct BinaryLogAddress *src) {
+    memset(dst, 0, sizeof(*dst));
+
+    switch (src->family) {
+        case BINARY_LOG_AF_INET:
+            dst->ss_family = AF_INET;
+            ((struct sockaddr_in *)dst)->sin_port = src->port;
+            memcpy(&((struct sockaddr_in *)dst)->sin_addr, src->addr, 4);
+            break;
+        case BINARY_LOG_AF_INET6:
+            dst->ss_family = AF_INET6;
+            ((struct sockaddr_in6 *)dst)->sin6_port = src->port;
+            ((struct sockaddr_in6 *)dst)->sin6_scope_id = src->scope_id;
+            memcpy(&((struct sockaddr_in6 *)dst)->sin6_addr, src->addr, 16);
+            break;
+        case BINARY_LOG_AF_UNIX:
+            dst->ss_family = AF_UNIX;
+            break;
+        default:
+            dst->ss_family = AF_UNSPEC;
+    }
+}
+
+int64_t
+binary_log_time(double seconds) {
+    return (int64_t)(seconds * 1000000.0 + 0.5);
+}
+
+/*
+ * Format stage times as the text access log shows them: each stage's name
+ * followed by its time in seconds, or - if it was not reached, each
+ * preceded by a space.
+ *
+ * Returns the length of the formatted string, truncated to fit in len bytes.
+ */
+size_t
+format_binary_log_stages(char *buffer, size_t len, const uint32_t *stages) {
+    size_t pos = 0;
+
+    if (len == 0)
+        return 0;
+    buffer[0] = '\0';
+
+    for (int i = 0; i < BINARY_LOG_STAGES && pos < len; i++) {
+        int n;
+
+        if (stages[i] == 0)
+            n = snprintf(buffer + pos, len - pos, " %s -",
+                    binary_log_stage_names[i]);
+        else
+            n = snprintf(buffer + pos, len - pos, " %s %1.3f",
+                    binary_log_stage_names[i], (double)stages[i] / 1000000.0);
+        if (n < 0)
+            break;
+        pos += (size_t)n;
+    }
+
+    return pos < len ? pos : len - 1;
+}
+
+/*
+ * Append the hostname to a record with its other fields filled in, padding
+ * the record to a multiple of 8 bytes.
+ *
+ * Returns the length of the record, which must have room for
+ * BINARY_LOG_RECORD_MAX bytes.
+ */
+size_t
+finish_binary_log_record(struct BinaryLogRecord *record, uint16_t type,
+        const char *hostname, size_t hostname_len) {
+    if (hostname == NULL || hostname_len > 255)
+        hostname_len = 0;
+
+    size_t len = (sizeof(struct BinaryLogRecord) + hostname_len + 7) & ~(size_t)7;
+
+    memset(record->hostname, 0, len - sizeof(struct BinaryLogRecord));
+    if (hostname_len > 0)
+        memcpy(record->hostname, hostname, hostname_len);
+
+    record->len = (uint32_t)len;
+    record->type = type;
+    record->hostname_len = (uint16_t)hostname_len;
+
+    return len;
+}
+
+/*
+ * Returns 1 if data starts with a file header this build can read
+ */
+int
+check_binary_log_file_header(const void *data, size_t len) {
+    const struct BinaryLogFileHeader *header = data;
+
+    return len >= sizeof(*header) &&
+        memcmp(header->magic, BINARY_LOG_MAGIC, BINARY_LOG_MAGIC_LEN) == 0 &&
+        header->byte_order == BINARY_LOG_BYTE_ORDER &&
+        header->version == BINARY_LOG_VERSION;
+}
+
+/*
+ * Return the record at *offset within data and advance *offset past it, or
+ * NULL at the end of data or at a truncated or malformed record. data must
+ * be 8 byte aligned.
+ */
+const struct BinaryLogRecord *
+next_binary_log_record(const void *data, size_t len, size_t *offset) {
+    if (*offset % 8 != 0 || len < *offset ||
+            len - *offset < sizeof(struct BinaryLogRecord))
+        return NULL;
+
+    const struct BinaryLogRecord *record =
+        (const struct BinaryLogRecord *)((const char *)data + *offset);
+
+    if (record->len < sizeof(struct BinaryLogRecord) ||
+            record->len % 8 != 0 ||
+            record->len > len - *offset ||
+            record->hostname_len > record->len - sizeof(struct BinaryLogRecord))
+        return NULL;
+
+    *offset += record->len;
+
+    return record;
+}
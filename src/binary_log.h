@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef BINARY_LOG_H
+#define BINARY_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Binary access log format
+ *
+ * A file starts with a BinaryLogFileHeader, followed by records each
+ * starting with its length. Fields are in the byte order of the host which
+ * wrote the file, given by byte_order, and records are padded to a multiple
+ * of 8 bytes so a mapped file can be read in place.
+ */
+#define BINARY_LOG_MAGIC "SNIPROXY"
+#define BINARY_LOG_MAGIC_LEN 8
+#define BINARY_LOG_VERSION 2
+#define BINARY_LOG_BYTE_ORDER 0x01020304
+
+/* Record types */
+#define BINARY_LOG_CONNECTION   1   /* TCP connection */
+#define BINARY_LOG_FLOW         2   /* UDP flow */
+
+/* Address families, independent of the host's AF_ values */
+#define BINARY_LOG_AF_UNSPEC    0
+#define BINARY_LOG_AF_UNIX      1
+#define BINARY_LOG_AF_INET      4
+#define BINARY_LOG_AF_INET6     6
+
+/*
+ * Stages of a connection, each timed in microseconds after it was
+ * established, or 0 if the connection never reached it. Up is toward the
+ * backend and down toward the client.
+ */
+#define BINARY_LOG_STAGE_PARSED             0
+#define BINARY_LOG_STAGE_RESOLVING          1
+#define BINARY_LOG_STAGE_RESOLVED           2
+#define BINARY_LOG_STAGE_CONNECTED          3
+#define BINARY_LOG_STAGE_FIRST_BYTE_UP      4
+#define BINARY_LOG_STAGE_FIRST_BYTE_DOWN    5
+#define BINARY_LOG_STAGES                   6
+
+struct BinaryLogFileHeader {
+    char magic[BINARY_LOG_MAGIC_LEN];
+    uint32_t version;
+    uint32_t byte_order;
+};
+
+struct BinaryLogAddress {
+    uint8_t family;
+    uint8_t reserved;
+    uint16_t port;              /* network byte order */
+    uint32_t scope_id;
+    uint8_t addr[16];
+};
+
+struct BinaryLogRecord {
+    uint32_t len;               /* including hostname and padding */
+    uint16_t type;
+    uint16_t hostname_len;
+    int64_t established;        /* microseconds since the epoch */
+    int64_t duration;           /* microseconds */
+    uint64_t server_tx_bytes;
+    uint64_t server_rx_bytes;
+    uint64_t client_tx_bytes;
+    uint64_t client_rx_bytes;
+    struct BinaryLogAddress client;
+    struct BinaryLogAddress listener;
+    struct BinaryLogAddress server;
+    uint32_t stages[BINARY_LOG_STAGES];
+    char hostname[];
+};
+
+#define BINARY_LOG_RECORD_MAX (sizeof(struct BinaryLogRecord) + 256)
+
+extern const struct BinaryLogFileHeader binary_log_file_header;
+extern const char *const binary_log_stage_names[BINARY_LOG_STAGES];
+
+void binary_log_address(struct BinaryLogAddress *, const struct sockaddr *);
+void binary_log_sockaddr(struct sockaddr_storage *, const struct BinaryLogAddress *);
+int64_t binary_log_time(double);
+size_t format_binary_log_stages(char *, size_t, const uint32_t *);
+size_t finish_binary_log_record(struct BinaryLogRecord *, uint16_t,
+        const char *, size_t);
+int check_binary_log_file_header(const void *, size_t);
+const struct BinaryLogRecord *next_binary_log_record(const void *, size_t,
+        size_t *);
+
+#endif
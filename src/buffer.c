@@ -42,9 +42,14 @@
 
 static const size_t BUFFER_MAX_SIZE = 1024 * 1024 * 1024;
 
+/* Bytes of buffer storage currently allocated, for the stats endpoint */
+static size_t buffer_memory = 0;
+
 
 static size_t setup_write_iov(const struct Buffer *, struct iovec *, size_t);
-static size_t setup_read_iov(const struct Buffer *, struct iovec *, size_t);
+static size_t setup_read_iov(const struct Buffer *, struct iovec *, size_t, size_t);
+static size_t setup_send_iov(const struct Buffer *, struct iovec *);
+static void advance_send_position(struct Buffer *, size_t);
 static inline void advance_write_position(struct Buffer *, size_t);
 static inline void advance_read_position(struct Buffer *, size_t);
 
@@ -62,13 +67,16 @@ new_buffer(size_t size, struct ev_loop *loop) {
     buf->head = 0;
     buf->tx_bytes = 0;
     buf->rx_bytes = 0;
+    buf->splice_offset = 0;
+    buf->splice_len = 0;
     buf->last_recv = ev_now(loop);
     buf->last_send = ev_now(loop);
     buf->buffer = malloc(size);
     if (buf->buffer == NULL) {
         free(buf);
-        buf = NULL;
+        return NULL;
     }
+    buffer_memory += size;
 
     return buf;
 }
@@ -91,6 +99,7 @@ buffer_resize(struct Buffer *buf, size_t new_size) {
     buffer_peek(buf, new_buffer, new_size);
 
     free(buf->buffer);
+    buffer_memory += new_size - buffer_size(buf);
     buf->buffer = new_buffer;
     buf->size_mask = new_size - 1;
     buf->head = 0;
@@ -98,15 +107,47 @@ buffer_resize(struct Buffer *buf, size_t new_size) {
     return (ssize_t)buf->len;
 }
 
+/*
+ * Arrange for len bytes of data to be sent after the first offset bytes of
+ * the buffer content, without moving or copying the content itself. The
+ * splice is only honoured by buffer_send() and buffer_write(), and moves with
+ * the content when bytes are popped from or unshifted to its front.
+ *
+ * Returns 1 on success, 0 if a splice is already pending or the arguments
+ * do not fit.
+ */
+int
+buffer_splice(struct Buffer *buf, size_t offset, const void *data, size_t len) {
+    if (buf->splice_len > 0 || len == 0 || len > sizeof(buf->splice))
+        return 0;
+
+    /* content must follow the splice, so buffer_len() stays non-zero until
+     * the splice has been sent */
+    if (offset >= buf->len)
+        return 0;
+
+    memcpy(buf->splice, data, len);
+    buf->splice_offset = offset;
+    buf->splice_len = len;
+
+    return 1;
+}
+
 void
 free_buffer(struct Buffer *buf) {
     if (buf == NULL)
         return;
 
+    buffer_memory -= buffer_size(buf);
     free(buf->buffer);
     free(buf);
 }
 
+size_t
+buffer_memory_in_use(void) {
+    return buffer_memory;
+}
+
 ssize_t
 buffer_recv(struct Buffer *buffer, int sockfd, int flags, struct ev_loop *loop) {
     /* coalesce when reading into an empty buffer */
@@ -131,10 +172,10 @@ buffer_recv(struct Buffer *buffer, int sockfd, int flags, struct ev_loop *loop)
 
 ssize_t
 buffer_send(struct Buffer *buffer, int sockfd, int flags, struct ev_loop *loop) {
-    struct iovec iov[2];
+    struct iovec iov[5];
     struct msghdr msg = {
         .msg_iov = iov,
-        .msg_iovlen = setup_read_iov(buffer, iov, 0)
+        .msg_iovlen = setup_send_iov(buffer, iov)
     };
 
     ssize_t bytes = sendmsg(sockfd, &msg, flags);
@@ -142,7 +183,7 @@ buffer_send(struct Buffer *buffer, int sockfd, int flags, struct ev_loop *loop)
     buffer->last_send = ev_now(loop);
 
     if (bytes > 0)
-        advance_read_position(buffer, (size_t)bytes);
+        advance_send_position(buffer, (size_t)bytes);
 
     return bytes;
 }
@@ -171,12 +212,12 @@ buffer_read(struct Buffer *buffer, int fd) {
  */
 ssize_t
 buffer_write(struct Buffer *buffer, int fd) {
-    struct iovec iov[2];
-    size_t iov_len = setup_read_iov(buffer, iov, 0);
+    struct iovec iov[5];
+    size_t iov_len = setup_send_iov(buffer, iov);
     ssize_t bytes = writev(fd, iov, iov_len);
 
     if (bytes > 0)
-        advance_read_position(buffer, (size_t)bytes);
+        advance_send_position(buffer, (size_t)bytes);
 
     return bytes;
 }
@@ -200,6 +241,7 @@ buffer_coalesce(struct Buffer *buffer, const void **dst) {
     } else {
         /* buffer wrapped */
         size_t len = buffer->len;
+        size_t splice_offset = buffer->splice_offset;
         char *temp = malloc(len);
         if (temp != NULL) {
             buffer_pop(buffer, temp, len);
@@ -208,6 +250,7 @@ buffer_coalesce(struct Buffer *buffer, const void **dst) {
             buffer_push(buffer, temp, len);
             assert(buffer->head == 0);
             assert(buffer->len == len);
+            buffer->splice_offset = splice_offset;
 
             free(temp);
         }
@@ -224,7 +267,7 @@ buffer_peek(const struct Buffer *src, void *dst, size_t len) {
     struct iovec iov[2];
     size_t bytes_copied = 0;
 
-    size_t iov_len = setup_read_iov(src, iov, len);
+    size_t iov_len = setup_read_iov(src, iov, 0, len);
 
     for (size_t i = 0; i < iov_len; i++) {
         if (dst != NULL)
@@ -240,8 +283,12 @@ size_t
 buffer_pop(struct Buffer *src, void *dst, size_t len) {
     size_t bytes = buffer_peek(src, dst, len);
 
-    if (bytes > 0)
+    if (bytes > 0) {
         advance_read_position(src, bytes);
+        /* a pending splice stays with the content it precedes */
+        if (src->splice_len > 0)
+            src->splice_offset -= MIN(bytes, src->splice_offset);
+    }
 
     return bytes;
 }
@@ -271,6 +318,36 @@ buffer_push(struct Buffer *dst, const void *src, size_t len) {
     return bytes_appended;
 }
 
+/*
+ * Insert len bytes before the current content, for headers which can only be
+ * built after the content they precede has been received.
+ * Returns the number of bytes inserted, 0 if there is insufficient room.
+ */
+size_t
+buffer_unshift(struct Buffer *dst, const void *src, size_t len) {
+    struct iovec iov[2];
+    size_t bytes_inserted = 0;
+
+    if (len == 0 || buffer_room(dst) < len)
+        return 0;
+
+    dst->head = (dst->head - len) & dst->size_mask;
+    dst->len += len;
+    dst->rx_bytes += len;
+    if (dst->splice_len > 0)
+        dst->splice_offset += len;
+
+    size_t iov_len = setup_read_iov(dst, iov, 0, len);
+
+    for (size_t i = 0; i < iov_len; i++) {
+        memcpy(iov[i].iov_base, (const char *)src + bytes_inserted,
+                iov[i].iov_len);
+        bytes_inserted += iov[i].iov_len;
+    }
+
+    return bytes_inserted;
+}
+
 /*
  * Setup a struct iovec iov[2] for a write to a buffer.
  * struct iovec *iov MUST be at least length 2.
@@ -318,17 +395,25 @@ setup_write_iov(const struct Buffer *buffer, struct iovec *iov, size_t len) {
     }
 }
 
+/*
+ * Setup a struct iovec iov[2] for a read of up to len bytes from a buffer,
+ * skipping the first offset bytes of content.
+ * struct iovec *iov MUST be at least length 2.
+ * returns the number of entries setup
+ */
 static size_t
-setup_read_iov(const struct Buffer *buffer, struct iovec *iov, size_t len) {
-    if (buffer->len == 0)
+setup_read_iov(const struct Buffer *buffer, struct iovec *iov, size_t offset, size_t len) {
+    if (buffer->len <= offset)
         return 0;
 
-    size_t read_len = buffer->len;
+    size_t read_len = buffer->len - offset;
     if (len != 0)
-        read_len = MIN(len, buffer->len);
+        read_len = MIN(len, read_len);
+
+    size_t start = (buffer->head + offset) & buffer->size_mask;
 
-    if (buffer->head + read_len <= buffer_size(buffer)) {
-        iov[0].iov_base = buffer->buffer + buffer->head;
+    if (start + read_len <= buffer_size(buffer)) {
+        iov[0].iov_base = buffer->buffer + start;
         iov[0].iov_len = read_len;
 
         /* assert iov are within bounds, non-zero length and non-overlapping */
@@ -338,8 +423,8 @@ setup_read_iov(const struct Buffer *buffer, struct iovec *iov, size_t len) {
 
         return 1;
     } else {
-        iov[0].iov_base = buffer->buffer + buffer->head;
-        iov[0].iov_len = buffer_size(buffer) - buffer->head;
+        iov[0].iov_base = buffer->buffer + start;
+        iov[0].iov_len = buffer_size(buffer) - start;
         iov[1].iov_base = buffer->buffer;
         iov[1].iov_len = read_len - iov[0].iov_len;
 
@@ -355,6 +440,57 @@ setup_read_iov(const struct Buffer *buffer, struct iovec *iov, size_t len) {
     }
 }
 
+/*
+ * Setup a struct iovec iov[5] to send the buffer content, including any
+ * pending splice: content before the splice, the splice and the remaining
+ * content.
+ * returns the number of entries setup
+ */
+static size_t
+setup_send_iov(const struct Buffer *buffer, struct iovec *iov) {
+    if (buffer->splice_len == 0)
+        return setup_read_iov(buffer, iov, 0, 0);
+
+    size_t iov_len = 0;
+    if (buffer->splice_offset > 0)
+        iov_len = setup_read_iov(buffer, iov, 0, buffer->splice_offset);
+
+    iov[iov_len].iov_base = (char *)buffer->splice;
+    iov[iov_len].iov_len = buffer->splice_len;
+    iov_len++;
+
+    iov_len += setup_read_iov(buffer, iov + iov_len, buffer->splice_offset, 0);
+
+    return iov_len;
+}
+
+/*
+ * Consume bytes sent from iovecs setup by setup_send_iov()
+ */
+static void
+advance_send_position(struct Buffer *buffer, size_t bytes) {
+    if (buffer->splice_len == 0) {
+        advance_read_position(buffer, bytes);
+        return;
+    }
+
+    size_t before = MIN(bytes, buffer->splice_offset);
+    advance_read_position(buffer, before);
+    buffer->splice_offset -= before;
+    bytes -= before;
+
+    size_t spliced = MIN(bytes, buffer->splice_len);
+    if (spliced > 0) {
+        buffer->splice_len -= spliced;
+        memmove(buffer->splice, buffer->splice + spliced, buffer->splice_len);
+        buffer->tx_bytes += spliced;
+        bytes -= spliced;
+    }
+
+    if (bytes > 0)
+        advance_read_position(buffer, bytes);
+}
+
 static inline void
 advance_write_position(struct Buffer *buffer, size_t offset) {
     buffer->len += offset;
@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <ev.h>
 
+#define BUFFER_SPLICE_MAX 8
 
 struct Buffer {
     char *buffer;
@@ -40,6 +41,9 @@ struct Buffer {
     ev_tstamp last_send;
     size_t tx_bytes;
     size_t rx_bytes;
+    size_t splice_offset;   /* content bytes to send before the splice */
+    size_t splice_len;      /* splice bytes remaining to be sent */
+    char splice[BUFFER_SPLICE_MAX];
 };
 
 struct Buffer *new_buffer(size_t, struct ev_loop *);
@@ -50,10 +54,13 @@ ssize_t buffer_send(struct Buffer *, int, int, struct ev_loop *);
 ssize_t buffer_read(struct Buffer *, int);
 ssize_t buffer_write(struct Buffer *, int);
 ssize_t buffer_resize(struct Buffer *, size_t);
+int buffer_splice(struct Buffer *, size_t, const void *, size_t);
 size_t buffer_peek(const struct Buffer *, void *, size_t);
 size_t buffer_coalesce(struct Buffer *, const void **);
 size_t buffer_pop(struct Buffer *, void *, size_t);
 size_t buffer_push(struct Buffer *, const void *, size_t);
+size_t buffer_unshift(struct Buffer *, const void *, size_t);
+size_t buffer_memory_in_use(void);
 static inline size_t buffer_size(const struct Buffer *b) {
     return b->size_mask + 1;
 }
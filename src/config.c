@@ -24,25 +24,36 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <netinet/in.h>
 #include "cfg_parser.h"
 #include "config.h"
 #include "logger.h"
 #include "connection.h"
+#include "udp.h"
+#include "proxy_protocol.h"
+#include "binary_log.h"
 
 
 struct LoggerBuilder {
     const char *filename;
     const char *syslog_facility;
     int priority;
+    int async;
+    size_t buffer_size;
+    unsigned long flush_interval;   /* milliseconds */
+    int binary;
+    double sample;
 };
 
 static int accept_username(struct Config *, const char *);
 static int accept_groupname(struct Config *, const char *);
 static int accept_pidfile(struct Config *, const char *);
+static int accept_stats_address(struct Config *, const char *);
 static int end_listener_stanza(struct Config *, struct Listener *);
 static int end_table_stanza(struct Config *, struct Table *);
 static int end_backend(struct Table *, struct Backend *);
@@ -50,6 +61,12 @@ static struct LoggerBuilder *new_logger_builder();
 static int accept_logger_filename(struct LoggerBuilder *, const char *);
 static int accept_logger_syslog_facility(struct LoggerBuilder *, const char *);
 static int accept_logger_priority(struct LoggerBuilder *, const char *);
+static int accept_logger_async(struct LoggerBuilder *, const char *);
+static int accept_logger_buffer_size(struct LoggerBuilder *, const char *);
+static int accept_logger_flush_interval(struct LoggerBuilder *, const char *);
+static int accept_logger_format(struct LoggerBuilder *, const char *);
+static int accept_logger_sample(struct LoggerBuilder *, const char *);
+static int configure_logger(struct Logger *, const struct LoggerBuilder *);
 static int end_error_logger_stanza(struct Config *, struct LoggerBuilder *);
 static int end_global_access_logger_stanza(struct Config *, struct LoggerBuilder *);
 static int end_listener_access_logger_stanza(struct Listener *, struct LoggerBuilder *);
@@ -77,6 +94,26 @@ static const struct Keyword logger_stanza_grammar[] = {
         .keyword="priority",
         .parse_arg=(int(*)(void *, const char *))accept_logger_priority,
     },
+    {
+        .keyword="async",
+        .parse_arg=(int(*)(void *, const char *))accept_logger_async,
+    },
+    {
+        .keyword="buffer_size",
+        .parse_arg=(int(*)(void *, const char *))accept_logger_buffer_size,
+    },
+    {
+        .keyword="flush_interval",
+        .parse_arg=(int(*)(void *, const char *))accept_logger_flush_interval,
+    },
+    {
+        .keyword="format",
+        .parse_arg=(int(*)(void *, const char *))accept_logger_format,
+    },
+    {
+        .keyword="sample",
+        .parse_arg=(int(*)(void *, const char *))accept_logger_sample,
+    },
     {
         .keyword = NULL,
     },
@@ -109,10 +146,30 @@ static const struct Keyword listener_stanza_grammar[] = {
         .keyword="reuseport",
         .parse_arg=(int(*)(void *, const char *))accept_listener_reuseport,
     },
+    {
+        .keyword="defer_accept",
+        .parse_arg=(int(*)(void *, const char *))accept_listener_defer_accept,
+    },
+    {
+        .keyword="accept_proxy",
+        .parse_arg=(int(*)(void *, const char *))accept_listener_accept_proxy,
+    },
+    {
+        .keyword="fastopen",
+        .parse_arg=(int(*)(void *, const char *))accept_listener_fastopen,
+    },
     {
         .keyword="ipv6_v6only",
         .parse_arg=(int(*)(void *, const char *))accept_listener_ipv6_v6only,
     },
+    {
+        .keyword="max_request_size",
+        .parse_arg=(int(*)(void *, const char *))accept_listener_max_request_size,
+    },
+    {
+        .keyword="max_flows",
+        .parse_arg=(int(*)(void *, const char *))accept_listener_max_flows,
+    },
     {
         .keyword="table",
         .parse_arg=(int(*)(void *, const char *))accept_listener_table_name,
@@ -165,6 +222,10 @@ static struct Keyword global_grammar[] = {
         .keyword="pidfile",
         .parse_arg=(int(*)(void *, const char *))accept_pidfile,
     },
+    {
+        .keyword="stats",
+        .parse_arg=(int(*)(void *, const char *))accept_stats_address,
+    },
     {
         .keyword="resolver",
         .create=(void *(*)())new_resolver_config,
@@ -271,6 +332,7 @@ free_config(struct Config *config, struct ev_loop *loop) {
     free(config->user);
     free(config->group);
     free(config->pidfile);
+    free(config->stats_address);
 
     free_string_vector(config->resolver.nameservers);
     config->resolver.nameservers = NULL;
@@ -320,6 +382,13 @@ print_config(FILE *file, struct Config *config) {
     if (config->pidfile)
         fprintf(file, "pidfile %s\n\n", config->pidfile);
 
+    if (config->stats_address) {
+        char address[ADDRESS_BUFFER_SIZE];
+
+        fprintf(file, "stats %s\n\n", display_address(config->stats_address,
+                    address, sizeof(address)));
+    }
+
     print_resolver_config(file, &config->resolver);
 
     SLIST_FOREACH(listener, &config->listeners, entries) {
@@ -376,9 +445,57 @@ accept_pidfile(struct Config *config, const char *pidfile) {
     return 1;
 }
 
+/*
+ * The stats endpoint exposes internal state, so it is only offered on a unix
+ * socket or a loopback address
+ */
+static int
+accept_stats_address(struct Config *config, const char *address) {
+    if (config->stats_address != NULL) {
+        err("Duplicate stats address: %s", address);
+        return 0;
+    }
+
+    struct Address *stats_address = new_address(address);
+    if (stats_address == NULL || !address_is_sockaddr(stats_address)) {
+        err("Invalid stats address: %s", address);
+        free(stats_address);
+        return 0;
+    }
+
+    const struct sockaddr *sa = address_sa(stats_address);
+    int loopback = 0;
+    switch (sa->sa_family) {
+        case AF_UNIX:
+            loopback = 1;
+            break;
+        case AF_INET:
+            loopback = (ntohl(((const struct sockaddr_in *)sa)->sin_addr.s_addr)
+                    >> 24) == 127;
+            break;
+        case AF_INET6:
+            loopback = IN6_IS_ADDR_LOOPBACK(
+                    &((const struct sockaddr_in6 *)sa)->sin6_addr);
+            break;
+    }
+
+    if (!loopback || (sa->sa_family != AF_UNIX &&
+                address_port(stats_address) == 0)) {
+        err("Stats address must be a unix socket or a loopback address "
+                "and port: %s", address);
+        free(stats_address);
+        return 0;
+    }
+
+    config->stats_address = stats_address;
+
+    return 1;
+}
+
 static int
 end_listener_stanza(struct Config *config, struct Listener *listener) {
-    listener->accept_cb = &accept_connection;
+    listener->accept_cb = listener->protocol->datagram ?
+        &accept_udp_datagrams : &accept_connection;
 
     if (valid_listener(listener) <= 0) {
         err("Invalid listener");
@@ -410,8 +527,8 @@ static int
 end_backend(struct Table *table, struct Backend *backend) {
     /* TODO check backend */
 
-    table->use_proxy_header = table->use_proxy_header ||
-                              backend->use_proxy_header;
+    table->use_proxy_v1_header = table->use_proxy_v1_header ||
+            backend->use_proxy_header == PROXY_HEADER_V1;
     add_backend(&table->backends, backend);
 
     return 1;
@@ -428,6 +545,11 @@ new_logger_builder() {
     lb->filename = NULL;
     lb->syslog_facility = NULL;
     lb->priority = LOG_NOTICE;
+    lb->async = LOG_ASYNC_OFF;
+    lb->buffer_size = 0;
+    lb->flush_interval = 1000;
+    lb->binary = 0;
+    lb->sample = 1.0;
 
     return lb;
 }
@@ -479,11 +601,132 @@ accept_logger_priority(struct LoggerBuilder *lb, const char *priority) {
     return -1;
 }
 
+static int
+accept_logger_async(struct LoggerBuilder *lb, const char *async) {
+    const struct {
+        const char *name;
+        int policy;
+    } policies[] = {
+        { "drop",   LOG_ASYNC_DROP },
+        { "block",  LOG_ASYNC_BLOCK },
+        { "yes",    LOG_ASYNC_DROP },
+        { "on",     LOG_ASYNC_DROP },
+        { "no",     LOG_ASYNC_OFF },
+        { "off",    LOG_ASYNC_OFF },
+    };
+
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+        if (strcasecmp(policies[i].name, async) == 0) {
+            lb->async = policies[i].policy;
+            return 1;
+        }
+
+    return -1;
+}
+
+static int
+accept_logger_buffer_size(struct LoggerBuilder *lb, const char *size) {
+    if (!is_numeric(size)) {
+        err("Invalid buffer_size %s", size);
+        return -1;
+    }
+
+    unsigned long buffer_size = strtoul(size, NULL, 10);
+    if (buffer_size != 0 &&
+            (buffer_size < 4096 || buffer_size > 16 * 1024 * 1024)) {
+        err("buffer_size must be 0 or between 4096 and 16777216 bytes");
+        return -1;
+    }
+
+    lb->buffer_size = (size_t)buffer_size;
+
+    return 1;
+}
+
+static int
+accept_logger_flush_interval(struct LoggerBuilder *lb, const char *interval) {
+    if (!is_numeric(interval)) {
+        err("Invalid flush_interval %s", interval);
+        return -1;
+    }
+
+    unsigned long flush_interval = strtoul(interval, NULL, 10);
+    if (flush_interval < 1 || flush_interval > 60 * 1000) {
+        err("flush_interval must be between 1 and 60000 milliseconds");
+        return -1;
+    }
+
+    lb->flush_interval = flush_interval;
+
+    return 1;
+}
+
+static int
+accept_logger_format(struct LoggerBuilder *lb, const char *format) {
+    if (strcasecmp(format, "text") == 0)
+        lb->binary = 0;
+    else if (strcasecmp(format, "binary") == 0)
+        lb->binary = 1;
+    else
+        return -1;
+
+    return 1;
+}
+
+static int
+accept_logger_sample(struct LoggerBuilder *lb, const char *sample) {
+    char *end;
+    double fraction = strtod(sample, &end);
+
+    if (end == sample || *end != '\0' || !(fraction > 0.0 && fraction <= 1.0)) {
+        err("sample must be a fraction greater than 0 and at most 1");
+        return -1;
+    }
+
+    lb->sample = fraction;
+
+    return 1;
+}
+
+/*
+ * Apply the options of a logger stanza, shared by all three kinds of logger
+ */
+static int
+configure_logger(struct Logger *logger, const struct LoggerBuilder *lb) {
+    set_logger_priority(logger, lb->priority);
+
+    if (!set_logger_buffer(logger, lb->buffer_size,
+                (double)lb->flush_interval / 1000.0)) {
+        err("Buffered logging is only available for log files");
+        return 0;
+    }
+
+    if (!set_logger_async(logger, lb->async)) {
+        err("Asynchronous logging is only available for log files");
+        return 0;
+    }
+
+    if (!set_logger_binary(logger,
+                lb->binary ? &binary_log_file_header : NULL,
+                sizeof(binary_log_file_header))) {
+        err("Binary logging is only available for log files");
+        return 0;
+    }
+
+    set_logger_sample(logger, lb->sample);
+
+    return 1;
+}
+
 static int
 end_error_logger_stanza(struct Config *config __attribute__ ((unused)), struct LoggerBuilder *lb) {
     struct Logger *logger = NULL;
 
-    if (lb->filename != NULL && lb->syslog_facility == NULL)
+    if (lb->binary)
+        err("The binary format is only available for access logs");
+    else if (lb->sample < 1.0)
+        err("Sampling is only available for access logs");
+    else if (lb->filename != NULL && lb->syslog_facility == NULL)
         logger = new_file_logger(lb->filename);
     else if (lb->syslog_facility != NULL && lb->filename == NULL)
         logger = new_syslog_logger(lb->syslog_facility);
@@ -497,7 +740,13 @@ end_error_logger_stanza(struct Config *config __attribute__ ((unused)), struct L
         return -1;
     }
 
-    set_logger_priority(logger, lb->priority);
+    if (!configure_logger(logger, lb)) {
+        logger_ref_put(logger_ref_get(logger));
+        free((char *)lb->filename);
+        free((char *)lb->syslog_facility);
+        free(lb);
+        return -1;
+    }
     set_default_logger(logger);
 
     free((char *)lb->filename);
@@ -524,7 +773,13 @@ end_global_access_logger_stanza(struct Config *config, struct LoggerBuilder *lb)
         return -1;
     }
 
-    set_logger_priority(logger, lb->priority);
+    if (!configure_logger(logger, lb)) {
+        logger_ref_put(logger_ref_get(logger));
+        free((char *)lb->filename);
+        free((char *)lb->syslog_facility);
+        free(lb);
+        return -1;
+    }
     logger_ref_put(config->access_log);
     config->access_log = logger_ref_get(logger);
 
@@ -552,7 +807,13 @@ end_listener_access_logger_stanza(struct Listener *listener, struct LoggerBuilde
         return -1;
     }
 
-    set_logger_priority(logger, lb->priority);
+    if (!configure_logger(logger, lb)) {
+        logger_ref_put(logger_ref_get(logger));
+        free((char *)lb->filename);
+        free((char *)lb->syslog_facility);
+        free(lb);
+        return -1;
+    }
     logger_ref_put(listener->access_log);
     listener->access_log = logger_ref_get(logger);
 
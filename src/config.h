@@ -35,6 +35,7 @@ struct Config {
     char *user;
     char *group;
     char *pidfile;
+    struct Address *stats_address;
     struct ResolverConfig {
         char **nameservers;
         char **search;
@@ -29,10 +29,14 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h> /* tolower() */
+#include <time.h> /* clock_gettime() */
+#include <fnmatch.h>
 #include <sys/queue.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h> /* getaddrinfo */
 #include <unistd.h> /* close */
 #include <fcntl.h>
@@ -43,14 +47,44 @@
 #include "resolv.h"
 #include "address.h"
 #include "protocol.h"
+#include "health.h"
+#include "metrics.h"
+#include "prewarm.h"
+#include "proxy_protocol.h"
+#include "binary_log.h"
 #include "logger.h"
+#include "probes.h"
 
 
 #define IS_TEMPORARY_SOCKERR(_errno) (_errno == EAGAIN || \
                                       _errno == EWOULDBLOCK || \
                                       _errno == EINTR)
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+/* Limit on client data buffered before the server connection is established */
+#define CLIENT_STAGING_MAX (64 * 1024)
 
+/* Connections a dump examines per step, and the longest record it writes */
+#define CONNECTION_DUMP_BATCH 1024
+#define CONNECTION_DUMP_RECORD_MAX (3 * ADDRESS_BUFFER_SIZE + 512)
+
+
+/*
+ * A dump walks the connection list from the tail with a marker entry, one
+ * batch per step, so connections may come and go between steps. Active
+ * connections move to the head of the list, where the marker has yet to
+ * reach, so each connection records the last dump to see it.
+ */
+struct ConnectionDump {
+    struct Connection marker;
+    int state;
+    char *listener;
+    char *hostname;
+    ev_tstamp min_age;
+    struct ev_loop *loop;
+    unsigned int serial;
+    int header_done;
+    int done;
+};
 
 struct resolv_cb_data {
     struct Connection *connection;
@@ -61,10 +95,40 @@ struct resolv_cb_data {
 
 
 static TAILQ_HEAD(ConnectionHead, Connection) connections;
+/* Number of connections in each state, for the stats endpoint */
+static size_t connection_states[CLOSED + 1];
+static const char *const state_names[CLOSED + 1] = {
+    [NEW] = "new",
+    [ACCEPTED] = "accepted",
+    [PARSED] = "parsed",
+    [RESOLVING] = "resolving",
+    [RESOLVED] = "resolved",
+    [CONNECTED] = "connected",
+    [SERVER_CLOSED] = "server_closed",
+    [CLIENT_CLOSED] = "client_closed",
+    [CLOSED] = "closed",
+};
+/* Only one dump walks the list at a time */
+static struct ConnectionDump *active_dump;
+static unsigned int dump_serial;
+/* SIGUSR1 dump in progress */
+static struct {
+    struct ConnectionDump *dump;
+    FILE *file;
+    char filename[sizeof("/tmp/sniproxy-connections-XXXXXX")];
+    struct ev_timer timer;
+} file_dump;
+/* Requests are parsed here before a connection gets its buffers */
+static char peek_buffer[4096];
 
 
 static inline int client_socket_open(const struct Connection *);
 static inline int server_socket_open(const struct Connection *);
+static inline void set_state(struct Connection *, enum State);
+static ev_tstamp monotonic_now(void);
+static int mark_stage(struct Connection *, enum ConnectionStage);
+static ev_tstamp stage_interval(const struct Connection *,
+        enum ConnectionStage, enum ConnectionStage);
 
 static void reactivate_watcher(struct ev_loop *, struct ev_io *,
         const struct Buffer *, const struct Buffer *);
@@ -72,20 +136,45 @@ static void reactivate_watcher(struct ev_loop *, struct ev_io *,
 static void connection_cb(struct ev_loop *, struct ev_io *, int);
 static void resolv_cb(struct Address *, void *);
 static void reactivate_watchers(struct Connection *, struct ev_loop *);
+static void grow_staging_buffer(struct Connection *);
 static void insert_proxy_v1_header(struct Connection *);
+static int insert_proxy_v2_header(struct Connection *);
+static int peek_client_request(struct Connection *, struct ev_loop *);
+static int read_client_proxy_header(struct Connection *, struct ev_loop *);
+static int raise_client_rcvlowat(struct Connection *, int);
+static void reset_client_rcvlowat(struct Connection *);
+static void discard_connection(struct Connection *, struct ev_loop *);
+static int alloc_connection_buffers(struct Connection *, struct ev_loop *);
 static void parse_client_request(struct Connection *);
+static int parse_request(struct Connection *, const char *, size_t,
+        struct RequestInfo *);
+static int copy_request(struct Connection *, const char *, size_t,
+        const struct RequestInfo *);
+static void free_request_parser(struct Connection *);
 static void resolve_server_address(struct Connection *, struct ev_loop *);
 static void initiate_server_connect(struct Connection *, struct ev_loop *);
+static int take_prewarmed_socket(struct Connection *);
+static int open_server_socket(struct Connection *);
 static void close_connection(struct Connection *, struct ev_loop *);
 static void close_client_socket(struct Connection *, struct ev_loop *);
 static void abort_connection(struct Connection *);
 static void close_server_socket(struct Connection *, struct ev_loop *);
-static struct Connection *new_connection(struct ev_loop *);
+static struct Connection *new_connection();
+static void count_connection(const struct Connection *);
 static void log_connection(struct Connection *);
+static void log_connection_record(const struct Connection *, ev_tstamp);
 static void log_bad_request(struct Connection *, const char *, size_t, int);
 static void free_connection(struct Connection *);
-static void print_connection(FILE *, const struct Connection *);
+static void file_dump_cb(struct ev_loop *, struct ev_timer *, int);
+static void end_file_dump(struct ev_loop *);
+static int dump_matches(const struct ConnectionDump *,
+        const struct Connection *, ev_tstamp);
+static size_t format_connection(const struct Connection *, ev_tstamp,
+        char *, size_t);
+static const char *listener_name(const struct Listener *, char *, size_t);
 static void free_resolv_cb_data(struct resolv_cb_data *);
+static void report_server_connect(struct Connection *, int);
+static void server_connect_done(struct Connection *, int);
 
 
 void
@@ -100,7 +189,7 @@ init_connections() {
  */
 int
 accept_connection(struct Listener *listener, struct ev_loop *loop) {
-    struct Connection *con = new_connection(loop);
+    struct Connection *con = new_connection();
     if (con == NULL) {
         err("new_connection failed");
         return 0;
@@ -120,7 +209,8 @@ accept_connection(struct Listener *listener, struct ev_loop *loop) {
     if (sockfd < 0) {
         int saved_errno = errno;
 
-        warn("accept failed: %s", strerror(errno));
+        metrics_count(listener->metrics, METRIC_ACCEPT_ERRORS, 1);
+        warn_ratelimited("accept failed: %s", strerror(errno));
         free_connection(con);
 
         errno = saved_errno;
@@ -147,16 +237,21 @@ accept_connection(struct Listener *listener, struct ev_loop *loop) {
     struct ev_io *client_watcher = &con->client.watcher;
     ev_io_init(client_watcher, connection_cb, sockfd, EV_READ);
     con->client.watcher.data = con;
-    con->state = ACCEPTED;
+    set_state(con, ACCEPTED);
     con->established_timestamp = ev_now(loop);
+    con->accepted_monotonic = monotonic_now();
+    con->client_proxy_header = listener->accept_proxy;
+    metrics_count(listener->metrics, METRIC_CONNECTIONS, 1);
+    PROBE2(accept, con, sockfd);
 
     TAILQ_INSERT_HEAD(&connections, con, entries);
 
     ev_io_start(loop, client_watcher);
 
-    if (con->listener->table->use_proxy_header ||
-            con->listener->fallback_use_proxy_header)
-        insert_proxy_v1_header(con);
+    /* With deferred accept the request has normally arrived already, so
+     * process it now rather than waiting for the next loop iteration */
+    if (listener->defer_accept)
+        connection_cb(loop, client_watcher, EV_READ);
 
     return 1;
 }
@@ -167,6 +262,10 @@ accept_connection(struct Listener *listener, struct ev_loop *loop) {
 void
 free_connections(struct ev_loop *loop) {
     struct Connection *iter;
+
+    end_file_dump(loop);
+    end_connection_dump(active_dump);
+
     while ((iter = TAILQ_FIRST(&connections)) != NULL) {
         TAILQ_REMOVE(&connections, iter, entries);
         close_connection(iter, loop);
@@ -174,32 +273,275 @@ free_connections(struct ev_loop *loop) {
     }
 }
 
-/* dumps a list of all connections for debugging */
+/*
+ * Dump every connection to a file in /tmp, a batch at a time from a timer
+ * so the event loop keeps serving connections in between
+ */
 void
-print_connections() {
-    char filename[] = "/tmp/sniproxy-connections-XXXXXX";
+print_connections(struct ev_loop *loop) {
+    if (file_dump.dump != NULL) {
+        notice("Connection dump to %s still in progress", file_dump.filename);
+        return;
+    }
+
+    struct ConnectionFilter filter = { .state = -1 };
+    struct ConnectionDump *dump = start_connection_dump(&filter, loop);
+    if (dump == NULL) {
+        notice("Connection dump already in progress");
+        return;
+    }
 
-    int fd = mkstemp(filename);
+    strcpy(file_dump.filename, "/tmp/sniproxy-connections-XXXXXX");
+    int fd = mkstemp(file_dump.filename);
     if (fd < 0) {
         warn("mkstemp failed: %s", strerror(errno));
+        end_connection_dump(dump);
         return;
     }
 
-    FILE *temp = fdopen(fd, "w");
-    if (temp == NULL) {
+    file_dump.file = fdopen(fd, "w");
+    if (file_dump.file == NULL) {
         warn("fdopen failed: %s", strerror(errno));
+        close(fd);
+        end_connection_dump(dump);
         return;
     }
 
-    fprintf(temp, "Running connections:\n");
-    struct Connection *iter;
-    TAILQ_FOREACH(iter, &connections, entries)
-        print_connection(temp, iter);
+    file_dump.dump = dump;
+    ev_timer_init(&file_dump.timer, file_dump_cb, 0.0, 0.0);
+    ev_timer_start(loop, &file_dump.timer);
+}
+
+static void
+file_dump_cb(struct ev_loop *loop, struct ev_timer *w, int revents) {
+    char buffer[64 * 1024];
+    (void)revents;
+
+    size_t len = connection_dump_read(file_dump.dump, buffer, sizeof(buffer));
+    if (len > 0 && fwrite(buffer, 1, len, file_dump.file) != len)
+        warn("fwrite failed: %s", strerror(errno));
+
+    if (!connection_dump_done(file_dump.dump)) {
+        ev_timer_set(w, 0.0, 0.0);
+        ev_timer_start(loop, w);
+        return;
+    }
 
-    if (fclose(temp) < 0)
+    print_metrics(file_dump.file);
+    end_file_dump(loop);
+    notice("Dumped connections to %s", file_dump.filename);
+}
+
+static void
+end_file_dump(struct ev_loop *loop) {
+    if (file_dump.dump == NULL)
+        return;
+
+    ev_timer_stop(loop, &file_dump.timer);
+    end_connection_dump(file_dump.dump);
+    file_dump.dump = NULL;
+
+    if (fclose(file_dump.file) < 0)
         warn("fclose failed: %s", strerror(errno));
+    file_dump.file = NULL;
+}
+
+/*
+ * Begin dumping the connections matching a filter as tab separated records
+ *
+ * Returns NULL if another dump is in progress
+ */
+struct ConnectionDump *
+start_connection_dump(const struct ConnectionFilter *filter,
+        struct ev_loop *loop) {
+    if (active_dump != NULL)
+        return NULL;
+
+    struct ConnectionDump *dump = calloc(1, sizeof(struct ConnectionDump));
+    if (dump == NULL) {
+        err("%s: calloc", __func__);
+        return NULL;
+    }
+
+    dump->state = filter->state;
+    dump->min_age = filter->min_age;
+    dump->loop = loop;
+    dump->serial = ++dump_serial;
+
+    if (filter->listener != NULL)
+        dump->listener = strdup(filter->listener);
+    if (filter->hostname != NULL) {
+        /* hostnames are kept in lower case */
+        dump->hostname = strdup(filter->hostname);
+        for (char *c = dump->hostname; c != NULL && *c != '\0'; c++)
+            *c = (char)tolower((unsigned char)*c);
+    }
+    if ((filter->listener != NULL && dump->listener == NULL) ||
+            (filter->hostname != NULL && dump->hostname == NULL)) {
+        err("%s: strdup", __func__);
+        free(dump->listener);
+        free(dump->hostname);
+        free(dump);
+        return NULL;
+    }
+
+    TAILQ_INSERT_TAIL(&connections, &dump->marker, entries);
+    active_dump = dump;
+
+    return dump;
+}
+
+/*
+ * Fill the buffer with whole records, examining at most
+ * CONNECTION_DUMP_BATCH connections
+ *
+ * Returns the number of bytes written, which may be zero before the dump
+ * is done if no connection in the batch matched
+ */
+size_t
+connection_dump_read(struct ConnectionDump *dump, char *buffer, size_t len) {
+    static const char header[] = "# state\tlistener\tclient\tserver\t"
+        "hostname\tage\tclient_buffered\tclient_buffer_size\t"
+        "client_last_recv\tclient_last_send\tserver_buffered\t"
+        "server_buffer_size\tserver_last_recv\tserver_last_send\n";
+    char record[CONNECTION_DUMP_RECORD_MAX];
+    ev_tstamp now = ev_now(dump->loop);
+    size_t used = 0;
+
+    if (!dump->header_done) {
+        if (len < sizeof(header) - 1)
+            return 0;
+        memcpy(buffer, header, sizeof(header) - 1);
+        used = sizeof(header) - 1;
+        dump->header_done = 1;
+    }
+
+    for (int i = 0; !dump->done && i < CONNECTION_DUMP_BATCH; i++) {
+        struct Connection *con =
+            TAILQ_PREV(&dump->marker, ConnectionHead, entries);
+
+        if (con == NULL) {
+            TAILQ_REMOVE(&connections, &dump->marker, entries);
+            dump->done = 1;
+            break;
+        }
+
+        if (con->dump_serial != dump->serial && dump_matches(dump, con, now)) {
+            size_t record_len = format_connection(con, now, record,
+                    sizeof(record));
+            if (record_len > len - used)
+                break;
+            memcpy(buffer + used, record, record_len);
+            used += record_len;
+        }
+        con->dump_serial = dump->serial;
+
+        TAILQ_REMOVE(&connections, &dump->marker, entries);
+        TAILQ_INSERT_BEFORE(con, &dump->marker, entries);
+    }
+
+    return used;
+}
+
+int
+connection_dump_done(const struct ConnectionDump *dump) {
+    return dump->done;
+}
+
+void
+end_connection_dump(struct ConnectionDump *dump) {
+    if (dump == NULL)
+        return;
+
+    if (!dump->done)
+        TAILQ_REMOVE(&connections, &dump->marker, entries);
+    if (active_dump == dump)
+        active_dump = NULL;
+
+    free(dump->listener);
+    free(dump->hostname);
+    free(dump);
+}
+
+const char *
+connection_state_name(enum State state) {
+    return state_names[state];
+}
+
+/*
+ * Returns the state with the given name, or -1
+ */
+int
+connection_state_from_name(const char *name) {
+    for (int i = NEW; i <= CLOSED; i++)
+        if (strcmp(name, state_names[i]) == 0)
+            return i;
+
+    return -1;
+}
+
+/*
+ * Returns the number of connections in the given state
+ */
+size_t
+connections_in_state(enum State state) {
+    return connection_states[state];
+}
+
+static inline void
+set_state(struct Connection *con, enum State state) {
+    connection_states[con->state]--;
+    connection_states[state]++;
+    con->state = state;
+}
+
+/*
+ * The loop's cached ev_now() is the same for every stage reached within one
+ * iteration, so stages are timed from the clock itself
+ */
+static ev_tstamp
+monotonic_now(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        return ev_time();
+
+    return (ev_tstamp)ts.tv_sec + (ev_tstamp)ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Record the time a connection first reaches a stage, as a 32-bit offset in
+ * microseconds from accepted_monotonic. A stage reached within a microsecond
+ * of the accept still records 1us, 0 meaning not reached.
+ *
+ * Returns 1 if the stage was reached just now.
+ */
+static int
+mark_stage(struct Connection *con, enum ConnectionStage stage) {
+    if (con->stage_times[stage] != 0)
+        return 0;
+
+    ev_tstamp elapsed = (monotonic_now() - con->accepted_monotonic) * 1000000.0;
+    if (elapsed < 1.0)
+        con->stage_times[stage] = 1;
+    else if (elapsed >= (ev_tstamp)UINT32_MAX)
+        con->stage_times[stage] = UINT32_MAX;
+    else
+        con->stage_times[stage] = (uint32_t)elapsed;
+
+    return 1;
+}
 
-    notice("Dumped connections to %s", filename);
+/*
+ * Seconds between two stages, or 0 if the connection skipped the first
+ */
+static ev_tstamp
+stage_interval(const struct Connection *con, enum ConnectionStage from,
+        enum ConnectionStage to) {
+    if (con->stage_times[from] == 0 || con->stage_times[to] < con->stage_times[from])
+        return 0.0;
+
+    return (ev_tstamp)(con->stage_times[to] - con->stage_times[from]) / 1000000.0;
 }
 
 /*
@@ -241,6 +583,12 @@ static void
 connection_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
     struct Connection *con = (struct Connection *)w->data;
     int is_client = &con->client.watcher == w;
+
+    /* Connections are only given buffers once the request is complete */
+    if (is_client && con->client.buffer == NULL &&
+            !peek_client_request(con, loop))
+        return;
+
     const char *socket_name =
         is_client ? "client" : "server";
     struct Buffer *input_buffer =
@@ -250,31 +598,82 @@ connection_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
     void (*close_socket)(struct Connection *, struct ev_loop *) =
         is_client ? close_client_socket : close_server_socket;
 
+    /* First event on the server socket completes the non-blocking connect,
+     * unless fast open deferred the SYN to our first send */
+    if (!is_client && con->server_connecting && !con->server_fastopen) {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+
+        if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0)
+            error = errno;
+        server_connect_done(con, error);
+
+        if (error != 0) {
+            char server[INET6_ADDRSTRLEN + 8];
+            warn("Failed to open connection to %s: %s",
+                    display_sockaddr(&con->server.addr, server, sizeof(server)),
+                    strerror(error));
+
+            close_server_socket(con, loop);
+            buffer_push(con->server.buffer,
+                    con->listener->protocol->abort_message,
+                    con->listener->protocol->abort_message_len);
+            revents = 0;
+        }
+    }
+
     /* Receive first in case the socket was closed */
     if (revents & EV_READ && buffer_room(input_buffer)) {
         ssize_t bytes_received = buffer_recv(input_buffer, w->fd, 0, loop);
-        if (bytes_received < 0 && !IS_TEMPORARY_SOCKERR(errno)) {
+        int error = bytes_received < 0 ? errno : 0;
+        PROBE3(recv, con, is_client, bytes_received);
+        /* with fast open the first response, or error, completes the
+         * connect */
+        if (!is_client && con->server_connecting &&
+                (error == 0 || !IS_TEMPORARY_SOCKERR(error)))
+            server_connect_done(con, error);
+
+        if (bytes_received < 0 && !IS_TEMPORARY_SOCKERR(error)) {
             warn("recv(%s): %s, closing connection",
                     socket_name,
-                    strerror(errno));
+                    strerror(error));
 
             close_socket(con, loop);
             revents = 0; /* Clear revents so we don't try to send */
         } else if (bytes_received == 0) { /* peer closed socket */
             close_socket(con, loop);
             revents = 0;
+        } else if (bytes_received > 0 && !is_client &&
+                mark_stage(con, STAGE_FIRST_BYTE_DOWN) &&
+                !con->server_fastopen) {
+            /* a fast open connect completes with the first byte */
+            metrics_record(con->backend_metrics, METRIC_FIRST_BYTE_TIME,
+                    stage_interval(con, STAGE_CONNECTED,
+                            STAGE_FIRST_BYTE_DOWN));
         }
     }
 
     /* Transmit */
     if (revents & EV_WRITE && buffer_len(output_buffer)) {
         ssize_t bytes_transmitted = buffer_send(output_buffer, w->fd, 0, loop);
-        if (bytes_transmitted < 0 && !IS_TEMPORARY_SOCKERR(errno)) {
+        int error = bytes_transmitted < 0 ? errno : 0;
+        PROBE3(send, con, !is_client, bytes_transmitted);
+        /* without a fast open cookie the SYN goes out alone, and sends fail
+         * with EINPROGRESS until the handshake completes */
+        if (error == EINPROGRESS && !is_client && con->server_connecting)
+            error = EAGAIN;
+        if (!is_client && con->server_connecting &&
+                error != 0 && !IS_TEMPORARY_SOCKERR(error))
+            server_connect_done(con, error);
+
+        if (bytes_transmitted < 0 && !IS_TEMPORARY_SOCKERR(error)) {
             warn("send(%s): %s, closing connection",
                     socket_name,
-                    strerror(errno));
+                    strerror(error));
 
             close_socket(con, loop);
+        } else if (bytes_transmitted > 0 && !is_client) {
+            mark_stage(con, STAGE_FIRST_BYTE_UP);
         }
     }
     
@@ -295,8 +694,13 @@ connection_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
 
     if (con->state == CLOSED) {
         TAILQ_REMOVE(&connections, con, entries);
+        PROBE4(close, con,
+                binary_log_time(ev_now(loop) - con->established_timestamp),
+                con->client.buffer->rx_bytes, con->server.buffer->rx_bytes);
 
-        if (con->listener->access_log)
+        count_connection(con);
+        if (con->listener->access_log &&
+                logger_sample(con->listener->access_log))
             log_connection(con);
 
         free_connection(con);
@@ -312,9 +716,11 @@ reactivate_watchers(struct Connection *con, struct ev_loop *loop) {
     struct ev_io *server_watcher = &con->server.watcher;
 
     /* Reactivate watchers */
-    if (client_socket_open(con))
+    if (client_socket_open(con)) {
+        grow_staging_buffer(con);
         reactivate_watcher(loop, client_watcher,
                 con->client.buffer, con->server.buffer);
+    }
 
     if (server_socket_open(con))
         reactivate_watcher(loop, server_watcher,
@@ -335,6 +741,28 @@ reactivate_watchers(struct Connection *con, struct ev_loop *loop) {
     TAILQ_INSERT_HEAD(&connections, con, entries);
 }
 
+/*
+ * Until the server connection is established the client's data is staged in
+ * its buffer. Grow the buffer when it fills, up to CLIENT_STAGING_MAX, rather
+ * than stop reading, so a client sending early data along with its request is
+ * not stalled behind DNS resolution and the connect. Once connected
+ * everything staged is sent in a single sendmsg().
+ */
+static void
+grow_staging_buffer(struct Connection *con) {
+    struct Buffer *buffer = con->client.buffer;
+
+    if (con->state != PARSED && con->state != RESOLVING &&
+            con->state != RESOLVED &&
+            !(con->state == CONNECTED && con->server_connecting))
+        return;
+
+    if (buffer_room(buffer) == 0 && buffer_size(buffer) < CLIENT_STAGING_MAX &&
+            buffer_resize(buffer, buffer_size(buffer) * 2) < 0)
+        warn("Unable to grow client buffer to %zu bytes",
+                buffer_size(buffer) * 2);
+}
+
 static void
 reactivate_watcher(struct ev_loop *loop, struct ev_io *w,
         const struct Buffer *input_buffer,
@@ -430,11 +858,216 @@ insert_proxy_v1_header(struct Connection *con) {
     con->header_len += buffer_push(con->client.buffer, "\r\n", 2);
 }
 
+/*
+ * The PROXY v2 header carries the requested hostname and the client's most
+ * preferred ALPN protocol, so it is only built once the request is parsed
+ * and is inserted ahead of it in a single copy.
+ *
+ * Returns 1 on success, 0 if the client buffer could not make room.
+ */
+static int
+insert_proxy_v2_header(struct Connection *con) {
+    char header[PROXY_V2_HEADER_MAX];
+    const char *alpn = NULL;
+    size_t alpn_len = 0;
+
+    if (con->alpn_len > 0) {
+        alpn = con->alpn + 1;
+        alpn_len = (uint8_t)con->alpn[0];
+    }
+
+    size_t len = proxy_v2_header(header, sizeof(header),
+            &con->client.addr, &con->client.local_addr,
+            con->hostname, con->hostname_len, alpn, alpn_len);
+    if (len == 0)
+        return 0;
+
+    if (buffer_room(con->client.buffer) < len &&
+            buffer_resize(con->client.buffer,
+                buffer_size(con->client.buffer) * 2) < 0)
+        return 0;
+
+    return buffer_unshift(con->client.buffer, header, len) == len;
+}
+
+/*
+ * Peek at the client's request without consuming it, so clients which never
+ * send a complete request (scanners, idle or slow clients) only cost the
+ * Connection itself.
+ *
+ * Returns 1 once buffers have been allocated and the request should be
+ * processed normally, this includes requests that are invalid or too large
+ * and clients which closed or errored, or 0 to keep waiting.
+ */
+static int
+peek_client_request(struct Connection *con, struct ev_loop *loop) {
+    int sockfd = con->client.watcher.fd;
+
+    if (con->client_proxy_header && !read_client_proxy_header(con, loop))
+        return 0;
+
+    ssize_t len = recv(sockfd, peek_buffer, sizeof(peek_buffer), MSG_PEEK);
+    if (len < 0 && IS_TEMPORARY_SOCKERR(errno))
+        return 0;
+
+    if (len > 0 && (size_t)len < sizeof(peek_buffer)) {
+        struct RequestInfo info;
+        int result = parse_request(con, peek_buffer, (size_t)len, &info);
+
+        /* The peeked data stays readable, so until more arrives raise the
+         * low water mark to avoid being woken for it again */
+        if (result == -1 && raise_client_rcvlowat(con, (int)len + 1))
+            return 0;
+
+        /* Keep the outcome, so parse_client_request() need not parse the
+         * same bytes again once they are received into the buffer */
+        if (result != -1) {
+            con->peek_result = result;
+            con->peek_len = (size_t)len;
+            con->peek_modify_pos = info.modify_pos;
+        }
+    }
+
+    reset_client_rcvlowat(con);
+
+    if (!alloc_connection_buffers(con, loop)) {
+        char client[INET6_ADDRSTRLEN + 8];
+        err_ratelimited("Unable to allocate buffers, closing connection from %s",
+                display_sockaddr(&con->client.addr, client, sizeof(client)));
+
+        discard_connection(con, loop);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Consume the PROXY header an upstream load balancer sent ahead of the
+ * client's request and adopt the client and destination addresses it
+ * carries. Only the header is read from the socket, the request stays queued
+ * in the kernel to be peeked as usual.
+ *
+ * Returns 1 once the header has been consumed, or 0 to keep waiting or after
+ * closing a connection with an invalid header.
+ */
+static int
+read_client_proxy_header(struct Connection *con, struct ev_loop *loop) {
+    int sockfd = con->client.watcher.fd;
+    struct sockaddr_storage src, dst;
+    char client[INET6_ADDRSTRLEN + 8];
+
+    ssize_t len = recv(sockfd, peek_buffer, sizeof(peek_buffer), MSG_PEEK);
+    if (len < 0 && IS_TEMPORARY_SOCKERR(errno))
+        return 0;
+
+    if (len <= 0) {
+        /* closed or errored before sending a header */
+        discard_connection(con, loop);
+        return 0;
+    }
+
+    int result = parse_proxy_header(peek_buffer, (size_t)len, &src, &dst);
+    /* As in peek_client_request(), wait for the rest of the header only if
+     * we will not be woken again for the bytes already peeked */
+    if (result == -1 && (size_t)len < sizeof(peek_buffer) &&
+            raise_client_rcvlowat(con, (int)len + 1))
+        return 0;
+
+    if (result == -1) {
+        warn_ratelimited("Incomplete PROXY header from %s, closing connection",
+                display_sockaddr(&con->client.addr, client, sizeof(client)));
+        discard_connection(con, loop);
+        return 0;
+    }
+
+    if (result < 0) {
+        warn_ratelimited("Invalid PROXY header from %s, closing connection",
+                display_sockaddr(&con->client.addr, client, sizeof(client)));
+        discard_connection(con, loop);
+        return 0;
+    }
+
+    if (recv(sockfd, peek_buffer, (size_t)result, 0) != result) {
+        warn("recv(client): %s, closing connection", strerror(errno));
+        discard_connection(con, loop);
+        return 0;
+    }
+
+    if (src.ss_family != AF_UNSPEC) {
+        socklen_t addr_len = src.ss_family == AF_INET ?
+                sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+
+        con->client.addr = src;
+        con->client.addr_len = addr_len;
+        con->client.local_addr = dst;
+        con->client.local_addr_len = addr_len;
+    }
+
+    con->client_proxy_header = 0;
+    reset_client_rcvlowat(con);
+
+    return 1;
+}
+
+/*
+ * Only wake for the client once lowat bytes are readable, while the
+ * lowat - 1 bytes already peeked are incomplete.
+ *
+ * Returns 1 on success, 0 if the socket option is not supported.
+ */
+static int
+raise_client_rcvlowat(struct Connection *con, int lowat) {
+    if (setsockopt(con->client.watcher.fd, SOL_SOCKET, SO_RCVLOWAT,
+                &lowat, sizeof(lowat)) < 0)
+        return 0;
+
+    con->client_rcvlowat = 1;
+    return 1;
+}
+
+static void
+reset_client_rcvlowat(struct Connection *con) {
+    int lowat = 1;
+
+    if (!con->client_rcvlowat)
+        return;
+
+    if (setsockopt(con->client.watcher.fd, SOL_SOCKET, SO_RCVLOWAT,
+                &lowat, sizeof(lowat)) < 0)
+        warn("setsockopt SO_RCVLOWAT failed: %s", strerror(errno));
+    con->client_rcvlowat = 0;
+}
+
+/*
+ * Close and free a connection which has not been given buffers yet
+ */
+static void
+discard_connection(struct Connection *con, struct ev_loop *loop) {
+    ev_io_stop(loop, &con->client.watcher);
+    close(con->client.watcher.fd);
+    TAILQ_REMOVE(&connections, con, entries);
+    free_connection(con);
+}
+
+static int
+alloc_connection_buffers(struct Connection *con, struct ev_loop *loop) {
+    con->client.buffer = new_buffer(4096, loop);
+    con->server.buffer = new_buffer(4096, loop);
+    if (con->client.buffer == NULL || con->server.buffer == NULL)
+        return 0;
+
+    if (con->listener->table->use_proxy_v1_header ||
+            con->listener->fallback_use_proxy_header == PROXY_HEADER_V1)
+        insert_proxy_v1_header(con);
+
+    return 1;
+}
+
 static void
 parse_client_request(struct Connection *con) {
     const char *payload;
     size_t payload_len = buffer_coalesce(con->client.buffer, (const void **)&payload);
-    char *hostname = NULL;
 
     /* Avoid payload_len underflow and empty request */
     if (payload_len <= con->header_len)
@@ -442,21 +1075,30 @@ parse_client_request(struct Connection *con) {
 
     payload += con->header_len;
     payload_len -= con->header_len;
-    size_t modify_pos = 0;
-    int result = con->listener->protocol->parse_packet(payload, payload_len, &hostname, &modify_pos);
-    if (result > 0 && con->listener->protocol->modify_packet && modify_pos > 0) {
-        char *modify_payload;
-        size_t modify_payload_len = buffer_coalesce(con->client.buffer, (const void **)&modify_payload);
-        modify_payload_len = buffer_resize(con->client.buffer, modify_payload_len + 5);
-        con->client.buffer->len += 5;
-        con->client.buffer->rx_bytes += 5;
-        modify_payload_len = buffer_coalesce(con->client.buffer, (const void **)&modify_payload);
-        if (modify_payload_len <= con->header_len)
-            return;
-        modify_payload += con->header_len;
-        modify_payload_len -= con->header_len;
-        con->listener->protocol->modify_packet(modify_payload, modify_payload_len, &hostname, &modify_pos);
+    struct RequestInfo info;
+    int result;
+    if (con->peek_len > 0 && payload_len >= con->peek_len) {
+        /* parsed while peeking, the hostname and ALPN are already copied */
+        result = con->peek_result;
+        info = (struct RequestInfo){ .modify_pos = con->peek_modify_pos };
+        con->peek_len = 0;
+    } else {
+        result = parse_request(con, payload, payload_len, &info);
+    }
+    if (result > 0 && con->listener->protocol->split_packet &&
+            info.modify_pos > 0) {
+        char header[BUFFER_SPLICE_MAX];
+        size_t header_len = 0;
+        size_t split = con->listener->protocol->split_packet(
+                (char *)payload, payload_len, info.modify_pos,
+                header, &header_len);
+
+        if (split > 0 &&
+                buffer_splice(con->client.buffer, con->header_len + split,
+                    header, header_len))
+            debug("Splitting request for %s at offset %zu", con->hostname, split);
     }
+    PROBE3(parse, con, result, con->hostname);
     if (result < 0) {
         char client[INET6_ADDRSTRLEN + 8];
 
@@ -464,14 +1106,29 @@ parse_client_request(struct Connection *con) {
             if (buffer_room(con->client.buffer) > 0)
                 return; /* give client a chance to send more data */
 
-            warn("Request from %s exceeded %zu byte buffer size",
+            /* Grow the buffer for large requests, up to the listener's
+             * limit */
+            size_t size = buffer_size(con->client.buffer);
+            if (size < con->header_len + con->listener->max_request_size &&
+                    buffer_resize(con->client.buffer, size * 2) >= 0)
+                return;
+
+            metrics_parse_failure(con->listener->metrics, result);
+            warn_ratelimited("Request from %s exceeded %zu byte buffer size",
                     display_sockaddr(&con->client.addr, client, sizeof(client)),
                     buffer_size(con->client.buffer));
+        } else if (result == -6) {
+            metrics_parse_failure(con->listener->metrics, result);
+            warn_ratelimited("Request from %s exceeded %zu byte request size limit",
+                    display_sockaddr(&con->client.addr, client, sizeof(client)),
+                    con->listener->max_request_size);
         } else if (result == -2) {
-            warn("Request from %s did not include a hostname",
+            metrics_parse_failure(con->listener->metrics, result);
+            warn_ratelimited("Request from %s did not include a hostname",
                     display_sockaddr(&con->client.addr, client, sizeof(client)));
         } else {
-            warn("Unable to parse request from %s: parse_packet returned %d",
+            metrics_parse_failure(con->listener->metrics, result);
+            warn_ratelimited("Unable to parse request from %s: parse_packet returned %d",
                     display_sockaddr(&con->client.addr, client, sizeof(client)),
                     result);
 
@@ -483,11 +1140,18 @@ parse_client_request(struct Connection *con) {
             abort_connection(con);
             return;
         }
+
+        con->hostname = NULL;
+        con->hostname_len = 0;
+        con->alpn_len = 0;
     }
 
-    con->hostname = hostname;
-    con->hostname_len = (size_t)result;
-    con->state = PARSED;
+    free_request_parser(con);
+
+    mark_stage(con, STAGE_PARSED);
+    metrics_record(con->listener->metrics, METRIC_PARSE_TIME,
+            (ev_tstamp)con->stage_times[STAGE_PARSED] / 1000000.0);
+    set_state(con, PARSED);
 }
 
 static void
@@ -498,13 +1162,106 @@ abort_connection(struct Connection *con) {
             con->listener->protocol->abort_message,
             con->listener->protocol->abort_message_len);
 
-    con->state = SERVER_CLOSED;
+    set_state(con, SERVER_CLOSED);
+}
+
+/*
+ * Parse the request received so far. The first attempt uses the protocol's
+ * stateless parser, so requests which arrive complete never allocate parser
+ * state. If that finds the request incomplete and the protocol has a
+ * resumable parser, it takes over and is only given the bytes it has not
+ * seen yet on later calls. data must always start at the beginning of the
+ * request.
+ *
+ * On success the hostname and ALPN protocol list are copied to the connection.
+ */
+static int
+parse_request(struct Connection *con, const char *data, size_t data_len,
+        struct RequestInfo *info) {
+    const struct Protocol *protocol = con->listener->protocol;
+    const char *hostname = NULL;
+    int result;
+
+    *info = (struct RequestInfo){ .alpn = NULL };
+
+    if (con->parser == NULL) {
+        result = protocol->parse_packet(data, data_len, &hostname, info);
+        if (result >= 0)
+            return copy_request(con, hostname, (size_t)result, info);
+        if (result != -1 || protocol->new_parser == NULL)
+            return result;
+
+        con->parser = protocol->new_parser(con->listener->max_request_size);
+        if (con->parser == NULL)
+            return -4;
+        con->parser_protocol = protocol;
+        con->parsed_len = 0;
+    }
+
+    if (data_len <= con->parsed_len)
+        return -1;
+
+    result = con->parser_protocol->parse_more(con->parser,
+            data + con->parsed_len, data_len - con->parsed_len,
+            &hostname, info);
+    con->parsed_len = data_len;
+
+    /* the hostname may point into the parser */
+    if (result >= 0)
+        result = copy_request(con, hostname, (size_t)result, info);
+
+    if (result != -1)
+        free_request_parser(con);
+
+    return result;
+}
+
+/*
+ * Keep a lower case copy of the hostname, and the ALPN protocol list, as the
+ * request they point into is forwarded and the buffer reused once the
+ * connection is established
+ */
+static int
+copy_request(struct Connection *con, const char *hostname, size_t len,
+        const struct RequestInfo *info) {
+    if (len >= sizeof(con->hostname_buf))
+        return -5;
+
+    for (size_t i = 0; i < len; i++)
+        con->hostname_buf[i] = (char)tolower((unsigned char)hostname[i]);
+    con->hostname_buf[len] = '\0';
+
+    con->hostname = con->hostname_buf;
+    con->hostname_len = len;
+
+    con->alpn_len = 0;
+    if (info->alpn != NULL) {
+        con->alpn_len = alpn_list_prefix(info->alpn, info->alpn_len,
+                sizeof(con->alpn));
+        memcpy(con->alpn, info->alpn, con->alpn_len);
+    }
+
+    return (int)len;
+}
+
+static void
+free_request_parser(struct Connection *con) {
+    if (con->parser == NULL)
+        return;
+
+    con->parser_protocol->free_parser(con->parser);
+    con->parser = NULL;
+    con->parser_protocol = NULL;
+    con->parsed_len = 0;
 }
 
 static void
 resolve_server_address(struct Connection *con, struct ev_loop *loop) {
     struct LookupResult result =
-        listener_lookup_server_address(con->listener, con->hostname, con->hostname_len);
+        listener_lookup_server_address(con->listener,
+                (const struct sockaddr *)&con->client.addr,
+                con->hostname, con->hostname_len,
+                con->alpn, con->alpn_len);
 
     if (result.address == NULL) {
         abort_connection(con);
@@ -538,6 +1295,10 @@ resolve_server_address(struct Connection *con, struct ev_loop *loop) {
         cb_data->cb_free_addr = result.caller_free_address;
         cb_data->loop = loop;
         con->use_proxy_header = result.use_proxy_header;
+        con->use_fastopen = result.use_fastopen;
+        con->health = backend_health_ref_get(result.health);
+        con->backend_metrics = metrics_ref_get(result.metrics);
+        mark_stage(con, STAGE_RESOLVING);
 
         int resolv_mode = RESOLV_MODE_DEFAULT;
         if (con->listener->transparent_proxy) {
@@ -564,7 +1325,7 @@ resolve_server_address(struct Connection *con, struct ev_loop *loop) {
                 resolv_mode, resolv_cb,
                 (void (*)(void *))free_resolv_cb_data, cb_data);
 
-        con->state = RESOLVING;
+        set_state(con, RESOLVING);
 #endif
     } else if (address_is_sockaddr(result.address)) {
         con->server.addr_len = address_sa_len(result.address);
@@ -572,11 +1333,16 @@ resolve_server_address(struct Connection *con, struct ev_loop *loop) {
         memcpy(&con->server.addr, address_sa(result.address),
             con->server.addr_len);
         con->use_proxy_header = result.use_proxy_header;
+        con->use_fastopen = result.use_fastopen;
+        con->health = backend_health_ref_get(result.health);
+        con->prewarm = prewarm_pool_ref_get(result.prewarm);
+        con->backend_metrics = metrics_ref_get(result.metrics);
 
         if (result.caller_free_address)
             free((void *)result.address);
 
-        con->state = RESOLVED;
+        mark_stage(con, STAGE_RESOLVED);
+        set_state(con, RESOLVED);
     } else {
         /* invalid address type */
         assert(0);
@@ -594,8 +1360,13 @@ resolv_cb(struct Address *result, void *data) {
         return;
     }
 
+    mark_stage(con, STAGE_RESOLVED);
+    metrics_record(con->backend_metrics, METRIC_DNS_TIME,
+            stage_interval(con, STAGE_RESOLVING, STAGE_RESOLVED));
+
     if (result == NULL) {
-        notice("unable to resolve %s, closing connection",
+        metrics_count(con->backend_metrics, METRIC_DNS_ERRORS, 1);
+        notice_ratelimited("unable to resolve %s, closing connection",
                 address_hostname(cb_data->address));
         abort_connection(con);
     } else {
@@ -608,7 +1379,7 @@ resolv_cb(struct Address *result, void *data) {
         assert(con->server.addr_len <= sizeof(con->server.addr));
         memcpy(&con->server.addr, address_sa(result), con->server.addr_len);
 
-        con->state = RESOLVED;
+        set_state(con, RESOLVED);
 
         initiate_server_connect(con, loop);
     }
@@ -617,6 +1388,40 @@ resolv_cb(struct Address *result, void *data) {
     reactivate_watchers(con, loop);
 }
 
+/*
+ * The connect to the server completed, successfully if error is 0
+ */
+static void
+server_connect_done(struct Connection *con, int error) {
+    con->server_connecting = 0;
+    report_server_connect(con, error == 0);
+    PROBE2(connect_done, con, error);
+
+    if (error != 0)
+        return;
+
+    mark_stage(con, STAGE_CONNECTED);
+    metrics_count(con->backend_metrics, METRIC_CONNECTIONS, 1);
+    /* a fast open handshake is not observed apart from the first response */
+    if (!con->server_fastopen)
+        metrics_record(con->backend_metrics, METRIC_CONNECT_TIME,
+                stage_interval(con, STAGE_RESOLVED, STAGE_CONNECTED));
+}
+
+/*
+ * Report the outcome of connecting to the backend to its health tracker and
+ * metrics, only the first outcome of each connection counts
+ */
+static void
+report_server_connect(struct Connection *con, int success) {
+    if (!success)
+        metrics_count(con->backend_metrics, METRIC_CONNECT_FAILURES, 1);
+
+    backend_health_report(con->health, success);
+    backend_health_ref_put(con->health);
+    con->health = NULL;
+}
+
 static void
 free_resolv_cb_data(struct resolv_cb_data *cb_data) {
     if (cb_data->cb_free_addr)
@@ -626,6 +1431,74 @@ free_resolv_cb_data(struct resolv_cb_data *cb_data) {
 
 static void
 initiate_server_connect(struct Connection *con, struct ev_loop *loop) {
+    if (con->header_len && con->use_proxy_header != PROXY_HEADER_V1) {
+        /* If we prepended the PROXY v1 header and this backend isn't
+         * configured to receive it, consume it now */
+        buffer_pop(con->client.buffer, NULL, con->header_len);
+    }
+
+    if (con->use_proxy_header == PROXY_HEADER_V2 &&
+            !insert_proxy_v2_header(con)) {
+        char client[INET6_ADDRSTRLEN + 8];
+        warn("Unable to insert PROXY v2 header, closing connection from %s",
+                display_sockaddr(&con->client.addr, client, sizeof(client)));
+        abort_connection(con);
+        return;
+    }
+
+    int sockfd = take_prewarmed_socket(con);
+    if (sockfd < 0)
+        sockfd = open_server_socket(con);
+    if (sockfd < 0)
+        return; /* connection aborted */
+
+    if (getsockname(sockfd, (struct sockaddr *)&con->server.local_addr,
+                &con->server.local_addr_len) != 0) {
+        close(sockfd);
+        warn("getsockname failed: %s", strerror(errno));
+
+        abort_connection(con);
+        return;
+    }
+
+
+    PROBE3(connect_start, con, sockfd, &con->server.addr);
+
+    struct ev_io *server_watcher = &con->server.watcher;
+    ev_io_init(server_watcher, connection_cb, sockfd, EV_WRITE);
+    con->server.watcher.data = con;
+    set_state(con, CONNECTED);
+    con->server_connecting = 1;
+
+    ev_io_start(loop, server_watcher);
+}
+
+/*
+ * Use an idle connection pre-established to this backend if there is one.
+ * These are connected from an arbitrary local address, so they are not
+ * eligible when the listener binds a source or transparent address.
+ */
+static int
+take_prewarmed_socket(struct Connection *con) {
+    int sockfd = -1;
+
+    if (con->prewarm != NULL && !con->use_proxy_header &&
+            !con->listener->transparent_proxy &&
+            con->listener->source_address == NULL)
+        sockfd = prewarm_take(con->prewarm);
+
+    prewarm_pool_ref_put(con->prewarm);
+    con->prewarm = NULL;
+
+    return sockfd;
+}
+
+/*
+ * Create a socket and start connecting it to the server, returns the socket
+ * or -1 after aborting the connection
+ */
+static int
+open_server_socket(struct Connection *con) {
 #ifdef HAVE_ACCEPT4
     int sockfd = socket(con->server.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
 #else
@@ -637,7 +1510,7 @@ initiate_server_connect(struct Connection *con, struct ev_loop *loop) {
                 strerror(errno),
                 display_sockaddr(&con->client.addr, client, sizeof(client)));
         abort_connection(con);
-        return;
+        return -1;
     }
 
 #ifndef HAVE_ACCEPT4
@@ -659,7 +1532,7 @@ initiate_server_connect(struct Connection *con, struct ev_loop *loop) {
             err("setsockopt IP_TRANSPARENT failed: %s", strerror(errno));
             close(sockfd);
             abort_connection(con);
-            return;
+            return -1;
         }
 
         result = bind(sockfd, (struct sockaddr *)&con->client.addr,
@@ -668,7 +1541,7 @@ initiate_server_connect(struct Connection *con, struct ev_loop *loop) {
             err("bind failed: %s", strerror(errno));
             close(sockfd);
             abort_connection(con);
-            return;
+            return -1;
         }
     } else if (con->listener->source_address) {
         int on = 1;
@@ -677,7 +1550,7 @@ initiate_server_connect(struct Connection *con, struct ev_loop *loop) {
             err("setsockopt SO_REUSEADDR failed: %s", strerror(errno));
             close(sockfd);
             abort_connection(con);
-            return;
+            return -1;
         }
 
         int tries = 5;
@@ -693,10 +1566,24 @@ initiate_server_connect(struct Connection *con, struct ev_loop *loop) {
             err("bind failed: %s", strerror(errno));
             close(sockfd);
             abort_connection(con);
-            return;
+            return -1;
         }
     }
 
+#ifdef TCP_FASTOPEN_CONNECT
+    if (con->use_fastopen) {
+        /* connect() then returns immediately and the SYN is deferred to our
+         * first write, so the buffered request rides in it */
+        int on = 1;
+        if (setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                    &on, sizeof(on)) < 0)
+            debug("setsockopt TCP_FASTOPEN_CONNECT failed: %s",
+                    strerror(errno));
+        else
+            con->server_fastopen = 1;
+    }
+#endif
+
     int result = connect(sockfd,
             (struct sockaddr *)&con->server.addr,
             con->server.addr_len);
@@ -707,31 +1594,12 @@ initiate_server_connect(struct Connection *con, struct ev_loop *loop) {
         warn("Failed to open connection to %s: %s",
                 display_sockaddr(&con->server.addr, server, sizeof(server)),
                 strerror(errno));
+        report_server_connect(con, 0);
         abort_connection(con);
-        return;
-    }
-
-    if (getsockname(sockfd, (struct sockaddr *)&con->server.local_addr,
-                &con->server.local_addr_len) != 0) {
-        close(sockfd);
-        warn("getsockname failed: %s", strerror(errno));
-
-        abort_connection(con);
-        return;
+        return -1;
     }
 
-    if (con->header_len && !con->use_proxy_header) {
-        /* If we prepended the PROXY header and this backend isn't configured
-         * to receive it, consume it now */
-        buffer_pop(con->client.buffer, NULL, con->header_len);
-    }
-
-    struct ev_io *server_watcher = &con->server.watcher;
-    ev_io_init(server_watcher, connection_cb, sockfd, EV_WRITE);
-    con->server.watcher.data = con;
-    con->state = CONNECTED;
-
-    ev_io_start(loop, server_watcher);
+    return sockfd;
 }
 
 /* Close client socket.
@@ -749,7 +1617,7 @@ close_client_socket(struct Connection *con, struct ev_loop *loop) {
 
     if (con->state == RESOLVING) {
         resolv_cancel(con->query_handle);
-        con->state = PARSED;
+        set_state(con, PARSED);
     }
 
     /* next state depends on previous state */
@@ -758,9 +1626,9 @@ close_client_socket(struct Connection *con, struct ev_loop *loop) {
             || con->state == PARSED
             || con->state == RESOLVING
             || con->state == RESOLVED)
-        con->state = CLOSED;
+        set_state(con, CLOSED);
     else
-        con->state = CLIENT_CLOSED;
+        set_state(con, CLIENT_CLOSED);
 }
 
 /* Close server socket.
@@ -778,9 +1646,9 @@ close_server_socket(struct Connection *con, struct ev_loop *loop) {
 
     /* next state depends on previous state */
     if (con->state == CLIENT_CLOSED)
-        con->state = CLOSED;
+        set_state(con, CLOSED);
     else
-        con->state = SERVER_CLOSED;
+        set_state(con, SERVER_CLOSED);
 }
 
 static void
@@ -807,12 +1675,13 @@ close_connection(struct Connection *con, struct ev_loop *loop) {
  * Allocate and initialize a new connection
  */
 static struct Connection *
-new_connection(struct ev_loop *loop) {
+new_connection() {
     struct Connection *con = calloc(1, sizeof(struct Connection));
     if (con == NULL)
         return NULL;
 
     con->state = NEW;
+    connection_states[NEW]++;
     con->client.addr_len = sizeof(con->client.addr);
     con->client.local_addr = (struct sockaddr_storage){.ss_family = AF_UNSPEC};
     con->client.local_addr_len = sizeof(con->client.local_addr);
@@ -822,22 +1691,51 @@ new_connection(struct ev_loop *loop) {
     con->hostname = NULL;
     con->hostname_len = 0;
     con->header_len = 0;
+    con->parser = NULL;
+    con->parser_protocol = NULL;
+    con->parsed_len = 0;
+    con->peek_result = 0;
+    con->peek_len = 0;
+    con->peek_modify_pos = 0;
     con->query_handle = NULL;
+    con->health = NULL;
+    con->prewarm = NULL;
+    con->backend_metrics = NULL;
+    memset(con->stage_times, 0, sizeof(con->stage_times));
     con->use_proxy_header = 0;
+    con->use_fastopen = 0;
+    con->client_rcvlowat = 0;
+    con->client_proxy_header = 0;
+    con->server_connecting = 0;
+    con->server_fastopen = 0;
+    con->client.buffer = NULL;
+    con->server.buffer = NULL;
 
-    con->client.buffer = new_buffer(4096, loop);
-    if (con->client.buffer == NULL) {
-        free_connection(con);
-        return NULL;
-    }
+    return con;
+}
 
-    con->server.buffer = new_buffer(4096, loop);
-    if (con->server.buffer == NULL) {
-        free_connection(con);
-        return NULL;
+/*
+ * Add a closed connection's traffic to its listener and backend metrics
+ */
+static void
+count_connection(const struct Connection *con) {
+    ev_tstamp duration = MAX(con->client.buffer->last_recv,
+                             con->server.buffer->last_recv) -
+                         con->established_timestamp;
+    struct Metrics *listener = con->listener->metrics;
+    struct Metrics *backend = con->backend_metrics;
+
+    /* Each buffer receives from one socket and sends to the other */
+    metrics_count(listener, METRIC_BYTES_IN, con->client.buffer->rx_bytes);
+    metrics_count(listener, METRIC_BYTES_OUT, con->server.buffer->tx_bytes);
+    metrics_record(listener, METRIC_DURATION, duration);
+
+    /* only once a server socket was opened */
+    if (con->server.local_addr.ss_family != AF_UNSPEC) {
+        metrics_count(backend, METRIC_BYTES_IN, con->server.buffer->rx_bytes);
+        metrics_count(backend, METRIC_BYTES_OUT, con->client.buffer->tx_bytes);
+        metrics_record(backend, METRIC_DURATION, duration);
     }
-
-    return con;
 }
 
 static void
@@ -848,15 +1746,21 @@ log_connection(struct Connection *con) {
     char client_address[ADDRESS_BUFFER_SIZE];
     char listener_address[ADDRESS_BUFFER_SIZE];
     char server_address[ADDRESS_BUFFER_SIZE];
+    char stages[256];
 
+    if (logger_is_binary(con->listener->access_log)) {
+        log_connection_record(con, duration);
+        return;
+    }
 
     display_sockaddr(&con->client.addr, client_address, sizeof(client_address));
     display_sockaddr(&con->client.local_addr, listener_address, sizeof(listener_address));
     display_sockaddr(&con->server.addr, server_address, sizeof(server_address));
+    format_binary_log_stages(stages, sizeof(stages), con->stage_times);
 
     log_msg(con->listener->access_log,
            LOG_NOTICE,
-           "%s -> %s -> %s [%.*s] %zu/%zu bytes tx %zu/%zu bytes rx %1.3f seconds",
+           "%s -> %s -> %s [%.*s] %zu/%zu bytes tx %zu/%zu bytes rx %1.3f seconds%s",
            client_address,
            listener_address,
            server_address,
@@ -866,7 +1770,38 @@ log_connection(struct Connection *con) {
            con->server.buffer->rx_bytes,
            con->client.buffer->tx_bytes,
            con->client.buffer->rx_bytes,
-           duration);
+           duration,
+           stages);
+}
+
+/*
+ * The fields of log_connection() as a binary record, without formatting the
+ * addresses
+ */
+static void
+log_connection_record(const struct Connection *con, ev_tstamp duration) {
+    uint64_t buf[BINARY_LOG_RECORD_MAX / sizeof(uint64_t)];
+    struct BinaryLogRecord *record = (struct BinaryLogRecord *)buf;
+
+    record->established = binary_log_time(con->established_timestamp);
+    record->duration = binary_log_time(duration);
+    record->server_tx_bytes = con->server.buffer->tx_bytes;
+    record->server_rx_bytes = con->server.buffer->rx_bytes;
+    record->client_tx_bytes = con->client.buffer->tx_bytes;
+    record->client_rx_bytes = con->client.buffer->rx_bytes;
+    binary_log_address(&record->client,
+            (const struct sockaddr *)&con->client.addr);
+    binary_log_address(&record->listener,
+            (const struct sockaddr *)&con->client.local_addr);
+    binary_log_address(&record->server,
+            (const struct sockaddr *)&con->server.addr);
+    assert(sizeof(record->stages) == sizeof(con->stage_times));
+    memcpy(record->stages, con->stage_times, sizeof(record->stages));
+
+    size_t len = finish_binary_log_record(record, BINARY_LOG_CONNECTION,
+            con->hostname, con->hostname_len);
+
+    log_record(con->listener->access_log, LOG_NOTICE, record, len);
 }
 
 static void
@@ -905,61 +1840,97 @@ free_connection(struct Connection *con) {
     if (con == NULL)
         return;
 
+    connection_states[con->state]--;
     listener_ref_put(con->listener);
+    backend_health_ref_put(con->health);
+    prewarm_pool_ref_put(con->prewarm);
+    metrics_ref_put(con->backend_metrics);
+    free_request_parser(con);
     free_buffer(con->client.buffer);
     free_buffer(con->server.buffer);
-    free((void *)con->hostname); /* cast away const'ness */
     free(con);
 }
 
-static void
-print_connection(FILE *file, const struct Connection *con) {
-    char client[INET6_ADDRSTRLEN + 8];
-    char server[INET6_ADDRSTRLEN + 8];
+static int
+dump_matches(const struct ConnectionDump *dump, const struct Connection *con,
+        ev_tstamp now) {
+    char address[ADDRESS_BUFFER_SIZE];
 
-    switch (con->state) {
-        case NEW:
-            fprintf(file, "NEW           -\t-\n");
-            break;
-        case ACCEPTED:
-            fprintf(file, "ACCEPTED      %s %zu/%zu\t-\n",
-                    display_sockaddr(&con->client.addr, client, sizeof(client)),
-                    buffer_len(con->client.buffer), buffer_size(con->client.buffer));
-            break;
-        case PARSED:
-            fprintf(file, "PARSED        %s %zu/%zu\t-\n",
-                    display_sockaddr(&con->client.addr, client, sizeof(client)),
-                    buffer_len(con->client.buffer), buffer_size(con->client.buffer));
-            break;
-        case RESOLVING:
-            fprintf(file, "RESOLVING      %s %zu/%zu\t-\n",
-                    display_sockaddr(&con->client.addr, client, sizeof(client)),
-                    buffer_len(con->client.buffer), buffer_size(con->client.buffer));
-            break;
-        case RESOLVED:
-            fprintf(file, "RESOLVED      %s %zu/%zu\t-\n",
-                    display_sockaddr(&con->client.addr, client, sizeof(client)),
-                    buffer_len(con->client.buffer), buffer_size(con->client.buffer));
-            break;
-        case CONNECTED:
-            fprintf(file, "CONNECTED     %s %zu/%zu\t%s %zu/%zu\n",
-                    display_sockaddr(&con->client.addr, client, sizeof(client)),
-                    buffer_len(con->client.buffer), buffer_size(con->client.buffer),
-                    display_sockaddr(&con->server.addr, server, sizeof(server)),
-                    buffer_len(con->server.buffer), buffer_size(con->server.buffer));
-            break;
-        case SERVER_CLOSED:
-            fprintf(file, "SERVER_CLOSED %s %zu/%zu\t-\n",
-                    display_sockaddr(&con->client.addr, client, sizeof(client)),
-                    buffer_len(con->client.buffer), buffer_size(con->client.buffer));
-            break;
-        case CLIENT_CLOSED:
-            fprintf(file, "CLIENT_CLOSED -\t%s %zu/%zu\n",
-                    display_sockaddr(&con->server.addr, server, sizeof(server)),
-                    buffer_len(con->server.buffer), buffer_size(con->server.buffer));
-            break;
-        case CLOSED:
-            fprintf(file, "CLOSED        -\t-\n");
+    if (dump->state >= 0 && con->state != (enum State)dump->state)
+        return 0;
+
+    if (now - con->established_timestamp < dump->min_age)
+        return 0;
+
+    if (dump->listener != NULL && strcmp(dump->listener,
+                listener_name(con->listener, address, sizeof(address))) != 0)
+        return 0;
+
+    if (dump->hostname != NULL && (con->hostname == NULL ||
+                fnmatch(dump->hostname, con->hostname, 0) != 0))
+        return 0;
+
+    return 1;
+}
+
+/*
+ * Format a connection as a tab separated record, with the occupancy and
+ * the time since data was last received and sent of each buffer. The
+ * client buffer holds data from the client and the server buffer data
+ * from the server.
+ */
+static size_t
+format_connection(const struct Connection *con, ev_tstamp now, char *record,
+        size_t len) {
+    char listener[ADDRESS_BUFFER_SIZE];
+    char client[ADDRESS_BUFFER_SIZE] = "-";
+    char server[ADDRESS_BUFFER_SIZE] = "-";
+    char hostname[sizeof(con->hostname_buf)] = "-";
+    const struct Buffer *buffers[] = { con->client.buffer, con->server.buffer };
+
+    if (con->client.addr.ss_family != AF_UNSPEC)
+        display_sockaddr(&con->client.addr, client, sizeof(client));
+    if (con->server.addr.ss_family != AF_UNSPEC)
+        display_sockaddr(&con->server.addr, server, sizeof(server));
+
+    /* keep the record on one line whatever the client sent */
+    if (con->hostname != NULL && con->hostname_len > 0) {
+        for (size_t i = 0; i < con->hostname_len; i++)
+            hostname[i] = isgraph((unsigned char)con->hostname[i]) ?
+                con->hostname[i] : '?';
+        hostname[con->hostname_len] = '\0';
+    }
+
+    int used = snprintf(record, len, "%s\t%s\t%s\t%s\t%s\t%.3f",
+            state_names[con->state],
+            listener_name(con->listener, listener, sizeof(listener)),
+            client, server, hostname, now - con->established_timestamp);
+
+    for (size_t i = 0; i < sizeof(buffers) / sizeof(buffers[0]); i++) {
+        if (used < 0 || (size_t)used >= len)
             break;
+
+        if (buffers[i] == NULL)
+            used += snprintf(record + used, len - (size_t)used, "\t-\t-\t-\t-");
+        else
+            used += snprintf(record + used, len - (size_t)used,
+                    "\t%zu\t%zu\t%.3f\t%.3f",
+                    buffer_len(buffers[i]), buffer_size(buffers[i]),
+                    now - buffers[i]->last_recv, now - buffers[i]->last_send);
     }
+
+    if (used < 0 || (size_t)used >= len - 1)
+        return 0;
+
+    record[used++] = '\n';
+
+    return (size_t)used;
+}
+
+static const char *
+listener_name(const struct Listener *listener, char *buffer, size_t len) {
+    if (listener->metrics != NULL)
+        return listener->metrics->name;
+
+    return display_address(listener->address, buffer, len);
 }
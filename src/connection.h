@@ -26,11 +26,27 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/queue.h>
 #include <ev.h>
 #include "listener.h"
 #include "buffer.h"
+#include "protocol.h"
+
+/*
+ * Stages timed for each connection, in the order the binary access log
+ * records them. Up is toward the server and down toward the client.
+ */
+enum ConnectionStage {
+    STAGE_PARSED,
+    STAGE_RESOLVING,        /* DNS query started */
+    STAGE_RESOLVED,
+    STAGE_CONNECTED,        /* connect to server completed */
+    STAGE_FIRST_BYTE_UP,    /* first byte sent to the server */
+    STAGE_FIRST_BYTE_DOWN,  /* first byte received from the server */
+    CONNECTION_STAGES
+};
 
 struct Connection {
     enum State {
@@ -52,19 +68,58 @@ struct Connection {
         struct Buffer *buffer;
     } client, server;
     struct Listener *listener;
-    const char *hostname; /* Requested hostname */
+    const char *hostname; /* Requested hostname, NULL or hostname_buf */
     size_t hostname_len;
+    char hostname_buf[256];
+    char alpn[ALPN_LIST_LEN];   /* ALPN protocol name list, as on the wire */
+    size_t alpn_len;
     size_t header_len;
+    void *parser;           /* incremental request parser, while incomplete */
+    const struct Protocol *parser_protocol;
+    size_t parsed_len;      /* request bytes already fed to parser */
+    int peek_result;        /* parse_request() result of the peeked request */
+    size_t peek_len;        /* bytes peek_result was parsed from, 0 if none */
+    size_t peek_modify_pos;
     struct ResolvQuery *query_handle;
+    struct BackendHealth *health; /* until connect outcome is reported */
+    struct PrewarmPool *prewarm; /* until the server socket is opened */
+    struct Metrics *backend_metrics;
     ev_tstamp established_timestamp;
+    ev_tstamp accepted_monotonic;
+    /* microseconds after accepted_monotonic, 0 until reached */
+    uint32_t stage_times[CONNECTION_STAGES];
     int use_proxy_header;
+    int use_fastopen;
+    int client_rcvlowat; /* raised while waiting for a complete request */
+    int client_proxy_header; /* inbound PROXY header not yet consumed */
+    int server_connecting; /* non-blocking connect to server in progress */
+    int server_fastopen; /* connect deferred to the first send */
+    unsigned int dump_serial; /* last connection dump to include this */
 
     TAILQ_ENTRY(Connection) entries;
 };
 
+/* Selects connections to dump, unset fields match any connection */
+struct ConnectionFilter {
+    int state;              /* enum State, or -1 */
+    const char *listener;   /* listener address as displayed */
+    const char *hostname;   /* fnmatch(3) pattern */
+    ev_tstamp min_age;      /* seconds since accepted */
+};
+
+struct ConnectionDump;
+
 void init_connections();
 int accept_connection(struct Listener *, struct ev_loop *);
 void free_connections(struct ev_loop *);
-void print_connections();
+void print_connections(struct ev_loop *);
+size_t connections_in_state(enum State);
+const char *connection_state_name(enum State);
+int connection_state_from_name(const char *);
+struct ConnectionDump *start_connection_dump(const struct ConnectionFilter *,
+        struct ev_loop *);
+size_t connection_dump_read(struct ConnectionDump *, char *, size_t);
+int connection_dump_done(const struct ConnectionDump *);
+void end_connection_dump(struct ConnectionDump *);
 
 #endif
@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Backend health tracking
+ *
+ * Connection attempts report their outcome here (passive detection), after
+ * HEALTH_FAILURE_THRESHOLD consecutive failures an address is marked
+ * unhealthy and backend pools skip it. It is retried after an exponential
+ * backoff: with an active check configured by probing it, otherwise by
+ * letting connections through again until the next failure.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <ev.h>
+#include "health.h"
+#include "address.h"
+#include "tls.h"
+#include "logger.h"
+
+
+#define HEALTH_FAILURE_THRESHOLD 3
+#define HEALTH_CHECK_INTERVAL 5.0
+#define HEALTH_CHECK_TIMEOUT 2.0
+#define HEALTH_BACKOFF_MIN 1.0
+#define HEALTH_BACKOFF_MAX 60.0
+
+#define TLS_HANDSHAKE_CONTENT_TYPE 0x16
+#define TLS_ALERT_CONTENT_TYPE 0x15
+
+#ifndef MIN
+#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+#endif
+
+
+static void free_backend_health(struct BackendHealth *);
+static void schedule_health_timer(struct BackendHealth *, ev_tstamp);
+static void mark_healthy(struct BackendHealth *);
+static void mark_unhealthy(struct BackendHealth *);
+static void health_timer_cb(struct ev_loop *, struct ev_timer *, int);
+static void start_probe(struct BackendHealth *);
+static void probe_cb(struct ev_loop *, struct ev_io *, int);
+static void end_probe(struct BackendHealth *, int);
+static void cancel_probe(struct BackendHealth *);
+
+
+static struct ev_loop *health_loop = NULL;
+static SLIST_HEAD(BackendHealth_head, BackendHealth) health_entries =
+    SLIST_HEAD_INITIALIZER(health_entries);
+
+
+void
+init_health_checks(struct ev_loop *loop) {
+    struct BackendHealth *iter;
+
+    health_loop = loop;
+
+    SLIST_FOREACH(iter, &health_entries, entries)
+        if (iter->check != HEALTH_CHECK_NONE)
+            schedule_health_timer(iter, HEALTH_CHECK_INTERVAL);
+}
+
+void
+health_checks_shutdown(struct ev_loop *loop) {
+    struct BackendHealth *iter;
+
+    SLIST_FOREACH(iter, &health_entries, entries) {
+        ev_timer_stop(loop, &iter->timer);
+        cancel_probe(iter);
+    }
+
+    health_loop = NULL;
+}
+
+/*
+ * Find or create the health entry for an address, active checks are only
+ * possible for socket addresses with a known port.
+ */
+struct BackendHealth *
+obtain_backend_health(const struct Address *address, enum HealthCheck check) {
+    char name[ADDRESS_BUFFER_SIZE];
+    struct BackendHealth *health;
+
+    display_address(address, name, sizeof(name));
+
+    if (check != HEALTH_CHECK_NONE &&
+            (!address_is_sockaddr(address) ||
+            (address_sa(address)->sa_family != AF_UNIX &&
+             address_port(address) == 0))) {
+        warn("Active health checks require a socket address with a port, "
+                "only passive checks enabled for %s", name);
+        check = HEALTH_CHECK_NONE;
+    }
+
+    SLIST_FOREACH(health, &health_entries, entries) {
+        if (strcmp(health->name, name) == 0) {
+            if (check > health->check) {
+                health->check = check;
+                if (health->healthy && health->probe_state == PROBE_IDLE)
+                    schedule_health_timer(health, HEALTH_CHECK_INTERVAL);
+            }
+
+            return health;
+        }
+    }
+
+    health = calloc(1, sizeof(struct BackendHealth));
+    if (health == NULL) {
+        err("%s: calloc", __func__);
+        return NULL;
+    }
+
+    health->name = strdup(name);
+    health->address = copy_address(address);
+    if (health->name == NULL || health->address == NULL) {
+        err("%s: malloc", __func__);
+        free(health->name);
+        free(health->address);
+        free(health);
+        return NULL;
+    }
+
+    health->check = check;
+    health->healthy = 1;
+    health->failures = 0;
+    health->backoff = HEALTH_BACKOFF_MIN;
+    health->probe_state = PROBE_IDLE;
+    health->reference_count = 0;
+    ev_timer_init(&health->timer, health_timer_cb, 0.0, 0.0);
+    health->timer.data = health;
+    ev_io_init(&health->probe_watcher, probe_cb, -1, EV_WRITE);
+    health->probe_watcher.data = health;
+
+    SLIST_INSERT_HEAD(&health_entries, health, entries);
+
+    if (check != HEALTH_CHECK_NONE)
+        schedule_health_timer(health, HEALTH_CHECK_INTERVAL);
+
+    return health;
+}
+
+struct BackendHealth *
+backend_health_ref_get(struct BackendHealth *health) {
+    if (health != NULL)
+        health->reference_count++;
+
+    return health;
+}
+
+void
+backend_health_ref_put(struct BackendHealth *health) {
+    if (health == NULL)
+        return;
+
+    assert(health->reference_count > 0);
+    health->reference_count--;
+    if (health->reference_count == 0)
+        free_backend_health(health);
+}
+
+/*
+ * Record the outcome of a connection attempt to this address
+ */
+void
+backend_health_report(struct BackendHealth *health, int success) {
+    if (health == NULL)
+        return;
+
+    if (success && health->healthy)
+        health->failures = 0;
+    else if (success)
+        mark_healthy(health);
+    else if (health->healthy &&
+            ++health->failures >= HEALTH_FAILURE_THRESHOLD)
+        mark_unhealthy(health);
+    /* Failures of an already ejected address are expected and do not
+     * extend its backoff */
+}
+
+static void
+free_backend_health(struct BackendHealth *health) {
+    cancel_probe(health);
+    if (health_loop != NULL)
+        ev_timer_stop(health_loop, &health->timer);
+
+    SLIST_REMOVE(&health_entries, health, BackendHealth, entries);
+
+    free(health->name);
+    free(health->address);
+    free(health);
+}
+
+static void
+schedule_health_timer(struct BackendHealth *health, ev_tstamp delay) {
+    if (health_loop == NULL)
+        return;
+
+    ev_timer_stop(health_loop, &health->timer);
+    ev_timer_set(&health->timer, delay, 0.0);
+    ev_timer_start(health_loop, &health->timer);
+}
+
+static void
+mark_healthy(struct BackendHealth *health) {
+    notice("Backend %s is healthy", health->name);
+
+    health->healthy = 1;
+    health->failures = 0;
+    health->backoff = HEALTH_BACKOFF_MIN;
+
+    if (health->check != HEALTH_CHECK_NONE)
+        schedule_health_timer(health, HEALTH_CHECK_INTERVAL);
+    else if (health_loop != NULL)
+        ev_timer_stop(health_loop, &health->timer);
+}
+
+static void
+mark_unhealthy(struct BackendHealth *health) {
+    if (health->healthy)
+        warn("Backend %s failed %u consecutive times, ejecting for %.0f seconds",
+                health->name, health->failures, health->backoff);
+
+    health->healthy = 0;
+    schedule_health_timer(health, health->backoff);
+    health->backoff = MIN(health->backoff * 2, HEALTH_BACKOFF_MAX);
+}
+
+static void
+health_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents) {
+    struct BackendHealth *health = (struct BackendHealth *)w->data;
+    (void)loop;
+
+    if (!(revents & EV_TIMER))
+        return;
+
+    if (health->probe_state != PROBE_IDLE) {
+        debug("Health check of %s timed out", health->name);
+        end_probe(health, 0);
+    } else if (health->check != HEALTH_CHECK_NONE) {
+        start_probe(health);
+    } else if (!health->healthy) {
+        /* Without an active check let connections try again, a single
+         * further failure ejects the address with a longer backoff */
+        info("Retrying backend %s", health->name);
+        health->healthy = 1;
+        health->failures = HEALTH_FAILURE_THRESHOLD - 1;
+    }
+}
+
+static void
+start_probe(struct BackendHealth *health) {
+    const struct sockaddr *addr = address_sa(health->address);
+
+    int sockfd = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        warn("Health check socket failed: %s", strerror(errno));
+        schedule_health_timer(health, HEALTH_CHECK_INTERVAL);
+        return;
+    }
+
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+
+    ev_io_set(&health->probe_watcher, sockfd, EV_WRITE);
+    health->probe_state = PROBE_CONNECTING;
+
+    if (connect(sockfd, addr, address_sa_len(health->address)) < 0 &&
+            errno != EINPROGRESS) {
+        debug("Health check of %s failed: %s", health->name, strerror(errno));
+        end_probe(health, 0);
+        return;
+    }
+
+    ev_io_start(health_loop, &health->probe_watcher);
+    schedule_health_timer(health, HEALTH_CHECK_TIMEOUT);
+}
+
+static void
+probe_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
+    struct BackendHealth *health = (struct BackendHealth *)w->data;
+
+    if (health->probe_state == PROBE_CONNECTING && revents & EV_WRITE) {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+
+        if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0)
+            error = errno;
+        if (error != 0) {
+            debug("Health check of %s failed: %s",
+                    health->name, strerror(error));
+            end_probe(health, 0);
+            return;
+        }
+
+        if (health->check == HEALTH_CHECK_TCP) {
+            end_probe(health, 1);
+            return;
+        }
+
+        char hello[512];
+        size_t hello_len = build_tls_client_hello(hello, sizeof(hello), NULL);
+        if (send(w->fd, hello, hello_len, 0) != (ssize_t)hello_len) {
+            end_probe(health, 0);
+            return;
+        }
+
+        ev_io_stop(loop, w);
+        ev_io_set(w, w->fd, EV_READ);
+        ev_io_start(loop, w);
+        health->probe_state = PROBE_AWAITING_REPLY;
+    } else if (health->probe_state == PROBE_AWAITING_REPLY && revents & EV_READ) {
+        unsigned char content_type;
+
+        /* Any TLS record, even an alert, shows a TLS server is answering */
+        ssize_t len = recv(w->fd, &content_type, sizeof(content_type), 0);
+        end_probe(health, len == 1 &&
+                (content_type == TLS_HANDSHAKE_CONTENT_TYPE ||
+                 content_type == TLS_ALERT_CONTENT_TYPE));
+    }
+}
+
+static void
+end_probe(struct BackendHealth *health, int success) {
+    cancel_probe(health);
+
+    if (success && health->healthy) {
+        health->failures = 0;
+        schedule_health_timer(health, HEALTH_CHECK_INTERVAL);
+    } else if (success) {
+        mark_healthy(health);
+    } else if (health->healthy &&
+            ++health->failures < HEALTH_FAILURE_THRESHOLD) {
+        schedule_health_timer(health, HEALTH_CHECK_INTERVAL);
+    } else {
+        mark_unhealthy(health);
+    }
+}
+
+static void
+cancel_probe(struct BackendHealth *health) {
+    if (health->probe_state == PROBE_IDLE)
+        return;
+
+    if (health_loop != NULL)
+        ev_io_stop(health_loop, &health->probe_watcher);
+    close(health->probe_watcher.fd);
+    ev_io_set(&health->probe_watcher, -1, EV_WRITE);
+    health->probe_state = PROBE_IDLE;
+}
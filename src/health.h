@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <sys/queue.h>
+#include <ev.h>
+#include "address.h"
+
+/*
+ * Health state of a backend address, shared by every table entry with the
+ * same address and kept across configuration reloads.
+ */
+struct BackendHealth {
+    char *name;
+    struct Address *address;
+    enum HealthCheck {
+        HEALTH_CHECK_NONE,  /* passive failure detection only */
+        HEALTH_CHECK_TCP,   /* periodic TCP connect probe */
+        HEALTH_CHECK_TLS,   /* TCP connect then expect a TLS record in reply
+                               to a ClientHello */
+    } check;
+    int healthy;
+    unsigned int failures;  /* consecutive failures */
+    ev_tstamp backoff;
+
+    /* Runtime fields */
+    enum {
+        PROBE_IDLE,
+        PROBE_CONNECTING,
+        PROBE_AWAITING_REPLY,
+    } probe_state;
+    struct ev_timer timer;
+    struct ev_io probe_watcher;
+    int reference_count;
+    SLIST_ENTRY(BackendHealth) entries;
+};
+
+void init_health_checks(struct ev_loop *);
+void health_checks_shutdown(struct ev_loop *);
+struct BackendHealth *obtain_backend_health(const struct Address *, enum HealthCheck);
+struct BackendHealth *backend_health_ref_get(struct BackendHealth *);
+void backend_health_ref_put(struct BackendHealth *);
+void backend_health_report(struct BackendHealth *, int);
+
+static inline int
+backend_is_healthy(const struct BackendHealth *health) {
+    return health == NULL || health->healthy;
+}
+
+#endif
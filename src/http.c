@@ -24,20 +24,37 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <stdio.h>
-#include <stdlib.h> /* malloc() */
-#include <string.h> /* strncpy() */
-#include <strings.h> /* strncasecmp() */
+#include <stdint.h>
+#include <string.h>
 #include <ctype.h> /* isblank(), isdigit() */
 #include "http.h"
 #include "protocol.h"
 
+#if defined(__x86_64__) && defined(__SSE2__) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define HTTP_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
 #define SERVER_NAME_LEN 256
+#define HOST_HEADER "host:"
+#define HOST_HEADER_LEN 5
+
 
+static int parse_http_header(const char *, size_t, const char **, struct RequestInfo *);
+static int get_host_header(const char *, size_t, const char **);
+static int is_host_header(const char *, const char *);
+static const char *select_newline_scanner(const char *, const char *);
+static const char *find_newline_scalar(const char *, const char *);
+#ifdef HTTP_SCAN_X86
+static const char *find_newline_sse2(const char *, const char *);
+static const char *find_newline_avx2(const char *, const char *);
+#endif
 
-static int parse_http_header(const char *, size_t, char **, size_t*);
-static int get_header(const char *, const char *, size_t, char **);
-static size_t next_header(const char **, size_t *);
 
+/* Line break scanner, the best this CPU supports is chosen on first use */
+static const char *(*find_newline)(const char *, const char *) =
+    &select_newline_scanner;
 
 static const char http_503[] =
     "HTTP/1.1 503 Service Temporarily Unavailable\r\n"
@@ -49,7 +66,10 @@ const struct Protocol *const http_protocol = &(struct Protocol){
     .name = "http",
     .default_port = 80,
     .parse_packet = &parse_http_header,
-    .modify_packet = NULL,
+    .split_packet = NULL,
+    .new_parser = NULL,
+    .parse_more = NULL,
+    .free_parser = NULL,
     .abort_message = http_503,
     .abort_message_len = sizeof(http_503) - 1,
 };
@@ -58,24 +78,24 @@ const struct Protocol *const http_protocol = &(struct Protocol){
  * Parses a HTTP request for the Host: header
  *
  * Returns:
- *  >=0  - length of the hostname and updates *hostname
- *         caller is responsible for freeing *hostname
+ *  >=0  - length of the hostname and updates *hostname to point to it
+ *         within data, without any port
  *  -1   - Incomplete request
  *  -2   - No Host header included in this request
- *  -3   - Invalid hostname pointer
- *  -4   - malloc failure
+ *  -3   - Invalid hostname or info pointer
  *  < -4 - Invalid HTTP request
  *
  */
 static int
-parse_http_header(const char* data, size_t data_len, char **hostname, size_t* modify_pos) {
-    (void)modify_pos;
+parse_http_header(const char* data, size_t data_len, const char **hostname, struct RequestInfo *info) {
     int result, i;
 
-    if (hostname == NULL)
+    if (hostname == NULL || info == NULL)
         return -3;
 
-    result = get_header("Host:", data, data_len, hostname);
+    *info = (struct RequestInfo){ .alpn = NULL };
+
+    result = get_host_header(data, data_len, hostname);
     if (result < 0)
         return result;
 
@@ -87,72 +107,146 @@ parse_http_header(const char* data, size_t data_len, char **hostname, size_t* mo
      */
     for (i = result - 1; i >= 0; i--)
         if ((*hostname)[i] == ':') {
-            (*hostname)[i] = '\0';
             result = i;
             break;
-        } else if (!isdigit((*hostname)[i])) {
+        } else if (!isdigit((unsigned char)(*hostname)[i])) {
             break;
         }
 
     return result;
 }
 
+/*
+ * Find the Host header in a single pass over the request, skipping the
+ * request line. Only complete header lines are considered, so a Host header
+ * still being received is not mistaken for a shorter hostname.
+ */
 static int
-get_header(const char *header, const char *data, size_t data_len, char **value) {
-    size_t len, header_len;
+get_host_header(const char *data, size_t data_len, const char **value) {
+    const char *end = data + data_len;
+    const char *line = find_newline(data, end);
 
-    header_len = strlen(header);
+    if (line == NULL)
+        return -1;
 
     /* loop through headers stopping at first blank line */
-    while ((len = next_header(&data, &data_len)) != 0)
-        if (len > header_len && strncasecmp(header, data, header_len) == 0) {
+    for (line++; line < end; ) {
+        const char *eol = find_newline(line, end);
+        if (eol == NULL)
+            break;
+
+        size_t len = (size_t)(eol - line);
+        /* ignore trailing <CR> */
+        if (len > 0 && line[len - 1] == '\r')
+            len--;
+
+        if (len == 0)
+            return -2;
+
+        if (len > HOST_HEADER_LEN && is_host_header(line, end)) {
+            size_t header_len = HOST_HEADER_LEN;
+
             /* Eat leading whitespace */
-            while (header_len < len && isblank(data[header_len]))
+            while (header_len < len && isblank((unsigned char)line[header_len]))
                 header_len++;
 
-            *value = malloc(len - header_len + 1);
-            if (*value == NULL)
-                return -4;
-
-            strncpy(*value, data + header_len, len - header_len);
-            (*value)[len - header_len] = '\0';
+            *value = line + header_len;
 
             return len - header_len;
         }
 
-    /* If there is no data left after reading all the headers then we do not
-     * have a complete HTTP request, there must be a blank line */
-    if (data_len == 0)
-        return -1;
+        line = eol + 1;
+    }
+
+    /* There must be a blank line after the headers for the request to be
+     * complete */
+    return -1;
+}
+
+/*
+ * Case insensitive comparison of the start of a line with "Host:". Setting
+ * the 0x20 bit lower cases the letters, it is left alone for the colon which
+ * would otherwise also match 0x1a.
+ */
+static int
+is_host_header(const char *line, const char *end) {
+#ifdef HTTP_SCAN_X86
+    if (end - line >= 16) {
+        const __m128i text = _mm_loadu_si128((const __m128i *)line);
+        const __m128i lower = _mm_setr_epi8(0x20, 0x20, 0x20, 0x20, 0,
+                0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m128i host = _mm_setr_epi8('h', 'o', 's', 't', ':',
+                0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        int mask = _mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_or_si128(text, lower), host));
+
+        return (mask & 0x1f) == 0x1f;
+    }
+#else
+    (void)end;
+#endif
+
+    for (size_t i = 0; i < HOST_HEADER_LEN; i++) {
+        uint8_t c = (uint8_t)line[i];
+
+        if (i < HOST_HEADER_LEN - 1)
+            c |= 0x20;
+        if (c != (uint8_t)HOST_HEADER[i])
+            return 0;
+    }
+
+    return 1;
+}
+
+static const char *
+select_newline_scanner(const char *start, const char *end) {
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        find_newline = &find_newline_avx2;
+    else
+        find_newline = &find_newline_sse2;
+#else
+    find_newline = &find_newline_scalar;
+#endif
+
+    return find_newline(start, end);
+}
+
+static const char *
+find_newline_scalar(const char *start, const char *end) {
+    return memchr(start, '\n', (size_t)(end - start));
+}
+
+#ifdef HTTP_SCAN_X86
+static const char *
+find_newline_sse2(const char *start, const char *end) {
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    for (; end - start >= 16; start += 16) {
+        const __m128i text = _mm_loadu_si128((const __m128i *)start);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(text, newline));
+
+        if (mask != 0)
+            return start + __builtin_ctz((unsigned int)mask);
+    }
 
-    return -2;
+    return find_newline_scalar(start, end);
 }
 
-static size_t
-next_header(const char **data, size_t *len) {
-    size_t header_len;
+__attribute__((target("avx2")))
+static const char *
+find_newline_avx2(const char *start, const char *end) {
+    const __m256i newline = _mm256_set1_epi8('\n');
 
-    if (*len == 0)
-        return 0;
+    for (; end - start >= 32; start += 32) {
+        const __m256i text = _mm256_loadu_si256((const __m256i *)start);
+        int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(text, newline));
 
-    /* perhaps we can optimize this to reuse the value of header_len, rather
-     * than scanning twice.
-     * Walk our data stream until the end of the header */
-    while (*len > 1 && (*data)[0] != '\n') {
-        (*len)--;
-        (*data)++;
+        if (mask != 0)
+            return start + __builtin_ctz((unsigned int)mask);
     }
 
-    /* advanced past the <LF> */
-    (*data)++;
-    (*len)--;
-
-    /* Find the length of the next header */
-    header_len = 0;
-    while (*len > header_len && (*data)[header_len] != '\n')
-        header_len++;
-    /* ignore preceding <CR> */
-    if (header_len > 0 && (*data)[header_len - 1] == '\r')
-        header_len--;
-    return header_len;
+    return find_newline_sse2(start, end);
 }
+#endif
@@ -38,6 +38,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <assert.h>
 #include "address.h"
@@ -47,6 +48,14 @@
 #include "protocol.h"
 #include "tls.h"
 #include "http.h"
+#include "quic.h"
+#include "udp.h"
+#include "proxy_protocol.h"
+#include "metrics.h"
+
+/* Seconds the kernel holds a connection waiting for data before passing it on
+ * regardless */
+#define LISTENER_DEFER_ACCEPT_TIMEOUT 5
 
 static void close_listener(struct ev_loop *, struct Listener *);
 static void accept_cb(struct ev_loop *, struct ev_io *, int);
@@ -54,6 +63,7 @@ static void backoff_timer_cb(struct ev_loop *, struct ev_timer *, int);
 static int init_listener(struct Listener *, const struct Table_head *, struct ev_loop *);
 static void listener_update(struct Listener *, struct Listener *,  const struct Table_head *);
 static void free_listener(struct Listener *);
+static int listener_compare(const struct Listener *, const struct Listener *);
 static int parse_boolean(const char *);
 
 
@@ -118,7 +128,7 @@ listeners_reload(struct Listener_head *existing_listeners,
         else if (iter_new == NULL)
             compare_result = -1;
         else
-            compare_result = address_compare(iter_existing->address, iter_new->address);
+            compare_result = listener_compare(iter_existing, iter_new);
 
         if (compare_result > 0) {
             struct Listener *new_listener = iter_new;
@@ -166,7 +176,7 @@ static void
 listener_update(struct Listener *existing_listener, struct Listener *new_listener, const struct Table_head *tables) {
     assert(existing_listener != NULL);
     assert(new_listener != NULL);
-    assert(address_compare(existing_listener->address, new_listener->address) == 0);
+    assert(listener_compare(existing_listener, new_listener) == 0);
 
     free(existing_listener->fallback_address);
     existing_listener->fallback_address = new_listener->fallback_address;
@@ -186,6 +196,9 @@ listener_update(struct Listener *existing_listener, struct Listener *new_listene
     existing_listener->access_log = logger_ref_get(new_listener->access_log);
 
     existing_listener->log_bad_requests = new_listener->log_bad_requests;
+    existing_listener->accept_proxy = new_listener->accept_proxy;
+    existing_listener->max_request_size = new_listener->max_request_size;
+    existing_listener->max_flows = new_listener->max_flows;
 
     struct Table *new_table =
             table_lookup(tables, existing_listener->table_name);
@@ -217,15 +230,22 @@ new_listener() {
     listener->access_log = NULL;
     listener->log_bad_requests = 0;
     listener->reuseport = 0;
+    listener->fastopen = 0;
+    listener->defer_accept = 0;
+    listener->accept_proxy = 0;
     listener->ipv6_v6only = 0;
     listener->transparent_proxy = 0;
     listener->fallback_use_proxy_header = 0;
+    listener->max_request_size = LISTENER_DEFAULT_MAX_REQUEST_SIZE;
+    listener->max_flows = LISTENER_DEFAULT_MAX_FLOWS;
     listener->reference_count = 0;
+    listener->flows = 0;
     /* Initializes sock fd to negative sentinel value to indicate watchers
      * are not active */
     ev_io_init(&listener->watcher, accept_cb, -1, EV_READ);
     ev_timer_init(&listener->backoff_timer, backoff_timer_cb, 0.0, 0.0);
     listener->table = NULL;
+    listener->metrics = NULL;
 
     return listener;
 }
@@ -281,10 +301,19 @@ accept_listener_table_name(struct Listener *listener, const char *table_name) {
 
 int
 accept_listener_protocol(struct Listener *listener, const char *protocol) {
-    if (strncasecmp(protocol, http_protocol->name, strlen(protocol)) == 0)
+    if (strncasecmp(protocol, http_protocol->name, strlen(protocol)) == 0) {
         listener->protocol = http_protocol;
-    else
+    } else if (strcasecmp(protocol, quic_protocol->name) == 0) {
+#ifndef HAVE_LIBCRYPTO
+        err("QUIC not supported in this build");
+        return 0;
+#endif
+        listener->protocol = quic_protocol;
+    } else if (strcasecmp(protocol, udp_protocol->name) == 0) {
+        listener->protocol = udp_protocol;
+    } else {
         listener->protocol = tls_protocol;
+    }
 
     if (address_port(listener->address) == 0)
         address_set_port(listener->address, listener->protocol->default_port);
@@ -309,6 +338,86 @@ accept_listener_reuseport(struct Listener *listener, const char *reuseport) {
     return 1;
 }
 
+int
+accept_listener_fastopen(struct Listener *listener, const char *fastopen) {
+    listener->fastopen = parse_boolean(fastopen);
+    if (listener->fastopen == -1) {
+        return 0;
+    }
+
+#ifndef TCP_FASTOPEN
+    if (listener->fastopen == 1) {
+        err("TCP Fast Open not supported in this build");
+        return 0;
+    }
+#endif
+
+    return 1;
+}
+
+int
+accept_listener_defer_accept(struct Listener *listener, const char *defer_accept) {
+    listener->defer_accept = parse_boolean(defer_accept);
+    if (listener->defer_accept == -1) {
+        return 0;
+    }
+
+#ifndef TCP_DEFER_ACCEPT
+    if (listener->defer_accept == 1) {
+        err("TCP_DEFER_ACCEPT not supported in this build");
+        return 0;
+    }
+#endif
+
+    return 1;
+}
+
+int
+accept_listener_accept_proxy(struct Listener *listener, const char *accept_proxy) {
+    listener->accept_proxy = parse_boolean(accept_proxy);
+    if (listener->accept_proxy == -1) {
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+accept_listener_max_request_size(struct Listener *listener, const char *size) {
+    if (!is_numeric(size)) {
+        err("Invalid max_request_size %s", size);
+        return 0;
+    }
+
+    unsigned long max_request_size = strtoul(size, NULL, 10);
+    if (max_request_size < 512 || max_request_size > 1024 * 1024) {
+        err("max_request_size must be between 512 and 1048576 bytes");
+        return 0;
+    }
+
+    listener->max_request_size = (size_t)max_request_size;
+
+    return 1;
+}
+
+int
+accept_listener_max_flows(struct Listener *listener, const char *flows) {
+    if (!is_numeric(flows)) {
+        err("Invalid max_flows %s", flows);
+        return 0;
+    }
+
+    unsigned long max_flows = strtoul(flows, NULL, 10);
+    if (max_flows < 1 || max_flows > 16 * 1024 * 1024) {
+        err("max_flows must be between 1 and 16777216");
+        return 0;
+    }
+
+    listener->max_flows = (size_t)max_flows;
+
+    return 1;
+}
+
 int
 accept_listener_ipv6_v6only(struct Listener *listener, const char *ipv6_v6only) {
     listener->ipv6_v6only = parse_boolean(ipv6_v6only);
@@ -359,8 +468,12 @@ accept_listener_fallback_address(struct Listener *listener, const char *fallback
             return 0;
         }
     } else if (strcasecmp("proxy", fallback) == 0 &&
-            listener->fallback_use_proxy_header == 0) {
-        listener->fallback_use_proxy_header = 1;
+            listener->fallback_use_proxy_header == PROXY_HEADER_NONE) {
+        listener->fallback_use_proxy_header = PROXY_HEADER_V1;
+        return 1;
+    } else if (strcasecmp("proxy_v2", fallback) == 0 &&
+            listener->fallback_use_proxy_header == PROXY_HEADER_NONE) {
+        listener->fallback_use_proxy_header = PROXY_HEADER_V2;
         return 1;
     } else {
         err("Unexpected fallback argument: %s", fallback);
@@ -426,7 +539,7 @@ add_listener(struct Listener_head *listeners, struct Listener *listener) {
     listener_ref_get(listener);
 
     if (SLIST_FIRST(listeners) == NULL ||
-            address_compare(listener->address, SLIST_FIRST(listeners)->address) < 0) {
+            listener_compare(listener, SLIST_FIRST(listeners)) < 0) {
         SLIST_INSERT_HEAD(listeners, listener, entries);
         return;
     }
@@ -434,7 +547,7 @@ add_listener(struct Listener_head *listeners, struct Listener *listener) {
     struct Listener *iter;
     SLIST_FOREACH(iter, listeners, entries) {
         if (SLIST_NEXT(iter, entries) == NULL ||
-                address_compare(listener->address, SLIST_NEXT(iter, entries)->address) < 0) {
+                listener_compare(listener, SLIST_NEXT(iter, entries)) < 0) {
             SLIST_INSERT_AFTER(iter, listener, entries);
             return;
         }
@@ -481,25 +594,72 @@ valid_listener(const struct Listener *listener) {
             return 0;
     }
 
-    if (listener->protocol != tls_protocol && listener->protocol != http_protocol) {
+    if (listener->protocol != tls_protocol &&
+            listener->protocol != http_protocol &&
+            listener->protocol != quic_protocol &&
+            listener->protocol != udp_protocol) {
         err("Invalid protocol");
         return 0;
     }
 
+    if (listener->protocol->datagram) {
+        if (address_sa(listener->address)->sa_family == AF_UNIX) {
+            err("Datagram protocols require an IP listener");
+            return 0;
+        }
+        if (listener->fastopen || listener->defer_accept ||
+                listener->accept_proxy) {
+            err("fastopen, defer_accept and accept_proxy only apply to TCP "
+                    "listeners");
+            return 0;
+        }
+        if (listener->transparent_proxy) {
+            err("Transparent proxy not supported on datagram listeners");
+            return 0;
+        }
+    } else if (listener->max_flows != LISTENER_DEFAULT_MAX_FLOWS) {
+        err("max_flows only applies to datagram listeners");
+        return 0;
+    }
+
     return 1;
 }
 
+/*
+ * Listeners are ordered by address, a TCP and a UDP listener may share one
+ */
+static int
+listener_compare(const struct Listener *a, const struct Listener *b) {
+    int result = address_compare(a->address, b->address);
+    if (result != 0)
+        return result;
+
+    return a->protocol->datagram - b->protocol->datagram;
+}
+
 static int
 init_listener(struct Listener *listener, const struct Table_head *tables,
         struct ev_loop *loop) {
     char address[ADDRESS_BUFFER_SIZE];
     struct Table *table = table_lookup(tables, listener->table_name);
-    if (table == NULL) {
+    if (table != NULL) {
+        init_table(table);
+        listener->table = table_ref_get(table);
+    } else if (listener->protocol->parse_packet != NULL ||
+            listener->table_name != NULL) {
+        /* Only listeners which never have a hostname may go without */
         err("Table \"%s\" not defined", listener->table_name);
         return -1;
     }
-    init_table(table);
-    listener->table = table_ref_get(table);
+
+    /* Datagram listeners may share an address with a stream listener */
+    display_address(listener->address, address, sizeof(address));
+    if (listener->protocol->datagram)
+        strncat(address, "/udp", sizeof(address) - strlen(address) - 1);
+    listener->metrics = metrics_ref_get(
+            obtain_metrics(METRICS_LISTENER, address));
+    if (listener->metrics == NULL)
+        return -1;
 
     /* If no port was specified on the fallback address, inherit the address
      * from the listening address */
@@ -508,10 +668,11 @@ init_listener(struct Listener *listener, const struct Table_head *tables,
         address_set_port(listener->fallback_address,
                 address_port(listener->address));
 
+    int type = listener->protocol->datagram ? SOCK_DGRAM : SOCK_STREAM;
 #ifdef HAVE_ACCEPT4
-    int sockfd = socket(address_sa(listener->address)->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int sockfd = socket(address_sa(listener->address)->sa_family, type | SOCK_NONBLOCK, 0);
 #else
-    int sockfd = socket(address_sa(listener->address)->sa_family, SOCK_STREAM, 0);
+    int sockfd = socket(address_sa(listener->address)->sa_family, type, 0);
 #endif
     if (sockfd < 0) {
         err("socket failed: %s", strerror(errno));
@@ -529,7 +690,8 @@ init_listener(struct Listener *listener, const struct Table_head *tables,
 
     /* set SO_KEEPALIVE on the server socket so that abandoned client connections
      * do not linger behind forever */
-    result = setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    if (type == SOCK_STREAM)
+        result = setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
     if (result < 0) {
         err("setsockopt SO_KEEPALIVE failed: %s", strerror(errno));
         close(sockfd);
@@ -587,7 +749,42 @@ init_listener(struct Listener *listener, const struct Table_head *tables,
         return result;
     }
 
-    result = listen(sockfd, SOMAXCONN);
+#ifdef TCP_FASTOPEN
+    /* without TCP_FASTOPEN the option is refused when parsing the config */
+    if (listener->fastopen == 1) {
+        /* set TCP_FASTOPEN on server socket so clients with a cookie can
+         * send their ClientHello in the SYN, the value bounds the number of
+         * pending fast open requests */
+        int qlen = SOMAXCONN;
+        result = setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+        if (result < 0) {
+            err("setsockopt TCP_FASTOPEN failed: %s", strerror(errno));
+            close(sockfd);
+            return result;
+        }
+    }
+#endif
+
+    if (listener->defer_accept == 1) {
+#ifdef TCP_DEFER_ACCEPT
+        /* set TCP_DEFER_ACCEPT on server socket so connections are only
+         * accepted once the client has sent data */
+        int timeout = LISTENER_DEFER_ACCEPT_TIMEOUT;
+        result = setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout, sizeof(timeout));
+#else
+        result = -ENOSYS;
+#endif
+        if (result < 0) {
+            err("setsockopt TCP_DEFER_ACCEPT failed: %s", strerror(errno));
+            close(sockfd);
+            return result;
+        }
+    }
+
+    if (type == SOCK_DGRAM)
+        udp_enable_gro(sockfd);
+    else
+        result = listen(sockfd, SOMAXCONN);
     if (result < 0) {
         err("listen failed: %s", strerror(errno));
         close(sockfd);
@@ -617,9 +814,13 @@ init_listener(struct Listener *listener, const struct Table_head *tables,
  */
 struct LookupResult
 listener_lookup_server_address(const struct Listener *listener,
-        const char *name, size_t name_len) {
-    struct LookupResult table_result =
-        table_lookup_server_address(listener->table, name, name_len);
+        const struct sockaddr *client_addr, const char *name, size_t name_len,
+        const char *alpn, size_t alpn_len) {
+    struct LookupResult table_result = { .address = NULL };
+
+    if (listener->table != NULL)
+        table_result = table_lookup_server_address(listener->table,
+                client_addr, name, name_len, alpn, alpn_len);
 
     if (table_result.address == NULL) {
         /* No match in table, use fallback address if present */
@@ -659,7 +860,9 @@ listener_lookup_server_address(const struct Listener *listener,
         return (struct LookupResult){
             .address = new_addr,
             .caller_free_address = 1,
-            .use_proxy_header = table_result.use_proxy_header
+            .use_proxy_header = table_result.use_proxy_header,
+            .use_fastopen = table_result.use_fastopen,
+            .metrics = table_result.metrics
         };
     } else if (address_port(table_result.address) == 0) {
         /* If the server port isn't specified return a new address using the
@@ -671,7 +874,10 @@ listener_lookup_server_address(const struct Listener *listener,
         return (struct LookupResult){
             .address = new_addr,
             .caller_free_address = 1,
-            .use_proxy_header = table_result.use_proxy_header
+            .use_proxy_header = table_result.use_proxy_header,
+            .use_fastopen = table_result.use_fastopen,
+            .health = table_result.health,
+            .metrics = table_result.metrics
         };
     } else {
         return table_result;
@@ -690,17 +896,14 @@ print_listener_config(FILE *file, const struct Listener *listener) {
     if (listener->table_name)
         fprintf(file, "\ttable %s\n", listener->table_name);
 
-    if (listener->fallback_address &&
-            !listener->fallback_use_proxy_header)
-        fprintf(file, "\tfallback %s\n",
+    if (listener->fallback_address)
+        fprintf(file, "\tfallback %s%s\n",
                 display_address(listener->fallback_address,
-                    address, sizeof(address)));
-
-    if (listener->fallback_address &&
-            listener->fallback_use_proxy_header)
-        fprintf(file, "\tfallback %s proxy\n",
-                display_address(listener->fallback_address,
-                    address, sizeof(address)));
+                    address, sizeof(address)),
+                listener->fallback_use_proxy_header == PROXY_HEADER_V2 ?
+                    " proxy_v2" :
+                listener->fallback_use_proxy_header == PROXY_HEADER_V1 ?
+                    " proxy" : "");
 
     if (listener->source_address)
         fprintf(file, "\tsource %s\n",
@@ -710,6 +913,20 @@ print_listener_config(FILE *file, const struct Listener *listener) {
     if (listener->reuseport)
         fprintf(file, "\treuseport on\n");
 
+    if (listener->fastopen)
+        fprintf(file, "\tfastopen on\n");
+
+    if (listener->defer_accept)
+        fprintf(file, "\tdefer_accept on\n");
+
+    if (listener->accept_proxy)
+        fprintf(file, "\taccept_proxy on\n");
+
+    if (listener->max_request_size != LISTENER_DEFAULT_MAX_REQUEST_SIZE)
+        fprintf(file, "\tmax_request_size %zu\n", listener->max_request_size);
+    if (listener->max_flows != LISTENER_DEFAULT_MAX_FLOWS)
+        fprintf(file, "\tmax_flows %zu\n", listener->max_flows);
+
     fprintf(file, "}\n\n");
 }
 
@@ -737,6 +954,9 @@ free_listener(struct Listener *listener) {
     table_ref_put(listener->table);
     listener->table = NULL;
 
+    metrics_ref_put(listener->metrics);
+    listener->metrics = NULL;
+
     logger_ref_put(listener->access_log);
     listener->access_log = NULL;
 
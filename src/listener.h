@@ -31,6 +31,8 @@
 #include "address.h"
 #include "table.h"
 
+#define LISTENER_DEFAULT_MAX_REQUEST_SIZE 16384
+#define LISTENER_DEFAULT_MAX_FLOWS 65536
 SLIST_HEAD(Listener_head, Listener);
 
 struct Listener {
@@ -39,14 +41,20 @@ struct Listener {
     const struct Protocol *protocol;
     char *table_name;
     struct Logger *access_log;
-    int log_bad_requests, reuseport, transparent_proxy, ipv6_v6only;
+    int log_bad_requests, reuseport, transparent_proxy, ipv6_v6only, fastopen;
+    int defer_accept;
+    int accept_proxy;   /* clients are preceded by an inbound PROXY header */
     int fallback_use_proxy_header;
+    size_t max_request_size;
+    size_t max_flows;   /* datagram flows open at once */
 
     /* Runtime fields */
     int reference_count;
+    size_t flows;
     struct ev_io watcher;
     struct ev_timer backoff_timer;
     struct Table *table;
+    struct Metrics *metrics;
     int (*accept_cb)(struct Listener *, struct ev_loop *);
     SLIST_ENTRY(Listener) entries;
 };
@@ -59,7 +67,12 @@ int accept_listener_fallback_address(struct Listener *, const char *);
 int accept_listener_source_address(struct Listener *, const char *);
 int accept_listener_protocol(struct Listener *, const char *);
 int accept_listener_reuseport(struct Listener *, const char *);
+int accept_listener_fastopen(struct Listener *, const char *);
+int accept_listener_defer_accept(struct Listener *, const char *);
+int accept_listener_accept_proxy(struct Listener *, const char *);
 int accept_listener_ipv6_v6only(struct Listener *, const char *);
+int accept_listener_max_request_size(struct Listener *, const char *);
+int accept_listener_max_flows(struct Listener *, const char *);
 int accept_listener_bad_request_action(struct Listener *, const char *);
 
 void add_listener(struct Listener_head *, struct Listener *);
@@ -70,7 +83,7 @@ void free_listeners(struct Listener_head *, struct ev_loop *);
 
 int valid_listener(const struct Listener *);
 struct LookupResult listener_lookup_server_address(const struct Listener *,
-        const char *, size_t);
+        const struct sockaddr *, const char *, size_t, const char *, size_t);
 void print_listener_config(FILE *, const struct Listener *);
 void listener_ref_put(struct Listener *);
 struct Listener *listener_ref_get(struct Listener *);
@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Convert binary access logs to text, JSON or CSV
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "address.h"
+#include "binary_log.h"
+
+enum Format {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_CSV,
+};
+
+static void usage();
+static int dump_file(const char *, enum Format);
+static int dump_records(const char *, const char *, size_t, enum Format);
+static void print_record(const struct BinaryLogRecord *, enum Format);
+static void print_time(int64_t, const char *);
+static void print_stage(uint32_t, const char *);
+static void print_json_string(const char *, size_t);
+static void print_csv_string(const char *, size_t);
+static char *read_all(int, size_t *);
+
+
+int
+main(int argc, char **argv) {
+    enum Format format = FORMAT_TEXT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:")) != -1) {
+        switch (opt) {
+            case 'f':
+                if (strcmp(optarg, "text") == 0) {
+                    format = FORMAT_TEXT;
+                } else if (strcmp(optarg, "json") == 0) {
+                    format = FORMAT_JSON;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    format = FORMAT_CSV;
+                } else {
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (format == FORMAT_CSV)
+        printf("type,established,duration,client,listener,server,hostname,"
+                "server_tx_bytes,server_rx_bytes,"
+                "client_tx_bytes,client_rx_bytes,"
+                "parsed,resolving,resolved,connected,"
+                "first_byte_up,first_byte_down\n");
+
+    int result = EXIT_SUCCESS;
+    if (optind == argc) {
+        if (!dump_file("-", format))
+            result = EXIT_FAILURE;
+    }
+    for (int i = optind; i < argc; i++)
+        if (!dump_file(argv[i], format))
+            result = EXIT_FAILURE;
+
+    return result;
+}
+
+static void
+usage() {
+    fprintf(stderr, "Usage: sniproxy-logdump [-f text|json|csv] [<file> ...]\n");
+}
+
+/*
+ * Log files are mapped and their records read in place, standard input is
+ * read into memory
+ */
+static int
+dump_file(const char *filename, enum Format format) {
+    struct stat st;
+    char *data;
+    size_t len;
+    int result;
+
+    if (strcmp(filename, "-") == 0) {
+        data = read_all(STDIN_FILENO, &len);
+        if (data == NULL) {
+            fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+            return 0;
+        }
+
+        result = dump_records(filename, data, len, format);
+        free(data);
+
+        return result;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+
+    len = (size_t)st.st_size;
+    if (len == 0) {
+        close(fd);
+        return 1;
+    }
+
+    data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap: %s\n", filename, strerror(errno));
+        return 0;
+    }
+
+    result = dump_records(filename, data, len, format);
+    munmap(data, len);
+
+    return result;
+}
+
+static int
+dump_records(const char *filename, const char *data, size_t len, enum Format format) {
+    if (len == 0)
+        return 1;
+
+    if (!check_binary_log_file_header(data, len)) {
+        fprintf(stderr, "%s: not a binary access log written by this "
+                "version on this platform\n", filename);
+        return 0;
+    }
+
+    size_t offset = sizeof(struct BinaryLogFileHeader);
+    const struct BinaryLogRecord *record;
+    while ((record = next_binary_log_record(data, len, &offset)) != NULL)
+        print_record(record, format);
+
+    if (offset < len) {
+        fprintf(stderr, "%s: truncated or invalid record at offset %zu\n",
+                filename, offset);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void
+print_record(const struct BinaryLogRecord *record, enum Format format) {
+    struct sockaddr_storage addr;
+    char client[ADDRESS_BUFFER_SIZE];
+    char listener[ADDRESS_BUFFER_SIZE];
+    char server[ADDRESS_BUFFER_SIZE];
+    const char *type = record->type == BINARY_LOG_FLOW ? "udp" : "tcp";
+    double duration = (double)record->duration / 1000000.0;
+    char stages[256];
+
+    binary_log_sockaddr(&addr, &record->client);
+    display_sockaddr(&addr, client, sizeof(client));
+    binary_log_sockaddr(&addr, &record->listener);
+    display_sockaddr(&addr, listener, sizeof(listener));
+    binary_log_sockaddr(&addr, &record->server);
+    display_sockaddr(&addr, server, sizeof(server));
+
+    switch (format) {
+        case FORMAT_TEXT:
+            /* as the text access log, stamped when the connection closed */
+            if (record->type == BINARY_LOG_FLOW)
+                stages[0] = '\0';
+            else
+                format_binary_log_stages(stages, sizeof(stages), record->stages);
+            print_time(record->established + record->duration, "%F %T");
+            printf(" %s -> %s -> %s [%.*s] %" PRIu64 "/%" PRIu64
+                    " bytes tx %" PRIu64 "/%" PRIu64 " bytes rx %1.3f seconds%s\n",
+                    client, listener, server,
+                    (int)record->hostname_len, record->hostname,
+                    record->server_tx_bytes, record->server_rx_bytes,
+                    record->client_tx_bytes, record->client_rx_bytes,
+                    duration, stages);
+            break;
+        case FORMAT_JSON:
+            printf("{\"type\":\"%s\",\"established\":\"", type);
+            print_time(record->established, "%FT%TZ");
+            printf("\",\"duration\":%.6f,\"client\":\"%s\",\"listener\":\"%s\","
+                    "\"server\":\"%s\",\"hostname\":",
+                    duration, client, listener, server);
+            print_json_string(record->hostname, record->hostname_len);
+            printf(",\"server_tx_bytes\":%" PRIu64 ",\"server_rx_bytes\":%" PRIu64
+                    ",\"client_tx_bytes\":%" PRIu64 ",\"client_rx_bytes\":%" PRIu64,
+                    record->server_tx_bytes, record->server_rx_bytes,
+                    record->client_tx_bytes, record->client_rx_bytes);
+            for (int i = 0; i < BINARY_LOG_STAGES; i++) {
+                printf(",\"%s\":", binary_log_stage_names[i]);
+                print_stage(record->stages[i], "null");
+            }
+            printf("}\n");
+            break;
+        case FORMAT_CSV:
+            printf("%s,", type);
+            print_time(record->established, "%FT%TZ");
+            printf(",%.6f,%s,%s,%s,", duration, client, listener, server);
+            print_csv_string(record->hostname, record->hostname_len);
+            printf(",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64,
+                    record->server_tx_bytes, record->server_rx_bytes,
+                    record->client_tx_bytes, record->client_rx_bytes);
+            for (int i = 0; i < BINARY_LOG_STAGES; i++) {
+                putchar(',');
+                print_stage(record->stages[i], "");
+            }
+            putchar('\n');
+            break;
+    }
+}
+
+/*
+ * Print a time in microseconds since the epoch, in UTC if the format ends
+ * with Z and in local time otherwise
+ */
+static void
+print_time(int64_t usec, const char *format) {
+    char buffer[64];
+    time_t when = (time_t)(usec / 1000000);
+    struct tm *tmp = format[strlen(format) - 1] == 'Z' ?
+        gmtime(&when) : localtime(&when);
+
+    if (tmp == NULL || strftime(buffer, sizeof(buffer), format, tmp) == 0)
+        buffer[0] = '\0';
+
+    fputs(buffer, stdout);
+}
+
+/*
+ * Print a stage time in seconds, or unset if the stage was not reached
+ */
+static void
+print_stage(uint32_t usec, const char *unset) {
+    if (usec == 0)
+        fputs(unset, stdout);
+    else
+        printf("%.6f", (double)usec / 1000000.0);
+}
+
+static void
+print_json_string(const char *s, size_t len) {
+    putchar('"');
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20 || c >= 0x7f)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+static void
+print_csv_string(const char *s, size_t len) {
+    putchar('"');
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '"')
+            putchar('"');
+        putchar(s[i]);
+    }
+    putchar('"');
+}
+
+static char *
+read_all(int fd, size_t *len) {
+    size_t size = 65536;
+    char *data = malloc(size);
+
+    *len = 0;
+    while (data != NULL) {
+        if (*len == size) {
+            char *larger = realloc(data, size * 2);
+            if (larger == NULL)
+                break;
+            data = larger;
+            size *= 2;
+        }
+
+        ssize_t result = read(fd, data + *len, size - *len);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+            break;
+        if (result == 0)
+            return data;
+
+        *len += (size_t)result;
+    }
+
+    free(data);
+
+    return NULL;
+}
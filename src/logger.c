@@ -31,13 +31,29 @@
 #include <syslog.h>
 #include <time.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <ev.h>
 #include "logger.h"
 
+#define LOG_RECORD_SIZE 1024
+#define LOG_RING_RECORDS 1024   /* must be a power of 2 */
+#define LOG_WRITE_BATCH 64
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
 struct Logger {
     struct LogSink *sink;
     int priority;
     int facility;
+    double sample;          /* fraction of access log entries written */
     int reference_count;
 };
 
@@ -50,13 +66,52 @@ struct LogSink {
     const char *filepath;
 
     FILE *fd;
+    struct AsyncLog *async;     /* file sinks written by a writer thread */
+    char *buffer;               /* block buffered file sinks */
+    size_t buffer_len;
+    size_t buffer_size;
+    struct ev_timer flush_timer;
+    void *header;               /* binary sinks, starts each file */
+    size_t header_len;
     int reference_count;
     SLIST_ENTRY(LogSink) entries;
 };
 
+struct LogRecord {
+    size_t len;
+    char line[LOG_RECORD_SIZE];
+};
+
+/*
+ * Single producer ring of formatted log lines: the event loop fills records
+ * at head and the writer thread writes them out in batches from tail. The
+ * lock and conditions are only used to sleep when the ring is empty, or full
+ * with the block policy.
+ */
+struct AsyncLog {
+    int policy;
+    int fd;
+    int running;                /* writer thread started */
+    size_t dropped;             /* records dropped while the ring was full */
+    size_t dropped_unreported;
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_int writer_waiting;
+    atomic_int producer_waiting;
+    atomic_int stop;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t writer_cond;
+    pthread_cond_t producer_cond;
+    struct LogRecord records[LOG_RING_RECORDS];
+};
+
 
 static struct Logger *default_logger = NULL;
 static SLIST_HEAD(LogSink_head, LogSink) sinks = SLIST_HEAD_INITIALIZER(sinks);
+static struct ev_loop *log_loop = NULL;
+static struct LogRateLimit *ratelimited_sites = NULL;
+static struct ev_timer ratelimit_timer;
 
 
 static void free_logger(struct Logger *);
@@ -64,13 +119,41 @@ static void init_default_logger();
 static void vlog_msg(struct Logger *, int, const char *, va_list);
 static void free_at_exit();
 static int lookup_syslog_facility(const char *);
-static const char *timestamp(char *, size_t);
+static time_t log_time();
+static size_t timestamp(char *, size_t);
+static void report_suppressed(struct LogRateLimit *);
+static void summarize_ratelimited(int);
+static void ratelimit_timer_cb(struct ev_loop *, struct ev_timer *, int);
+static uint32_t sample_random();
 static struct LogSink *obtain_stderr_sink();
 static struct LogSink *obtain_syslog_sink();
 static struct LogSink *obtain_file_sink(const char *);
 static struct LogSink *log_sink_ref_get(struct LogSink *);
 static void log_sink_ref_put(struct LogSink *);
 static void free_sink(struct LogSink *);
+static void write_sink(struct LogSink *, const void *, size_t);
+static int sink_file_empty(struct LogSink *);
+static void buffer_log_data(struct LogSink *, const void *, size_t);
+static void flush_sink(struct LogSink *);
+static void flush_timer_cb(struct ev_loop *, struct ev_timer *, int);
+static void flush_loggers();
+static int register_fork_handlers();
+static struct AsyncLog *new_async_log(int, int);
+static void free_async_log(struct AsyncLog *);
+static void init_async_log_sync(struct AsyncLog *);
+static int start_async_writer(struct AsyncLog *);
+static void async_vlog_msg(struct AsyncLog *, const char *, va_list);
+static void async_log_data(struct AsyncLog *, const void *, size_t);
+static void format_record(struct LogRecord *, const char *, ...)
+    __attribute__ ((format (printf, 2, 3)));
+static void vformat_record(struct LogRecord *, const char *, va_list);
+static struct LogRecord *reserve_record(struct AsyncLog *);
+static void commit_record(struct AsyncLog *, struct LogRecord *);
+static void drain_async_log(struct AsyncLog *);
+static void *async_log_writer(void *);
+static void write_records(int, struct iovec *, int);
+static void logger_prepare_fork();
+static void async_log_child_fork();
 
 
 struct Logger *
@@ -84,6 +167,7 @@ new_syslog_logger(const char *facility) {
         }
         logger->priority = LOG_DEBUG;
         logger->facility = lookup_syslog_facility(facility);
+        logger->sample = 1.0;
         logger->reference_count = 0;
 
         log_sink_ref_get(logger->sink);
@@ -103,6 +187,7 @@ new_file_logger(const char *filepath) {
         }
         logger->priority = LOG_DEBUG;
         logger->facility = 0;
+        logger->sample = 1.0;
         logger->reference_count = 0;
 
         log_sink_ref_get(logger->sink);
@@ -119,7 +204,19 @@ reopen_loggers() {
         if (sink->type == LOG_SINK_SYSLOG) {
             closelog();
             openlog(PACKAGE_NAME, LOG_PID, 0);
+        } else if (sink->type == LOG_SINK_FILE && sink->async != NULL) {
+            /* the writer thread keeps writing to the same descriptor, so
+             * replace the file beneath it once what was logged before has
+             * been written */
+            drain_async_log(sink->async);
+            int fd = open(sink->filepath, O_WRONLY | O_APPEND | O_CREAT, 0666);
+            if (fd < 0 || dup2(fd, sink->async->fd) < 0)
+                err("failed to reopen log file %s: %s",
+                        sink->filepath, strerror(errno));
+            if (fd >= 0)
+                close(fd);
         } else if (sink->type == LOG_SINK_FILE) {
+            flush_sink(sink);
             sink->fd = freopen(sink->filepath, "a", sink->fd);
             if (sink->fd == NULL)
                 err("failed to reopen log file %s: %s",
@@ -127,6 +224,9 @@ reopen_loggers() {
             else
                 setvbuf(sink->fd, NULL, _IOLBF, 0);
         }
+
+        if (sink->header != NULL && sink_file_empty(sink))
+            write_sink(sink, sink->header, sink->header_len);
     }
 }
 
@@ -146,6 +246,198 @@ set_logger_priority(struct Logger *logger, int priority) {
     logger->priority = priority;
 }
 
+/*
+ * Hand writing a file logger's lines to a writer thread, or back to the event
+ * loop with LOG_ASYNC_OFF. The setting applies to every logger sharing the
+ * file.
+ *
+ * Returns 1 on success, or 0 if the logger does not write to a file or the
+ * writer could not be set up.
+ */
+int
+set_logger_async(struct Logger *logger, int policy) {
+    struct LogSink *sink = logger->sink;
+
+    assert(policy >= LOG_ASYNC_OFF && policy <= LOG_ASYNC_BLOCK);
+
+    if (policy == LOG_ASYNC_OFF) {
+        free_async_log(sink->async);
+        sink->async = NULL;
+        return 1;
+    }
+
+    if (sink->type != LOG_SINK_FILE || sink->fd == NULL)
+        return 0;
+
+    if (sink->async == NULL) {
+        flush_sink(sink);
+        fflush(sink->fd);
+        sink->async = new_async_log(fileno(sink->fd), policy);
+    }
+    if (sink->async == NULL)
+        return 0;
+
+    sink->async->policy = policy;
+
+    return 1;
+}
+
+/*
+ * Collect a file logger's lines in a buffer of size bytes, written out when
+ * it fills and every interval seconds, instead of writing each line as it is
+ * logged. A size of zero returns to writing each line. Like the async
+ * setting, this applies to every logger sharing the file.
+ *
+ * Returns 1 on success, or 0 if the logger does not write to a file or the
+ * buffer could not be allocated.
+ */
+int
+set_logger_buffer(struct Logger *logger, size_t size, double interval) {
+    struct LogSink *sink = logger->sink;
+
+    if (sink->type != LOG_SINK_FILE)
+        return size == 0;
+
+    flush_sink(sink);
+    if (log_loop != NULL)
+        ev_timer_stop(log_loop, &sink->flush_timer);
+
+    if (size == 0) {
+        free(sink->buffer);
+        sink->buffer = NULL;
+        sink->buffer_size = 0;
+        return 1;
+    }
+
+    /* log lines are formatted into 1 KiB, so they always fit */
+    assert(size >= LOG_RECORD_SIZE);
+    assert(interval > 0.0);
+
+    if (!register_fork_handlers())
+        return 0;
+
+    char *buffer = realloc(sink->buffer, size);
+    if (buffer == NULL) {
+        err("%s: realloc", __func__);
+        return 0;
+    }
+    sink->buffer = buffer;
+    sink->buffer_size = size;
+
+    ev_timer_set(&sink->flush_timer, interval, interval);
+    if (log_loop != NULL)
+        ev_timer_start(log_loop, &sink->flush_timer);
+
+    return 1;
+}
+
+/*
+ * Write records passed to log_record() to a file logger, rather than text
+ * lines, which are discarded. The header is written at the start of the file
+ * whenever it is empty, including after it is reopened. A NULL header
+ * returns to writing text. Like the async setting, this applies to every
+ * logger sharing the file.
+ *
+ * Returns 1 on success, or 0 if the logger does not write to a file.
+ */
+int
+set_logger_binary(struct Logger *logger, const void *header, size_t header_len) {
+    struct LogSink *sink = logger->sink;
+
+    if (header == NULL) {
+        free(sink->header);
+        sink->header = NULL;
+        sink->header_len = 0;
+        return 1;
+    }
+
+    if (sink->type != LOG_SINK_FILE || sink->fd == NULL)
+        return 0;
+
+    int new_file = sink->header == NULL && sink_file_empty(sink);
+
+    void *copy = realloc(sink->header, header_len);
+    if (copy == NULL) {
+        err("%s: realloc", __func__);
+        return 0;
+    }
+    memcpy(copy, header, header_len);
+    sink->header = copy;
+    sink->header_len = header_len;
+
+    if (new_file)
+        write_sink(sink, sink->header, sink->header_len);
+
+    return 1;
+}
+
+int
+logger_is_binary(const struct Logger *logger) {
+    return logger->sink->header != NULL;
+}
+
+/*
+ * Write only a random fraction, between 0 and 1, of access log entries.
+ * Unlike the sink settings, this applies to this logger alone, so each
+ * listener may sample its own access log.
+ *
+ * Returns 1 on success, or 0 if the fraction is out of range.
+ */
+int
+set_logger_sample(struct Logger *logger, double fraction) {
+    if (!(fraction > 0.0 && fraction <= 1.0))
+        return 0;
+
+    logger->sample = fraction;
+
+    return 1;
+}
+
+/*
+ * Draw whether to log an access log entry, checked before it is formatted
+ */
+int
+logger_sample(struct Logger *logger) {
+    if (logger->sample >= 1.0)
+        return 1;
+
+    return sample_random() < (uint32_t)(logger->sample * 4294967295.0);
+}
+
+/*
+ * Start the flush timers of buffered log files
+ */
+void
+init_loggers(struct ev_loop *loop) {
+    struct LogSink *sink;
+
+    log_loop = loop;
+
+    SLIST_FOREACH(sink, &sinks, entries)
+        if (sink->type == LOG_SINK_FILE && sink->buffer != NULL)
+            ev_timer_start(loop, &sink->flush_timer);
+
+    ev_timer_init(&ratelimit_timer, ratelimit_timer_cb,
+            LOG_RATELIMIT_INTERVAL, LOG_RATELIMIT_INTERVAL);
+    ev_timer_start(loop, &ratelimit_timer);
+}
+
+void
+loggers_shutdown(struct ev_loop *loop) {
+    struct LogSink *sink;
+
+    ev_timer_stop(loop, &ratelimit_timer);
+    summarize_ratelimited(1);
+
+    SLIST_FOREACH(sink, &sinks, entries)
+        if (sink->type == LOG_SINK_FILE) {
+            ev_timer_stop(loop, &sink->flush_timer);
+            flush_sink(sink);
+        }
+
+    log_loop = NULL;
+}
+
 void
 logger_ref_put(struct Logger *logger) {
     if (logger == NULL)
@@ -185,6 +477,57 @@ log_msg(struct Logger *logger, int priority, const char *format, ...) {
     va_end(args);
 }
 
+/*
+ * Write a binary record, up to 1 KiB, to a logger set up with
+ * set_logger_binary()
+ */
+void
+log_record(struct Logger *logger, int priority, const void *data, size_t len) {
+    assert(logger != NULL);
+    assert(len <= LOG_RECORD_SIZE);
+
+    if (priority > logger->priority || logger->sink->header == NULL)
+        return;
+
+    write_sink(logger->sink, data, len);
+}
+
+/*
+ * Check a call site against its rate limit, see warn_ratelimited()
+ *
+ * Returns 1 if the message should be logged, or 0 if it is suppressed.
+ */
+int
+log_ratelimit(struct LogRateLimit *site, int priority, const char *format) {
+    init_default_logger();
+
+    if (priority > default_logger->priority)
+        return 0;
+
+    long now = (long)log_time();
+    if (now - site->window >= LOG_RATELIMIT_INTERVAL || now < site->window) {
+        report_suppressed(site);
+        site->window = now;
+        site->count = 0;
+    }
+
+    if (site->count < LOG_RATELIMIT_BURST) {
+        site->count++;
+        return 1;
+    }
+
+    site->format = format;
+    site->priority = priority;
+    site->suppressed++;
+    if (!site->pending) {
+        site->pending = 1;
+        site->next = ratelimited_sites;
+        ratelimited_sites = site;
+    }
+
+    return 0;
+}
+
 void
 fatal(const char *format, ...) {
     va_list args;
@@ -262,16 +605,19 @@ vlog_msg(struct Logger *logger, int priority, const char *format, va_list args)
 
     if (logger->sink->type == LOG_SINK_SYSLOG) {
         vsyslog(logger->facility|logger->priority, format, args);
+    } else if (logger->sink->header != NULL) {
+        return; /* binary log */
+    } else if (logger->sink->async != NULL) {
+        async_vlog_msg(logger->sink->async, format, args);
     } else if (logger->sink->fd != NULL) {
-        char buffer[1024];
-
-        timestamp(buffer, sizeof(buffer));
-        size_t len = strlen(buffer);
+        struct LogRecord record;
 
-        vsnprintf(buffer + len, sizeof(buffer) - len, format, args);
-        buffer[sizeof(buffer) - 1] = '\0'; /* ensure buffer null terminated */
+        vformat_record(&record, format, args);
 
-        fprintf(logger->sink->fd, "%s\n", buffer);
+        if (logger->sink->buffer != NULL)
+            buffer_log_data(logger->sink, record.line, record.len);
+        else
+            fwrite(record.line, 1, record.len, logger->sink->fd);
     }
 }
 
@@ -291,6 +637,7 @@ init_default_logger() {
         }
         logger->priority = LOG_DEBUG;
         logger->facility = 0;
+        logger->sample = 1.0;
         logger->reference_count = 0;
 
         log_sink_ref_get(logger->sink);
@@ -356,6 +703,12 @@ obtain_stderr_sink() {
         sink->type = LOG_SINK_STDERR;
         sink->filepath = NULL;
         sink->fd = stderr;
+        sink->async = NULL;
+        sink->buffer = NULL;
+        sink->buffer_len = 0;
+        sink->buffer_size = 0;
+        sink->header = NULL;
+        sink->header_len = 0;
         sink->reference_count = 0;
 
         SLIST_INSERT_HEAD(&sinks, sink, entries);
@@ -378,6 +731,12 @@ obtain_syslog_sink() {
         sink->type = LOG_SINK_SYSLOG;
         sink->filepath = NULL;
         sink->fd = NULL;
+        sink->async = NULL;
+        sink->buffer = NULL;
+        sink->buffer_len = 0;
+        sink->buffer_size = 0;
+        sink->header = NULL;
+        sink->header_len = 0;
         sink->reference_count = 0;
 
         openlog(PACKAGE_NAME, LOG_PID, 0);
@@ -417,6 +776,14 @@ obtain_file_sink(const char *filepath) {
     sink->type = LOG_SINK_FILE;
     sink->filepath = strdup(filepath);
     sink->fd = fd;
+    sink->async = NULL;
+    sink->buffer = NULL;
+    sink->buffer_len = 0;
+    sink->buffer_size = 0;
+    ev_timer_init(&sink->flush_timer, flush_timer_cb, 0.0, 0.0);
+    sink->flush_timer.data = sink;
+    sink->header = NULL;
+    sink->header_len = 0;
     sink->reference_count = 0;
 
     SLIST_INSERT_HEAD(&sinks, sink, entries);
@@ -459,6 +826,15 @@ free_sink(struct LogSink *sink) {
             sink->fd = NULL;
             break;
         case LOG_SINK_FILE:
+            free_async_log(sink->async);
+            sink->async = NULL;
+            if (log_loop != NULL)
+                ev_timer_stop(log_loop, &sink->flush_timer);
+            flush_sink(sink);
+            free(sink->buffer);
+            sink->buffer = NULL;
+            free(sink->header);
+            sink->header = NULL;
             fclose(sink->fd);
             sink->fd = NULL;
             free((char *)sink->filepath);
@@ -471,31 +847,506 @@ free_sink(struct LogSink *sink) {
     free(sink);
 }
 
-static const char *
+static void
+write_sink(struct LogSink *sink, const void *data, size_t len) {
+    if (sink->async != NULL) {
+        async_log_data(sink->async, data, len);
+    } else if (sink->buffer != NULL) {
+        buffer_log_data(sink, data, len);
+    } else if (sink->fd != NULL) {
+        fwrite(data, 1, len, sink->fd);
+        fflush(sink->fd);
+    }
+}
+
+/*
+ * Check if nothing has been written to a log file, once what has been logged
+ * to it is written
+ */
+static int
+sink_file_empty(struct LogSink *sink) {
+    struct stat st;
+
+    if (sink->async != NULL)
+        drain_async_log(sink->async);
+    flush_sink(sink);
+    if (sink->fd == NULL)
+        return 0;
+    fflush(sink->fd);
+
+    return fstat(fileno(sink->fd), &st) == 0 && st.st_size == 0;
+}
+
+static void
+buffer_log_data(struct LogSink *sink, const void *data, size_t len) {
+    if (sink->buffer_len + len > sink->buffer_size)
+        flush_sink(sink);
+
+    memcpy(sink->buffer + sink->buffer_len, data, len);
+    sink->buffer_len += len;
+}
+
+static void
+flush_sink(struct LogSink *sink) {
+    if (sink->buffer_len == 0)
+        return;
+
+    /* lines are lost if the file could not be reopened */
+    if (sink->fd != NULL) {
+        fwrite(sink->buffer, 1, sink->buffer_len, sink->fd);
+        fflush(sink->fd);
+    }
+
+    sink->buffer_len = 0;
+}
+
+static void
+flush_timer_cb(struct ev_loop *loop __attribute__((unused)),
+        struct ev_timer *w, int revents __attribute__((unused))) {
+    flush_sink((struct LogSink *)w->data);
+}
+
+static void
+flush_loggers() {
+    struct LogSink *sink;
+
+    SLIST_FOREACH(sink, &sinks, entries)
+        if (sink->type == LOG_SINK_FILE)
+            flush_sink(sink);
+}
+
+/*
+ * Buffered lines are written before forking, so they are not written again
+ * by both processes, and on exit, including through fatal().
+ */
+static int
+register_fork_handlers() {
+    static int registered = 0;
+
+    if (registered)
+        return 1;
+
+    if (pthread_atfork(logger_prepare_fork, NULL, async_log_child_fork) != 0)
+        return 0;
+    atexit(flush_loggers);
+    registered = 1;
+
+    return 1;
+}
+
+static struct AsyncLog *
+new_async_log(int fd, int policy) {
+    if (!register_fork_handlers())
+        return NULL;
+
+    struct AsyncLog *async = malloc(sizeof(struct AsyncLog));
+    if (async == NULL) {
+        err("%s: malloc", __func__);
+        return NULL;
+    }
+
+    async->policy = policy;
+    async->fd = fd;
+    async->running = 0;
+    async->dropped = 0;
+    async->dropped_unreported = 0;
+    atomic_init(&async->head, 0);
+    atomic_init(&async->tail, 0);
+    atomic_init(&async->stop, 0);
+    init_async_log_sync(async);
+
+    return async;
+}
+
+static void
+init_async_log_sync(struct AsyncLog *async) {
+    atomic_init(&async->writer_waiting, 0);
+    atomic_init(&async->producer_waiting, 0);
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->writer_cond, NULL);
+    pthread_cond_init(&async->producer_cond, NULL);
+}
+
+/*
+ * Stop the writer once it has written every queued record
+ */
+static void
+free_async_log(struct AsyncLog *async) {
+    if (async == NULL)
+        return;
+
+    if (async->running) {
+        atomic_store(&async->stop, 1);
+        pthread_mutex_lock(&async->lock);
+        pthread_cond_signal(&async->writer_cond);
+        pthread_mutex_unlock(&async->lock);
+        pthread_join(async->writer, NULL);
+    }
+
+    pthread_mutex_destroy(&async->lock);
+    pthread_cond_destroy(&async->writer_cond);
+    pthread_cond_destroy(&async->producer_cond);
+    free(async);
+}
+
+/*
+ * The writer is started with the first record rather than with the sink, so
+ * it is created after the process has daemonized. Signals are left to the
+ * event loop thread.
+ */
+static int
+start_async_writer(struct AsyncLog *async) {
+    sigset_t all, saved;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    int result = pthread_create(&async->writer, NULL, async_log_writer, async);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    async->running = result == 0;
+
+    return async->running;
+}
+
+static void
+async_vlog_msg(struct AsyncLog *async, const char *format, va_list args) {
+    struct LogRecord *record = reserve_record(async);
+
+    if (record != NULL && async->dropped_unreported > 0) {
+        format_record(record, "Log writer fell behind, dropped %zu records "
+                "(%zu total)", async->dropped_unreported, async->dropped);
+        commit_record(async, record);
+        async->dropped_unreported = 0;
+
+        record = reserve_record(async);
+    }
+
+    if (record == NULL) {
+        async->dropped++;
+        async->dropped_unreported++;
+        return;
+    }
+
+    vformat_record(record, format, args);
+    commit_record(async, record);
+}
+
+/*
+ * Queue binary data, reporting records dropped from binary logs to the
+ * error log since they can not be reported in the file itself
+ */
+static void
+async_log_data(struct AsyncLog *async, const void *data, size_t len) {
+    struct LogRecord *record = reserve_record(async);
+
+    if (record == NULL) {
+        async->dropped++;
+        async->dropped_unreported++;
+        return;
+    }
+
+    memcpy(record->line, data, len);
+    record->len = len;
+    commit_record(async, record);
+
+    if (async->dropped_unreported > 0) {
+        warn("Log writer fell behind, dropped %zu records (%zu total)",
+                async->dropped_unreported, async->dropped);
+        async->dropped_unreported = 0;
+    }
+}
+
+static void
+format_record(struct LogRecord *record, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    vformat_record(record, format, args);
+    va_end(args);
+}
+
+/*
+ * Format a timestamped log line ending with a newline, truncating it to the
+ * record
+ */
+static void
+vformat_record(struct LogRecord *record, const char *format, va_list args) {
+    size_t len = timestamp(record->line, sizeof(record->line));
+
+    /* keep room for the newline */
+    int result = vsnprintf(record->line + len, sizeof(record->line) - len - 1,
+            format, args);
+    if (result > 0)
+        len += MIN((size_t)result, sizeof(record->line) - len - 2);
+    record->line[len++] = '\n';
+    record->len = len;
+}
+
+/*
+ * Returns the record at the head of the ring to be filled, or NULL if the
+ * ring is full and the policy is to drop.
+ */
+static struct LogRecord *
+reserve_record(struct AsyncLog *async) {
+    size_t head = atomic_load_explicit(&async->head, memory_order_relaxed);
+
+    if (head - atomic_load(&async->tail) == LOG_RING_RECORDS) {
+        if (async->policy == LOG_ASYNC_DROP)
+            return NULL;
+
+        pthread_mutex_lock(&async->lock);
+        atomic_store(&async->producer_waiting, 1);
+        while (head - atomic_load(&async->tail) == LOG_RING_RECORDS)
+            pthread_cond_wait(&async->producer_cond, &async->lock);
+        atomic_store(&async->producer_waiting, 0);
+        pthread_mutex_unlock(&async->lock);
+    }
+
+    return &async->records[head & (LOG_RING_RECORDS - 1)];
+}
+
+static void
+commit_record(struct AsyncLog *async, struct LogRecord *record) {
+    if (!async->running && !start_async_writer(async)) {
+        /* no writer thread, write it ourselves */
+        struct iovec iov = { .iov_base = record->line, .iov_len = record->len };
+        write_records(async->fd, &iov, 1);
+        return;
+    }
+
+    atomic_fetch_add(&async->head, 1);
+
+    if (atomic_load(&async->writer_waiting)) {
+        pthread_mutex_lock(&async->lock);
+        pthread_cond_signal(&async->writer_cond);
+        pthread_mutex_unlock(&async->lock);
+    }
+}
+
+/*
+ * Wait for the writer to write every queued record
+ */
+static void
+drain_async_log(struct AsyncLog *async) {
+    if (!async->running)
+        return;
+
+    pthread_mutex_lock(&async->lock);
+    atomic_store(&async->producer_waiting, 1);
+    while (atomic_load(&async->tail) != atomic_load(&async->head))
+        pthread_cond_wait(&async->producer_cond, &async->lock);
+    atomic_store(&async->producer_waiting, 0);
+    pthread_mutex_unlock(&async->lock);
+}
+
+static void *
+async_log_writer(void *arg) {
+    struct AsyncLog *async = (struct AsyncLog *)arg;
+    struct iovec iov[LOG_WRITE_BATCH];
+
+    for (;;) {
+        size_t tail = atomic_load_explicit(&async->tail, memory_order_relaxed);
+        size_t head = atomic_load(&async->head);
+
+        if (head == tail) {
+            if (atomic_load(&async->stop))
+                break;
+
+            pthread_mutex_lock(&async->lock);
+            atomic_store(&async->writer_waiting, 1);
+            while (atomic_load(&async->head) == tail &&
+                    !atomic_load(&async->stop))
+                pthread_cond_wait(&async->writer_cond, &async->lock);
+            atomic_store(&async->writer_waiting, 0);
+            pthread_mutex_unlock(&async->lock);
+            continue;
+        }
+
+        int count = (int)MIN(head - tail, LOG_WRITE_BATCH);
+        for (int i = 0; i < count; i++) {
+            struct LogRecord *record =
+                &async->records[(tail + (size_t)i) & (LOG_RING_RECORDS - 1)];
+
+            iov[i].iov_base = record->line;
+            iov[i].iov_len = record->len;
+        }
+        write_records(async->fd, iov, count);
+
+        atomic_store(&async->tail, tail + (size_t)count);
+
+        if (atomic_load(&async->producer_waiting)) {
+            pthread_mutex_lock(&async->lock);
+            pthread_cond_signal(&async->producer_cond);
+            pthread_mutex_unlock(&async->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Write all of iov, there is nowhere to report a failure to so the remaining
+ * records are discarded.
+ */
+static void
+write_records(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return;
+
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+}
+
+/*
+ * Writer threads do not survive fork(), so queued records are written before
+ * forking and the child starts its own writers when it logs.
+ */
+static void
+logger_prepare_fork() {
+    struct LogSink *sink;
+
+    SLIST_FOREACH(sink, &sinks, entries)
+        if (sink->async != NULL)
+            drain_async_log(sink->async);
+
+    flush_loggers();
+}
+
+static void
+async_log_child_fork() {
+    struct LogSink *sink;
+
+    SLIST_FOREACH(sink, &sinks, entries)
+        if (sink->async != NULL) {
+            sink->async->running = 0;
+            init_async_log_sync(sink->async);
+        }
+}
+
+static time_t
+log_time() {
+    return log_loop != NULL ? (time_t)ev_now(log_loop) : time(NULL);
+}
+
+/*
+ * Format the current time into dst, using the event loop's time once the
+ * loggers are started rather than calling time() for every line. The
+ * formatted time is kept for the rest of the minute, updating only the
+ * seconds digits, so localtime() and strftime() run once a minute.
+ *
+ * Returns the length of the timestamp copied, which is null terminated.
+ */
+static size_t
 timestamp(char *dst, size_t dst_len) {
-    /* TODO change to ev_now() */
-    time_t now = time(NULL);
+    time_t now = log_time();
     static struct {
-        time_t when;
+        time_t minute;          /* start of the formatted minute */
+        size_t seconds;         /* offset of the seconds digits */
+        size_t len;
         char string[32];
-    } timestamp_cache = { .when = 0, .string = {'\0'} };
+    } timestamp_cache = { .minute = 0, .seconds = 0, .len = 0, .string = {'\0'} };
 
-    if (now != timestamp_cache.when) {
+    if (timestamp_cache.len == 0 || now < timestamp_cache.minute ||
+            now - timestamp_cache.minute >= 60) {
 #ifdef RFC3339_TIMESTAMP
         struct tm *tmp = gmtime(&now);
-        strftime(timestamp_cache.string, sizeof(timestamp_cache.string),
-                "%FT%TZ ", tmp);
+        timestamp_cache.len = strftime(timestamp_cache.string,
+                sizeof(timestamp_cache.string), "%FT%TZ ", tmp);
+        timestamp_cache.seconds = timestamp_cache.len - strlen("SSZ ");
 #else
         struct tm *tmp = localtime(&now);
-        strftime(timestamp_cache.string, sizeof(timestamp_cache.string),
-                "%F %T ", tmp);
+        timestamp_cache.len = strftime(timestamp_cache.string,
+                sizeof(timestamp_cache.string), "%F %T ", tmp);
+        timestamp_cache.seconds = timestamp_cache.len - strlen("SS ");
 #endif
 
-        timestamp_cache.when = now;
+        timestamp_cache.minute = now - tmp->tm_sec;
+    } else {
+        int seconds = (int)(now - timestamp_cache.minute);
+
+        timestamp_cache.string[timestamp_cache.seconds] = (char)('0' + seconds / 10);
+        timestamp_cache.string[timestamp_cache.seconds + 1] = (char)('0' + seconds % 10);
+    }
+
+    if (dst_len == 0)
+        return 0;
+
+    size_t len = MIN(timestamp_cache.len, dst_len - 1);
+    memcpy(dst, timestamp_cache.string, len);
+    dst[len] = '\0';
+
+    return len;
+}
+
+static void
+report_suppressed(struct LogRateLimit *site) {
+    if (site->suppressed == 0)
+        return;
+
+    log_msg(default_logger, site->priority,
+            "%u messages like \"%s\" suppressed",
+            site->suppressed, site->format);
+    site->suppressed = 0;
+}
+
+/*
+ * Log the number of messages suppressed at each call site whose interval has
+ * ended, or at every site with all set, so a burst is summarized even if the
+ * site is not reached again
+ */
+static void
+summarize_ratelimited(int all) {
+    struct LogRateLimit **site = &ratelimited_sites;
+    long now = (long)log_time();
+
+    while (*site != NULL) {
+        struct LogRateLimit *current = *site;
+
+        if (all || now - current->window >= LOG_RATELIMIT_INTERVAL ||
+                current->suppressed == 0) {
+            report_suppressed(current);
+            current->pending = 0;
+            *site = current->next;
+            current->next = NULL;
+        } else {
+            site = &current->next;
+        }
     }
+}
+
+static void
+ratelimit_timer_cb(struct ev_loop *loop __attribute__((unused)),
+        struct ev_timer *w __attribute__((unused)),
+        int revents __attribute__((unused))) {
+    summarize_ratelimited(0);
+}
+
+/*
+ * xorshift32, seeded on first use. Sampling needs a cheap draw, not an
+ * unpredictable one.
+ */
+static uint32_t
+sample_random() {
+    static uint32_t state = 0;
+
+    if (state == 0)
+        state = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16) ^ 0x9e3779b9;
 
-    if (dst != NULL)
-        strncpy(dst, timestamp_cache.string, dst_len);
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
 
-    return timestamp_cache.string;
+    return state;
 }
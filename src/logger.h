@@ -26,7 +26,10 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include <stddef.h>
+
 struct Logger;
+struct ev_loop;
 
 #define LOG_EMERG   0
 #define LOG_ALERT   1
@@ -37,13 +40,44 @@ struct Logger;
 #define LOG_INFO    6
 #define LOG_DEBUG   7
 
+/* Asynchronous file logging policy when the writer thread falls behind */
+#define LOG_ASYNC_OFF   0
+#define LOG_ASYNC_DROP  1
+#define LOG_ASYNC_BLOCK 2
+
+/* Messages logged from one rate limited call site per interval */
+#define LOG_RATELIMIT_BURST     10
+#define LOG_RATELIMIT_INTERVAL  5   /* seconds */
+
+/*
+ * State of a rate limited call site, allocated statically by the
+ * *_ratelimited() macros below
+ */
+struct LogRateLimit {
+    const char *format;
+    int priority;
+    long window;                /* start of the current interval */
+    unsigned int count;         /* messages logged in the interval */
+    unsigned int suppressed;
+    int pending;                /* on the list of sites to summarize */
+    struct LogRateLimit *next;
+};
+
 struct Logger *new_syslog_logger(const char *facility);
 struct Logger *new_file_logger(const char *filepath);
 void set_default_logger(struct Logger *);
 void set_logger_priority(struct Logger *, int);
+int set_logger_async(struct Logger *, int);
+int set_logger_buffer(struct Logger *, size_t, double);
+int set_logger_binary(struct Logger *, const void *, size_t);
+int logger_is_binary(const struct Logger *);
+int set_logger_sample(struct Logger *, double);
+int logger_sample(struct Logger *);
 struct Logger *logger_ref_get(struct Logger *);
 void logger_ref_put(struct Logger *);
 void reopen_loggers();
+void init_loggers(struct ev_loop *);
+void loggers_shutdown(struct ev_loop *);
 
 /* Shorthand to log to global error log */
 void fatal(const char *, ...)
@@ -62,5 +96,26 @@ void debug(const char *, ...)
 
 void log_msg(struct Logger *, int, const char *, ...)
     __attribute__ ((format (printf, 3, 4)));
+void log_record(struct Logger *, int, const void *, size_t);
+int log_ratelimit(struct LogRateLimit *, int, const char *);
+
+/*
+ * Log to the global error log from a call site limited to
+ * LOG_RATELIMIT_BURST messages every LOG_RATELIMIT_INTERVAL seconds. The
+ * arguments are not evaluated for suppressed messages, and the number
+ * suppressed is logged once the interval ends.
+ */
+#define err_ratelimited(...)    LOG_RATELIMITED(LOG_ERR, err, __VA_ARGS__)
+#define warn_ratelimited(...)   LOG_RATELIMITED(LOG_WARNING, warn, __VA_ARGS__)
+#define notice_ratelimited(...) LOG_RATELIMITED(LOG_NOTICE, notice, __VA_ARGS__)
+#define info_ratelimited(...)   LOG_RATELIMITED(LOG_INFO, info, __VA_ARGS__)
+
+#define LOG_RATELIMITED(priority, log, ...) do { \
+        static struct LogRateLimit log_rate_limit_; \
+        if (log_ratelimit(&log_rate_limit_, (priority), \
+                    LOG_FORMAT_(__VA_ARGS__, ""))) \
+            log(__VA_ARGS__); \
+    } while (0)
+#define LOG_FORMAT_(format, ...) (format)
 
 #endif
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "maglev.h"
+#include "logger.h"
+
+
+#define MAGLEV_OFFSET_SEED 0x6d61676c65763031ULL
+#define MAGLEV_SKIP_SEED   0x6d61676c65763032ULL
+
+
+/*
+ * Build a lookup table from the member names, names should be stable across
+ * reloads (e.g. the displayed backend address) so the permutations and hence
+ * the resulting table only change for added or removed members.
+ */
+struct Maglev *
+new_maglev(const char *const *names, size_t names_len) {
+    if (names_len == 0 || names_len >= UINT16_MAX) {
+        err("%s: unsupported member count %zu", __func__, names_len);
+        return NULL;
+    }
+
+    struct Maglev *maglev = malloc(sizeof(struct Maglev));
+    uint32_t *offset = calloc(names_len, sizeof(uint32_t));
+    uint32_t *skip = calloc(names_len, sizeof(uint32_t));
+    uint32_t *next = calloc(names_len, sizeof(uint32_t));
+    if (maglev == NULL || offset == NULL || skip == NULL || next == NULL) {
+        err("%s: malloc", __func__);
+        free(maglev);
+        free(offset);
+        free(skip);
+        free(next);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < names_len; i++) {
+        size_t len = strlen(names[i]);
+
+        offset[i] = maglev_hash(names[i], len, MAGLEV_OFFSET_SEED) %
+                MAGLEV_TABLE_SIZE;
+        skip[i] = maglev_hash(names[i], len, MAGLEV_SKIP_SEED) %
+                (MAGLEV_TABLE_SIZE - 1) + 1;
+    }
+
+    memset(maglev->lookup, 0xff, sizeof(maglev->lookup));
+    maglev->members_len = names_len;
+
+    /* Each member in turn claims the next unclaimed slot of its permutation
+     * until the table is full */
+    for (size_t filled = 0;;) {
+        for (size_t i = 0; i < names_len; i++) {
+            uint32_t slot;
+
+            do {
+                slot = (uint32_t)((offset[i] +
+                        (uint64_t)next[i] * skip[i]) % MAGLEV_TABLE_SIZE);
+                next[i]++;
+            } while (maglev->lookup[slot] != UINT16_MAX);
+
+            maglev->lookup[slot] = (uint16_t)i;
+
+            if (++filled == MAGLEV_TABLE_SIZE) {
+                free(offset);
+                free(skip);
+                free(next);
+                return maglev;
+            }
+        }
+    }
+}
+
+void
+free_maglev(struct Maglev *maglev) {
+    free(maglev);
+}
+
+/*
+ * FNV-1a with a MurmurHash3 finalizer so every output bit depends on every
+ * input bit, maglev_lookup() uses the upper 32 bits.
+ */
+uint64_t
+maglev_hash(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = data;
+    uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef MAGLEV_H
+#define MAGLEV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Maglev consistent hashing (Eisenbud et al., NSDI 2016)
+ *
+ * Each of N members fills slots of a prime sized lookup table following its
+ * own permutation, so removing one member only remaps the keys that hashed
+ * to its slots, roughly 1/N of all keys.
+ */
+#define MAGLEV_TABLE_SIZE 65537 /* prime, must exceed the member count */
+
+struct Maglev {
+    size_t members_len;
+    uint16_t lookup[MAGLEV_TABLE_SIZE];
+};
+
+struct Maglev *new_maglev(const char *const *, size_t);
+void free_maglev(struct Maglev *);
+uint64_t maglev_hash(const void *, size_t, uint64_t);
+
+/*
+ * Map a key hash to a member index, a single multiply and table load
+ */
+static inline size_t
+maglev_lookup(const struct Maglev *maglev, uint64_t hash) {
+    return maglev->lookup[((hash >> 32) * MAGLEV_TABLE_SIZE) >> 32];
+}
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Connection metrics
+ *
+ * Listeners, tables and backend addresses each count their traffic into a
+ * Metrics entry found by name, so an entry outlives configuration reloads
+ * as long as the new configuration still has it. Counters are dumped along
+ * with the connections on SIGUSR1, and served by the stats endpoint.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/queue.h>
+#include "metrics.h"
+#include "logger.h"
+
+
+static void free_metrics(struct Metrics *);
+static size_t histogram_bucket(uint64_t);
+static void print_histogram(FILE *, const char *, const struct Histogram *);
+
+
+static SLIST_HEAD(Metrics_head, Metrics) metrics_entries =
+    SLIST_HEAD_INITIALIZER(metrics_entries);
+
+static const char *const type_names[] = {
+    [METRICS_LISTENER] = "listener",
+    [METRICS_TABLE] = "table",
+    [METRICS_BACKEND] = "backend",
+};
+
+static const char *const counter_names[METRIC_COUNTERS] = {
+    [METRIC_CONNECTIONS] = "connections",
+    [METRIC_ACCEPT_ERRORS] = "accept_errors",
+    [METRIC_LOOKUPS] = "lookups",
+    [METRIC_LOOKUP_MISSES] = "lookup_misses",
+    [METRIC_DNS_ERRORS] = "dns_errors",
+    [METRIC_CONNECT_FAILURES] = "connect_failures",
+    [METRIC_BYTES_IN] = "bytes_in",
+    [METRIC_BYTES_OUT] = "bytes_out",
+};
+
+static const char *const histogram_names[METRIC_HISTOGRAMS] = {
+    [METRIC_PARSE_TIME] = "parse_time",
+    [METRIC_DNS_TIME] = "dns_time",
+    [METRIC_CONNECT_TIME] = "connect_time",
+    [METRIC_FIRST_BYTE_TIME] = "first_byte_time",
+    [METRIC_DURATION] = "duration",
+};
+
+/* Counters and histograms each type of entry reports */
+static const unsigned int type_counters[] = {
+    [METRICS_LISTENER] = 1 << METRIC_CONNECTIONS | 1 << METRIC_ACCEPT_ERRORS |
+            1 << METRIC_BYTES_IN | 1 << METRIC_BYTES_OUT,
+    [METRICS_TABLE] = 1 << METRIC_LOOKUPS | 1 << METRIC_LOOKUP_MISSES,
+    [METRICS_BACKEND] = 1 << METRIC_CONNECTIONS | 1 << METRIC_DNS_ERRORS |
+            1 << METRIC_CONNECT_FAILURES |
+            1 << METRIC_BYTES_IN | 1 << METRIC_BYTES_OUT,
+};
+
+static const unsigned int type_histograms[] = {
+    [METRICS_LISTENER] = 1 << METRIC_PARSE_TIME | 1 << METRIC_DURATION,
+    [METRICS_TABLE] = 0,
+    [METRICS_BACKEND] = 1 << METRIC_DNS_TIME | 1 << METRIC_CONNECT_TIME |
+            1 << METRIC_FIRST_BYTE_TIME | 1 << METRIC_DURATION,
+};
+
+
+/*
+ * Find the metrics of the named listener, table or backend, creating them
+ * if this is the first
+ */
+struct Metrics *
+obtain_metrics(enum MetricsType type, const char *name) {
+    struct Metrics *metrics;
+
+    SLIST_FOREACH(metrics, &metrics_entries, entries)
+        if (metrics->type == type && strcmp(metrics->name, name) == 0)
+            return metrics;
+
+    metrics = calloc(1, sizeof(struct Metrics));
+    if (metrics == NULL) {
+        err("%s: calloc", __func__);
+        return NULL;
+    }
+
+    metrics->name = strdup(name);
+    if (metrics->name == NULL) {
+        err("%s: strdup", __func__);
+        free(metrics);
+        return NULL;
+    }
+    metrics->type = type;
+    metrics->reference_count = 0;
+
+    SLIST_INSERT_HEAD(&metrics_entries, metrics, entries);
+
+    return metrics;
+}
+
+struct Metrics *
+metrics_ref_get(struct Metrics *metrics) {
+    if (metrics != NULL)
+        metrics->reference_count++;
+
+    return metrics;
+}
+
+void
+metrics_ref_put(struct Metrics *metrics) {
+    if (metrics == NULL)
+        return;
+
+    metrics->reference_count--;
+    if (metrics->reference_count <= 0)
+        free_metrics(metrics);
+}
+
+/*
+ * Iterate over every entry, starting from the first when passed NULL. A
+ * caller pausing between steps holds a reference to the entry it is at, so
+ * the entry stays listed.
+ */
+struct Metrics *
+metrics_next(struct Metrics *metrics) {
+    if (metrics == NULL)
+        return SLIST_FIRST(&metrics_entries);
+
+    return SLIST_NEXT(metrics, entries);
+}
+
+static void
+free_metrics(struct Metrics *metrics) {
+    SLIST_REMOVE(&metrics_entries, metrics, Metrics, entries);
+    free(metrics->name);
+    free(metrics);
+}
+
+/*
+ * Count a request parse_packet() failed to parse, by its result
+ */
+void
+metrics_parse_failure(struct Metrics *metrics, int result) {
+    if (metrics == NULL)
+        return;
+
+    if (result < 0 && result > -METRIC_PARSE_RESULTS)
+        metrics->parse_failures[-result]++;
+    else
+        metrics->parse_failures[0]++;
+}
+
+void
+print_metrics(FILE *file) {
+    struct Metrics *metrics;
+
+    fprintf(file, "Metrics:\n");
+    SLIST_FOREACH(metrics, &metrics_entries, entries) {
+        fprintf(file, "%s %s", type_names[metrics->type], metrics->name);
+        for (int i = 0; i < METRIC_COUNTERS; i++)
+            if (type_counters[metrics->type] & 1u << i)
+                fprintf(file, " %s %" PRIu64,
+                        counter_names[i], metrics->counters[i]);
+        fprintf(file, "\n");
+
+        if (metrics->type == METRICS_LISTENER) {
+            fprintf(file, "\tparse_failures");
+            for (int i = 1; i < METRIC_PARSE_RESULTS; i++)
+                fprintf(file, " %d:%" PRIu64, -i, metrics->parse_failures[i]);
+            fprintf(file, " other:%" PRIu64 "\n", metrics->parse_failures[0]);
+        }
+
+        for (int i = 0; i < METRIC_HISTOGRAMS; i++)
+            if (type_histograms[metrics->type] & 1u << i)
+                print_histogram(file, histogram_names[i],
+                        &metrics->histograms[i]);
+    }
+}
+
+static void
+print_histogram(FILE *file, const char *name, const struct Histogram *histogram) {
+    fprintf(file, "\t%s count %" PRIu64, name, histogram->count);
+    if (histogram->count > 0)
+        fprintf(file, " mean %" PRIu64 "us p50 %" PRIu64 "us p90 %" PRIu64
+                "us p99 %" PRIu64 "us max %" PRIu64 "us",
+                histogram->sum / histogram->count,
+                histogram_percentile(histogram, 0.50),
+                histogram_percentile(histogram, 0.90),
+                histogram_percentile(histogram, 0.99),
+                histogram->max);
+    fprintf(file, "\n");
+}
+
+void
+histogram_record(struct Histogram *histogram, ev_tstamp seconds) {
+    uint64_t value = seconds > 0.0 ? (uint64_t)(seconds * 1000000.0 + 0.5) : 0;
+
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max)
+        histogram->max = value;
+    histogram->buckets[histogram_bucket(value)]++;
+}
+
+static size_t
+histogram_bucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return (size_t)value;
+
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > HISTOGRAM_MAX_EXPONENT)
+        return HISTOGRAM_BUCKETS - 1;
+
+    int shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+
+    return (size_t)(shift + 1) * HISTOGRAM_SUB_BUCKETS +
+        (size_t)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/*
+ * Returns the largest value counted in a bucket
+ */
+uint64_t
+histogram_bucket_limit(size_t bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    int shift = (int)(bucket / HISTOGRAM_SUB_BUCKETS) - 1;
+    uint64_t sub_bucket = bucket % HISTOGRAM_SUB_BUCKETS;
+
+    return ((HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+}
+
+/*
+ * Returns the upper bound of the bucket holding the given fraction of
+ * values, limited to the largest value recorded
+ */
+uint64_t
+histogram_percentile(const struct Histogram *histogram, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * (double)histogram->count + 0.5);
+    uint64_t seen = 0;
+
+    if (rank == 0)
+        rank = 1;
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            uint64_t limit = histogram_bucket_limit(i);
+            return limit < histogram->max ? limit : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
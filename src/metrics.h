@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <ev.h>
+
+/*
+ * Durations are counted in microseconds into log scaled buckets, as in HDR
+ * histograms: values below HISTOGRAM_SUB_BUCKETS have a bucket each, and
+ * every power of two above is split into HISTOGRAM_SUB_BUCKETS buckets, so
+ * a bucket's bounds are within 25% of each other. Values of 2^36 us (about
+ * 19 hours) or more share the last bucket.
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 2
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_EXPONENT 35
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BUCKET_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+/* Slots for parse_packet() results -1 to -6, and any other failure */
+#define METRIC_PARSE_RESULTS 7
+
+enum MetricsCounter {
+    METRIC_CONNECTIONS,         /* accepted, or proxied to a backend */
+    METRIC_ACCEPT_ERRORS,
+    METRIC_LOOKUPS,
+    METRIC_LOOKUP_MISSES,
+    METRIC_DNS_ERRORS,
+    METRIC_CONNECT_FAILURES,
+    METRIC_BYTES_IN,            /* from clients, or from a backend */
+    METRIC_BYTES_OUT,           /* to clients, or to a backend */
+    METRIC_COUNTERS
+};
+
+enum MetricsHistogram {
+    METRIC_PARSE_TIME,          /* accept to request parsed */
+    METRIC_DNS_TIME,
+    METRIC_CONNECT_TIME,
+    METRIC_FIRST_BYTE_TIME,     /* connected to first byte from backend */
+    METRIC_DURATION,            /* accept to last data received */
+    METRIC_HISTOGRAMS
+};
+
+struct Histogram {
+    uint64_t count;
+    uint64_t sum;           /* microseconds */
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+/*
+ * Counters of a listener, table or backend address, shared by every
+ * configuration entry with the same name and kept across configuration
+ * reloads. They are only updated from the event loop, so plain increments
+ * suffice.
+ */
+struct Metrics {
+    char *name;
+    enum MetricsType {
+        METRICS_LISTENER,
+        METRICS_TABLE,
+        METRICS_BACKEND,
+    } type;
+    uint64_t counters[METRIC_COUNTERS];
+    uint64_t parse_failures[METRIC_PARSE_RESULTS];
+    struct Histogram histograms[METRIC_HISTOGRAMS];
+
+    /* Runtime fields */
+    int reference_count;
+    SLIST_ENTRY(Metrics) entries;
+};
+
+struct Metrics *obtain_metrics(enum MetricsType, const char *);
+struct Metrics *metrics_ref_get(struct Metrics *);
+void metrics_ref_put(struct Metrics *);
+struct Metrics *metrics_next(struct Metrics *);
+void metrics_parse_failure(struct Metrics *, int);
+void print_metrics(FILE *);
+
+void histogram_record(struct Histogram *, ev_tstamp);
+uint64_t histogram_bucket_limit(size_t);
+uint64_t histogram_percentile(const struct Histogram *, double);
+
+static inline void
+metrics_count(struct Metrics *metrics, enum MetricsCounter counter,
+        uint64_t n) {
+    if (metrics != NULL)
+        metrics->counters[counter] += n;
+}
+
+static inline void
+metrics_record(struct Metrics *metrics, enum MetricsHistogram histogram,
+        ev_tstamp seconds) {
+    if (metrics != NULL)
+        histogram_record(&metrics->histograms[histogram], seconds);
+}
+
+#endif
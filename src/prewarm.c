@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Backend connection pre-warming
+ *
+ * A pool keeps up to size idle TCP connections to a backend address so a
+ * client connection can skip the handshake with the backend. Pools are
+ * refilled in the background, idle connections are closed after
+ * PREWARM_IDLE_TIMEOUT and any connection the backend closes (or writes to)
+ * while idle is discarded.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <ev.h>
+#include "prewarm.h"
+#include "address.h"
+#include "logger.h"
+
+
+#define PREWARM_REFILL_INTERVAL 1.0
+#define PREWARM_CONNECT_TIMEOUT 5.0
+#define PREWARM_IDLE_TIMEOUT 30.0
+
+
+static void free_prewarm_pool(struct PrewarmPool *);
+static void prewarm_refill(struct PrewarmPool *);
+static void prewarm_timer_cb(struct ev_loop *, struct ev_timer *, int);
+static void prewarm_socket_cb(struct ev_loop *, struct ev_io *, int);
+static void close_prewarm_socket(struct PrewarmSocket *);
+static int prewarm_socket_alive(int);
+
+
+static struct ev_loop *prewarm_loop = NULL;
+static SLIST_HEAD(PrewarmPool_head, PrewarmPool) prewarm_pools =
+    SLIST_HEAD_INITIALIZER(prewarm_pools);
+
+
+void
+init_prewarm(struct ev_loop *loop) {
+    struct PrewarmPool *iter;
+
+    prewarm_loop = loop;
+
+    SLIST_FOREACH(iter, &prewarm_pools, entries) {
+        ev_timer_start(loop, &iter->timer);
+        prewarm_refill(iter);
+    }
+}
+
+void
+prewarm_shutdown(struct ev_loop *loop) {
+    struct PrewarmPool *iter;
+
+    SLIST_FOREACH(iter, &prewarm_pools, entries) {
+        ev_timer_stop(loop, &iter->timer);
+        while (!TAILQ_EMPTY(&iter->sockets))
+            close_prewarm_socket(TAILQ_FIRST(&iter->sockets));
+    }
+
+    prewarm_loop = NULL;
+}
+
+/*
+ * Find or create the pool for an address, pre-warming is only possible for
+ * socket addresses with a known port.
+ */
+struct PrewarmPool *
+obtain_prewarm_pool(const struct Address *address, size_t size) {
+    char name[ADDRESS_BUFFER_SIZE];
+    struct PrewarmPool *pool;
+
+    display_address(address, name, sizeof(name));
+
+    if (!address_is_sockaddr(address) ||
+            (address_sa(address)->sa_family != AF_UNIX &&
+             address_port(address) == 0)) {
+        warn("Pre-warming requires a socket address with a port, "
+                "disabled for %s", name);
+        return NULL;
+    }
+
+    SLIST_FOREACH(pool, &prewarm_pools, entries) {
+        if (strcmp(pool->name, name) == 0) {
+            if (size > pool->size) {
+                pool->size = size;
+                prewarm_refill(pool);
+            }
+
+            return pool;
+        }
+    }
+
+    pool = calloc(1, sizeof(struct PrewarmPool));
+    if (pool == NULL) {
+        err("%s: calloc", __func__);
+        return NULL;
+    }
+
+    pool->name = strdup(name);
+    pool->address = copy_address(address);
+    if (pool->name == NULL || pool->address == NULL) {
+        err("%s: malloc", __func__);
+        free(pool->name);
+        free(pool->address);
+        free(pool);
+        return NULL;
+    }
+
+    pool->size = size;
+    TAILQ_INIT(&pool->sockets);
+    pool->sockets_len = 0;
+    pool->reference_count = 0;
+    ev_timer_init(&pool->timer, prewarm_timer_cb,
+            PREWARM_REFILL_INTERVAL, PREWARM_REFILL_INTERVAL);
+    pool->timer.data = pool;
+
+    SLIST_INSERT_HEAD(&prewarm_pools, pool, entries);
+
+    if (prewarm_loop != NULL) {
+        ev_timer_start(prewarm_loop, &pool->timer);
+        prewarm_refill(pool);
+    }
+
+    return pool;
+}
+
+struct PrewarmPool *
+prewarm_pool_ref_get(struct PrewarmPool *pool) {
+    if (pool != NULL)
+        pool->reference_count++;
+
+    return pool;
+}
+
+void
+prewarm_pool_ref_put(struct PrewarmPool *pool) {
+    if (pool == NULL)
+        return;
+
+    assert(pool->reference_count > 0);
+    pool->reference_count--;
+    if (pool->reference_count == 0)
+        free_prewarm_pool(pool);
+}
+
+/*
+ * Take an established connection from the pool, the caller owns the
+ * returned socket. Returns -1 if no live connection is available.
+ */
+int
+prewarm_take(struct PrewarmPool *pool) {
+    struct PrewarmSocket *sock;
+    int sockfd = -1;
+
+    if (pool == NULL)
+        return -1;
+
+    /* Connected sockets are kept at the head, most recent first */
+    while (sockfd < 0 && (sock = TAILQ_FIRST(&pool->sockets)) != NULL &&
+            sock->connected) {
+        sockfd = sock->watcher.fd;
+
+        ev_io_stop(prewarm_loop, &sock->watcher);
+        TAILQ_REMOVE(&pool->sockets, sock, entries);
+        pool->sockets_len--;
+        free(sock);
+
+        /* The backend may have closed it since we last polled */
+        if (!prewarm_socket_alive(sockfd)) {
+            close(sockfd);
+            sockfd = -1;
+        }
+    }
+
+    prewarm_refill(pool);
+
+    return sockfd;
+}
+
+static void
+free_prewarm_pool(struct PrewarmPool *pool) {
+    if (prewarm_loop != NULL)
+        ev_timer_stop(prewarm_loop, &pool->timer);
+
+    while (!TAILQ_EMPTY(&pool->sockets))
+        close_prewarm_socket(TAILQ_FIRST(&pool->sockets));
+
+    SLIST_REMOVE(&prewarm_pools, pool, PrewarmPool, entries);
+
+    free(pool->name);
+    free(pool->address);
+    free(pool);
+}
+
+/*
+ * Start connecting until the pool holds size connected or connecting sockets
+ */
+static void
+prewarm_refill(struct PrewarmPool *pool) {
+    const struct sockaddr *addr = address_sa(pool->address);
+
+    if (prewarm_loop == NULL)
+        return;
+
+    while (pool->sockets_len < pool->size) {
+#ifdef HAVE_ACCEPT4
+        int sockfd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+#else
+        int sockfd = socket(addr->sa_family, SOCK_STREAM, 0);
+#endif
+        if (sockfd < 0) {
+            warn("Pre-warming socket failed: %s", strerror(errno));
+            return;
+        }
+
+#ifndef HAVE_ACCEPT4
+        int flags = fcntl(sockfd, F_GETFL, 0);
+        fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+#endif
+
+        if (connect(sockfd, addr, address_sa_len(pool->address)) < 0 &&
+                errno != EINPROGRESS) {
+            debug("Pre-warming connection to %s failed: %s",
+                    pool->name, strerror(errno));
+            close(sockfd);
+            return;
+        }
+
+        struct PrewarmSocket *sock = malloc(sizeof(struct PrewarmSocket));
+        if (sock == NULL) {
+            err("%s: malloc", __func__);
+            close(sockfd);
+            return;
+        }
+
+        sock->pool = pool;
+        sock->connected = 0;
+        sock->idle_since = ev_now(prewarm_loop);
+        ev_io_init(&sock->watcher, prewarm_socket_cb, sockfd, EV_WRITE);
+        sock->watcher.data = sock;
+        ev_io_start(prewarm_loop, &sock->watcher);
+
+        TAILQ_INSERT_TAIL(&pool->sockets, sock, entries);
+        pool->sockets_len++;
+    }
+}
+
+static void
+prewarm_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents) {
+    struct PrewarmPool *pool = (struct PrewarmPool *)w->data;
+    struct PrewarmSocket *sock = TAILQ_FIRST(&pool->sockets);
+    ev_tstamp now = ev_now(loop);
+
+    if (!(revents & EV_TIMER))
+        return;
+
+    while (sock != NULL) {
+        struct PrewarmSocket *next = TAILQ_NEXT(sock, entries);
+
+        if (now - sock->idle_since > (sock->connected ?
+                    PREWARM_IDLE_TIMEOUT : PREWARM_CONNECT_TIMEOUT))
+            close_prewarm_socket(sock);
+
+        sock = next;
+    }
+
+    prewarm_refill(pool);
+}
+
+static void
+prewarm_socket_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
+    struct PrewarmSocket *sock = (struct PrewarmSocket *)w->data;
+    struct PrewarmPool *pool = sock->pool;
+
+    if (!sock->connected && revents & EV_WRITE) {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+
+        if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0)
+            error = errno;
+        if (error != 0) {
+            debug("Pre-warming connection to %s failed: %s",
+                    pool->name, strerror(error));
+            close_prewarm_socket(sock);
+            return;
+        }
+
+        sock->connected = 1;
+        sock->idle_since = ev_now(loop);
+
+        ev_io_stop(loop, w);
+        ev_io_set(w, w->fd, EV_READ);
+        ev_io_start(loop, w);
+
+        TAILQ_REMOVE(&pool->sockets, sock, entries);
+        TAILQ_INSERT_HEAD(&pool->sockets, sock, entries);
+    } else if (sock->connected && revents & EV_READ) {
+        /* Nothing has been sent, so this is the backend closing the
+         * connection or talking out of turn, either way it is unusable */
+        debug("Pre-warmed connection to %s closed by backend", pool->name);
+        close_prewarm_socket(sock);
+    }
+}
+
+static void
+close_prewarm_socket(struct PrewarmSocket *sock) {
+    struct PrewarmPool *pool = sock->pool;
+
+    if (prewarm_loop != NULL)
+        ev_io_stop(prewarm_loop, &sock->watcher);
+    close(sock->watcher.fd);
+
+    TAILQ_REMOVE(&pool->sockets, sock, entries);
+    pool->sockets_len--;
+    free(sock);
+}
+
+static int
+prewarm_socket_alive(int sockfd) {
+    char c;
+    ssize_t len = recv(sockfd, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT);
+
+    return len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
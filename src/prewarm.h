@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef PREWARM_H
+#define PREWARM_H
+
+#include <sys/queue.h>
+#include <ev.h>
+#include "address.h"
+
+#define PREWARM_DEFAULT_SIZE 4
+
+struct PrewarmSocket {
+    struct PrewarmPool *pool;
+    int connected;
+    ev_tstamp idle_since;
+    struct ev_io watcher;
+    TAILQ_ENTRY(PrewarmSocket) entries;
+};
+
+/*
+ * Idle connections established ahead of time to a backend address, shared
+ * by every table entry with the same address and kept across configuration
+ * reloads.
+ */
+struct PrewarmPool {
+    char *name;
+    struct Address *address;
+    size_t size;
+
+    /* Runtime fields */
+    TAILQ_HEAD(, PrewarmSocket) sockets;    /* most recently connected first */
+    size_t sockets_len;
+    struct ev_timer timer;
+    int reference_count;
+    SLIST_ENTRY(PrewarmPool) entries;
+};
+
+void init_prewarm(struct ev_loop *);
+void prewarm_shutdown(struct ev_loop *);
+struct PrewarmPool *obtain_prewarm_pool(const struct Address *, size_t);
+struct PrewarmPool *prewarm_pool_ref_get(struct PrewarmPool *);
+void prewarm_pool_ref_put(struct PrewarmPool *);
+int prewarm_take(struct PrewarmPool *);
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static tracepoints for bpftrace, perf or SystemTap, under the provider
+ * sniproxy. Built with --enable-usdt each probe is a single nop with a note
+ * describing where its arguments are, otherwise the probes and their
+ * arguments compile to nothing.
+ *
+ * accept(connection, fd)
+ * parse(connection, result, hostname)
+ * table_match(hostname, pattern), table_miss(hostname)
+ * dns_submit(query, hostname, mode), dns_complete(query, found), dns_cancel(query)
+ * connect_start(connection, fd, sockaddr)
+ * connect_done(connection, errno), for every server connect including fallbacks
+ * recv(connection, from_client, bytes), send(connection, to_client, bytes)
+ * close(connection, microseconds, bytes from client, bytes from server)
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(sniproxy, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(sniproxy, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(sniproxy, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(sniproxy, name, a, b, c, d)
+#else
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif
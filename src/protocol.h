@@ -26,15 +26,58 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <stddef.h>
 #include <inttypes.h>
 
+/* Longest ALPN protocol name list kept for routing */
+#define ALPN_LIST_LEN 128
+
+/* Details of the request beyond the hostname, set by the parsers */
+struct RequestInfo {
+    size_t modify_pos;  /* offset of the hostname, for split_packet */
+    const char *alpn;   /* ALPN protocol name list in wire format, a view
+                           like the hostname, NULL if not offered */
+    size_t alpn_len;
+};
+
 struct Protocol {
     const char *const name;
     const uint16_t default_port;
-    int (*const parse_packet)(const char*, size_t, char **, size_t*);
-    void (*const modify_packet)(char*, size_t, char **, size_t*);
+    /* On success returns the hostname length and points the char ** at
+     * the hostname, within the request where possible; it is not
+     * terminated and is only valid while the request data is */
+    int (*const parse_packet)(const char*, size_t, const char **,
+            struct RequestInfo *);
+    size_t (*const split_packet)(char*, size_t, size_t, char*, size_t*);
+    /* Optional resumable parser, fed only bytes following those it has
+     * already seen; the size_t is the maximum request size */
+    void *(*const new_parser)(size_t);
+    int (*const parse_more)(void *, const char*, size_t, const char **,
+            struct RequestInfo *);
+    void (*const free_parser)(void *);
     const char *const abort_message;
     const size_t abort_message_len;
+    /* Carried over UDP, each parse_packet() or parse_more() call is passed a
+     * single datagram */
+    const int datagram;
 };
 
+/*
+ * Length of the longest prefix of the ALPN protocol name list made of whole
+ * entries that fits in max bytes
+ */
+static inline size_t
+alpn_list_prefix(const char *list, size_t len, size_t max) {
+    size_t pos = 0;
+
+    while (pos < len) {
+        size_t next = pos + 1 + (uint8_t)list[pos];
+        if (next > len || next > max)
+            break;
+        pos = next;
+    }
+
+    return pos;
+}
+
 #endif
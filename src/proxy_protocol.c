@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "proxy_protocol.h"
+
+
+static size_t append_tlv(char *, uint8_t, const char *, size_t);
+static int parse_v1_header(const char *, size_t, struct sockaddr_storage *,
+        struct sockaddr_storage *);
+static int parse_v2_header(const char *, size_t, struct sockaddr_storage *,
+        struct sockaddr_storage *);
+static int parse_v1_address(int, const char *, const char *,
+        struct sockaddr_storage *);
+
+
+/*
+ * Build a binary PROXY v2 header for a TCP connection from src to dst into
+ * buf, followed by TLVs carrying the requested authority (hostname) and ALPN
+ * protocol name when they are not empty. Connections which are not between
+ * two addresses of the same IP family are sent as UNSPEC, as PROXY v1 does
+ * with UNKNOWN.
+ *
+ * Returns the length of the header, or 0 if it does not fit in buf.
+ */
+size_t
+proxy_v2_header(char *buf, size_t buf_len,
+        const struct sockaddr_storage *src, const struct sockaddr_storage *dst,
+        const char *authority, size_t authority_len,
+        const char *alpn, size_t alpn_len) {
+    struct ProxyV2Header hdr;
+    size_t addr_len = 0;
+
+    memcpy(hdr.sig, PP2_SIGNATURE, PP2_SIGNATURE_LEN);
+    hdr.ver_cmd = PP2_VERSION_PROXY;
+    hdr.fam = PP2_FAM_UNSPEC;
+
+    if (src->ss_family == AF_INET && dst->ss_family == AF_INET) {
+        const struct sockaddr_in *s = (const struct sockaddr_in *)src;
+        const struct sockaddr_in *d = (const struct sockaddr_in *)dst;
+
+        hdr.fam = PP2_FAM_TCP4;
+        hdr.addr.ipv4.src_addr = s->sin_addr.s_addr;
+        hdr.addr.ipv4.dst_addr = d->sin_addr.s_addr;
+        hdr.addr.ipv4.src_port = s->sin_port;
+        hdr.addr.ipv4.dst_port = d->sin_port;
+        addr_len = sizeof(hdr.addr.ipv4);
+    } else if (src->ss_family == AF_INET6 && dst->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *s = (const struct sockaddr_in6 *)src;
+        const struct sockaddr_in6 *d = (const struct sockaddr_in6 *)dst;
+
+        hdr.fam = PP2_FAM_TCP6;
+        memcpy(hdr.addr.ipv6.src_addr, &s->sin6_addr, 16);
+        memcpy(hdr.addr.ipv6.dst_addr, &d->sin6_addr, 16);
+        hdr.addr.ipv6.src_port = s->sin6_port;
+        hdr.addr.ipv6.dst_port = d->sin6_port;
+        addr_len = sizeof(hdr.addr.ipv6);
+    }
+
+    if (authority_len > 255 || alpn_len > 255)
+        return 0;
+
+    size_t header_len = offsetof(struct ProxyV2Header, addr) + addr_len +
+        (authority_len > 0 ? 3 + authority_len : 0) +
+        (alpn_len > 0 ? 3 + alpn_len : 0);
+    if (header_len > buf_len)
+        return 0;
+
+    hdr.len = htons((uint16_t)(header_len -
+                offsetof(struct ProxyV2Header, addr)));
+
+    size_t pos = offsetof(struct ProxyV2Header, addr) + addr_len;
+    memcpy(buf, &hdr, pos);
+    if (alpn_len > 0)
+        pos += append_tlv(buf + pos, PP2_TYPE_ALPN, alpn, alpn_len);
+    if (authority_len > 0)
+        pos += append_tlv(buf + pos, PP2_TYPE_AUTHORITY,
+                authority, authority_len);
+
+    return pos;
+}
+
+static size_t
+append_tlv(char *buf, uint8_t type, const char *value, size_t len) {
+    buf[0] = (char)type;
+    buf[1] = (char)(len >> 8);
+    buf[2] = (char)(len & 0xff);
+    memcpy(buf + 3, value, len);
+
+    return 3 + len;
+}
+
+/*
+ * Parse a PROXY v1 or v2 header at the start of data, the version is
+ * detected from its signature. The addresses it carries are stored in src
+ * and dst, which are left with the family AF_UNSPEC when it carries none
+ * (v1 UNKNOWN, v2 LOCAL or a family other than TCP or UDP over IP).
+ *
+ * Returns the length of the header,
+ *  -1 if the header is incomplete
+ *  -2 if data does not start with a PROXY header
+ *  -3 if the header is malformed
+ */
+int
+parse_proxy_header(const char *data, size_t data_len,
+        struct sockaddr_storage *src, struct sockaddr_storage *dst) {
+    size_t prefix_len;
+
+    src->ss_family = AF_UNSPEC;
+    dst->ss_family = AF_UNSPEC;
+
+    if (data_len == 0)
+        return -1;
+
+    if (data[0] == 'P') {
+        prefix_len = data_len < 6 ? data_len : 6;
+        if (memcmp(data, "PROXY ", prefix_len) != 0)
+            return -2;
+
+        return parse_v1_header(data, data_len, src, dst);
+    }
+
+    prefix_len = data_len < PP2_SIGNATURE_LEN ? data_len : PP2_SIGNATURE_LEN;
+    if (memcmp(data, PP2_SIGNATURE, prefix_len) != 0)
+        return -2;
+
+    return parse_v2_header(data, data_len, src, dst);
+}
+
+static int
+parse_v1_header(const char *data, size_t data_len,
+        struct sockaddr_storage *src, struct sockaddr_storage *dst) {
+    char line[PROXY_V1_HEADER_MAX + 1];
+    const char *end = memchr(data, '\n', data_len < PROXY_V1_HEADER_MAX ?
+            data_len : PROXY_V1_HEADER_MAX);
+    if (end == NULL)
+        return data_len < PROXY_V1_HEADER_MAX ? -1 : -3;
+
+    size_t len = (size_t)(end - data) + 1;
+    if (len < 8 || data[len - 2] != '\r')
+        return -3;
+
+    memcpy(line, data, len - 2);
+    line[len - 2] = '\0';
+
+    char *saveptr = NULL;
+    char *field[7];
+    size_t fields = 0;
+    for (char *token = strtok_r(line, " ", &saveptr);
+            token != NULL && fields < 7;
+            token = strtok_r(NULL, " ", &saveptr))
+        field[fields++] = token;
+
+    if (fields >= 2 && strcmp(field[1], "UNKNOWN") == 0)
+        return (int)len;
+
+    if (fields != 6)
+        return -3;
+
+    int family;
+    if (strcmp(field[1], "TCP4") == 0)
+        family = AF_INET;
+    else if (strcmp(field[1], "TCP6") == 0)
+        family = AF_INET6;
+    else
+        return -3;
+
+    if (!parse_v1_address(family, field[2], field[4], src) ||
+            !parse_v1_address(family, field[3], field[5], dst)) {
+        src->ss_family = AF_UNSPEC;
+        dst->ss_family = AF_UNSPEC;
+        return -3;
+    }
+
+    return (int)len;
+}
+
+static int
+parse_v1_address(int family, const char *address, const char *port,
+        struct sockaddr_storage *addr) {
+    char *end = NULL;
+
+    if (port[0] < '0' || port[0] > '9')
+        return 0;
+
+    unsigned long value = strtoul(port, &end, 10);
+    if (*end != '\0' || value > 65535)
+        return 0;
+
+    memset(addr, 0, sizeof(*addr));
+    if (family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons((uint16_t)value);
+        return inet_pton(AF_INET, address, &sin->sin_addr) == 1;
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons((uint16_t)value);
+        return inet_pton(AF_INET6, address, &sin6->sin6_addr) == 1;
+    }
+}
+
+static int
+parse_v2_header(const char *data, size_t data_len,
+        struct sockaddr_storage *src, struct sockaddr_storage *dst) {
+    struct ProxyV2Header hdr;
+    size_t fixed_len = offsetof(struct ProxyV2Header, addr);
+
+    if (data_len < fixed_len)
+        return -1;
+
+    memcpy(&hdr, data, fixed_len);
+    size_t len = fixed_len + ntohs(hdr.len);
+    if (data_len < len)
+        return -1;
+
+    if (hdr.ver_cmd == PP2_VERSION_LOCAL)
+        return (int)len;
+    if (hdr.ver_cmd != PP2_VERSION_PROXY)
+        return -3;
+
+    size_t addr_len = len - fixed_len;
+    if (addr_len > sizeof(hdr.addr))
+        addr_len = sizeof(hdr.addr);
+    memcpy(&hdr.addr, data + fixed_len, addr_len);
+
+    if (hdr.fam == PP2_FAM_TCP4 || hdr.fam == PP2_FAM_UDP4) {
+        if (addr_len < sizeof(hdr.addr.ipv4))
+            return -3;
+
+        struct sockaddr_in *s = (struct sockaddr_in *)src;
+        struct sockaddr_in *d = (struct sockaddr_in *)dst;
+        memset(src, 0, sizeof(*src));
+        memset(dst, 0, sizeof(*dst));
+        s->sin_family = AF_INET;
+        s->sin_addr.s_addr = hdr.addr.ipv4.src_addr;
+        s->sin_port = hdr.addr.ipv4.src_port;
+        d->sin_family = AF_INET;
+        d->sin_addr.s_addr = hdr.addr.ipv4.dst_addr;
+        d->sin_port = hdr.addr.ipv4.dst_port;
+    } else if (hdr.fam == PP2_FAM_TCP6 || hdr.fam == PP2_FAM_UDP6) {
+        if (addr_len < sizeof(hdr.addr.ipv6))
+            return -3;
+
+        struct sockaddr_in6 *s = (struct sockaddr_in6 *)src;
+        struct sockaddr_in6 *d = (struct sockaddr_in6 *)dst;
+        memset(src, 0, sizeof(*src));
+        memset(dst, 0, sizeof(*dst));
+        s->sin6_family = AF_INET6;
+        memcpy(&s->sin6_addr, hdr.addr.ipv6.src_addr, 16);
+        s->sin6_port = hdr.addr.ipv6.src_port;
+        d->sin6_family = AF_INET6;
+        memcpy(&d->sin6_addr, hdr.addr.ipv6.dst_addr, 16);
+        d->sin6_port = hdr.addr.ipv6.dst_port;
+    }
+
+    return (int)len;
+}
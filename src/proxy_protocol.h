@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef PROXY_PROTOCOL_H
+#define PROXY_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Values of use_proxy_header */
+#define PROXY_HEADER_NONE   0
+#define PROXY_HEADER_V1     1   /* text PROXY v1 line */
+#define PROXY_HEADER_V2     2   /* binary PROXY v2 header with TLVs */
+
+#define PP2_SIGNATURE "\r\n\r\n\0\r\nQUIT\n"
+#define PP2_SIGNATURE_LEN 12
+#define PP2_VERSION_LOCAL 0x20
+#define PP2_VERSION_PROXY 0x21
+#define PP2_FAM_UNSPEC 0x00
+#define PP2_FAM_TCP4 0x11
+#define PP2_FAM_UDP4 0x12
+#define PP2_FAM_TCP6 0x21
+#define PP2_FAM_UDP6 0x22
+#define PP2_TYPE_ALPN 0x01
+#define PP2_TYPE_AUTHORITY 0x02
+
+/* longest PROXY v1 line, including the CRLF */
+#define PROXY_V1_HEADER_MAX 107
+
+/* fixed part, addresses and an authority and ALPN TLV of up to 255 bytes */
+#define PROXY_V2_HEADER_MAX (16 + 36 + 2 * (3 + 255))
+
+struct ProxyV2Header {
+    uint8_t sig[PP2_SIGNATURE_LEN];
+    uint8_t ver_cmd;
+    uint8_t fam;
+    uint16_t len;       /* network byte order, bytes following the header */
+    union {
+        struct {
+            uint32_t src_addr;
+            uint32_t dst_addr;
+            uint16_t src_port;
+            uint16_t dst_port;
+        } ipv4;
+        struct {
+            uint8_t src_addr[16];
+            uint8_t dst_addr[16];
+            uint16_t src_port;
+            uint16_t dst_port;
+        } ipv6;
+    } addr;
+};
+
+size_t proxy_v2_header(char *, size_t, const struct sockaddr_storage *,
+        const struct sockaddr_storage *, const char *, size_t,
+        const char *, size_t);
+int parse_proxy_header(const char *, size_t, struct sockaddr_storage *,
+        struct sockaddr_storage *);
+
+#endif
@@ -0,0 +1,722 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * QUIC version 1 Initial packet parsing, RFC 9000 and RFC 9001
+ *
+ * A client's Initial packets are protected with keys derived from the
+ * destination connection ID it chose, which is sent in the clear, so without
+ * any secret the proxy can remove the protection and read the TLS ClientHello
+ * from their CRYPTO frames. The ClientHello may span several Initial packets
+ * and datagrams, and its CRYPTO frames may arrive in any order.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <assert.h>
+#ifdef HAVE_LIBCRYPTO
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#endif
+#include "quic.h"
+#include "tls.h"
+#include "protocol.h"
+#include "logger.h"
+
+#define QUIC_VERSION_1 0x00000001
+#define QUIC_MAX_CID_LEN 20
+#define QUIC_MIN_INITIAL_DATAGRAM 1200
+#define QUIC_MAX_DATAGRAM 65527
+#define QUIC_PACKET_TYPE_INITIAL 0x00
+#define QUIC_SAMPLE_LEN 16
+#define QUIC_TAG_LEN 16
+#define QUIC_KEY_LEN 16
+#define QUIC_IV_LEN 12
+#define QUIC_HANDSHAKE_HEADER_LEN 4
+#define QUIC_MAX_HELLO_LEN 65536
+
+#define QUIC_FRAME_PADDING 0x00
+#define QUIC_FRAME_PING 0x01
+#define QUIC_FRAME_ACK 0x02
+#define QUIC_FRAME_ACK_ECN 0x03
+#define QUIC_FRAME_CRYPTO 0x06
+#define QUIC_FRAME_CONNECTION_CLOSE 0x1c
+
+struct QUICLongHeader {
+    uint8_t type;
+    uint32_t version;
+    size_t dcid_pos, dcid_len;
+    size_t scid_pos, scid_len;
+    size_t pn_pos;              /* 0 for packets without a packet number */
+    size_t packet_len;
+};
+
+struct QUICKeys {
+    uint8_t key[QUIC_KEY_LEN];
+    uint8_t iv[QUIC_IV_LEN];
+    uint8_t hp[QUIC_KEY_LEN];
+};
+
+/*
+ * Per flow parser state: the keys for the client's original destination
+ * connection ID and the CRYPTO stream reassembled so far
+ */
+struct QUICParser {
+    size_t max_hello_len;
+    uint8_t dcid[QUIC_MAX_CID_LEN];
+    size_t dcid_len;
+    struct QUICKeys keys;
+    size_t packets;             /* Initial packets successfully decrypted */
+    uint64_t largest_pn;
+    uint8_t *crypto;            /* CRYPTO stream reassembled so far */
+    uint8_t *received;          /* which bytes of crypto have arrived */
+    size_t crypto_size;
+    size_t contiguous;          /* bytes received without a gap from 0 */
+    size_t hello_len;           /* ClientHello length, 0 until known */
+};
+
+static int parse_quic_initial(const char *, size_t, const char **, struct RequestInfo *);
+static struct QUICParser *new_quic_parser(size_t);
+static int parse_quic_more(struct QUICParser *, const char *, size_t, const char **, struct RequestInfo *);
+static void free_quic_parser(struct QUICParser *);
+static int quic_parser_feed(struct QUICParser *, const uint8_t *, size_t, const char **, struct RequestInfo *);
+static int parse_long_header(const uint8_t *, size_t, struct QUICLongHeader *);
+static int decrypt_initial(struct QUICParser *, const uint8_t *, const struct QUICLongHeader *, uint8_t *, size_t *);
+static int parse_frames(struct QUICParser *, const uint8_t *, size_t);
+static int store_crypto(struct QUICParser *, uint64_t, const uint8_t *, size_t);
+static int read_varint(const uint8_t *, size_t, size_t *, uint64_t *);
+static uint64_t decode_packet_number(const struct QUICParser *, uint64_t, size_t);
+static int derive_initial_keys(struct QUICKeys *, const uint8_t *, size_t);
+static int header_protection_mask(const struct QUICKeys *, const uint8_t *, uint8_t *);
+static int aead_decrypt(const struct QUICKeys *, uint64_t, const uint8_t *, size_t, uint8_t *, size_t);
+
+
+/* RFC 9001 5.2 */
+static const uint8_t initial_salt_v1[] = {
+    0x38, 0x76, 0x2c, 0xf7, 0xf5, 0x59, 0x34, 0xb3, 0x4d, 0x17,
+    0x9a, 0xe6, 0xa4, 0xc8, 0x0c, 0xad, 0xcc, 0xbb, 0x7f, 0x0a,
+};
+
+const struct Protocol *const quic_protocol = &(struct Protocol){
+    .name = "quic",
+    .default_port = 443,
+    .parse_packet = &parse_quic_initial,
+    .new_parser = (void *(*const)(size_t))&new_quic_parser,
+    .parse_more = (int (*const)(void *, const char *, size_t, const char **, struct RequestInfo *))&parse_quic_more,
+    .free_parser = (void (*const)(void *))&free_quic_parser,
+    .abort_message = NULL,
+    .abort_message_len = 0,
+    .datagram = 1,
+};
+
+
+/*
+ * Returns 1 if the datagram begins with a QUIC version 1 Initial packet of
+ * the minimum size clients must pad them to, so is worth tracking a flow for
+ */
+int
+quic_client_initial(const char *data, size_t data_len) {
+    struct QUICLongHeader header;
+
+    return data_len >= QUIC_MIN_INITIAL_DATAGRAM &&
+        parse_long_header((const uint8_t *)data, data_len, &header) &&
+        header.version == QUIC_VERSION_1 &&
+        header.type == QUIC_PACKET_TYPE_INITIAL;
+}
+
+/*
+ * Returns 1 if the datagram begins with a short header packet, the
+ * destination connection ID of which immediately follows the first byte
+ */
+int
+quic_short_header(const char *data, size_t data_len) {
+    return data_len > 1 && (data[0] & 0xc0) == 0x40;
+}
+
+/*
+ * Returns the length of the source connection ID of a long header packet,
+ * pointing *cid at it, or 0 if the datagram does not start with one. Servers
+ * use the connection ID they choose here as the destination of the client's
+ * short header packets.
+ */
+size_t
+quic_source_cid(const char *data, size_t data_len, const char **cid) {
+    struct QUICLongHeader header;
+
+    if (!parse_long_header((const uint8_t *)data, data_len, &header) ||
+            header.version != QUIC_VERSION_1)
+        return 0;
+
+    *cid = data + header.scid_pos;
+    return header.scid_len;
+}
+
+/*
+ * Parse a single datagram for the server name in the ClientHello carried by
+ * its Initial packets.
+ *
+ * Returns:
+ *  >=0  - length of the hostname and updates *hostname to point to it, in a
+ *         static array overwritten by the next call, info->alpn likewise
+ *  -1   - Incomplete request, the ClientHello continues in another datagram
+ *  -2   - No server name in the ClientHello
+ *  -3   - Invalid hostname or info pointer
+ *  -4   - malloc failure
+ *  -6   - ClientHello larger than the parser limit
+ *  < -4 - Not a valid QUIC version 1 client Initial
+ */
+static int
+parse_quic_initial(const char *data, size_t data_len, const char **hostname, struct RequestInfo *info) {
+    struct QUICParser parser = { .max_hello_len = QUIC_MAX_HELLO_LEN };
+
+    if (hostname == NULL || info == NULL)
+        return -3;
+
+    int result = quic_parser_feed(&parser, (const uint8_t *)data, data_len,
+            hostname, info);
+
+    if (result >= 0) {
+        static char initial_hostname[256];
+        static char initial_alpn[ALPN_LIST_LEN];
+
+        if ((size_t)result >= sizeof(initial_hostname)) {
+            result = -5;
+        } else {
+            memcpy(initial_hostname, *hostname, (size_t)result);
+            initial_hostname[result] = '\0';
+            *hostname = initial_hostname;
+        }
+
+        if (info->alpn != NULL) {
+            info->alpn_len = alpn_list_prefix(info->alpn, info->alpn_len,
+                    sizeof(initial_alpn));
+            memcpy(initial_alpn, info->alpn, info->alpn_len);
+            info->alpn = initial_alpn;
+        }
+    }
+
+    free(parser.crypto);
+    free(parser.received);
+
+    return result;
+}
+
+static struct QUICParser *
+new_quic_parser(size_t max_hello_len) {
+    struct QUICParser *parser = calloc(1, sizeof(struct QUICParser));
+    if (parser == NULL) {
+        err("%s: calloc", __func__);
+        return NULL;
+    }
+
+    parser->max_hello_len = max_hello_len;
+
+    return parser;
+}
+
+/*
+ * Continue parsing with the flow's next datagram from the client. Return
+ * values are those of parse_quic_initial(), but *hostname and info->alpn point
+ * into the parser, so remain valid only until it is freed.
+ */
+static int
+parse_quic_more(struct QUICParser *parser, const char *data, size_t data_len, const char **hostname, struct RequestInfo *info) {
+    if (hostname == NULL || info == NULL)
+        return -3;
+
+    return quic_parser_feed(parser, (const uint8_t *)data, data_len,
+            hostname, info);
+}
+
+static void
+free_quic_parser(struct QUICParser *parser) {
+    if (parser == NULL)
+        return;
+
+    free(parser->crypto);
+    free(parser->received);
+    free(parser);
+}
+
+static int
+quic_parser_feed(struct QUICParser *parser, const uint8_t *data, size_t data_len, const char **hostname, struct RequestInfo *info) {
+    static uint8_t plaintext[QUIC_MAX_DATAGRAM];
+    size_t pos = 0;
+
+    /* A datagram may hold several coalesced long header packets, anything
+     * following a short header packet is part of it */
+    while (pos < data_len && (data[pos] & 0x80)) {
+        struct QUICLongHeader header;
+
+        if (!parse_long_header(data + pos, data_len - pos, &header))
+            return -5;
+        if (header.version != QUIC_VERSION_1) {
+            debug("Unsupported QUIC version 0x%08" PRIx32, header.version);
+            return -5;
+        }
+
+        if (header.type == QUIC_PACKET_TYPE_INITIAL) {
+            /* RFC 9000 14.1, Initial packets from clients are padded */
+            if (data_len < QUIC_MIN_INITIAL_DATAGRAM) {
+                debug("QUIC Initial in a %zu byte datagram", data_len);
+                return -5;
+            }
+
+            size_t plaintext_len = 0;
+            int result = decrypt_initial(parser, data + pos, &header,
+                    plaintext, &plaintext_len);
+            if (result < 0)
+                return result;
+
+            if (result > 0 &&
+                    (result = parse_frames(parser, plaintext, plaintext_len)) < 0)
+                return result;
+        }
+
+        pos += header.packet_len;
+    }
+
+    if (parser->packets == 0)
+        return -5; /* nothing we could read */
+
+    /* The handshake message header gives the ClientHello length */
+    if (parser->hello_len == 0 &&
+            parser->contiguous >= QUIC_HANDSHAKE_HEADER_LEN) {
+        if (parser->crypto[0] != 0x01) {
+            debug("QUIC CRYPTO stream does not start with a ClientHello");
+            return -5;
+        }
+
+        parser->hello_len = QUIC_HANDSHAKE_HEADER_LEN +
+            ((size_t)parser->crypto[1] << 16) +
+            ((size_t)parser->crypto[2] << 8) +
+            (size_t)parser->crypto[3];
+        if (parser->hello_len > parser->max_hello_len) {
+            debug("ClientHello of %zu bytes exceeds %zu byte limit",
+                    parser->hello_len, parser->max_hello_len);
+            return -6;
+        }
+    }
+
+    if (parser->hello_len == 0 || parser->contiguous < parser->hello_len)
+        return -1;
+
+    return parse_tls_client_hello((const char *)parser->crypto,
+            parser->hello_len, hostname, info);
+}
+
+/*
+ * Parse the unprotected fields of a long header packet, RFC 9000 17.2.
+ *
+ * Returns 1 and fills in header, or 0 if the data is not a complete long
+ * header packet
+ */
+static int
+parse_long_header(const uint8_t *data, size_t data_len, struct QUICLongHeader *header) {
+    size_t pos = 0;
+    uint64_t len;
+
+    /* Form and fixed bits, version and the destination connection ID
+     * length */
+    if (data_len < 6 || (data[0] & 0xc0) != 0xc0)
+        return 0;
+
+    header->type = (data[0] >> 4) & 0x03;
+    header->version = ((uint32_t)data[1] << 24) + ((uint32_t)data[2] << 16) +
+        ((uint32_t)data[3] << 8) + (uint32_t)data[4];
+    pos = 5;
+
+    header->dcid_len = data[pos];
+    header->dcid_pos = pos + 1;
+    pos += 1 + header->dcid_len;
+    if (header->dcid_len > QUIC_MAX_CID_LEN || pos + 1 > data_len)
+        return 0;
+
+    header->scid_len = data[pos];
+    header->scid_pos = pos + 1;
+    pos += 1 + header->scid_len;
+    if (header->scid_len > QUIC_MAX_CID_LEN || pos > data_len)
+        return 0;
+
+    if (header->version != QUIC_VERSION_1) {
+        /* The rest of the header is version specific */
+        header->pn_pos = 0;
+        header->packet_len = data_len;
+        return 1;
+    }
+
+    if (header->type == QUIC_PACKET_TYPE_INITIAL) {
+        /* Token */
+        if (!read_varint(data, data_len, &pos, &len) || len > data_len - pos)
+            return 0;
+        pos += len;
+    } else if (header->type == 0x03) {
+        /* Retry, the remainder is the token and integrity tag */
+        header->pn_pos = 0;
+        header->packet_len = data_len;
+        return 1;
+    }
+
+    /* Length of the packet number and payload */
+    if (!read_varint(data, data_len, &pos, &len) || len > data_len - pos)
+        return 0;
+
+    header->pn_pos = pos;
+    header->packet_len = pos + len;
+
+    return 1;
+}
+
+/*
+ * Remove header and packet protection from the Initial packet at data,
+ * RFC 9001 5.
+ *
+ * Returns 1 with the frames in plaintext, 0 if the packet is to be ignored or
+ * a negative parse result if the flow should be abandoned
+ */
+static int
+decrypt_initial(struct QUICParser *parser, const uint8_t *data, const struct QUICLongHeader *header, uint8_t *plaintext, size_t *plaintext_len) {
+    static uint8_t packet_header[QUIC_MAX_DATAGRAM];
+    uint8_t mask[QUIC_SAMPLE_LEN];
+
+    if (parser->dcid_len == 0 && parser->packets == 0) {
+        /* First Initial packet of the flow, keys depend on the
+         * destination connection ID it was sent to */
+        if (header->dcid_len < 8) {
+            debug("QUIC Initial with a %zu byte destination connection ID",
+                    header->dcid_len);
+            return -5;
+        }
+
+        memcpy(parser->dcid, data + header->dcid_pos, header->dcid_len);
+        parser->dcid_len = header->dcid_len;
+
+        if (!derive_initial_keys(&parser->keys, parser->dcid,
+                    parser->dcid_len))
+            return -5;
+    } else if (header->dcid_len != parser->dcid_len ||
+            memcmp(parser->dcid, data + header->dcid_pos,
+                header->dcid_len) != 0) {
+        debug("Ignoring QUIC Initial for another connection ID");
+        return 0;
+    }
+
+    /* The header protection sample starts four bytes past the start of the
+     * packet number, as if it were its maximum length */
+    if (header->pn_pos + 4 + QUIC_SAMPLE_LEN > header->packet_len)
+        return parser->packets == 0 ? -5 : 0;
+
+    if (!header_protection_mask(&parser->keys, data + header->pn_pos + 4,
+                mask))
+        return parser->packets == 0 ? -5 : 0;
+
+    memcpy(packet_header, data, header->pn_pos + 4);
+    packet_header[0] ^= mask[0] & 0x0f;
+    size_t pn_len = (packet_header[0] & 0x03) + 1;
+    uint64_t truncated_pn = 0;
+    for (size_t i = 0; i < pn_len; i++) {
+        packet_header[header->pn_pos + i] ^= mask[1 + i];
+        truncated_pn = (truncated_pn << 8) +
+            packet_header[header->pn_pos + i];
+    }
+    uint64_t pn = decode_packet_number(parser, truncated_pn, pn_len * 8);
+
+    size_t header_len = header->pn_pos + pn_len;
+    size_t payload_len = header->packet_len - header_len;
+    if (payload_len < QUIC_TAG_LEN)
+        return parser->packets == 0 ? -5 : 0;
+
+    memcpy(plaintext, data + header_len, payload_len);
+    if (!aead_decrypt(&parser->keys, pn, packet_header, header_len,
+                plaintext, payload_len)) {
+        /* A packet which can not be authenticated is dropped, unless it is
+         * the first, which rules out anything which is not QUIC */
+        debug("QUIC Initial packet %" PRIu64 " failed authentication", pn);
+        return parser->packets == 0 ? -5 : 0;
+    }
+
+    if (parser->packets == 0 || pn > parser->largest_pn)
+        parser->largest_pn = pn;
+    parser->packets++;
+
+    *plaintext_len = payload_len - QUIC_TAG_LEN;
+
+    return 1;
+}
+
+/*
+ * Collect the CRYPTO frames of an Initial packet, RFC 9000 12.4 and 19. Only
+ * frames permitted in Initial packets are accepted.
+ */
+static int
+parse_frames(struct QUICParser *parser, const uint8_t *data, size_t data_len) {
+    size_t pos = 0;
+    uint64_t type, value, offset, len;
+
+    while (pos < data_len) {
+        if (!read_varint(data, data_len, &pos, &type))
+            return -5;
+
+        switch (type) {
+            case QUIC_FRAME_PADDING:
+            case QUIC_FRAME_PING:
+                break;
+            case QUIC_FRAME_ACK:
+            case QUIC_FRAME_ACK_ECN: {
+                /* Largest acknowledged, delay, range count, first range */
+                uint64_t ranges = 0;
+                for (int i = 0; i < 4; i++)
+                    if (!read_varint(data, data_len, &pos,
+                                i == 2 ? &ranges : &value))
+                        return -5;
+                /* Gap and length of each further range, then ECN counts */
+                uint64_t fields = 2 * ranges +
+                    (type == QUIC_FRAME_ACK_ECN ? 3 : 0);
+                for (uint64_t i = 0; i < fields; i++)
+                    if (!read_varint(data, data_len, &pos, &value))
+                        return -5;
+                break;
+            }
+            case QUIC_FRAME_CRYPTO: {
+                if (!read_varint(data, data_len, &pos, &offset) ||
+                        !read_varint(data, data_len, &pos, &len) ||
+                        len > data_len - pos)
+                    return -5;
+
+                int result = store_crypto(parser, offset, data + pos,
+                        (size_t)len);
+                if (result < 0)
+                    return result;
+                pos += len;
+                break;
+            }
+            case QUIC_FRAME_CONNECTION_CLOSE:
+                debug("QUIC client closed the connection");
+                return -5;
+            default:
+                debug("Unexpected frame type 0x%" PRIx64
+                        " in QUIC Initial packet", type);
+                return -5;
+        }
+    }
+
+    return 0;
+}
+
+static int
+store_crypto(struct QUICParser *parser, uint64_t offset, const uint8_t *data, size_t len) {
+    if (offset > parser->max_hello_len ||
+            len > parser->max_hello_len - offset) {
+        debug("QUIC CRYPTO data past the %zu byte limit",
+                parser->max_hello_len);
+        return -6;
+    }
+
+    if (offset + len > parser->crypto_size) {
+        size_t size = parser->crypto_size > 0 ? parser->crypto_size : 2048;
+        while (size < offset + len)
+            size *= 2;
+        if (size > parser->max_hello_len)
+            size = parser->max_hello_len;
+
+        uint8_t *crypto = realloc(parser->crypto, size);
+        if (crypto == NULL) {
+            err("%s: realloc", __func__);
+            return -4;
+        }
+        parser->crypto = crypto;
+
+        uint8_t *received = realloc(parser->received, size);
+        if (received == NULL) {
+            err("%s: realloc", __func__);
+            return -4;
+        }
+        memset(received + parser->crypto_size, 0, size - parser->crypto_size);
+        parser->received = received;
+        parser->crypto_size = size;
+    }
+
+    /* Retransmitted data is identical, so overlaps are simply overwritten */
+    memcpy(parser->crypto + offset, data, len);
+    memset(parser->received + offset, 1, len);
+
+    while (parser->contiguous < parser->crypto_size &&
+            parser->received[parser->contiguous])
+        parser->contiguous++;
+
+    return 0;
+}
+
+/* Variable length integer, RFC 9000 16 */
+static int
+read_varint(const uint8_t *data, size_t data_len, size_t *pos, uint64_t *value) {
+    if (*pos >= data_len)
+        return 0;
+
+    size_t len = (size_t)1 << (data[*pos] >> 6);
+    if (len > data_len - *pos)
+        return 0;
+
+    *value = data[*pos] & 0x3f;
+    for (size_t i = 1; i < len; i++)
+        *value = (*value << 8) + data[*pos + i];
+    *pos += len;
+
+    return 1;
+}
+
+/* RFC 9000 A.3 */
+static uint64_t
+decode_packet_number(const struct QUICParser *parser, uint64_t truncated, size_t bits) {
+    uint64_t expected = parser->packets > 0 ? parser->largest_pn + 1 : 0;
+    uint64_t window = (uint64_t)1 << bits;
+    uint64_t half_window = window / 2;
+    uint64_t candidate = (expected & ~(window - 1)) | truncated;
+
+    if (candidate + half_window <= expected &&
+            candidate < ((uint64_t)1 << 62) - window)
+        return candidate + window;
+    if (candidate > expected + half_window && candidate >= window)
+        return candidate - window;
+
+    return candidate;
+}
+
+#ifdef HAVE_LIBCRYPTO
+/* HKDF-Expand-Label with an empty context, RFC 8446 7.1 */
+static int
+hkdf_expand_label(const uint8_t *secret, const char *label, uint8_t *out, size_t out_len) {
+    uint8_t info[2 + 1 + 6 + 32 + 1 + 1];
+    uint8_t block[EVP_MAX_MD_SIZE];
+    unsigned int block_len;
+    size_t label_len = strlen(label);
+    size_t pos = 0;
+
+    assert(label_len <= 32 && out_len <= 32);
+
+    info[pos++] = 0;
+    info[pos++] = (uint8_t)out_len;
+    info[pos++] = (uint8_t)(6 + label_len);
+    memcpy(info + pos, "tls13 ", 6);
+    pos += 6;
+    memcpy(info + pos, label, label_len);
+    pos += label_len;
+    info[pos++] = 0;    /* context */
+    info[pos++] = 1;    /* HKDF-Expand block counter, one block suffices */
+
+    if (HMAC(EVP_sha256(), secret, 32, info, pos, block, &block_len) == NULL)
+        return 0;
+
+    memcpy(out, block, out_len);
+
+    return 1;
+}
+
+/* RFC 9001 5.2 */
+static int
+derive_initial_keys(struct QUICKeys *keys, const uint8_t *dcid, size_t dcid_len) {
+    uint8_t initial_secret[EVP_MAX_MD_SIZE];
+    uint8_t client_secret[32];
+    unsigned int len;
+
+    /* HKDF-Extract */
+    if (HMAC(EVP_sha256(), initial_salt_v1, sizeof(initial_salt_v1),
+                dcid, dcid_len, initial_secret, &len) == NULL)
+        return 0;
+
+    return hkdf_expand_label(initial_secret, "client in", client_secret,
+                sizeof(client_secret)) &&
+        hkdf_expand_label(client_secret, "quic key", keys->key,
+                sizeof(keys->key)) &&
+        hkdf_expand_label(client_secret, "quic iv", keys->iv,
+                sizeof(keys->iv)) &&
+        hkdf_expand_label(client_secret, "quic hp", keys->hp,
+                sizeof(keys->hp));
+}
+
+/* AES based header protection, RFC 9001 5.4.3 */
+static int
+header_protection_mask(const struct QUICKeys *keys, const uint8_t *sample, uint8_t *mask) {
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len;
+
+    int result = ctx != NULL &&
+        EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, keys->hp, NULL) &&
+        EVP_CIPHER_CTX_set_padding(ctx, 0) &&
+        EVP_EncryptUpdate(ctx, mask, &len, sample, QUIC_SAMPLE_LEN) &&
+        len == QUIC_SAMPLE_LEN;
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    return result;
+}
+
+/*
+ * AEAD_AES_128_GCM, RFC 9001 5.3, decrypting payload in place. The payload
+ * includes the authentication tag.
+ */
+static int
+aead_decrypt(const struct QUICKeys *keys, uint64_t pn, const uint8_t *aad, size_t aad_len, uint8_t *payload, size_t payload_len) {
+    uint8_t nonce[QUIC_IV_LEN];
+    int len;
+
+    memcpy(nonce, keys->iv, sizeof(nonce));
+    for (size_t i = 0; i < 8; i++)
+        nonce[sizeof(nonce) - 1 - i] ^= (uint8_t)(pn >> (8 * i));
+
+    size_t ciphertext_len = payload_len - QUIC_TAG_LEN;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+    int result = ctx != NULL &&
+        EVP_DecryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, keys->key, nonce) &&
+        EVP_DecryptUpdate(ctx, NULL, &len, aad, (int)aad_len) &&
+        EVP_DecryptUpdate(ctx, payload, &len, payload, (int)ciphertext_len) &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, QUIC_TAG_LEN,
+                payload + ciphertext_len) &&
+        EVP_DecryptFinal_ex(ctx, payload + len, &len) > 0;
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    return result;
+}
+#else
+static int
+derive_initial_keys(struct QUICKeys *keys __attribute__((unused)), const uint8_t *dcid __attribute__((unused)), size_t dcid_len __attribute__((unused))) {
+    err("QUIC not supported in this build");
+    return 0;
+}
+
+static int
+header_protection_mask(const struct QUICKeys *keys __attribute__((unused)), const uint8_t *sample __attribute__((unused)), uint8_t *mask __attribute__((unused))) {
+    return 0;
+}
+
+static int
+aead_decrypt(const struct QUICKeys *keys __attribute__((unused)), uint64_t pn __attribute__((unused)), const uint8_t *aad __attribute__((unused)), size_t aad_len __attribute__((unused)), uint8_t *payload __attribute__((unused)), size_t payload_len __attribute__((unused))) {
+    return 0;
+}
+#endif
@@ -38,8 +38,17 @@
 #include "resolv.h"
 #include "address.h"
 #include "logger.h"
+#include "probes.h"
 
 
+static struct ResolvStats stats;
+
+
+const struct ResolvStats *
+resolv_stats(void) {
+    return &stats;
+}
+
 #ifndef HAVE_LIBUDNS
 /*
  * If we do not have a DNS resolution library stub out module as no ops
@@ -209,9 +218,13 @@ resolv_query(const char *hostname, int mode,
         if (cb_data->client_free_cb != NULL)
             cb_data->client_free_cb(cb_data->client_cb_data);
         free(cb_data);
-        cb_data = NULL;
+        return NULL;
     }
 
+    stats.queries++;
+    stats.pending++;
+    PROBE3(dns_submit, cb_data, hostname, cb_data->resolv_mode);
+
     return cb_data;
 }
 
@@ -232,6 +245,10 @@ resolv_cancel(struct ResolvQuery *query_handle) {
         cb_data->client_free_cb(cb_data->client_cb_data);
 
     free(cb_data);
+
+    stats.cancelled++;
+    stats.pending--;
+    PROBE1(dns_cancel, cb_data);
 }
 
 /*
@@ -342,6 +359,11 @@ process_client_callback(struct ResolvQuery *cb_data) {
     else
         best_address = choose_any(cb_data);
 
+    stats.pending--;
+    if (best_address == NULL)
+        stats.failures++;
+    PROBE2(dns_complete, cb_data, best_address != NULL);
+
     cb_data->client_cb(best_address, cb_data->client_cb_data);
 
     for (size_t i = 0; i < cb_data->response_count; i++)
@@ -26,15 +26,24 @@
 #ifndef RESOLV_H
 #define RESOLV_H
 
+#include <stdint.h>
 #include "address.h"
 
 struct ResolvQuery;
 
+struct ResolvStats {
+    uint64_t queries;
+    uint64_t failures;      /* completed without an address */
+    uint64_t cancelled;
+    uint64_t pending;
+};
+
 int resolv_init(struct ev_loop *, char **, char **, int);
 struct ResolvQuery *resolv_query(const char *, int,
         void(*)(struct Address *, void *), void (*)(void *), void *);
 void resolv_cancel(struct ResolvQuery *);
 void resolv_shutdown(struct ev_loop *);
+const struct ResolvStats *resolv_stats(void);
 
 static const int RESOLV_MODE_DEFAULT = 0;
 static const int RESOLV_MODE_IPV4_ONLY = 1;
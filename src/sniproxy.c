@@ -43,6 +43,10 @@
 #include "connection.h"
 #include "listener.h"
 #include "resolv.h"
+#include "health.h"
+#include "prewarm.h"
+#include "udp.h"
+#include "stats.h"
 #include "logger.h"
 
 
@@ -117,6 +121,7 @@ main(int argc, char **argv) {
     set_limits(max_nofiles);
 
     init_listeners(&config->listeners, &config->tables, EV_DEFAULT);
+    init_stats(config, EV_DEFAULT);
 
     /* Drop permissions only when we can */
     drop_perms(config->user ? config->user : default_username, config->group);
@@ -135,10 +140,20 @@ main(int argc, char **argv) {
 
     init_connections();
 
+    init_health_checks(EV_DEFAULT);
+    init_prewarm(EV_DEFAULT);
+    init_udp_flows(EV_DEFAULT);
+    init_loggers(EV_DEFAULT);
+
     ev_run(EV_DEFAULT, 0);
 
+    stats_shutdown(EV_DEFAULT);
     free_connections(EV_DEFAULT);
+    udp_flows_shutdown(EV_DEFAULT);
+    health_checks_shutdown(EV_DEFAULT);
+    prewarm_shutdown(EV_DEFAULT);
     resolv_shutdown(EV_DEFAULT);
+    loggers_shutdown(EV_DEFAULT);
 
     free_config(config, EV_DEFAULT);
 
@@ -280,7 +295,7 @@ signal_cb(struct ev_loop *loop, struct ev_signal *w, int revents) {
                 reload_config(config, loop);
                 break;
             case SIGUSR1:
-                print_connections();
+                print_connections(loop);
                 break;
             case SIGINT:
             case SIGTERM:
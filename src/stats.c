@@ -0,0 +1,751 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Stats endpoint
+ *
+ * An admin socket, either a unix socket or a loopback TCP address, serving
+ * the connection states, buffer memory, resolver activity, table sizes and
+ * the metrics of every listener, table and backend as Prometheus text
+ * exposition over HTTP at /metrics, and the open connections as tab
+ * separated records at /connections. The response is rendered a chunk at a
+ * time as the client drains it, so a large scrape never holds up the event
+ * loop for longer than it takes to render one chunk.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <ev.h>
+#include "stats.h"
+#include "address.h"
+#include "buffer.h"
+#include "connection.h"
+#include "metrics.h"
+#include "resolv.h"
+#include "table.h"
+#include "udp.h"
+#include "logger.h"
+
+
+#define STATS_REQUEST_MAX 4096
+#define STATS_CHUNK_SIZE 16384
+/* Another entry is rendered into a chunk while this much room remains */
+#define STATS_CHUNK_LOW_WATER 8192
+#define STATS_TIMEOUT 10.0
+#define STATS_MAX_CLIENTS 16
+
+/* Histogram buckets exposed, every other power of two from 64 us */
+#define STATS_FIRST_BUCKET (4 * HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS - 1)
+#define STATS_BUCKET_STEP (2 * HISTOGRAM_SUB_BUCKETS)
+
+
+struct StatsClient {
+    struct ev_io watcher;
+    struct ev_timer timeout;
+    char request[STATS_REQUEST_MAX + 1];
+    size_t request_len;
+    char *chunk;
+    size_t chunk_size, chunk_len, chunk_sent;
+    size_t family;              /* metric family being rendered */
+    int family_started;         /* its HELP and TYPE lines are out */
+    struct Metrics *cursor;     /* last entry rendered, referenced */
+    struct ConnectionDump *dump; /* when listing connections instead */
+    int done;                   /* nothing left to render */
+    LIST_ENTRY(StatsClient) entries;
+};
+
+static const struct StatsFamily {
+    const char *name;
+    const char *help;
+    enum MetricsType type;
+    enum {
+        FAMILY_COUNTER,
+        FAMILY_PARSE_FAILURES,
+        FAMILY_HISTOGRAM,
+    } kind;
+    int index;
+} families[] = {
+    { "sniproxy_listener_connections_total", "Connections accepted.",
+        METRICS_LISTENER, FAMILY_COUNTER, METRIC_CONNECTIONS },
+    { "sniproxy_listener_accept_errors_total", "Failed accept calls.",
+        METRICS_LISTENER, FAMILY_COUNTER, METRIC_ACCEPT_ERRORS },
+    { "sniproxy_listener_received_bytes_total", "Bytes received from clients.",
+        METRICS_LISTENER, FAMILY_COUNTER, METRIC_BYTES_IN },
+    { "sniproxy_listener_sent_bytes_total", "Bytes sent to clients.",
+        METRICS_LISTENER, FAMILY_COUNTER, METRIC_BYTES_OUT },
+    { "sniproxy_listener_parse_failures_total",
+        "Requests which failed to parse, by parser result.",
+        METRICS_LISTENER, FAMILY_PARSE_FAILURES, 0 },
+    { "sniproxy_listener_parse_seconds",
+        "Time from accept to the request being parsed.",
+        METRICS_LISTENER, FAMILY_HISTOGRAM, METRIC_PARSE_TIME },
+    { "sniproxy_listener_connection_duration_seconds",
+        "Time from accept to the last data received.",
+        METRICS_LISTENER, FAMILY_HISTOGRAM, METRIC_DURATION },
+    { "sniproxy_table_lookups_total", "Hostnames looked up.",
+        METRICS_TABLE, FAMILY_COUNTER, METRIC_LOOKUPS },
+    { "sniproxy_table_lookup_misses_total", "Hostnames matching no backend.",
+        METRICS_TABLE, FAMILY_COUNTER, METRIC_LOOKUP_MISSES },
+    { "sniproxy_backend_connections_total", "Connections established.",
+        METRICS_BACKEND, FAMILY_COUNTER, METRIC_CONNECTIONS },
+    { "sniproxy_backend_dns_errors_total", "Failed address lookups.",
+        METRICS_BACKEND, FAMILY_COUNTER, METRIC_DNS_ERRORS },
+    { "sniproxy_backend_connect_failures_total", "Failed connection attempts.",
+        METRICS_BACKEND, FAMILY_COUNTER, METRIC_CONNECT_FAILURES },
+    { "sniproxy_backend_received_bytes_total", "Bytes received from backends.",
+        METRICS_BACKEND, FAMILY_COUNTER, METRIC_BYTES_IN },
+    { "sniproxy_backend_sent_bytes_total", "Bytes sent to backends.",
+        METRICS_BACKEND, FAMILY_COUNTER, METRIC_BYTES_OUT },
+    { "sniproxy_backend_dns_seconds", "Time to resolve backend addresses.",
+        METRICS_BACKEND, FAMILY_HISTOGRAM, METRIC_DNS_TIME },
+    { "sniproxy_backend_connect_seconds", "Time to connect to backends.",
+        METRICS_BACKEND, FAMILY_HISTOGRAM, METRIC_CONNECT_TIME },
+    { "sniproxy_backend_first_byte_seconds",
+        "Time from connecting to the first byte received from backends.",
+        METRICS_BACKEND, FAMILY_HISTOGRAM, METRIC_FIRST_BYTE_TIME },
+    { "sniproxy_backend_connection_duration_seconds",
+        "Time from accept to the last data received.",
+        METRICS_BACKEND, FAMILY_HISTOGRAM, METRIC_DURATION },
+};
+
+static const char *const label_names[] = {
+    [METRICS_LISTENER] = "listener",
+    [METRICS_TABLE] = "table",
+    [METRICS_BACKEND] = "backend",
+};
+
+static const char metrics_response[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char connections_response[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/tab-separated-values; charset=utf-8\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+
+static void stats_accept_cb(struct ev_loop *, struct ev_io *, int);
+static void stats_client_cb(struct ev_loop *, struct ev_io *, int);
+static void stats_timeout_cb(struct ev_loop *, struct ev_timer *, int);
+static void read_request(struct StatsClient *, struct ev_loop *);
+static void respond(struct StatsClient *, struct ev_loop *);
+static const char *start_dump(struct StatsClient *, char *, struct ev_loop *);
+static int url_decode(char *);
+static int path_is(const char *, size_t, const char *);
+static void write_response(struct StatsClient *, struct ev_loop *);
+static void close_client(struct StatsClient *, struct ev_loop *);
+static void render_chunk(struct StatsClient *);
+static void render_gauges(struct StatsClient *);
+static void render_entry(struct StatsClient *, const struct StatsFamily *,
+        const struct Metrics *);
+static void render_histogram(struct StatsClient *, const struct StatsFamily *,
+        const struct Metrics *, const struct Histogram *);
+static void print_label(struct StatsClient *, const char *, const char *);
+static void stats_printf(struct StatsClient *, const char *, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+
+static struct Config *stats_config;
+static struct ev_io stats_watcher = { .fd = -1 };
+static LIST_HEAD(, StatsClient) stats_clients =
+    LIST_HEAD_INITIALIZER(stats_clients);
+static size_t stats_client_count;
+
+
+/*
+ * Listen on the configured stats address, if any. This must be called
+ * before dropping privileges, like init_listeners() it exits on failure.
+ */
+void
+init_stats(struct Config *config, struct ev_loop *loop) {
+    const struct Address *address = config->stats_address;
+    char buffer[ADDRESS_BUFFER_SIZE];
+    struct stat st;
+
+    stats_config = config;
+    if (address == NULL)
+        return;
+
+    const struct sockaddr *sa = address_sa(address);
+
+    /* Replace the socket left behind by a previous instance */
+    if (sa->sa_family == AF_UNIX) {
+        const char *path = ((const struct sockaddr_un *)sa)->sun_path;
+
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(path);
+    }
+
+    int sockfd = socket(sa->sa_family, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        err("socket failed: %s", strerror(errno));
+        exit(1);
+    }
+
+    int on = 1;
+    if (sa->sa_family != AF_UNIX &&
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+        warn("setsockopt SO_REUSEADDR failed: %s", strerror(errno));
+
+    if (bind(sockfd, sa, address_sa_len(address)) < 0 ||
+            listen(sockfd, SOMAXCONN) < 0) {
+        err("Failed to initialize stats endpoint %s: %s",
+                display_address(address, buffer, sizeof(buffer)),
+                strerror(errno));
+        exit(1);
+    }
+
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+
+    ev_io_init(&stats_watcher, stats_accept_cb, sockfd, EV_READ);
+    ev_io_start(loop, &stats_watcher);
+}
+
+void
+stats_shutdown(struct ev_loop *loop) {
+    struct StatsClient *client;
+
+    while ((client = LIST_FIRST(&stats_clients)) != NULL)
+        close_client(client, loop);
+
+    if (stats_watcher.fd < 0)
+        return;
+
+    ev_io_stop(loop, &stats_watcher);
+    close(stats_watcher.fd);
+    stats_watcher.fd = -1;
+
+    const struct sockaddr *sa = address_sa(stats_config->stats_address);
+    if (sa->sa_family == AF_UNIX)
+        unlink(((const struct sockaddr_un *)sa)->sun_path);
+}
+
+static void
+stats_accept_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
+    (void)revents;
+
+    int sockfd = accept(w->fd, NULL, NULL);
+    if (sockfd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            warn_ratelimited("stats accept failed: %s", strerror(errno));
+        return;
+    }
+
+    if (stats_client_count >= STATS_MAX_CLIENTS) {
+        warn_ratelimited("Too many stats clients, closing connection");
+        close(sockfd);
+        return;
+    }
+
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+
+    struct StatsClient *client = calloc(1, sizeof(struct StatsClient));
+    if (client == NULL) {
+        err("%s: calloc", __func__);
+        close(sockfd);
+        return;
+    }
+
+    ev_io_init(&client->watcher, stats_client_cb, sockfd, EV_READ);
+    client->watcher.data = client;
+    ev_timer_init(&client->timeout, stats_timeout_cb, 0.0, STATS_TIMEOUT);
+    client->timeout.data = client;
+
+    LIST_INSERT_HEAD(&stats_clients, client, entries);
+    stats_client_count++;
+
+    ev_io_start(loop, &client->watcher);
+    ev_timer_again(loop, &client->timeout);
+}
+
+static void
+stats_client_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
+    struct StatsClient *client = (struct StatsClient *)w->data;
+
+    ev_timer_again(loop, &client->timeout);
+
+    if (revents & EV_READ)
+        read_request(client, loop);
+    else if (revents & EV_WRITE)
+        write_response(client, loop);
+}
+
+static void
+stats_timeout_cb(struct ev_loop *loop, struct ev_timer *w, int revents) {
+    (void)revents;
+
+    close_client((struct StatsClient *)w->data, loop);
+}
+
+/*
+ * Read until the end of the request headers, only the request line is of
+ * interest
+ */
+static void
+read_request(struct StatsClient *client, struct ev_loop *loop) {
+    ssize_t len = recv(client->watcher.fd,
+            client->request + client->request_len,
+            STATS_REQUEST_MAX - client->request_len, 0);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (len <= 0) {
+        close_client(client, loop);
+        return;
+    }
+
+    client->request_len += (size_t)len;
+    client->request[client->request_len] = '\0';
+
+    if (strstr(client->request, "\r\n\r\n") != NULL ||
+            strstr(client->request, "\n\n") != NULL ||
+            client->request_len == STATS_REQUEST_MAX)
+        respond(client, loop);
+}
+
+static void
+respond(struct StatsClient *client, struct ev_loop *loop) {
+    const char *status = NULL;
+    char *path = client->request + 4;
+    size_t path_len = strcspn(path, " ?\r\n");
+
+    client->chunk_size = STATS_CHUNK_SIZE;
+    client->chunk = malloc(client->chunk_size);
+    if (client->chunk == NULL) {
+        err("%s: malloc", __func__);
+        close_client(client, loop);
+        return;
+    }
+
+    if (strncmp(client->request, "GET ", 4) != 0) {
+        status = "405 Method Not Allowed";
+    } else if (path_is(path, path_len, "/") ||
+            path_is(path, path_len, "/metrics")) {
+        stats_printf(client, "%s", metrics_response);
+        render_gauges(client);
+    } else if (path_is(path, path_len, "/connections")) {
+        status = start_dump(client, path + path_len, loop);
+    } else {
+        status = "404 Not Found";
+    }
+
+    if (status != NULL) {
+        stats_printf(client, "HTTP/1.0 %s\r\n"
+                "Content-Type: text/plain\r\n"
+                "Connection: close\r\n"
+                "\r\n"
+                "%s\n", status, status);
+        client->done = 1;
+    }
+
+    ev_io_stop(loop, &client->watcher);
+    ev_io_set(&client->watcher, client->watcher.fd, EV_WRITE);
+    ev_io_start(loop, &client->watcher);
+}
+
+/*
+ * Start listing the connections selected by the query string, with the
+ * parameters state, listener, hostname and min_age
+ *
+ * Returns NULL on success, otherwise the HTTP status to respond with
+ */
+static const char *
+start_dump(struct StatsClient *client, char *query, struct ev_loop *loop) {
+    struct ConnectionFilter filter = { .state = -1 };
+    char *saveptr = NULL;
+
+    if (*query == '?') {
+        query++;
+        query[strcspn(query, " \r\n")] = '\0';
+    } else {
+        query = NULL;
+    }
+
+    for (char *param = query != NULL ? strtok_r(query, "&", &saveptr) : NULL;
+            param != NULL; param = strtok_r(NULL, "&", &saveptr)) {
+        char *value = strchr(param, '=');
+        char *end;
+
+        if (value == NULL)
+            return "400 Bad Request";
+        *value++ = '\0';
+        if (!url_decode(value))
+            return "400 Bad Request";
+
+        if (strcmp(param, "state") == 0) {
+            filter.state = connection_state_from_name(value);
+            if (filter.state < 0)
+                return "400 Bad Request";
+        } else if (strcmp(param, "listener") == 0) {
+            filter.listener = value;
+        } else if (strcmp(param, "hostname") == 0) {
+            filter.hostname = value;
+        } else if (strcmp(param, "min_age") == 0) {
+            filter.min_age = strtod(value, &end);
+            if (end == value || *end != '\0' || filter.min_age < 0.0)
+                return "400 Bad Request";
+        } else {
+            return "400 Bad Request";
+        }
+    }
+
+    client->dump = start_connection_dump(&filter, loop);
+    if (client->dump == NULL)
+        return "503 Service Unavailable";
+
+    stats_printf(client, "%s", connections_response);
+
+    return NULL;
+}
+
+/*
+ * Decode a query string value in place
+ *
+ * Returns 0 if it is malformed
+ */
+static int
+url_decode(char *value) {
+    char *out = value;
+
+    for (const char *in = value; *in != '\0'; in++) {
+        if (*in == '%') {
+            if (!isxdigit((unsigned char)in[1]) ||
+                    !isxdigit((unsigned char)in[2]))
+                return 0;
+
+            char hex[3] = { in[1], in[2], '\0' };
+            long c = strtol(hex, NULL, 16);
+            if (c == 0)
+                return 0;
+            *out++ = (char)c;
+            in += 2;
+        } else if (*in == '+') {
+            *out++ = ' ';
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+
+    return 1;
+}
+
+static int
+path_is(const char *path, size_t len, const char *expected) {
+    return len == strlen(expected) && strncmp(path, expected, len) == 0;
+}
+
+static void
+write_response(struct StatsClient *client, struct ev_loop *loop) {
+    if (client->chunk_sent == client->chunk_len) {
+        if (client->done) {
+            close_client(client, loop);
+            return;
+        }
+
+        render_chunk(client);
+    }
+
+    ssize_t len = send(client->watcher.fd,
+            client->chunk + client->chunk_sent,
+            client->chunk_len - client->chunk_sent, MSG_NOSIGNAL);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (len < 0) {
+        debug("stats send failed: %s", strerror(errno));
+        close_client(client, loop);
+        return;
+    }
+
+    client->chunk_sent += (size_t)len;
+}
+
+static void
+close_client(struct StatsClient *client, struct ev_loop *loop) {
+    ev_io_stop(loop, &client->watcher);
+    ev_timer_stop(loop, &client->timeout);
+    close(client->watcher.fd);
+
+    metrics_ref_put(client->cursor);
+    end_connection_dump(client->dump);
+    LIST_REMOVE(client, entries);
+    stats_client_count--;
+    free(client->chunk);
+    free(client);
+}
+
+/*
+ * Render the next batch of connections, or metric entries until the chunk
+ * is mostly full, in family order so the samples of a family stay together
+ */
+static void
+render_chunk(struct StatsClient *client) {
+    static const size_t family_count = sizeof(families) / sizeof(families[0]);
+
+    client->chunk_len = 0;
+    client->chunk_sent = 0;
+
+    if (client->dump != NULL) {
+        client->chunk_len = connection_dump_read(client->dump, client->chunk,
+                client->chunk_size);
+        client->done = connection_dump_done(client->dump);
+        return;
+    }
+
+    while (client->family < family_count &&
+            client->chunk_size - client->chunk_len >= STATS_CHUNK_LOW_WATER) {
+        const struct StatsFamily *family = &families[client->family];
+        struct Metrics *next;
+
+        if (!client->family_started) {
+            stats_printf(client, "# HELP %s %s\n# TYPE %s %s\n",
+                    family->name, family->help, family->name,
+                    family->kind == FAMILY_HISTOGRAM ? "histogram" : "counter");
+            client->family_started = 1;
+            next = metrics_next(NULL);
+        } else {
+            next = metrics_next(client->cursor);
+        }
+
+        while (next != NULL && next->type != family->type)
+            next = metrics_next(next);
+
+        metrics_ref_get(next);
+        metrics_ref_put(client->cursor);
+        client->cursor = next;
+
+        if (next == NULL) {
+            client->family++;
+            client->family_started = 0;
+            continue;
+        }
+
+        render_entry(client, family, next);
+    }
+
+    if (client->family == family_count)
+        client->done = 1;
+}
+
+static void
+render_gauges(struct StatsClient *client) {
+    const struct ResolvStats *resolv = resolv_stats();
+    struct Table *table;
+
+    stats_printf(client, "# HELP sniproxy_connections "
+            "Open connections by state.\n"
+            "# TYPE sniproxy_connections gauge\n");
+    for (int i = NEW; i <= CLOSED; i++)
+        stats_printf(client, "sniproxy_connections{state=\"%s\"} %zu\n",
+                connection_state_name((enum State)i),
+                connections_in_state((enum State)i));
+
+    stats_printf(client, "# HELP sniproxy_udp_flows Active datagram flows.\n"
+            "# TYPE sniproxy_udp_flows gauge\n"
+            "sniproxy_udp_flows %zu\n", udp_flows_active());
+
+    stats_printf(client, "# HELP sniproxy_buffer_bytes "
+            "Memory allocated to connection buffers.\n"
+            "# TYPE sniproxy_buffer_bytes gauge\n"
+            "sniproxy_buffer_bytes %zu\n", buffer_memory_in_use());
+
+    stats_printf(client, "# HELP sniproxy_resolver_queries_total "
+            "DNS queries started.\n"
+            "# TYPE sniproxy_resolver_queries_total counter\n"
+            "sniproxy_resolver_queries_total %" PRIu64 "\n"
+            "# HELP sniproxy_resolver_failures_total "
+            "DNS queries which found no address.\n"
+            "# TYPE sniproxy_resolver_failures_total counter\n"
+            "sniproxy_resolver_failures_total %" PRIu64 "\n"
+            "# HELP sniproxy_resolver_cancelled_total "
+            "DNS queries abandoned by their connection.\n"
+            "# TYPE sniproxy_resolver_cancelled_total counter\n"
+            "sniproxy_resolver_cancelled_total %" PRIu64 "\n"
+            "# HELP sniproxy_resolver_pending DNS queries in progress.\n"
+            "# TYPE sniproxy_resolver_pending gauge\n"
+            "sniproxy_resolver_pending %" PRIu64 "\n",
+            resolv->queries, resolv->failures, resolv->cancelled,
+            resolv->pending);
+
+    stats_printf(client, "# HELP sniproxy_table_backends "
+            "Backends configured in each table.\n"
+            "# TYPE sniproxy_table_backends gauge\n");
+    SLIST_FOREACH(table, &stats_config->tables, entries) {
+        const struct Backend *backend;
+        size_t count = 0;
+
+        STAILQ_FOREACH(backend, &table->backends, entries)
+            count++;
+
+        stats_printf(client, "sniproxy_table_backends{");
+        print_label(client, "table",
+                table->name != NULL ? table->name : "default");
+        stats_printf(client, "} %zu\n", count);
+    }
+}
+
+static void
+render_entry(struct StatsClient *client, const struct StatsFamily *family,
+        const struct Metrics *metrics) {
+    const char *label = label_names[metrics->type];
+
+    switch (family->kind) {
+        case FAMILY_COUNTER:
+            stats_printf(client, "%s{", family->name);
+            print_label(client, label, metrics->name);
+            stats_printf(client, "} %" PRIu64 "\n",
+                    metrics->counters[family->index]);
+            break;
+        case FAMILY_PARSE_FAILURES:
+            for (int i = 0; i < METRIC_PARSE_RESULTS; i++) {
+                stats_printf(client, "%s{", family->name);
+                print_label(client, label, metrics->name);
+                if (i == 0)
+                    stats_printf(client, ",result=\"other\"}");
+                else
+                    stats_printf(client, ",result=\"%d\"}", -i);
+                stats_printf(client, " %" PRIu64 "\n",
+                        metrics->parse_failures[i]);
+            }
+            break;
+        case FAMILY_HISTOGRAM:
+            render_histogram(client, family, metrics,
+                    &metrics->histograms[family->index]);
+            break;
+    }
+}
+
+/*
+ * Cumulative counts at a subset of the bucket limits, so each count is
+ * exact
+ */
+static void
+render_histogram(struct StatsClient *client, const struct StatsFamily *family,
+        const struct Metrics *metrics, const struct Histogram *histogram) {
+    const char *label = label_names[metrics->type];
+    uint64_t cumulative = 0;
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        cumulative += histogram->buckets[i];
+
+        if (i < STATS_FIRST_BUCKET ||
+                (i - STATS_FIRST_BUCKET) % STATS_BUCKET_STEP != 0)
+            continue;
+
+        stats_printf(client, "%s_bucket{", family->name);
+        print_label(client, label, metrics->name);
+        stats_printf(client, ",le=\"%.6f\"} %" PRIu64 "\n",
+                (double)histogram_bucket_limit(i) / 1000000.0, cumulative);
+    }
+
+    stats_printf(client, "%s_bucket{", family->name);
+    print_label(client, label, metrics->name);
+    stats_printf(client, ",le=\"+Inf\"} %" PRIu64 "\n", histogram->count);
+
+    stats_printf(client, "%s_sum{", family->name);
+    print_label(client, label, metrics->name);
+    stats_printf(client, "} %.6f\n", (double)histogram->sum / 1000000.0);
+
+    stats_printf(client, "%s_count{", family->name);
+    print_label(client, label, metrics->name);
+    stats_printf(client, "} %" PRIu64 "\n", histogram->count);
+}
+
+/*
+ * Append a label, escaping the value as the exposition format requires
+ */
+static void
+print_label(struct StatsClient *client, const char *name, const char *value) {
+    stats_printf(client, "%s=\"", name);
+
+    while (*value != '\0') {
+        size_t len = strcspn(value, "\\\"\n");
+
+        stats_printf(client, "%.*s", (int)len, value);
+        value += len;
+
+        if (*value == '\n')
+            stats_printf(client, "\\n");
+        else if (*value != '\0')
+            stats_printf(client, "\\%c", *value);
+        else
+            break;
+        value++;
+    }
+
+    stats_printf(client, "\"");
+}
+
+/*
+ * Append to the chunk, growing it if an entry does not fit
+ */
+static void
+stats_printf(struct StatsClient *client, const char *format, ...) {
+    va_list args;
+
+    for (;;) {
+        size_t room = client->chunk_size - client->chunk_len;
+
+        va_start(args, format);
+        int len = vsnprintf(client->chunk + client->chunk_len, room,
+                format, args);
+        va_end(args);
+
+        if (len < 0)
+            return;
+
+        if ((size_t)len < room) {
+            client->chunk_len += (size_t)len;
+            return;
+        }
+
+        size_t size = client->chunk_size * 2;
+        while (size - client->chunk_len <= (size_t)len)
+            size *= 2;
+
+        char *chunk = realloc(client->chunk, size);
+        if (chunk == NULL) {
+            err("%s: realloc", __func__);
+            return;
+        }
+        client->chunk = chunk;
+        client->chunk_size = size;
+    }
+}
@@ -32,14 +32,16 @@
 #include "backend.h"
 #include "address.h"
 #include "logger.h"
+#include "metrics.h"
 
 
 static void free_table(struct Table *);
 
 
 static inline struct Backend *
-table_lookup_backend(const struct Table *table, const char *name, size_t name_len) {
-    return lookup_backend(&table->backends, name, name_len);
+table_lookup_backend(const struct Table *table, const char *name,
+        size_t name_len, const char *alpn, size_t alpn_len) {
+    return lookup_backend(&table->backends, name, name_len, alpn, alpn_len);
 }
 
 static inline void __attribute__((unused))
@@ -59,8 +61,9 @@ new_table() {
     }
 
     table->name = NULL;
-    table->use_proxy_header = 0;
+    table->use_proxy_v1_header = 0;
     table->reference_count = 0;
+    table->metrics = NULL;
     STAILQ_INIT(&table->backends);
 
     return table;
@@ -94,6 +97,12 @@ void init_table(struct Table *table) {
 
     STAILQ_FOREACH(iter, &table->backends, entries)
         init_backend(iter);
+
+    init_backend_pools(&table->backends);
+
+    if (table->metrics == NULL)
+        table->metrics = metrics_ref_get(obtain_metrics(METRICS_TABLE,
+                    table->name != NULL ? table->name : "default"));
 }
 
 void
@@ -129,15 +138,26 @@ remove_table(struct Table_head *tables, struct Table *table) {
 }
 
 struct LookupResult
-table_lookup_server_address(const struct Table *table, const char *name, size_t name_len) {
-    struct Backend *b = table_lookup_backend(table, name, name_len);
+table_lookup_server_address(const struct Table *table,
+        const struct sockaddr *client_addr, const char *name, size_t name_len,
+        const char *alpn, size_t alpn_len) {
+    const struct Backend *b = table_lookup_backend(table, name, name_len,
+            alpn, alpn_len);
+    metrics_count(table->metrics, METRIC_LOOKUPS, 1);
     if (b == NULL) {
+        metrics_count(table->metrics, METRIC_LOOKUP_MISSES, 1);
         info("No match found for %.*s", (int)name_len, name);
         return (struct LookupResult){.address = NULL};
     }
 
+    b = select_pool_backend(b, client_addr, name, name_len);
+
     return (struct LookupResult){.address = b->address,
-                                 .use_proxy_header = b->use_proxy_header};
+                                 .use_proxy_header = b->use_proxy_header,
+                                 .use_fastopen = b->use_fastopen,
+                                 .health = b->health,
+                                 .prewarm = b->prewarm_pool,
+                                 .metrics = b->metrics};
 }
 
 void
@@ -208,6 +228,7 @@ free_table(struct Table *table) {
     while ((iter = STAILQ_FIRST(&table->backends)) != NULL)
         remove_backend(&table->backends, iter);
 
+    metrics_ref_put(table->metrics);
     free(table->name);
     free(table);
 }
@@ -37,10 +37,11 @@ SLIST_HEAD(Table_head, Table);
 
 struct Table {
     char *name;
-    int use_proxy_header;
+    int use_proxy_v1_header; /* a backend expects a PROXY v1 header */
 
     /* Runtime fields */
     int reference_count;
+    struct Metrics *metrics;
     struct Backend_head backends;
     SLIST_ENTRY(Table) entries;
 };
@@ -49,6 +50,10 @@ struct LookupResult {
     const struct Address *address;
     int caller_free_address;
     int use_proxy_header;
+    int use_fastopen;
+    struct BackendHealth *health;
+    struct PrewarmPool *prewarm;
+    struct Metrics *metrics;    /* of the backend address */
 };
 
 struct Table *new_table();
@@ -56,7 +61,7 @@ int accept_table_arg(struct Table *, const char *);
 void add_table(struct Table_head *, struct Table *);
 struct Table *table_lookup(const struct Table_head *, const char *);
 struct LookupResult table_lookup_server_address(const struct Table *,
-                                                const char *, size_t);
+        const struct sockaddr *, const char *, size_t, const char *, size_t);
 void reload_tables(struct Table_head *, struct Table_head *);
 void print_table_config(FILE *, struct Table *);
 int valid_table(struct Table *);
@@ -34,7 +34,7 @@
 #include <string.h> /* strncpy() */
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <arpa/inet.h> /* hstons() */
+#include <assert.h>
 #include "tls.h"
 #include "protocol.h"
 #include "logger.h"
@@ -43,15 +43,41 @@
 #define TLS_HEADER_LEN 5
 #define TLS_HANDSHAKE_CONTENT_TYPE 0x16
 #define TLS_HANDSHAKE_TYPE_CLIENT_HELLO 0x01
+#define TLS_HANDSHAKE_HEADER_LEN 4
 
 #ifndef MIN
 #define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
 #endif
 
-static void modify_tls_header(uint8_t*, size_t, char **, size_t*);
-static int parse_tls_header(const uint8_t*, size_t, char **, size_t*);
-static int parse_extensions(const uint8_t*, size_t, char **, size_t*);
-static int parse_server_name_extension(const uint8_t*, size_t, char **, size_t*);
+/*
+ * Resumable client hello parser state: the record layer is tracked byte by
+ * byte and the handshake message is reassembled across records, so each byte
+ * of the request is examined once however it is fragmented.
+ */
+struct TLSParser {
+    size_t max_hello_len;       /* 0 for no limit */
+    size_t records;             /* record headers seen */
+    uint8_t header[TLS_HEADER_LEN];
+    size_t header_len;          /* bytes of the current record header seen */
+    size_t record_remaining;    /* payload bytes left in the current record */
+    uint8_t *hello;             /* reassembled handshake message */
+    size_t hello_len;
+    size_t hello_size;
+    size_t hello_expected;      /* message length, 0 until known */
+};
+
+static size_t split_tls_record(uint8_t*, size_t, size_t, uint8_t*, size_t*);
+static int parse_tls_header(const uint8_t*, size_t, const char **, struct RequestInfo *);
+static struct TLSParser *new_tls_parser(size_t);
+static int parse_tls_more(struct TLSParser *, const uint8_t*, size_t, const char **, struct RequestInfo *);
+static void free_tls_parser(struct TLSParser *);
+static int tls_parser_feed(struct TLSParser *, const uint8_t*, size_t, const char **, struct RequestInfo *);
+static int check_record_header(struct TLSParser *);
+static int append_hello(struct TLSParser *, const uint8_t*, size_t);
+static int parse_client_hello(const uint8_t*, size_t, const char **, struct RequestInfo *);
+static int parse_extensions(const uint8_t*, size_t, size_t, const char **, struct RequestInfo *);
+static int parse_server_name_extension(const uint8_t*, size_t, size_t, const char **, struct RequestInfo *);
+static void parse_alpn_extension(const uint8_t*, size_t, struct RequestInfo *);
 
 
 static const char tls_alert[] = {
@@ -64,52 +90,321 @@ static const char tls_alert[] = {
 const struct Protocol *const tls_protocol = &(struct Protocol){
     .name = "tls",
     .default_port = 443,
-    .parse_packet = (int (*const)(const char *, size_t, char **, size_t*))&parse_tls_header,
-    .modify_packet = (void (*const)(char*, size_t, char **, size_t*))&modify_tls_header,
+    .parse_packet = (int (*const)(const char *, size_t, const char **, struct RequestInfo *))&parse_tls_header,
+    .split_packet = (size_t (*const)(char*, size_t, size_t, char*, size_t*))&split_tls_record,
+    .new_parser = (void *(*const)(size_t))&new_tls_parser,
+    .parse_more = (int (*const)(void *, const char *, size_t, const char **, struct RequestInfo *))&parse_tls_more,
+    .free_parser = (void (*const)(void *))&free_tls_parser,
     .abort_message = tls_alert,
     .abort_message_len = sizeof(tls_alert)
 };
 
-static void
-modify_tls_header(uint8_t *data, size_t data_len, char **hostname, size_t* modify_pos) {
-    debug("Received SNI %s.", *hostname);
-    size_t sni_split_pos = *modify_pos + 1;
-    memmove(data + 5 + sni_split_pos, data + sni_split_pos, data_len - 5 - sni_split_pos);
-    memcpy(data + sni_split_pos, data, 5);
-    size_t part1_len = sni_split_pos - 5;
-    size_t record_length = (uint16_t)((data[3] << 8) + (uint8_t)data[4]);
-    size_t part2_len = record_length - part1_len;
-    *(uint16_t *)(data + 3) = htons(part1_len);
-    *(uint16_t *)(data + sni_split_pos + 3) = htons(part2_len);
+/* Body of the ClientHello used by build_tls_client_hello(), TLS 1.2 with
+ * common ECDHE cipher suites so any reasonably current server will answer */
+static const uint8_t client_hello_body[] = {
+    0x03, 0x03, /* Version: TLS 1.2 */
+    /* Random */
+    0x73, 0x6e, 0x69, 0x70, 0x72, 0x6f, 0x78, 0x79,
+    0x20, 0x68, 0x65, 0x61, 0x6c, 0x74, 0x68, 0x20,
+    0x63, 0x68, 0x65, 0x63, 0x6b, 0x20, 0x70, 0x72,
+    0x6f, 0x62, 0x65, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, /* Session ID Length */
+    0x00, 0x0c, /* Cipher Suites Length */
+        0xc0, 0x2b, /* ECDHE-ECDSA-AES128-GCM-SHA256 */
+        0xc0, 0x2f, /* ECDHE-RSA-AES128-GCM-SHA256 */
+        0xc0, 0x2c, /* ECDHE-ECDSA-AES256-GCM-SHA384 */
+        0xc0, 0x30, /* ECDHE-RSA-AES256-GCM-SHA384 */
+        0x00, 0x9c, /* RSA-AES128-GCM-SHA256 */
+        0x00, 0xff, /* RENEGOTIATION INFO SCSV */
+    0x01, /* Compression Methods Length */
+        0x00, /* NULL */
+};
+
+static const uint8_t client_hello_extensions[] = {
+    0x00, 0x0a, /* Extension Type: Supported Groups */
+    0x00, 0x06, /* Length */
+    0x00, 0x04, /* Supported Groups List Length */
+        0x00, 0x1d, /* x25519 */
+        0x00, 0x17, /* secp256r1 */
+    0x00, 0x0b, /* Extension Type: EC Point Formats */
+    0x00, 0x02, /* Length */
+    0x01, /* EC Point Formats Length */
+        0x00, /* uncompressed */
+    0x00, 0x0d, /* Extension Type: Signature Algorithms */
+    0x00, 0x08, /* Length */
+    0x00, 0x06, /* Signature Hash Algorithms Length */
+        0x04, 0x03, /* ecdsa_secp256r1_sha256 */
+        0x08, 0x04, /* rsa_pss_rsae_sha256 */
+        0x04, 0x01, /* rsa_pkcs1_sha256 */
+};
+
+/*
+ * Write a minimal ClientHello, including a server name extension if hostname
+ * is not NULL, into dst.
+ *
+ * Returns the length of the record or 0 if dst is too small.
+ */
+size_t
+build_tls_client_hello(char *dst, size_t dst_len, const char *hostname) {
+    uint8_t *data = (uint8_t *)dst;
+    size_t hostname_len = hostname != NULL ? strlen(hostname) : 0;
+    size_t sni_len = hostname != NULL ? 9 + hostname_len : 0;
+    size_t extensions_len = sizeof(client_hello_extensions) + sni_len;
+    size_t handshake_len = sizeof(client_hello_body) + 2 + extensions_len;
+    size_t record_len = TLS_HANDSHAKE_HEADER_LEN + handshake_len;
+    size_t pos = 0;
+
+    if (TLS_HEADER_LEN + record_len > dst_len || hostname_len > 0xffff - 9)
+        return 0;
+
+    data[pos++] = TLS_HANDSHAKE_CONTENT_TYPE;
+    data[pos++] = 0x03; /* TLS 1.0 record version, as sent by most clients */
+    data[pos++] = 0x01;
+    data[pos++] = (uint8_t)(record_len >> 8);
+    data[pos++] = (uint8_t)record_len;
+
+    data[pos++] = TLS_HANDSHAKE_TYPE_CLIENT_HELLO;
+    data[pos++] = (uint8_t)(handshake_len >> 16);
+    data[pos++] = (uint8_t)(handshake_len >> 8);
+    data[pos++] = (uint8_t)handshake_len;
+
+    memcpy(data + pos, client_hello_body, sizeof(client_hello_body));
+    pos += sizeof(client_hello_body);
+
+    data[pos++] = (uint8_t)(extensions_len >> 8);
+    data[pos++] = (uint8_t)extensions_len;
+
+    if (hostname != NULL) {
+        data[pos++] = 0x00; /* Extension Type: Server Name */
+        data[pos++] = 0x00;
+        data[pos++] = (uint8_t)((hostname_len + 5) >> 8);
+        data[pos++] = (uint8_t)(hostname_len + 5);
+        data[pos++] = (uint8_t)((hostname_len + 3) >> 8);
+        data[pos++] = (uint8_t)(hostname_len + 3);
+        data[pos++] = 0x00; /* Server Name Type: host_name */
+        data[pos++] = (uint8_t)(hostname_len >> 8);
+        data[pos++] = (uint8_t)hostname_len;
+        memcpy(data + pos, hostname, hostname_len);
+        pos += hostname_len;
+    }
+
+    memcpy(data + pos, client_hello_extensions, sizeof(client_hello_extensions));
+    pos += sizeof(client_hello_extensions);
+
+    assert(pos == TLS_HEADER_LEN + record_len);
+
+    return pos;
+}
+
+/* Split the TLS record holding the server name of a client hello in two,
+ * at the byte following modify_pos (the offset into the handshake message
+ * reported by the parser). The length of that record is rewritten in place
+ * and the header of the second record is written to header; nothing is
+ * moved, the caller is expected to send header in front of the byte at the
+ * returned offset.
+ *
+ * Returns the offset at which to insert header, or 0 if the record can not be
+ * split there.
+ */
+static size_t
+split_tls_record(uint8_t *data, size_t data_len, size_t modify_pos, uint8_t *header, size_t *header_len) {
+    size_t split_pos = modify_pos + 1; /* offset into the handshake message */
+    size_t hello_pos = 0;
+    size_t pos = 0;
+
+    while (pos + TLS_HEADER_LEN <= data_len) {
+        size_t record_len = ((size_t)data[pos + 3] << 8) + (size_t)data[pos + 4];
+
+        if (split_pos < hello_pos + record_len) {
+            size_t part1_len = split_pos - hello_pos;
+            size_t part2_len = record_len - part1_len;
+            size_t sni_split_pos = pos + TLS_HEADER_LEN + part1_len;
+
+            if (part1_len == 0 || sni_split_pos >= data_len)
+                return 0;
+
+            memcpy(header, data + pos, TLS_HEADER_LEN);
+            header[3] = (uint8_t)(part2_len >> 8);
+            header[4] = (uint8_t)(part2_len & 0xff);
+            *header_len = TLS_HEADER_LEN;
+
+            data[pos + 3] = (uint8_t)(part1_len >> 8);
+            data[pos + 4] = (uint8_t)(part1_len & 0xff);
+
+            return sni_split_pos;
+        }
+
+        hello_pos += record_len;
+        pos += TLS_HEADER_LEN + record_len;
+    }
+
+    return 0;
 }
 
 /* Parse a TLS packet for the Server Name Indication extension in the client
- * hello handshake, returning the first servername found (pointer to static
- * array)
+ * hello handshake, returning the first servername found. The client hello may
+ * span several records.
  *
  * Returns:
- *  >=0  - length of the hostname and updates *hostname
- *         caller is responsible for freeing *hostname
+ *  >=0  - length of the hostname and updates *hostname to point to it, within
+ *         data or, for hellos reassembled from several records, a static
+ *         array overwritten by the next call, info->alpn likewise
  *  -1   - Incomplete request
  *  -2   - No Host header included in this request
- *  -3   - Invalid hostname pointer
+ *  -3   - Invalid hostname or info pointer
  *  -4   - malloc failure
+ *  -6   - Client hello larger than the parser limit
  *  < -4 - Invalid TLS client hello
  */
 static int
-parse_tls_header(const uint8_t *data, size_t data_len, char **hostname, size_t* modify_pos) {
-    uint8_t tls_content_type;
-    uint8_t tls_version_major;
-    uint8_t tls_version_minor;
-    size_t pos = TLS_HEADER_LEN;
-    size_t len;
+parse_tls_header(const uint8_t *data, size_t data_len, const char **hostname, struct RequestInfo *info) {
+    struct TLSParser parser = { .max_hello_len = 0 };
 
-    if (hostname == NULL)
+    if (hostname == NULL || info == NULL)
         return -3;
 
-    /* Check that our TCP payload is at least large enough for a TLS header */
-    if (data_len < TLS_HEADER_LEN)
-        return -1;
+    int result = tls_parser_feed(&parser, data, data_len, hostname, info);
+
+    if (result >= 0 && parser.hello != NULL) {
+        static char reassembled_hostname[SERVER_NAME_LEN];
+
+        if ((size_t)result >= sizeof(reassembled_hostname)) {
+            result = -5;
+        } else {
+            memcpy(reassembled_hostname, *hostname, (size_t)result);
+            reassembled_hostname[result] = '\0';
+            *hostname = reassembled_hostname;
+        }
+
+        if (info->alpn != NULL) {
+            static char reassembled_alpn[ALPN_LIST_LEN];
+
+            info->alpn_len = alpn_list_prefix(info->alpn, info->alpn_len,
+                    sizeof(reassembled_alpn));
+            memcpy(reassembled_alpn, info->alpn, info->alpn_len);
+            info->alpn = reassembled_alpn;
+        }
+    }
+
+    free(parser.hello);
+
+    return result;
+}
+
+/*
+ * Parse a complete ClientHello handshake message, without the record layer,
+ * as QUIC carries it in CRYPTO frames. Return values are those of
+ * parse_tls_header(), *hostname and info->alpn point into data.
+ */
+int
+parse_tls_client_hello(const char *data, size_t data_len, const char **hostname, struct RequestInfo *info) {
+    if (hostname == NULL || info == NULL)
+        return -3;
+
+    return parse_client_hello((const uint8_t *)data, data_len, hostname, info);
+}
+
+static struct TLSParser *
+new_tls_parser(size_t max_hello_len) {
+    struct TLSParser *parser = calloc(1, sizeof(struct TLSParser));
+    if (parser == NULL) {
+        err("%s: calloc", __func__);
+        return NULL;
+    }
+
+    parser->max_hello_len = max_hello_len;
+
+    return parser;
+}
+
+/*
+ * Continue parsing a client hello with the bytes following those previously
+ * passed to this parser. Return values are those of parse_tls_header(), but
+ * *hostname and info->alpn may point into the parser, so remain valid only
+ * until it is freed. Once anything other than -1 is returned the parser must
+ * not be fed again.
+ */
+static int
+parse_tls_more(struct TLSParser *parser, const uint8_t *data, size_t data_len, const char **hostname, struct RequestInfo *info) {
+    if (hostname == NULL || info == NULL)
+        return -3;
+
+    return tls_parser_feed(parser, data, data_len, hostname, info);
+}
+
+static void
+free_tls_parser(struct TLSParser *parser) {
+    if (parser == NULL)
+        return;
+
+    free(parser->hello);
+    free(parser);
+}
+
+static int
+tls_parser_feed(struct TLSParser *parser, const uint8_t *data, size_t data_len, const char **hostname, struct RequestInfo *info) {
+    int result;
+
+    while (data_len > 0) {
+        if (parser->header_len < TLS_HEADER_LEN) {
+            size_t len = MIN(TLS_HEADER_LEN - parser->header_len, data_len);
+            memcpy(parser->header + parser->header_len, data, len);
+            parser->header_len += len;
+            data += len;
+            data_len -= len;
+
+            if (parser->header_len == TLS_HEADER_LEN &&
+                    (result = check_record_header(parser)) < 0)
+                return result;
+
+            continue;
+        }
+
+        size_t len = MIN(parser->record_remaining, data_len);
+
+        /* Common case: the whole message is in this record and this read,
+         * parse it where it is. Like earlier versions, when the record is
+         * complete its length rather than the message length bounds it. */
+        if (parser->hello_len == 0 && len >= TLS_HANDSHAKE_HEADER_LEN) {
+            size_t hello_len = TLS_HANDSHAKE_HEADER_LEN +
+                ((size_t)data[1] << 16) + ((size_t)data[2] << 8) +
+                (size_t)data[3];
+
+            if (hello_len <= len) {
+                if (parser->max_hello_len > 0 &&
+                        hello_len > parser->max_hello_len)
+                    return -6;
+
+                return parse_client_hello(data,
+                        len == parser->record_remaining ? len : hello_len,
+                        hostname, info);
+            }
+        }
+
+        if ((result = append_hello(parser, data, len)) < 0)
+            return result;
+
+        parser->record_remaining -= len;
+        data += len;
+        data_len -= len;
+
+        if (parser->record_remaining == 0)
+            parser->header_len = 0; /* next record */
+
+        if (parser->hello_expected > 0 &&
+                parser->hello_len == parser->hello_expected)
+            return parse_client_hello(parser->hello, parser->hello_len,
+                    hostname, info);
+    }
+
+    return -1;
+}
+
+static int
+check_record_header(struct TLSParser *parser) {
+    const uint8_t *header = parser->header;
+
+    parser->records++;
 
     /* SSL 2.0 compatible Client Hello
      *
@@ -117,34 +412,101 @@ parse_tls_header(const uint8_t *data, size_t data_len, char **hostname, size_t*
      *
      * See RFC5246 Appendix E.2
      */
-    if (data[0] & 0x80 && data[2] == 1) {
+    if (parser->records == 1 && header[0] & 0x80 && header[2] == 1) {
         debug("Received SSL 2.0 Client Hello which can not support SNI.");
         return -2;
     }
 
-    tls_content_type = data[0];
-    if (tls_content_type != TLS_HANDSHAKE_CONTENT_TYPE) {
-        debug("Request did not begin with TLS handshake.");
+    if (header[0] != TLS_HANDSHAKE_CONTENT_TYPE) {
+        if (parser->records == 1)
+            debug("Request did not begin with TLS handshake.");
+        else
+            debug("Client hello interrupted by a non handshake record.");
         return -5;
     }
 
-    tls_version_major = data[1];
-    tls_version_minor = data[2];
-    if (tls_version_major < 3) {
+    if (header[1] < 3) {
         debug("Received SSL %" PRIu8 ".%" PRIu8 " handshake which can not support SNI.",
-              tls_version_major, tls_version_minor);
+              header[1], header[2]);
 
         return -2;
     }
 
     /* TLS record length */
-    len = ((size_t)data[3] << 8) +
-        (size_t)data[4] + TLS_HEADER_LEN;
-    data_len = MIN(data_len, len);
+    parser->record_remaining = ((size_t)header[3] << 8) + (size_t)header[4];
+    if (parser->record_remaining == 0)
+        return -5;
+
+    return 0;
+}
+
+/*
+ * Append a fragment of the handshake message, ignoring anything following it
+ */
+static int
+append_hello(struct TLSParser *parser, const uint8_t *data, size_t len) {
+    if (parser->hello_expected > 0)
+        len = MIN(len, parser->hello_expected - parser->hello_len);
+
+    if (parser->hello_len + len > parser->hello_size) {
+        size_t size = parser->hello_size > 0 ? parser->hello_size : 512;
+        while (size < parser->hello_len + len)
+            size *= 2;
+
+        uint8_t *hello = realloc(parser->hello, size);
+        if (hello == NULL) {
+            err("%s: realloc", __func__);
+            return -4;
+        }
+        parser->hello = hello;
+        parser->hello_size = size;
+    }
+
+    memcpy(parser->hello + parser->hello_len, data, len);
+    parser->hello_len += len;
 
-    /* Check we received entire TLS record length */
-    if (data_len < len)
-        return -1;
+    if (parser->hello_expected == 0 &&
+            parser->hello_len >= TLS_HANDSHAKE_HEADER_LEN) {
+        const uint8_t *hello = parser->hello;
+
+        if (hello[0] != TLS_HANDSHAKE_TYPE_CLIENT_HELLO) {
+            debug("Not a client hello");
+
+            return -5;
+        }
+
+        parser->hello_expected = TLS_HANDSHAKE_HEADER_LEN +
+            ((size_t)hello[1] << 16) + ((size_t)hello[2] << 8) +
+            (size_t)hello[3];
+
+        if (parser->max_hello_len > 0 &&
+                parser->hello_expected > parser->max_hello_len) {
+            debug("Client hello of %zu bytes exceeds %zu byte limit",
+                    parser->hello_expected, parser->max_hello_len);
+
+            return -6;
+        }
+
+        /* drop anything after the message appended with its header */
+        parser->hello_len = MIN(parser->hello_len, parser->hello_expected);
+    }
+
+    return 0;
+}
+
+/*
+ * Parse a complete client hello handshake message, info->modify_pos is set to
+ * the offset of the server name within it and info->alpn to the ALPN protocol
+ * name list if one was offered
+ */
+static int
+parse_client_hello(const uint8_t *data, size_t data_len, const char **hostname, struct RequestInfo *info) {
+    size_t pos = 0;
+    size_t len;
+
+    info->modify_pos = 0;
+    info->alpn = NULL;
+    info->alpn_len = 0;
 
     /*
      * Handshake
@@ -185,7 +547,7 @@ parse_tls_header(const uint8_t *data, size_t data_len, char **hostname, size_t*
     len = (size_t)data[pos];
     pos += 1 + len;
 
-    if (pos == data_len && tls_version_major == 3 && tls_version_minor == 0) {
+    if (pos == data_len && data[4] == 3 && data[5] == 0) {
         debug("Received SSL 3.0 handshake without extensions");
         return -2;
     }
@@ -198,47 +560,57 @@ parse_tls_header(const uint8_t *data, size_t data_len, char **hostname, size_t*
 
     if (pos + len > data_len)
         return -5;
-    *modify_pos = pos;
-    return parse_extensions(data + pos, len, hostname, modify_pos);
+    return parse_extensions(data + pos, len, pos, hostname, info);
 }
 
+/*
+ * Walk every extension, picking out the server name and ALPN protocol list
+ * in the one pass. offset is that of the extensions within the handshake
+ * message.
+ */
 static int
-parse_extensions(const uint8_t *data, size_t data_len, char **hostname, size_t* modify_pos) {
+parse_extensions(const uint8_t *data, size_t data_len, size_t offset,
+        const char **hostname, struct RequestInfo *info) {
     size_t pos = 0;
     size_t len;
-    size_t old_pos = *modify_pos;
-    *modify_pos = 0;
+    int result = -2;
     /* Parse each 4 bytes for the extension header */
     while (pos + 4 <= data_len) {
         /* Extension Length */
         len = ((size_t)data[pos + 2] << 8) +
             (size_t)data[pos + 3];
 
-        /* Check if it's a server name extension */
+        /* Once the server name has been found, a malformed extension only
+         * ends the search for the protocol list */
+        if (pos + 4 + len > data_len)
+            break;
+
         if (data[pos] == 0x00 && data[pos + 1] == 0x00) {
-            /* There can be only one extension of each type, so we break
-               our state and move p to beinnging of the extension here */
-            if (pos + 4 + len > data_len)
-                return -5;
-            *modify_pos = pos + 4 + old_pos;
-            return parse_server_name_extension(data + pos + 4, len, hostname, modify_pos);
+            /* Server name */
+            result = parse_server_name_extension(data + pos + 4, len,
+                    offset + pos + 4, hostname, info);
+            if (result < 0 && result != -2)
+                return result;
+        } else if (data[pos] == 0x00 && data[pos + 1] == 0x10) {
+            /* Application layer protocol negotiation */
+            parse_alpn_extension(data + pos + 4, len, info);
         }
         pos += 4 + len; /* Advance to the next extension header */
     }
+    if (result >= 0)
+        return result;
     /* Check we ended where we expected to */
     if (pos != data_len)
         return -5;
 
-    return -2;
+    return result;
 }
 
 static int
 parse_server_name_extension(const uint8_t *data, size_t data_len,
-        char **hostname, size_t* modify_pos) {
+        size_t offset, const char **hostname, struct RequestInfo *info) {
     size_t pos = 2; /* skip server name list length */
     size_t len;
-    size_t old_pos = *modify_pos;
-    *modify_pos = 0;
     while (pos + 3 < data_len) {
         len = ((size_t)data[pos + 1] << 8) +
             (size_t)data[pos + 2];
@@ -248,16 +620,8 @@ parse_server_name_extension(const uint8_t *data, size_t data_len,
 
         switch (data[pos]) { /* name type */
             case 0x00: /* host_name */
-                *hostname = malloc(len + 1);
-                if (*hostname == NULL) {
-                    err("malloc() failure");
-                    return -4;
-                }
-
-                strncpy(*hostname, (const char *)(data + pos + 3), len);
-
-                (*hostname)[len] = '\0';
-                *modify_pos = pos + 3 + old_pos;
+                *hostname = (const char *)(data + pos + 3);
+                info->modify_pos = pos + 3 + offset;
                 return len;
             default:
                 debug("Unknown server name extension name type: %" PRIu8,
@@ -271,3 +635,27 @@ parse_server_name_extension(const uint8_t *data, size_t data_len,
 
     return -2;
 }
+
+/*
+ * The protocol name list is only used to choose a backend, the server is left
+ * to reject a malformed one
+ */
+static void
+parse_alpn_extension(const uint8_t *data, size_t data_len,
+        struct RequestInfo *info) {
+    if (data_len < 2 ||
+            ((size_t)data[0] << 8) + (size_t)data[1] != data_len - 2) {
+        debug("Malformed ALPN extension");
+        return;
+    }
+
+    for (size_t pos = 2; pos < data_len; pos += 1 + (size_t)data[pos]) {
+        if (data[pos] == 0 || pos + 1 + (size_t)data[pos] > data_len) {
+            debug("Malformed ALPN protocol name list");
+            return;
+        }
+    }
+
+    info->alpn = (const char *)(data + 2);
+    info->alpn_len = data_len - 2;
+}
@@ -26,8 +26,13 @@
 #ifndef TLS_H
 #define TLS_H
 
+#include <stddef.h>
 #include "protocol.h"
 
 extern const struct Protocol *const tls_protocol;
 
+size_t build_tls_client_hello(char *, size_t, const char *);
+int parse_tls_client_hello(const char *, size_t, const char **,
+        struct RequestInfo *);
+
 #endif
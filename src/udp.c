@@ -0,0 +1,1278 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Datagram listeners
+ *
+ * Each client address seen on a datagram listener becomes a flow with its
+ * own connected socket to the server, so replies can be told apart and sent
+ * back to the right client from the listening socket. Datagrams are read and
+ * written in batches to keep the per datagram system call cost down, and
+ * where the kernel coalesces a flow's datagrams (UDP GRO) they are forwarded
+ * still coalesced (UDP GSO).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h> /* tolower() */
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <ev.h>
+#include "udp.h"
+#include "address.h"
+#include "listener.h"
+#include "protocol.h"
+#include "quic.h"
+#include "binary_log.h"
+#include "logger.h"
+#include "metrics.h"
+
+#define IS_TEMPORARY_SOCKERR(_errno) (_errno == EAGAIN || \
+                                      _errno == EWOULDBLOCK || \
+                                      _errno == EINTR)
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define UDP_BATCH 64
+/* Room for the largest datagram, or a coalesced run of them */
+#define UDP_BUFFER_SIZE 65536
+/* Initial buckets of the flow tables, doubled whenever the flows outnumber
+ * them */
+#define UDP_FLOW_BUCKETS 4096
+/* Seconds without a datagram in either direction before a flow is closed */
+#define UDP_FLOW_IDLE_TIMEOUT 60
+/* Seconds a flow which never reached a server is kept to drop the rest of
+ * the client's datagrams */
+#define UDP_FLOW_UNCONNECTED_TIMEOUT 10
+/* One second slots, longer timeouts take more than one turn of the wheel */
+#define UDP_WHEEL_SLOTS 64
+/* Server connection IDs are indexed by this many leading bytes, as the
+ * length is not carried in the client's short header packets */
+#define UDP_CID_HASH_LEN 4
+
+#ifndef HAVE_RECVMMSG
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#endif
+
+LIST_HEAD(UDPFlowList, UDPFlow);
+
+union UDPControl {
+    char buf[CMSG_SPACE(sizeof(int))];
+    size_t align;       /* as struct cmsghdr */
+};
+
+static struct UDPFlow *new_flow(struct Listener *,
+        const struct sockaddr_storage *, socklen_t, ev_tstamp,
+        struct ev_loop *);
+static struct UDPFlow *lookup_flow(struct Listener *,
+        const struct sockaddr_storage *, socklen_t, const char *, size_t,
+        ev_tstamp, struct ev_loop *);
+static int parse_flow_datagram(struct UDPFlow *, const char *, size_t,
+        struct ev_loop *);
+static int parse_datagram(struct UDPFlow *, const char *, size_t);
+static int copy_request(struct UDPFlow *, const char *, size_t,
+        const struct RequestInfo *);
+static void free_flow_parser(struct UDPFlow *);
+static int connect_flow(struct UDPFlow *, struct ev_loop *);
+static void reject_flow(struct UDPFlow *);
+static void forward_pending(struct UDPFlow *);
+static void queue_to_server(struct UDPFlow *, unsigned int *, char *,
+        size_t, size_t);
+static void forward_to_server(struct UDPFlow *, struct mmsghdr *, unsigned int);
+static void server_cb(struct ev_loop *, struct ev_io *, int);
+static void learn_server_cid(struct UDPFlow *, const char *, size_t);
+static ev_tstamp flow_expiry(const struct UDPFlow *);
+static void wheel_insert(struct UDPFlow *);
+static void wheel_cb(struct ev_loop *, struct ev_timer *, int);
+static void close_flow(struct UDPFlow *, struct ev_loop *);
+static void count_flow(const struct UDPFlow *);
+static void log_flow(const struct UDPFlow *);
+static void log_flow_record(const struct UDPFlow *, ev_tstamp);
+static int receive_datagrams(int, struct mmsghdr *, unsigned int);
+static size_t segment_size(const struct msghdr *, size_t);
+static void prepare_send(unsigned int, void *, socklen_t, char *, size_t,
+        size_t);
+static int send_datagrams(int, struct mmsghdr *, unsigned int);
+static int send_segments(int, struct mmsghdr *, unsigned int);
+static uint32_t hash_bytes(uint32_t, const void *, size_t);
+static unsigned int address_bucket(const struct Listener *,
+        const struct sockaddr_storage *);
+static unsigned int cid_bucket(const struct Listener *, const char *);
+static int same_client(const struct sockaddr_storage *,
+        const struct sockaddr_storage *);
+static void grow_flow_tables(void);
+static void insert_flow_address(struct UDPFlow *);
+static void remove_flow_address(struct UDPFlow *);
+static void insert_flow_cid(struct UDPFlow *);
+static void remove_flow_cid(struct UDPFlow *);
+
+
+/* Datagrams are forwarded as they are, to the listener's table entry for an
+ * empty hostname or its fallback server */
+const struct Protocol *const udp_protocol = &(struct Protocol){
+    .name = "udp",
+    .default_port = 0,
+    .parse_packet = NULL,
+    .abort_message = NULL,
+    .abort_message_len = 0,
+    .datagram = 1,
+};
+
+static struct UDPFlow **flows_by_address;
+static struct UDPFlow **flows_by_cid;
+static size_t flow_buckets;
+static uint32_t hash_seed;
+static struct UDPFlowList wheel[UDP_WHEEL_SLOTS];
+static long wheel_tick;         /* last second whose slot was expired */
+static struct ev_timer wheel_timer;
+static size_t flow_count;
+static int gso_failed;
+
+/* Shared by every socket, only one batch is in flight at a time */
+static char datagram_buffers[UDP_BATCH][UDP_BUFFER_SIZE];
+static struct sockaddr_storage datagram_addrs[UDP_BATCH];
+static union UDPControl datagram_controls[UDP_BATCH];
+static struct iovec datagram_iovs[UDP_BATCH];
+static struct mmsghdr datagram_msgs[UDP_BATCH];
+static union UDPControl send_controls[UDP_BATCH];
+static struct iovec send_iovs[UDP_BATCH];
+static struct mmsghdr send_msgs[UDP_BATCH];
+
+
+void
+init_udp_flows(struct ev_loop *loop) {
+    for (int i = 0; i < UDP_WHEEL_SLOTS; i++)
+        LIST_INIT(&wheel[i]);
+
+    flow_buckets = UDP_FLOW_BUCKETS;
+    flows_by_address = calloc(flow_buckets, sizeof(struct UDPFlow *));
+    flows_by_cid = calloc(flow_buckets, sizeof(struct UDPFlow *));
+    if (flows_by_address == NULL || flows_by_cid == NULL) {
+        err("%s: calloc", __func__);
+        exit(1);
+    }
+
+    /* Keep clients from choosing source ports which share a bucket */
+    hash_seed = (uint32_t)(ev_time() * 1000000.0) ^ (uint32_t)getpid();
+
+    ev_timer_init(&wheel_timer, wheel_cb, 1.0, 1.0);
+    (void)loop;
+}
+
+void
+udp_flows_shutdown(struct ev_loop *loop) {
+    for (int i = 0; i < UDP_WHEEL_SLOTS; i++) {
+        struct UDPFlow *flow;
+
+        while ((flow = LIST_FIRST(&wheel[i])) != NULL)
+            close_flow(flow, loop);
+    }
+
+    ev_timer_stop(loop, &wheel_timer);
+
+    free(flows_by_address);
+    free(flows_by_cid);
+    flows_by_address = NULL;
+    flows_by_cid = NULL;
+}
+
+size_t
+udp_flows_active(void) {
+    return flow_count;
+}
+
+/*
+ * Let the kernel coalesce consecutive datagrams of a flow into one read
+ */
+void
+udp_enable_gro(int sockfd) {
+#ifdef UDP_GRO
+    int on = 1;
+
+    if (setsockopt(sockfd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) < 0)
+        debug("setsockopt UDP_GRO failed: %s", strerror(errno));
+#else
+    (void)sockfd;
+#endif
+}
+
+/*
+ * Read a batch of datagrams from a datagram listener and dispatch them to
+ * their flows. Consecutive datagrams of the same flow are forwarded with a
+ * single system call.
+ *
+ * Returns 1 on success or 0 if the listener should back off, with errno set
+ */
+int
+accept_udp_datagrams(struct Listener *listener, struct ev_loop *loop) {
+    ev_tstamp now = ev_now(loop);
+    char client[ADDRESS_BUFFER_SIZE];
+    int backoff = 0;
+
+    int count = receive_datagrams(listener->watcher.fd, datagram_msgs,
+            UDP_BATCH);
+    if (count < 0) {
+        if (!IS_TEMPORARY_SOCKERR(errno))
+            warn_ratelimited("recvmmsg failed: %s", strerror(errno));
+        return 1;
+    }
+
+    struct UDPFlow *run = NULL;
+    unsigned int run_len = 0;
+
+    for (int i = 0; i < count; i++) {
+        const struct msghdr *msg = &datagram_msgs[i].msg_hdr;
+        char *data = datagram_buffers[i];
+        size_t len = datagram_msgs[i].msg_len;
+
+        if (msg->msg_flags & MSG_TRUNC) {
+            debug("Dropping truncated datagram from %s",
+                    display_sockaddr(&datagram_addrs[i], client, sizeof(client)));
+            continue;
+        }
+
+        /* Coalesced datagrams all come from the same client */
+        size_t segment = segment_size(msg, len);
+        struct UDPFlow *flow = lookup_flow(listener, &datagram_addrs[i],
+                msg->msg_namelen, data, segment, now, loop);
+
+        if (flow != run && run_len > 0) {
+            forward_to_server(run, send_msgs, run_len);
+            run_len = 0;
+        }
+        run = NULL;
+
+        if (flow == NULL)
+            continue;
+
+        flow->client_rx_bytes += len;
+        if (flow->state != FLOW_REJECTED)
+            flow->last_activity = now; /* rejected flows expire */
+
+        for (size_t pos = 0; pos < len && flow->state != FLOW_REJECTED;) {
+            if (flow->state == FLOW_CONNECTED) {
+                /* Forward the rest still coalesced */
+                queue_to_server(flow, &run_len, data + pos, len - pos, segment);
+                run = flow;
+                break;
+            }
+
+            size_t datagram_len = MIN(segment, len - pos);
+            if (!parse_flow_datagram(flow, data + pos, datagram_len, loop))
+                backoff = 1;
+            pos += datagram_len;
+        }
+    }
+
+    if (run_len > 0)
+        forward_to_server(run, send_msgs, run_len);
+
+    if (backoff) {
+        errno = EMFILE;
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Find the flow of a datagram received on a listener, by the client's
+ * address or, for QUIC clients which have moved to a new address, by the
+ * server's connection ID. A new flow is created if the datagram could start
+ * one.
+ */
+static struct UDPFlow *
+lookup_flow(struct Listener *listener, const struct sockaddr_storage *addr,
+        socklen_t addr_len, const char *data, size_t len, ev_tstamp now,
+        struct ev_loop *loop) {
+    struct UDPFlow *flow;
+
+    for (flow = flows_by_address[address_bucket(listener, addr)];
+            flow != NULL; flow = flow->address_next)
+        if (flow->listener == listener && same_client(&flow->client_addr, addr))
+            return flow;
+
+    if (listener->protocol == quic_protocol && quic_short_header(data, len) &&
+            len >= 1 + UDP_CID_HASH_LEN) {
+        for (flow = flows_by_cid[cid_bucket(listener, data + 1)];
+                flow != NULL; flow = flow->cid_next) {
+            if (flow->listener != listener ||
+                    len < 1 + flow->server_cid_len ||
+                    memcmp(data + 1, flow->server_cid,
+                        flow->server_cid_len) != 0)
+                continue;
+
+            char old_client[ADDRESS_BUFFER_SIZE];
+            char new_client[ADDRESS_BUFFER_SIZE];
+            debug("QUIC connection for %.*s moved from %s to %s",
+                    (int)flow->hostname_len, flow->hostname,
+                    display_sockaddr(&flow->client_addr, old_client,
+                        sizeof(old_client)),
+                    display_sockaddr(addr, new_client, sizeof(new_client)));
+
+            remove_flow_address(flow);
+            memcpy(&flow->client_addr, addr, addr_len);
+            flow->client_addr_len = addr_len;
+            insert_flow_address(flow);
+
+            return flow;
+        }
+    }
+
+    if (listener->protocol == quic_protocol && !quic_client_initial(data, len)) {
+        char client[ADDRESS_BUFFER_SIZE];
+        debug("Ignoring datagram from %s without a flow",
+                display_sockaddr(addr, client, sizeof(client)));
+        return NULL;
+    }
+
+    /* Each flow holds a server socket, so bound them against floods of
+     * client addresses until idle flows expire */
+    if (listener->flows >= listener->max_flows) {
+        char client[ADDRESS_BUFFER_SIZE];
+        warn_ratelimited("Ignoring datagram from %s, listener has %zu flows",
+                display_sockaddr(addr, client, sizeof(client)),
+                listener->flows);
+        return NULL;
+    }
+
+    return new_flow(listener, addr, addr_len, now, loop);
+}
+
+static struct UDPFlow *
+new_flow(struct Listener *listener, const struct sockaddr_storage *addr,
+        socklen_t addr_len, ev_tstamp now, struct ev_loop *loop) {
+    struct UDPFlow *flow = calloc(1, sizeof(struct UDPFlow));
+    if (flow == NULL) {
+        err("%s: calloc", __func__);
+        return NULL;
+    }
+
+    flow->state = FLOW_PARSING;
+    flow->listener = listener_ref_get(listener);
+    memcpy(&flow->client_addr, addr, addr_len);
+    flow->client_addr_len = addr_len;
+    ev_io_init(&flow->server_watcher, server_cb, -1, EV_READ);
+    flow->server_watcher.data = flow;
+    STAILQ_INIT(&flow->pending);
+    flow->established_timestamp = now;
+    flow->last_activity = now;
+    metrics_count(listener->metrics, METRIC_CONNECTIONS, 1);
+
+    if (flow_count >= flow_buckets)
+        grow_flow_tables();
+    insert_flow_address(flow);
+    listener->flows++;
+
+    if (flow_count++ == 0) {
+        wheel_tick = (long)now - 1;
+        ev_timer_again(loop, &wheel_timer);
+    }
+    wheel_insert(flow);
+
+    return flow;
+}
+
+/*
+ * Hold the datagram and try to parse the request from those received so
+ * far, connecting to the server once it parses.
+ *
+ * Returns 0 if the flow was rejected for lack of file descriptors, otherwise
+ * 1
+ */
+static int
+parse_flow_datagram(struct UDPFlow *flow, const char *data, size_t len,
+        struct ev_loop *loop) {
+    const struct Protocol *protocol = flow->listener->protocol;
+    char client[ADDRESS_BUFFER_SIZE];
+    int result;
+
+    /* Queued even past the size limit, so a fallback server is sent the
+     * client's whole first flight */
+    struct UDPDatagram *datagram = malloc(sizeof(struct UDPDatagram) + len);
+    if (datagram == NULL) {
+        err("%s: malloc", __func__);
+        reject_flow(flow);
+        return 1;
+    }
+    datagram->len = len;
+    memcpy(datagram->data, data, len);
+    STAILQ_INSERT_TAIL(&flow->pending, datagram, entries);
+    flow->pending_len += len;
+
+    if (flow->pending_len > flow->listener->max_request_size)
+        result = -6;
+    else if (protocol->parse_packet != NULL)
+        result = parse_datagram(flow, data, len);
+    else
+        result = 0; /* protocols without a parser are routed without a hostname */
+
+    if (result == -1)
+        return 1; /* wait for the rest of the request */
+
+    free_flow_parser(flow);
+
+    if (result < 0) {
+        metrics_parse_failure(flow->listener->metrics, result);
+
+        if (result == -6) {
+            warn_ratelimited("Request from %s exceeded %zu byte request size limit",
+                    display_sockaddr(&flow->client_addr, client, sizeof(client)),
+                    flow->listener->max_request_size);
+        } else if (result == -2) {
+            warn_ratelimited("Request from %s did not include a hostname",
+                    display_sockaddr(&flow->client_addr, client, sizeof(client)));
+        } else {
+            warn_ratelimited("Unable to parse request from %s: parse_packet returned %d",
+                    display_sockaddr(&flow->client_addr, client, sizeof(client)),
+                    result);
+        }
+
+        if (flow->listener->fallback_address == NULL) {
+            reject_flow(flow);
+            return 1;
+        }
+
+        flow->hostname = NULL;
+        flow->hostname_len = 0;
+        flow->alpn_len = 0;
+    }
+
+    metrics_record(flow->listener->metrics, METRIC_PARSE_TIME,
+            ev_now(loop) - flow->established_timestamp);
+
+    if (!connect_flow(flow, loop)) {
+        reject_flow(flow);
+        return errno != EMFILE && errno != ENFILE;
+    }
+
+    flow->state = FLOW_CONNECTED;
+    forward_pending(flow);
+
+    return 1;
+}
+/*
+ * Feed one datagram to the listener protocol's parser. As with stream
+ * connections the stateless parser is tried first, so requests in a single
+ * datagram never allocate parser state.
+ */
+static int
+parse_datagram(struct UDPFlow *flow, const char *data, size_t len) {
+    const struct Protocol *protocol = flow->listener->protocol;
+    struct RequestInfo info = { .alpn = NULL };
+    const char *hostname = NULL;
+    int result;
+
+    if (flow->parser == NULL) {
+        result = protocol->parse_packet(data, len, &hostname, &info);
+        if (result >= 0)
+            return copy_request(flow, hostname, (size_t)result, &info);
+        if (result != -1 || protocol->new_parser == NULL)
+            return result;
+
+        flow->parser = protocol->new_parser(flow->listener->max_request_size);
+        if (flow->parser == NULL)
+            return -4;
+        flow->parser_protocol = protocol;
+    }
+
+    result = flow->parser_protocol->parse_more(flow->parser, data, len,
+            &hostname, &info);
+
+    /* the hostname may point into the parser */
+    if (result >= 0)
+        result = copy_request(flow, hostname, (size_t)result, &info);
+
+    return result;
+}
+
+/* Keep a lower case copy of the hostname, and the ALPN protocol list */
+static int
+copy_request(struct UDPFlow *flow, const char *hostname, size_t len,
+        const struct RequestInfo *info) {
+    if (len >= sizeof(flow->hostname_buf))
+        return -5;
+
+    for (size_t i = 0; i < len; i++)
+        flow->hostname_buf[i] = (char)tolower((unsigned char)hostname[i]);
+    flow->hostname_buf[len] = '\0';
+
+    flow->hostname = flow->hostname_buf;
+    flow->hostname_len = len;
+
+    flow->alpn_len = 0;
+    if (info->alpn != NULL) {
+        flow->alpn_len = alpn_list_prefix(info->alpn, info->alpn_len,
+                sizeof(flow->alpn));
+        memcpy(flow->alpn, info->alpn, flow->alpn_len);
+    }
+
+    return (int)len;
+}
+
+static void
+free_flow_parser(struct UDPFlow *flow) {
+    if (flow->parser == NULL)
+        return;
+
+    flow->parser_protocol->free_parser(flow->parser);
+    flow->parser = NULL;
+    flow->parser_protocol = NULL;
+}
+
+/*
+ * Open a socket connected to the server for the flow's request.
+ *
+ * Returns 1 on success or 0 on failure, with errno set if a socket could not
+ * be opened
+ */
+static int
+connect_flow(struct UDPFlow *flow, struct ev_loop *loop) {
+    struct Listener *listener = flow->listener;
+    char server[ADDRESS_BUFFER_SIZE];
+
+    struct LookupResult result =
+        listener_lookup_server_address(listener,
+                (const struct sockaddr *)&flow->client_addr,
+                flow->hostname, flow->hostname_len,
+                flow->alpn, flow->alpn_len);
+
+    errno = 0;
+
+    if (result.address == NULL)
+        return 0;
+
+    if (!address_is_sockaddr(result.address)) {
+        warn("Unable to forward datagrams for %.*s to %s, "
+                "datagram listeners require socket address servers",
+                (int)flow->hostname_len, flow->hostname,
+                display_address(result.address, server, sizeof(server)));
+        if (result.caller_free_address)
+            free((void *)result.address);
+        return 0;
+    }
+
+    flow->server_addr_len = address_sa_len(result.address);
+    memcpy(&flow->server_addr, address_sa(result.address),
+            flow->server_addr_len);
+    if (result.caller_free_address)
+        free((void *)result.address);
+    flow->backend_metrics = metrics_ref_get(result.metrics);
+
+    if (result.use_proxy_header)
+        debug("PROXY protocol header not sent on datagram flows");
+
+#ifdef HAVE_ACCEPT4
+    int sockfd = socket(flow->server_addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+#else
+    int sockfd = socket(flow->server_addr.ss_family, SOCK_DGRAM, 0);
+#endif
+    if (sockfd < 0) {
+        int saved_errno = errno;
+        warn("socket failed: %s", strerror(errno));
+        errno = saved_errno;
+        return 0;
+    }
+
+#ifndef HAVE_ACCEPT4
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+#endif
+
+    if (listener->source_address) {
+        int on = 1;
+        int result = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (result < 0) {
+            err("setsockopt SO_REUSEADDR failed: %s", strerror(errno));
+            close(sockfd);
+            return 0;
+        }
+
+        result = bind(sockfd, address_sa(listener->source_address),
+                address_sa_len(listener->source_address));
+        if (result < 0) {
+            err("bind failed: %s", strerror(errno));
+            close(sockfd);
+            return 0;
+        }
+    }
+
+    if (connect(sockfd, (struct sockaddr *)&flow->server_addr,
+                flow->server_addr_len) < 0) {
+        warn("Failed to open flow to %s: %s",
+                display_sockaddr(&flow->server_addr, server, sizeof(server)),
+                strerror(errno));
+        metrics_count(flow->backend_metrics, METRIC_CONNECT_FAILURES, 1);
+        close(sockfd);
+        return 0;
+    }
+    metrics_count(flow->backend_metrics, METRIC_CONNECTIONS, 1);
+
+    udp_enable_gro(sockfd);
+
+    ev_io_set(&flow->server_watcher, sockfd, EV_READ);
+    ev_io_start(loop, &flow->server_watcher);
+
+    return 1;
+}
+
+static void
+reject_flow(struct UDPFlow *flow) {
+    struct UDPDatagram *datagram;
+
+    free_flow_parser(flow);
+
+    while ((datagram = STAILQ_FIRST(&flow->pending)) != NULL) {
+        STAILQ_REMOVE_HEAD(&flow->pending, entries);
+        free(datagram);
+    }
+    flow->pending_len = 0;
+
+    flow->state = FLOW_REJECTED;
+}
+
+/* Send the datagrams held while the request was parsed */
+static void
+forward_pending(struct UDPFlow *flow) {
+    struct UDPDatagram *datagram;
+    unsigned int count = 0;
+
+    STAILQ_FOREACH(datagram, &flow->pending, entries)
+        queue_to_server(flow, &count, datagram->data, datagram->len,
+                datagram->len);
+
+    if (count > 0)
+        forward_to_server(flow, send_msgs, count);
+
+    while ((datagram = STAILQ_FIRST(&flow->pending)) != NULL) {
+        STAILQ_REMOVE_HEAD(&flow->pending, entries);
+        free(datagram);
+    }
+    flow->pending_len = 0;
+}
+
+/*
+ * Add datagrams, coalesced if segment is less than len, to the batch for the
+ * flow's server, sending the batch first if it is full
+ */
+static void
+queue_to_server(struct UDPFlow *flow, unsigned int *count, char *data,
+        size_t len, size_t segment) {
+    if (*count == UDP_BATCH) {
+        forward_to_server(flow, send_msgs, *count);
+        *count = 0;
+    }
+
+    prepare_send(*count, NULL, 0, data, len, segment);
+    (*count)++;
+}
+
+static void
+forward_to_server(struct UDPFlow *flow, struct mmsghdr *msgs, unsigned int count) {
+    int sent = send_datagrams(flow->server_watcher.fd, msgs, count);
+    if (sent < 0) {
+        char server[ADDRESS_BUFFER_SIZE];
+        if (!IS_TEMPORARY_SOCKERR(errno))
+            debug("Unable to send to %s: %s",
+                    display_sockaddr(&flow->server_addr, server, sizeof(server)),
+                    strerror(errno));
+        return;
+    }
+
+    /* Datagrams the socket had no room for are dropped */
+    for (int i = 0; i < sent; i++)
+        flow->server_tx_bytes += msgs[i].msg_len;
+}
+
+/*
+ * Relay a batch of datagrams from the server to the client, through the
+ * listening socket so they come from the address the client sent to
+ */
+static void
+server_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
+    struct UDPFlow *flow = (struct UDPFlow *)w->data;
+    char server[ADDRESS_BUFFER_SIZE];
+
+    if (!(revents & EV_READ))
+        return;
+
+    int count = receive_datagrams(w->fd, datagram_msgs, UDP_BATCH);
+    if (count < 0) {
+        /* Includes errors from ICMP port unreachable replies */
+        if (!IS_TEMPORARY_SOCKERR(errno))
+            debug("Unable to receive from %s: %s",
+                    display_sockaddr(&flow->server_addr, server, sizeof(server)),
+                    strerror(errno));
+        return;
+    }
+
+    if (flow->listener->watcher.fd < 0) {
+        /* Listener removed from the configuration */
+        close_flow(flow, loop);
+        return;
+    }
+
+    unsigned int valid = 0;
+    for (int i = 0; i < count; i++) {
+        const struct msghdr *msg = &datagram_msgs[i].msg_hdr;
+        size_t len = datagram_msgs[i].msg_len;
+
+        if (msg->msg_flags & MSG_TRUNC)
+            continue;
+
+        flow->server_rx_bytes += len;
+
+        size_t segment = segment_size(msg, len);
+        if (flow->listener->protocol == quic_protocol)
+            learn_server_cid(flow, datagram_buffers[i], segment);
+
+        prepare_send(valid++, &flow->client_addr, flow->client_addr_len,
+                datagram_buffers[i], len, segment);
+    }
+
+    int sent = send_datagrams(flow->listener->watcher.fd, send_msgs, valid);
+    if (sent < 0) {
+        char client[ADDRESS_BUFFER_SIZE];
+        if (!IS_TEMPORARY_SOCKERR(errno))
+            debug("Unable to send to %s: %s",
+                    display_sockaddr(&flow->client_addr, client, sizeof(client)),
+                    strerror(errno));
+        sent = 0;
+    }
+
+    for (int i = 0; i < sent; i++)
+        flow->client_tx_bytes += send_msgs[i].msg_len;
+
+    flow->last_activity = ev_now(loop);
+}
+
+/*
+ * Index the flow by the connection ID in the server's first long header
+ * packet, which the client uses as the destination of its short header
+ * packets. This allows following a client to a new address, until the
+ * client switches to a connection ID issued later in the encrypted
+ * handshake.
+ */
+static void
+learn_server_cid(struct UDPFlow *flow, const char *data, size_t len) {
+    const char *cid;
+
+    if (flow->server_cid_len > 0)
+        return;
+
+    size_t cid_len = quic_source_cid(data, len, &cid);
+    if (cid_len < UDP_CID_HASH_LEN || cid_len > sizeof(flow->server_cid))
+        return;
+
+    memcpy(flow->server_cid, cid, cid_len);
+    flow->server_cid_len = cid_len;
+
+    insert_flow_cid(flow);
+}
+
+static ev_tstamp
+flow_expiry(const struct UDPFlow *flow) {
+    return flow->last_activity + (flow->state == FLOW_CONNECTED ?
+            UDP_FLOW_IDLE_TIMEOUT : UDP_FLOW_UNCONNECTED_TIMEOUT);
+}
+
+/*
+ * Flows sit in the wheel slot of the second they would expire in, were they
+ * to see no more datagrams. Activity only updates last_activity, the flow is
+ * moved to a later slot when its current one comes round.
+ */
+static void
+wheel_insert(struct UDPFlow *flow) {
+    long tick = (long)flow_expiry(flow);
+
+    LIST_INSERT_HEAD(&wheel[tick % UDP_WHEEL_SLOTS], flow, entries);
+}
+
+static void
+wheel_cb(struct ev_loop *loop, struct ev_timer *w, int revents) {
+    ev_tstamp now = ev_now(loop);
+
+    if (!(revents & EV_TIMER))
+        return;
+
+    /* A slot is complete once its second has passed */
+    long last_tick = (long)now - 1;
+    if (last_tick - wheel_tick > UDP_WHEEL_SLOTS)
+        wheel_tick = last_tick - UDP_WHEEL_SLOTS;
+
+    while (wheel_tick < last_tick) {
+        struct UDPFlowList *slot = &wheel[++wheel_tick % UDP_WHEEL_SLOTS];
+        struct UDPFlowList due = LIST_HEAD_INITIALIZER(due);
+        struct UDPFlow *flow;
+
+        while ((flow = LIST_FIRST(slot)) != NULL) {
+            LIST_REMOVE(flow, entries);
+            LIST_INSERT_HEAD(&due, flow, entries);
+        }
+
+        while ((flow = LIST_FIRST(&due)) != NULL) {
+            if (flow_expiry(flow) <= now) {
+                close_flow(flow, loop);
+            } else {
+                LIST_REMOVE(flow, entries);
+                wheel_insert(flow);
+            }
+        }
+    }
+
+    if (flow_count == 0)
+        ev_timer_stop(loop, w);
+}
+
+static void
+close_flow(struct UDPFlow *flow, struct ev_loop *loop) {
+    if (flow->state == FLOW_CONNECTED)
+        count_flow(flow);
+    if (flow->state == FLOW_CONNECTED && flow->listener->access_log &&
+            logger_sample(flow->listener->access_log))
+        log_flow(flow);
+
+    remove_flow_address(flow);
+    remove_flow_cid(flow);
+    LIST_REMOVE(flow, entries);
+    flow_count--;
+    flow->listener->flows--;
+
+    if (flow->server_watcher.fd >= 0) {
+        ev_io_stop(loop, &flow->server_watcher);
+        close(flow->server_watcher.fd);
+    }
+
+    reject_flow(flow);
+    listener_ref_put(flow->listener);
+    metrics_ref_put(flow->backend_metrics);
+    free(flow);
+}
+
+/*
+ * Add a closed flow's traffic to its listener and backend metrics
+ */
+static void
+count_flow(const struct UDPFlow *flow) {
+    ev_tstamp duration = flow->last_activity - flow->established_timestamp;
+    struct Metrics *listener = flow->listener->metrics;
+    struct Metrics *backend = flow->backend_metrics;
+
+    metrics_count(listener, METRIC_BYTES_IN, flow->client_rx_bytes);
+    metrics_count(listener, METRIC_BYTES_OUT, flow->client_tx_bytes);
+    metrics_record(listener, METRIC_DURATION, duration);
+
+    metrics_count(backend, METRIC_BYTES_IN, flow->server_rx_bytes);
+    metrics_count(backend, METRIC_BYTES_OUT, flow->server_tx_bytes);
+    metrics_record(backend, METRIC_DURATION, duration);
+}
+
+static void
+log_flow(const struct UDPFlow *flow) {
+    ev_tstamp duration = flow->last_activity - flow->established_timestamp;
+    char client_address[ADDRESS_BUFFER_SIZE];
+    char listener_address[ADDRESS_BUFFER_SIZE];
+    char server_address[ADDRESS_BUFFER_SIZE];
+
+    if (logger_is_binary(flow->listener->access_log)) {
+        log_flow_record(flow, duration);
+        return;
+    }
+    display_sockaddr(&flow->client_addr, client_address, sizeof(client_address));
+    display_address(flow->listener->address, listener_address, sizeof(listener_address));
+    display_sockaddr(&flow->server_addr, server_address, sizeof(server_address));
+
+    log_msg(flow->listener->access_log,
+           LOG_NOTICE,
+           "%s -> %s -> %s [%.*s] %zu/%zu bytes tx %zu/%zu bytes rx %1.3f seconds",
+           client_address,
+           listener_address,
+           server_address,
+           (int)flow->hostname_len,
+           flow->hostname,
+           flow->server_tx_bytes,
+           flow->server_rx_bytes,
+           flow->client_tx_bytes,
+           flow->client_rx_bytes,
+           duration);
+}
+
+static void
+log_flow_record(const struct UDPFlow *flow, ev_tstamp duration) {
+    uint64_t buf[BINARY_LOG_RECORD_MAX / sizeof(uint64_t)];
+    struct BinaryLogRecord *record = (struct BinaryLogRecord *)buf;
+
+    record->established = binary_log_time(flow->established_timestamp);
+    record->duration = binary_log_time(duration);
+    record->server_tx_bytes = flow->server_tx_bytes;
+    record->server_rx_bytes = flow->server_rx_bytes;
+    record->client_tx_bytes = flow->client_tx_bytes;
+    record->client_rx_bytes = flow->client_rx_bytes;
+    binary_log_address(&record->client,
+            (const struct sockaddr *)&flow->client_addr);
+    binary_log_address(&record->listener,
+            address_sa(flow->listener->address));
+    binary_log_address(&record->server,
+            (const struct sockaddr *)&flow->server_addr);
+    /* flows are not timed by stage */
+    memset(record->stages, 0, sizeof(record->stages));
+
+    size_t len = finish_binary_log_record(record, BINARY_LOG_FLOW,
+            flow->hostname, flow->hostname_len);
+
+    log_record(flow->listener->access_log, LOG_NOTICE, record, len);
+}
+
+/*
+ * Receive up to count datagrams into the shared buffers, returning the
+ * number received or -1 with errno set
+ */
+static int
+receive_datagrams(int fd, struct mmsghdr *msgs, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        datagram_iovs[i].iov_base = datagram_buffers[i];
+        datagram_iovs[i].iov_len = sizeof(datagram_buffers[i]);
+        msgs[i].msg_hdr = (struct msghdr){
+            .msg_name = &datagram_addrs[i],
+            .msg_namelen = sizeof(datagram_addrs[i]),
+            .msg_iov = &datagram_iovs[i],
+            .msg_iovlen = 1,
+            .msg_control = datagram_controls[i].buf,
+            .msg_controllen = sizeof(datagram_controls[i].buf),
+        };
+        msgs[i].msg_len = 0;
+    }
+
+#ifdef HAVE_RECVMMSG
+    return recvmmsg(fd, msgs, count, MSG_DONTWAIT, NULL);
+#else
+    unsigned int received = 0;
+    while (received < count) {
+        ssize_t len = recvmsg(fd, &msgs[received].msg_hdr, MSG_DONTWAIT);
+        if (len < 0)
+            return received > 0 ? (int)received : -1;
+        msgs[received++].msg_len = (unsigned int)len;
+    }
+    return (int)received;
+#endif
+}
+
+/*
+ * Size of each datagram in a received buffer, which holds several if the
+ * kernel coalesced them
+ */
+static size_t
+segment_size(const struct msghdr *msg, size_t len) {
+#ifdef UDP_GRO
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR((struct msghdr *)msg);
+            cmsg != NULL;
+            cmsg = CMSG_NXTHDR((struct msghdr *)msg, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int segment;
+            memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+            if (segment > 0 && (size_t)segment < len)
+                return (size_t)segment;
+        }
+    }
+#else
+    (void)msg;
+#endif
+
+    return len;
+}
+
+/*
+ * Fill in entry index of the send batch, asking the kernel to split the data
+ * into segment sized datagrams if it is shorter than len
+ */
+static void
+prepare_send(unsigned int index, void *name, socklen_t name_len, char *data,
+        size_t len, size_t segment) {
+    struct msghdr *msg = &send_msgs[index].msg_hdr;
+
+    send_iovs[index].iov_base = data;
+    send_iovs[index].iov_len = len;
+    *msg = (struct msghdr){
+        .msg_name = name,
+        .msg_namelen = name_len,
+        .msg_iov = &send_iovs[index],
+        .msg_iovlen = 1,
+    };
+    send_msgs[index].msg_len = 0;
+
+#ifdef UDP_SEGMENT
+    if (segment < len) {
+        uint16_t gso_size = (uint16_t)segment;
+
+        msg->msg_control = send_controls[index].buf;
+        msg->msg_controllen = CMSG_SPACE(sizeof(gso_size));
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+        cmsg->cmsg_level = IPPROTO_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+        memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    }
+#else
+    (void)segment;
+#endif
+}
+
+/* Returns the number of datagrams sent or -1 with errno set */
+static int
+send_datagrams(int fd, struct mmsghdr *msgs, unsigned int count) {
+    if (count == 0)
+        return 0;
+
+    if (gso_failed)
+        return send_segments(fd, msgs, count);
+
+#ifdef HAVE_SENDMMSG
+    int sent = sendmmsg(fd, msgs, count, MSG_DONTWAIT);
+#else
+    int sent = 0;
+    while ((unsigned int)sent < count) {
+        ssize_t len = sendmsg(fd, &msgs[sent].msg_hdr, MSG_DONTWAIT);
+        if (len < 0) {
+            if (sent == 0)
+                sent = -1;
+            break;
+        }
+        msgs[sent++].msg_len = (unsigned int)len;
+    }
+#endif
+
+    if (sent < 0 && (errno == EIO || errno == EINVAL) &&
+            msgs[0].msg_hdr.msg_controllen > 0) {
+        /* The output device can not take segmentation offload */
+        info("UDP segmentation offload failed: %s, disabling",
+                strerror(errno));
+        gso_failed = 1;
+        return send_segments(fd, msgs, count);
+    }
+
+    return sent;
+}
+
+/* Send coalesced datagrams one at a time */
+static int
+send_segments(int fd, struct mmsghdr *msgs, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        struct msghdr msg = msgs[i].msg_hdr;
+        const struct iovec *iov = msg.msg_iov;
+        size_t segment = iov->iov_len;
+
+#ifdef UDP_SEGMENT
+        if (msg.msg_controllen > 0) {
+            uint16_t gso_size;
+            memcpy(&gso_size, CMSG_DATA(CMSG_FIRSTHDR(&msg)), sizeof(gso_size));
+            segment = gso_size;
+        }
+#endif
+
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        msgs[i].msg_len = 0;
+
+        for (size_t pos = 0; pos < iov->iov_len; pos += segment) {
+            struct iovec part = {
+                .iov_base = (char *)iov->iov_base + pos,
+                .iov_len = MIN(segment, iov->iov_len - pos),
+            };
+            msg.msg_iov = &part;
+
+            ssize_t len = sendmsg(fd, &msg, MSG_DONTWAIT);
+            if (len < 0)
+                return i > 0 ? (int)i : -1;
+            msgs[i].msg_len += (unsigned int)len;
+        }
+    }
+
+    return (int)count;
+}
+/* FNV-1a */
+static uint32_t
+hash_bytes(uint32_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static unsigned int
+address_bucket(const struct Listener *listener, const struct sockaddr_storage *addr) {
+    uint32_t hash = hash_bytes(hash_seed ^ 2166136261u,
+            &listener, sizeof(listener));
+
+    switch (addr->ss_family) {
+        case AF_INET: {
+            const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+            hash = hash_bytes(hash, &sin->sin_port, sizeof(sin->sin_port));
+            hash = hash_bytes(hash, &sin->sin_addr, sizeof(sin->sin_addr));
+            break;
+        }
+        case AF_INET6: {
+            const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+            hash = hash_bytes(hash, &sin6->sin6_port, sizeof(sin6->sin6_port));
+            hash = hash_bytes(hash, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+            break;
+        }
+    }
+
+    return hash % flow_buckets;
+}
+
+static unsigned int
+cid_bucket(const struct Listener *listener, const char *cid) {
+    uint32_t hash = hash_bytes(hash_seed ^ 2166136261u,
+            &listener, sizeof(listener));
+
+    return hash_bytes(hash, cid, UDP_CID_HASH_LEN) % flow_buckets;
+}
+
+static int
+same_client(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+    if (a->ss_family != b->ss_family)
+        return 0;
+
+    switch (a->ss_family) {
+        case AF_INET: {
+            const struct sockaddr_in *a_in = (const struct sockaddr_in *)a;
+            const struct sockaddr_in *b_in = (const struct sockaddr_in *)b;
+            return a_in->sin_port == b_in->sin_port &&
+                a_in->sin_addr.s_addr == b_in->sin_addr.s_addr;
+        }
+        case AF_INET6: {
+            const struct sockaddr_in6 *a_in6 = (const struct sockaddr_in6 *)a;
+            const struct sockaddr_in6 *b_in6 = (const struct sockaddr_in6 *)b;
+            return a_in6->sin6_port == b_in6->sin6_port &&
+                memcmp(&a_in6->sin6_addr, &b_in6->sin6_addr,
+                        sizeof(a_in6->sin6_addr)) == 0;
+        }
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Double the buckets of both flow tables and rehash every flow, keeping
+ * chains short as flows are added. On failure the tables are kept as they
+ * are, only with longer chains.
+ */
+static void
+grow_flow_tables(void) {
+    size_t old_buckets = flow_buckets;
+    struct UDPFlow **old_by_address = flows_by_address;
+    struct UDPFlow **old_by_cid = flows_by_cid;
+    struct UDPFlow **by_address = calloc(2 * old_buckets, sizeof(struct UDPFlow *));
+    struct UDPFlow **by_cid = calloc(2 * old_buckets, sizeof(struct UDPFlow *));
+
+    if (by_address == NULL || by_cid == NULL) {
+        warn("Unable to grow UDP flow tables to %zu buckets", 2 * old_buckets);
+        free(by_address);
+        free(by_cid);
+        return;
+    }
+
+    flow_buckets = 2 * old_buckets;
+    flows_by_address = by_address;
+    flows_by_cid = by_cid;
+
+    for (size_t i = 0; i < old_buckets; i++) {
+        struct UDPFlow *flow, *next;
+
+        for (flow = old_by_address[i]; flow != NULL; flow = next) {
+            next = flow->address_next;
+            insert_flow_address(flow);
+        }
+        for (flow = old_by_cid[i]; flow != NULL; flow = next) {
+            next = flow->cid_next;
+            insert_flow_cid(flow);
+        }
+    }
+
+    free(old_by_address);
+    free(old_by_cid);
+}
+
+static void
+insert_flow_address(struct UDPFlow *flow) {
+    unsigned int bucket = address_bucket(flow->listener, &flow->client_addr);
+
+    flow->address_next = flows_by_address[bucket];
+    flows_by_address[bucket] = flow;
+}
+
+static void
+remove_flow_address(struct UDPFlow *flow) {
+    struct UDPFlow **iter =
+        &flows_by_address[address_bucket(flow->listener, &flow->client_addr)];
+
+    while (*iter != NULL && *iter != flow)
+        iter = &(*iter)->address_next;
+
+    if (*iter == flow)
+        *iter = flow->address_next;
+    flow->address_next = NULL;
+}
+
+static void
+insert_flow_cid(struct UDPFlow *flow) {
+    unsigned int bucket = cid_bucket(flow->listener, flow->server_cid);
+
+    flow->cid_next = flows_by_cid[bucket];
+    flows_by_cid[bucket] = flow;
+}
+
+static void
+remove_flow_cid(struct UDPFlow *flow) {
+    if (flow->server_cid_len == 0)
+        return;
+
+    struct UDPFlow **iter =
+        &flows_by_cid[cid_bucket(flow->listener, flow->server_cid)];
+
+    while (*iter != NULL && *iter != flow)
+        iter = &(*iter)->cid_next;
+
+    if (*iter == flow)
+        *iter = flow->cid_next;
+    flow->cid_next = NULL;
+}
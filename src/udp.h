@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2026, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef UDP_H
+#define UDP_H
+
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <ev.h>
+#include "listener.h"
+#include "protocol.h"
+
+#define UDP_MAX_CID_LEN 20
+
+struct UDPDatagram {
+    size_t len;
+    STAILQ_ENTRY(UDPDatagram) entries;
+    char data[];
+};
+
+/*
+ * A client address on a datagram listener and the connected socket its
+ * datagrams are forwarded through
+ */
+struct UDPFlow {
+    enum UDPFlowState {
+        FLOW_PARSING,       /* Collecting datagrams until the request parses */
+        FLOW_CONNECTED,     /* Forwarding to and from the server */
+        FLOW_REJECTED,      /* Dropping datagrams until the flow expires */
+    } state;
+
+    struct Listener *listener;
+    struct Metrics *backend_metrics;
+    struct sockaddr_storage client_addr, server_addr;
+    socklen_t client_addr_len, server_addr_len;
+    struct ev_io server_watcher;
+    const char *hostname;   /* Requested hostname, NULL or hostname_buf */
+    size_t hostname_len;
+    char hostname_buf[256];
+    char alpn[ALPN_LIST_LEN];
+    size_t alpn_len;
+    void *parser;           /* incremental request parser, while incomplete */
+    const struct Protocol *parser_protocol;
+    STAILQ_HEAD(, UDPDatagram) pending; /* held while parsing */
+    size_t pending_len;
+    char server_cid[UDP_MAX_CID_LEN];  /* connection ID chosen by the server */
+    size_t server_cid_len;
+    ev_tstamp established_timestamp;
+    ev_tstamp last_activity;
+    size_t client_rx_bytes, client_tx_bytes;
+    size_t server_rx_bytes, server_tx_bytes;
+
+    struct UDPFlow *address_next, *cid_next; /* hash chains */
+    LIST_ENTRY(UDPFlow) entries;    /* expiry timer wheel slot */
+};
+
+extern const struct Protocol *const udp_protocol;
+
+void init_udp_flows(struct ev_loop *);
+int accept_udp_datagrams(struct Listener *, struct ev_loop *);
+void udp_enable_gro(int);
+void udp_flows_shutdown(struct ev_loop *);
+size_t udp_flows_active(void);
+
+#endif
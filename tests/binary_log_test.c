@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "binary_log.h"
+
+
+static void test_address();
+static void test_record();
+static void test_invalid();
+static void test_stages();
+
+
+int main() {
+    test_address();
+    test_record();
+    test_invalid();
+    test_stages();
+
+    return 0;
+}
+
+static void
+test_address() {
+    struct sockaddr_storage sa = { .ss_family = AF_INET6 }, result;
+    struct BinaryLogAddress address;
+
+    inet_pton(AF_INET6, "2001:db8::1", &((struct sockaddr_in6 *)&sa)->sin6_addr);
+    ((struct sockaddr_in6 *)&sa)->sin6_port = htons(443);
+
+    binary_log_address(&address, (struct sockaddr *)&sa);
+    assert(address.family == BINARY_LOG_AF_INET6);
+    binary_log_sockaddr(&result, &address);
+    assert(memcmp(&result, &sa, sizeof(struct sockaddr_in6)) == 0);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.ss_family = AF_INET;
+    inet_pton(AF_INET, "192.0.2.1", &((struct sockaddr_in *)&sa)->sin_addr);
+    ((struct sockaddr_in *)&sa)->sin_port = htons(56324);
+
+    binary_log_address(&address, (struct sockaddr *)&sa);
+    assert(address.family == BINARY_LOG_AF_INET);
+    assert(address.port == htons(56324));
+    binary_log_sockaddr(&result, &address);
+    assert(memcmp(&result, &sa, sizeof(struct sockaddr_in)) == 0);
+
+    binary_log_address(&address, NULL);
+    assert(address.family == BINARY_LOG_AF_UNSPEC);
+}
+
+static void
+test_record() {
+    uint64_t buf[2 * BINARY_LOG_RECORD_MAX / sizeof(uint64_t)];
+    struct BinaryLogRecord *record = (struct BinaryLogRecord *)buf;
+
+    memset(buf, 0xff, sizeof(buf));
+    record->established = binary_log_time(1700000000.25);
+    record->duration = binary_log_time(1.5);
+    record->server_tx_bytes = 1;
+    record->server_rx_bytes = 2;
+    record->client_tx_bytes = 3;
+    record->client_rx_bytes = 4;
+    binary_log_address(&record->client, NULL);
+    binary_log_address(&record->listener, NULL);
+    binary_log_address(&record->server, NULL);
+
+    size_t len = finish_binary_log_record(record, BINARY_LOG_CONNECTION,
+            "example.com", 11);
+    assert(len == sizeof(struct BinaryLogRecord) + 16);
+    assert(record->len == len);
+    assert(record->established == 1700000000250000);
+    assert(record->duration == 1500000);
+    assert(memcmp(record->hostname, "example.com\0\0\0\0\0", 16) == 0);
+
+    /* a second record without a hostname follows */
+    struct BinaryLogRecord *second = (struct BinaryLogRecord *)((char *)buf + len);
+    size_t second_len = finish_binary_log_record(second, BINARY_LOG_FLOW, NULL, 0);
+    assert(second_len == sizeof(struct BinaryLogRecord));
+
+    size_t offset = 0;
+    assert(next_binary_log_record(buf, len + second_len, &offset) == record);
+    assert(offset == len);
+    assert(next_binary_log_record(buf, len + second_len, &offset) == second);
+    assert(second->type == BINARY_LOG_FLOW && second->hostname_len == 0);
+    assert(next_binary_log_record(buf, len + second_len, &offset) == NULL);
+    assert(offset == len + second_len);
+
+    assert(check_binary_log_file_header(&binary_log_file_header,
+                sizeof(binary_log_file_header)));
+}
+
+static void
+test_invalid() {
+    uint64_t buf[BINARY_LOG_RECORD_MAX / sizeof(uint64_t)];
+    struct BinaryLogRecord *record = (struct BinaryLogRecord *)buf;
+    size_t offset;
+
+    size_t len = finish_binary_log_record(record, BINARY_LOG_CONNECTION,
+            "example.com", 11);
+
+    /* truncated */
+    offset = 0;
+    assert(next_binary_log_record(buf, len - 8, &offset) == NULL);
+    assert(offset == 0);
+
+    /* length not a multiple of 8 */
+    record->len = (uint32_t)len - 1;
+    assert(next_binary_log_record(buf, len, &offset) == NULL);
+
+    /* hostname past the end of the record */
+    record->len = (uint32_t)len;
+    record->hostname_len = 17;
+    assert(next_binary_log_record(buf, len, &offset) == NULL);
+
+    struct BinaryLogFileHeader header = binary_log_file_header;
+    header.byte_order = 0x04030201;
+    assert(!check_binary_log_file_header(&header, sizeof(header)));
+    assert(!check_binary_log_file_header(&binary_log_file_header, 8));
+}
+
+static void
+test_stages() {
+    uint32_t stages[BINARY_LOG_STAGES] = { 12, 0, 1600, 2600, 2700, 1234567 };
+    char buffer[256];
+
+    size_t len = format_binary_log_stages(buffer, sizeof(buffer), stages);
+    assert(strcmp(buffer, " parsed 0.000 resolving - resolved 0.002"
+                " connected 0.003 first_byte_up 0.003"
+                " first_byte_down 1.235") == 0);
+    assert(len == strlen(buffer));
+
+    /* truncated to fit */
+    len = format_binary_log_stages(buffer, 10, stages);
+    assert(len == 9);
+    assert(strcmp(buffer, " parsed 0") == 0);
+}
@@ -1,8 +1,10 @@
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <ev.h>
 #include "buffer.h"
 
@@ -168,6 +170,69 @@ static void test_buffer_coalesce() {
     assert(len == 0);
 }
 
+static void test_buffer_unshift() {
+    struct Buffer *buffer;
+    char header[] = "HEADER ";
+    char input[] = "payload";
+    char output[64];
+    size_t len;
+
+    buffer = new_buffer(16, EV_DEFAULT);
+    assert(buffer != NULL);
+
+    /* head at the start of the buffer, so the header wraps around */
+    len = buffer_push(buffer, input, sizeof(input) - 1);
+    assert(len == sizeof(input) - 1);
+    assert(buffer->head == 0);
+
+    len = buffer_unshift(buffer, header, sizeof(header) - 1);
+    assert(len == sizeof(header) - 1);
+    assert(buffer_len(buffer) == 14);
+
+    len = buffer_peek(buffer, output, sizeof(output));
+    assert(len == 14);
+    assert(memcmp(output, "HEADER payload", 14) == 0);
+
+    /* insufficient room */
+    len = buffer_unshift(buffer, header, sizeof(header) - 1);
+    assert(len == 0);
+    assert(buffer_len(buffer) == 14);
+
+    free_buffer(buffer);
+}
+
+static void test_buffer_pop_after_splice() {
+    struct Buffer *buffer;
+    char input[] = "HDRAAAABBBB";
+    char output[64];
+    int fds[2];
+    ssize_t len;
+
+    buffer = new_buffer(64, EV_DEFAULT);
+    assert(buffer != NULL);
+    assert(pipe(fds) == 0);
+
+    len = buffer_push(buffer, input, sizeof(input) - 1);
+    assert(len == sizeof(input) - 1);
+    assert(buffer_splice(buffer, 7, "|", 1));
+
+    /* dropping a header in front keeps the splice after the As */
+    len = buffer_pop(buffer, NULL, 3);
+    assert(len == 3);
+
+    len = buffer_write(buffer, fds[1]);
+    assert(len == 9);
+    assert(buffer_len(buffer) == 0);
+
+    len = read(fds[0], output, sizeof(output));
+    assert(len == 9);
+    assert(memcmp(output, "AAAA|BBBB", 9) == 0);
+
+    close(fds[0]);
+    close(fds[1]);
+    free_buffer(buffer);
+}
+
 int main() {
     test1();
 
@@ -178,4 +243,8 @@ int main() {
     test4();
 
     test_buffer_coalesce();
+
+    test_buffer_unshift();
+
+    test_buffer_pop_after_splice();
 }
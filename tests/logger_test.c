@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <ev.h>
+#include "logger.h"
+
+
+static void test_async_block();
+static void test_async_drop();
+static void test_async_reopen();
+static void test_async_syslog();
+static void test_buffered();
+static void test_buffered_reopen();
+static void test_timestamp();
+static void test_binary();
+static void test_ratelimit();
+static void test_sample();
+static size_t read_file(const char *, char *, size_t);
+static size_t count_lines(const char *, const char *);
+
+
+int main() {
+    test_async_block();
+    test_async_drop();
+    test_async_reopen();
+    test_async_syslog();
+    test_buffered();
+    test_buffered_reopen();
+    test_timestamp();
+    test_binary();
+    test_ratelimit();
+    test_sample();
+
+    return 0;
+}
+
+static void
+test_async_block() {
+    char filename[] = "/tmp/sniproxy-logger-test-XXXXXX";
+    int fd = mkstemp(filename);
+    assert(fd >= 0);
+    close(fd);
+
+    struct Logger *logger = logger_ref_get(new_file_logger(filename));
+    assert(logger != NULL);
+    assert(set_logger_async(logger, LOG_ASYNC_BLOCK));
+
+    for (int i = 0; i < 20000; i++)
+        log_msg(logger, LOG_NOTICE, "line %d", i);
+
+    /* freeing the logger waits for the writer */
+    logger_ref_put(logger);
+
+    FILE *file = fopen(filename, "r");
+    assert(file != NULL);
+    char line[1024];
+    int i = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char expected[32];
+        snprintf(expected, sizeof(expected), " line %d\n", i);
+        assert(strlen(line) > strlen(expected));
+        assert(strcmp(line + strlen(line) - strlen(expected), expected) == 0);
+        i++;
+    }
+    assert(i == 20000);
+    fclose(file);
+
+    unlink(filename);
+}
+
+static void
+test_async_drop() {
+    char filename[] = "/tmp/sniproxy-logger-test-XXXXXX";
+    int fd = mkstemp(filename);
+    assert(fd >= 0);
+    close(fd);
+
+    struct Logger *logger = logger_ref_get(new_file_logger(filename));
+    assert(logger != NULL);
+    assert(set_logger_async(logger, LOG_ASYNC_DROP));
+
+    for (int i = 0; i < 100000; i++)
+        log_msg(logger, LOG_NOTICE, "line %d", i);
+    log_msg(logger, LOG_NOTICE, "last");
+
+    logger_ref_put(logger);
+
+    /* every line which was written is complete */
+    size_t lines = count_lines(filename, NULL);
+    size_t complete = count_lines(filename, " line ") +
+        count_lines(filename, " Log writer fell behind, dropped ") +
+        count_lines(filename, " last\n");
+    assert(lines > 0 && lines == complete);
+
+    unlink(filename);
+}
+
+static void
+test_async_reopen() {
+    char filename[] = "/tmp/sniproxy-logger-test-XXXXXX";
+    char rotated[sizeof(filename) + 2];
+    int fd = mkstemp(filename);
+    assert(fd >= 0);
+    close(fd);
+    snprintf(rotated, sizeof(rotated), "%s.1", filename);
+
+    struct Logger *logger = logger_ref_get(new_file_logger(filename));
+    assert(logger != NULL);
+    assert(set_logger_async(logger, LOG_ASYNC_BLOCK));
+
+    for (int i = 0; i < 1000; i++)
+        log_msg(logger, LOG_NOTICE, "before rotation");
+
+    assert(rename(filename, rotated) == 0);
+    reopen_loggers();
+
+    for (int i = 0; i < 1000; i++)
+        log_msg(logger, LOG_NOTICE, "after rotation");
+
+    logger_ref_put(logger);
+
+    assert(count_lines(rotated, NULL) == 1000);
+    assert(count_lines(rotated, "before rotation") == 1000);
+    assert(count_lines(filename, NULL) == 1000);
+    assert(count_lines(filename, "after rotation") == 1000);
+
+    unlink(filename);
+    unlink(rotated);
+}
+
+static void
+test_async_syslog() {
+    struct Logger *logger = logger_ref_get(new_syslog_logger("daemon"));
+    assert(logger != NULL);
+
+    assert(!set_logger_async(logger, LOG_ASYNC_DROP));
+    assert(set_logger_async(logger, LOG_ASYNC_OFF));
+
+    logger_ref_put(logger);
+}
+
+static void
+test_buffered() {
+    struct ev_loop *loop = EV_DEFAULT;
+    char filename[] = "/tmp/sniproxy-logger-test-XXXXXX";
+    int fd = mkstemp(filename);
+    assert(fd >= 0);
+    close(fd);
+
+    struct Logger *logger = logger_ref_get(new_file_logger(filename));
+    assert(logger != NULL);
+    assert(set_logger_buffer(logger, 4096, 0.05));
+    init_loggers(loop);
+
+    for (int i = 0; i < 10; i++)
+        log_msg(logger, LOG_NOTICE, "line %d", i);
+    assert(count_lines(filename, NULL) == 0);
+
+    /* the flush timer is the only watcher */
+    ev_run(loop, EVRUN_ONCE);
+    assert(count_lines(filename, NULL) == 10);
+
+    /* a full buffer is written without waiting for the timer */
+    for (int i = 10; i < 1000; i++)
+        log_msg(logger, LOG_NOTICE, "line %d", i);
+    size_t lines = count_lines(filename, NULL);
+    assert(lines > 10 && lines < 1000);
+
+    /* lines already buffered are written when buffering is turned off */
+    assert(set_logger_buffer(logger, 0, 0.0));
+    assert(count_lines(filename, NULL) == 1000);
+    log_msg(logger, LOG_NOTICE, "line %d", 1000);
+    assert(count_lines(filename, NULL) == 1001);
+
+    loggers_shutdown(loop);
+    logger_ref_put(logger);
+
+    unlink(filename);
+}
+
+static void
+test_buffered_reopen() {
+    struct ev_loop *loop = EV_DEFAULT;
+    char filename[] = "/tmp/sniproxy-logger-test-XXXXXX";
+    char rotated[sizeof(filename) + 2];
+    int fd = mkstemp(filename);
+    assert(fd >= 0);
+    close(fd);
+    snprintf(rotated, sizeof(rotated), "%s.1", filename);
+
+    struct Logger *logger = logger_ref_get(new_file_logger(filename));
+    assert(logger != NULL);
+    init_loggers(loop);
+    assert(set_logger_buffer(logger, 65536, 60.0));
+
+    for (int i = 0; i < 100; i++)
+        log_msg(logger, LOG_NOTICE, "before rotation");
+
+    assert(rename(filename, rotated) == 0);
+    reopen_loggers();
+    assert(count_lines(rotated, "before rotation") == 100);
+
+    for (int i = 0; i < 100; i++)
+        log_msg(logger, LOG_NOTICE, "after rotation");
+    assert(count_lines(filename, NULL) == 0);
+
+    /* and on shutdown */
+    loggers_shutdown(loop);
+    assert(count_lines(filename, "after rotation") == 100);
+
+    log_msg(logger, LOG_NOTICE, "after shutdown");
+    logger_ref_put(logger);
+    assert(count_lines(filename, NULL) == 101);
+    assert(count_lines(rotated, NULL) == 100);
+
+    unlink(filename);
+    unlink(rotated);
+}
+
+/*
+ * Lines logged over a few seconds carry the time they were logged, whether
+ * the cached timestamp is reformatted or only its seconds are updated
+ */
+static void
+test_timestamp() {
+    char filename[] = "/tmp/sniproxy-logger-test-XXXXXX";
+    char expected[10][32];
+    int fd = mkstemp(filename);
+    assert(fd >= 0);
+    close(fd);
+
+    struct Logger *logger = logger_ref_get(new_file_logger(filename));
+    assert(logger != NULL);
+
+    for (int i = 0; i < 10; i++) {
+        time_t now = time(NULL);
+#ifdef RFC3339_TIMESTAMP
+        strftime(expected[i], sizeof(expected[i]), "%FT%TZ ", gmtime(&now));
+#else
+        strftime(expected[i], sizeof(expected[i]), "%F %T ", localtime(&now));
+#endif
+        log_msg(logger, LOG_NOTICE, "line %d", i);
+        if (time(NULL) != now)
+            expected[i][0] = '\0'; /* raced with the next second */
+
+        usleep(300 * 1000);
+    }
+
+    logger_ref_put(logger);
+
+    FILE *file = fopen(filename, "r");
+    assert(file != NULL);
+    char line[1024];
+    for (int i = 0; i < 10; i++) {
+        assert(fgets(line, sizeof(line), file) != NULL);
+        if (expected[i][0] != '\0')
+            assert(strncmp(line, expected[i], strlen(expected[i])) == 0);
+    }
+    fclose(file);
+
+    unlink(filename);
+}
+
+/*
+ * Binary logs start each file with their header, and ignore text lines
+ */
+static void
+test_binary() {
+    char filename[] = "/tmp/sniproxy-logger-test-XXXXXX";
+    char rotated[sizeof(filename) + 2];
+    char contents[64];
+    int fd = mkstemp(filename);
+    assert(fd >= 0);
+    close(fd);
+    snprintf(rotated, sizeof(rotated), "%s.1", filename);
+
+    struct Logger *logger = logger_ref_get(new_file_logger(filename));
+    assert(logger != NULL);
+    assert(!logger_is_binary(logger));
+    assert(set_logger_binary(logger, "HEAD", 4));
+    assert(logger_is_binary(logger));
+
+    log_msg(logger, LOG_NOTICE, "text");
+    log_record(logger, LOG_NOTICE, "one\0", 4);
+    log_record(logger, LOG_DEBUG + 1, "two\0", 4);
+    assert(read_file(filename, contents, sizeof(contents)) == 8);
+    assert(memcmp(contents, "HEADone\0", 8) == 0);
+
+    /* buffered, then written to a new file on reopen */
+    assert(set_logger_buffer(logger, 4096, 60.0));
+    log_record(logger, LOG_NOTICE, "thr\0", 4);
+    assert(rename(filename, rotated) == 0);
+    reopen_loggers();
+    log_record(logger, LOG_NOTICE, "fou\0", 4);
+    logger_ref_put(logger);
+
+    assert(read_file(rotated, contents, sizeof(contents)) == 12);
+    assert(memcmp(contents, "HEADone\0thr\0", 12) == 0);
+    assert(read_file(filename, contents, sizeof(contents)) == 8);
+    assert(memcmp(contents, "HEADfou\0", 8) == 0);
+
+    /* only log files can be binary */
+    logger = logger_ref_get(new_syslog_logger("daemon"));
+    assert(!set_logger_binary(logger, "HEAD", 4));
+    logger_ref_put(logger);
+
+    unlink(filename);
+    unlink(rotated);
+}
+
+/*
+ * A rate limited call site logs a burst, then its suppressed message count
+ */
+static void
+test_ratelimit() {
+    char filename[] = "/tmp/sniproxy-logger-test-XXXXXX";
+    struct ev_loop *loop = ev_default_loop(EVFLAG_AUTO);
+    int evaluated = 0;
+    int fd = mkstemp(filename);
+    assert(fd >= 0);
+    close(fd);
+
+    struct Logger *logger = new_file_logger(filename);
+    assert(logger != NULL);
+    set_default_logger(logger);
+    init_loggers(loop);
+
+    for (int i = 0; i < LOG_RATELIMIT_BURST + 15; i++) {
+        warn_ratelimited("limited %d", evaluated++);
+        notice_ratelimited("other site");
+    }
+    /* below the logger's priority, neither logged nor counted */
+    set_logger_priority(logger, LOG_WARNING);
+    info_ratelimited("filtered");
+    set_logger_priority(logger, LOG_DEBUG);
+
+    assert(evaluated == LOG_RATELIMIT_BURST);
+    assert(count_lines(filename, "limited") == LOG_RATELIMIT_BURST);
+    assert(count_lines(filename, "other site") == LOG_RATELIMIT_BURST);
+    assert(count_lines(filename, "suppressed") == 0);
+
+    loggers_shutdown(loop);
+    assert(count_lines(filename, "15 messages like \"limited %d\" suppressed") == 1);
+    assert(count_lines(filename, "15 messages like \"other site\" suppressed") == 1);
+    assert(count_lines(filename, "filtered") == 0);
+
+    unlink(filename);
+}
+
+/*
+ * Sampling draws roughly the configured fraction of entries
+ */
+static void
+test_sample() {
+    struct Logger *logger = logger_ref_get(new_syslog_logger("daemon"));
+    assert(logger != NULL);
+
+    int sampled = 0;
+    for (int i = 0; i < 100000; i++)
+        sampled += logger_sample(logger);
+    assert(sampled == 100000);
+
+    assert(set_logger_sample(logger, 0.25));
+    sampled = 0;
+    for (int i = 0; i < 100000; i++)
+        sampled += logger_sample(logger);
+    assert(sampled > 23000 && sampled < 27000);
+
+    assert(!set_logger_sample(logger, 0.0));
+    assert(!set_logger_sample(logger, 1.5));
+
+    logger_ref_put(logger);
+}
+
+static size_t
+read_file(const char *filename, char *buffer, size_t len) {
+    FILE *file = fopen(filename, "r");
+    assert(file != NULL);
+
+    size_t result = fread(buffer, 1, len, file);
+    fclose(file);
+
+    return result;
+}
+
+/*
+ * Count the lines of a file, or those containing substring
+ */
+static size_t
+count_lines(const char *filename, const char *substring) {
+    FILE *file = fopen(filename, "r");
+    assert(file != NULL);
+
+    char line[2048];
+    size_t count = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+        if (substring == NULL || strstr(line, substring) != NULL)
+            count++;
+
+    fclose(file);
+
+    return count;
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include "maglev.h"
+
+#define KEYS 1000000
+
+
+static void test_distribution();
+static void test_remap_on_removal();
+static void benchmark_lookup();
+static size_t key_member(const struct Maglev *, uint32_t);
+
+
+int main() {
+    test_distribution();
+    test_remap_on_removal();
+    benchmark_lookup();
+
+    return 0;
+}
+
+static size_t
+key_member(const struct Maglev *maglev, uint32_t key) {
+    return maglev_lookup(maglev, maglev_hash(&key, sizeof(key), 0));
+}
+
+static void
+test_distribution() {
+    const char *names[] = {
+        "192.0.2.10:443", "192.0.2.11:443", "192.0.2.12:443",
+        "192.0.2.13:443", "192.0.2.14:443", "192.0.2.15:443",
+        "192.0.2.16:443",
+    };
+    const size_t names_len = sizeof(names) / sizeof(names[0]);
+    size_t slots[sizeof(names) / sizeof(names[0])] = { 0 };
+    size_t keys[sizeof(names) / sizeof(names[0])] = { 0 };
+
+    struct Maglev *maglev = new_maglev(names, names_len);
+    assert(maglev != NULL);
+    assert(maglev->members_len == names_len);
+
+    for (size_t i = 0; i < MAGLEV_TABLE_SIZE; i++) {
+        assert(maglev->lookup[i] < names_len);
+        slots[maglev->lookup[i]]++;
+    }
+
+    for (uint32_t key = 0; key < KEYS; key++)
+        keys[key_member(maglev, key)]++;
+
+    /* Maglev fills the table round robin, so slot counts differ by at most
+     * one, and hashed keys should land within a few percent of the ideal */
+    for (size_t i = 0; i < names_len; i++) {
+        double slot_share = (double)slots[i] * names_len / MAGLEV_TABLE_SIZE;
+        double key_share = (double)keys[i] * names_len / KEYS;
+
+        printf("member %zu: %zu slots (%.4f), %zu keys (%.4f)\n",
+                i, slots[i], slot_share, keys[i], key_share);
+
+        assert(slots[i] >= MAGLEV_TABLE_SIZE / names_len);
+        assert(slots[i] <= MAGLEV_TABLE_SIZE / names_len + 1);
+        assert(key_share > 0.97 && key_share < 1.03);
+    }
+
+    /* Same names produce the same table */
+    struct Maglev *rebuilt = new_maglev(names, names_len);
+    assert(rebuilt != NULL);
+    assert(memcmp(maglev->lookup, rebuilt->lookup, sizeof(maglev->lookup)) == 0);
+
+    free_maglev(rebuilt);
+    free_maglev(maglev);
+}
+
+static void
+test_remap_on_removal() {
+    const char *before[] = {
+        "10.0.0.1:443", "10.0.0.2:443", "10.0.0.3:443", "10.0.0.4:443",
+        "10.0.0.5:443", "10.0.0.6:443", "10.0.0.7:443", "10.0.0.8:443",
+    };
+    /* 10.0.0.4 removed */
+    const char *after[] = {
+        "10.0.0.1:443", "10.0.0.2:443", "10.0.0.3:443",
+        "10.0.0.5:443", "10.0.0.6:443", "10.0.0.7:443", "10.0.0.8:443",
+    };
+    const size_t before_len = sizeof(before) / sizeof(before[0]);
+    const size_t after_len = sizeof(after) / sizeof(after[0]);
+    size_t moved = 0;
+
+    struct Maglev *old_table = new_maglev(before, before_len);
+    struct Maglev *new_table = new_maglev(after, after_len);
+    assert(old_table != NULL);
+    assert(new_table != NULL);
+
+    for (uint32_t key = 0; key < KEYS; key++) {
+        const char *old_name = before[key_member(old_table, key)];
+        const char *new_name = after[key_member(new_table, key)];
+
+        if (strcmp(old_name, new_name) != 0)
+            moved++;
+    }
+
+    /* Ideally exactly the removed member's 1/8 share moves, Maglev trades a
+     * little extra disruption for even balance */
+    double moved_share = (double)moved / KEYS;
+    printf("removing 1 of %zu members remapped %.4f of keys\n",
+            before_len, moved_share);
+    assert(moved_share >= 1.0 / before_len - 0.01);
+    assert(moved_share < 1.0 / before_len + 0.05);
+
+    free_maglev(old_table);
+    free_maglev(new_table);
+}
+
+static void
+benchmark_lookup() {
+    const char *names[] = {
+        "192.0.2.10:443", "192.0.2.11:443", "192.0.2.12:443",
+        "192.0.2.13:443",
+    };
+    struct timespec start, end;
+    size_t sum = 0;
+
+    struct Maglev *maglev = new_maglev(names, sizeof(names) / sizeof(names[0]));
+    assert(maglev != NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t key = 0; key < 10 * KEYS; key++)
+        sum += key_member(maglev, key);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (double)(end.tv_sec - start.tv_sec) +
+        (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d hash+lookups in %.3f seconds, %.1f ns each (checksum %zu)\n",
+            10 * KEYS, elapsed, elapsed * 1e9 / (10 * KEYS), sum);
+
+    free_maglev(maglev);
+}
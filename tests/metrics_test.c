@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "metrics.h"
+
+
+static void test_buckets();
+static void test_percentile();
+static void test_obtain();
+static void test_print();
+
+
+int main() {
+    test_buckets();
+    test_percentile();
+    test_obtain();
+    test_print();
+
+    return 0;
+}
+
+/*
+ * Each value lands in a bucket whose limit is at most 25% above it, and
+ * bucket limits increase
+ */
+static void
+test_buckets() {
+    static const uint64_t values[] = {
+        0, 1, 3, 4, 5, 7, 8, 9, 15, 16, 100, 1000, 999999, 1000000,
+        123456789, 68719476735ull,
+    };
+
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        struct Histogram histogram;
+        memset(&histogram, 0, sizeof(histogram));
+
+        histogram_record(&histogram, (ev_tstamp)values[i] / 1000000.0);
+        assert(histogram.count == 1);
+
+        size_t bucket = 0;
+        while (histogram.buckets[bucket] == 0)
+            bucket++;
+
+        uint64_t limit = histogram_bucket_limit(bucket);
+        uint64_t value = histogram.max;
+        assert(value == values[i]);
+        assert(limit >= value);
+        assert(limit - value <= value / 4);
+        assert(bucket == 0 || histogram_bucket_limit(bucket - 1) < value);
+    }
+
+    for (size_t i = 1; i < HISTOGRAM_BUCKETS; i++)
+        assert(histogram_bucket_limit(i) > histogram_bucket_limit(i - 1));
+
+    /* beyond the last exponent */
+    struct Histogram histogram;
+    memset(&histogram, 0, sizeof(histogram));
+    histogram_record(&histogram, 1e9);
+    assert(histogram.buckets[HISTOGRAM_BUCKETS - 1] == 1);
+
+    /* clock steps backwards count as zero */
+    histogram_record(&histogram, -1.0);
+    assert(histogram.buckets[0] == 1);
+}
+
+static void
+test_percentile() {
+    struct Histogram histogram;
+    memset(&histogram, 0, sizeof(histogram));
+
+    /* 1 ms to 100 ms */
+    for (int i = 1; i <= 100; i++)
+        histogram_record(&histogram, i / 1000.0);
+
+    assert(histogram.count == 100);
+    assert(histogram.max == 100000);
+    uint64_t p50 = histogram_percentile(&histogram, 0.50);
+    assert(p50 >= 50000 && p50 <= 50000 * 5 / 4);
+    uint64_t p99 = histogram_percentile(&histogram, 0.99);
+    assert(p99 >= 99000 && p99 <= 100000);
+    assert(histogram_percentile(&histogram, 1.0) == 100000);
+}
+
+static void
+test_obtain() {
+    struct Metrics *a = metrics_ref_get(obtain_metrics(METRICS_BACKEND, "192.0.2.1:443"));
+    struct Metrics *b = metrics_ref_get(obtain_metrics(METRICS_BACKEND, "192.0.2.1:443"));
+    struct Metrics *c = metrics_ref_get(obtain_metrics(METRICS_LISTENER, "192.0.2.1:443"));
+
+    assert(a != NULL && a == b);
+    assert(c != NULL && c != a);
+
+    metrics_count(a, METRIC_CONNECTIONS, 1);
+    metrics_count(b, METRIC_BYTES_IN, 100);
+    assert(a->counters[METRIC_CONNECTIONS] == 1);
+    assert(a->counters[METRIC_BYTES_IN] == 100);
+    assert(c->counters[METRIC_CONNECTIONS] == 0);
+
+    /* updates through no metrics are ignored */
+    metrics_count(NULL, METRIC_CONNECTIONS, 1);
+    metrics_record(NULL, METRIC_DURATION, 1.0);
+    metrics_parse_failure(NULL, -2);
+
+    metrics_parse_failure(c, -2);
+    metrics_parse_failure(c, -6);
+    metrics_parse_failure(c, -100);
+    assert(c->parse_failures[2] == 1);
+    assert(c->parse_failures[6] == 1);
+    assert(c->parse_failures[0] == 1);
+
+    /* kept while any reference remains */
+    metrics_ref_put(b);
+    assert(obtain_metrics(METRICS_BACKEND, "192.0.2.1:443") == a);
+    metrics_ref_put(a);
+    metrics_ref_put(c);
+}
+
+static void
+test_print() {
+    char *output = NULL;
+    size_t output_len = 0;
+    FILE *file = open_memstream(&output, &output_len);
+    assert(file != NULL);
+
+    struct Metrics *listener = metrics_ref_get(obtain_metrics(METRICS_LISTENER, "127.0.0.1:8080"));
+    struct Metrics *table = metrics_ref_get(obtain_metrics(METRICS_TABLE, "default"));
+
+    metrics_count(listener, METRIC_CONNECTIONS, 3);
+    metrics_parse_failure(listener, -2);
+    metrics_record(listener, METRIC_PARSE_TIME, 0.001);
+    metrics_count(table, METRIC_LOOKUP_MISSES, 2);
+
+    print_metrics(file);
+    fclose(file);
+
+    assert(strstr(output, "listener 127.0.0.1:8080 connections 3 ") != NULL);
+    assert(strstr(output, " -2:1 ") != NULL);
+    assert(strstr(output, "\tparse_time count 1 mean 1000us") != NULL);
+    assert(strstr(output, "table default lookups 0 lookup_misses 2\n") != NULL);
+
+    free(output);
+    metrics_ref_put(listener);
+    metrics_ref_put(table);
+}
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "proxy_protocol.h"
+
+
+static void test_v2_ipv4();
+static void test_v2_ipv6();
+static void test_v2_unspec();
+static void test_v2_too_small();
+static void test_parse_v1();
+static void test_parse_v2();
+static void test_parse_invalid();
+
+
+int main() {
+    test_v2_ipv4();
+    test_v2_ipv6();
+    test_v2_unspec();
+    test_v2_too_small();
+    test_parse_v1();
+    test_parse_v2();
+    test_parse_invalid();
+
+    return 0;
+}
+
+static void
+test_v2_ipv4() {
+    struct sockaddr_storage src = { .ss_family = AF_INET };
+    struct sockaddr_storage dst = { .ss_family = AF_INET };
+    char buf[PROXY_V2_HEADER_MAX];
+
+    inet_pton(AF_INET, "192.0.2.1", &((struct sockaddr_in *)&src)->sin_addr);
+    ((struct sockaddr_in *)&src)->sin_port = htons(56324);
+    inet_pton(AF_INET, "198.51.100.2", &((struct sockaddr_in *)&dst)->sin_addr);
+    ((struct sockaddr_in *)&dst)->sin_port = htons(443);
+
+    static const char expected[] =
+        "\r\n\r\n\0\r\nQUIT\n"  /* signature */
+        "\x21"                  /* v2, PROXY */
+        "\x11"                  /* TCP over IPv4 */
+        "\x00\x1f"              /* 12 address bytes, two TLVs */
+        "\xc0\x00\x02\x01"      /* 192.0.2.1 */
+        "\xc6\x33\x64\x02"      /* 198.51.100.2 */
+        "\xdc\x04"              /* 56324 */
+        "\x01\xbb"              /* 443 */
+        "\x01\x00\x02" "h2"
+        "\x02\x00\x0b" "example.com";
+
+    size_t len = proxy_v2_header(buf, sizeof(buf), &src, &dst,
+            "example.com", 11, "h2", 2);
+    assert(len == sizeof(expected) - 1);
+    assert(memcmp(buf, expected, len) == 0);
+
+    /* TLVs are omitted when empty */
+    len = proxy_v2_header(buf, sizeof(buf), &src, &dst, NULL, 0, NULL, 0);
+    assert(len == 28);
+    assert(buf[14] == 0 && buf[15] == 12);
+}
+
+static void
+test_v2_ipv6() {
+    struct sockaddr_storage src = { .ss_family = AF_INET6 };
+    struct sockaddr_storage dst = { .ss_family = AF_INET6 };
+    char buf[PROXY_V2_HEADER_MAX];
+
+    inet_pton(AF_INET6, "2001:db8::1", &((struct sockaddr_in6 *)&src)->sin6_addr);
+    ((struct sockaddr_in6 *)&src)->sin6_port = htons(1234);
+    inet_pton(AF_INET6, "2001:db8::2", &((struct sockaddr_in6 *)&dst)->sin6_addr);
+    ((struct sockaddr_in6 *)&dst)->sin6_port = htons(443);
+
+    size_t len = proxy_v2_header(buf, sizeof(buf), &src, &dst,
+            "example.com", 11, NULL, 0);
+    assert(len == 16 + 36 + 3 + 11);
+    assert(memcmp(buf, PP2_SIGNATURE, PP2_SIGNATURE_LEN) == 0);
+    assert((unsigned char)buf[13] == PP2_FAM_TCP6);
+    assert(buf[14] == 0 && buf[15] == 36 + 3 + 11);
+    assert(memcmp(buf + 16, &((struct sockaddr_in6 *)&src)->sin6_addr, 16) == 0);
+    assert(memcmp(buf + 32, &((struct sockaddr_in6 *)&dst)->sin6_addr, 16) == 0);
+    assert((unsigned char)buf[48] == 0x04 && (unsigned char)buf[49] == 0xd2);
+    assert((unsigned char)buf[50] == 0x01 && (unsigned char)buf[51] == 0xbb);
+    assert(buf[52] == PP2_TYPE_AUTHORITY);
+    assert(memcmp(buf + 55, "example.com", 11) == 0);
+}
+
+static void
+test_v2_unspec() {
+    struct sockaddr_storage src = { .ss_family = AF_UNIX };
+    struct sockaddr_storage dst = { .ss_family = AF_UNIX };
+    char buf[PROXY_V2_HEADER_MAX];
+
+    size_t len = proxy_v2_header(buf, sizeof(buf), &src, &dst,
+            "example.com", 11, NULL, 0);
+    assert(len == 16 + 3 + 11);
+    assert(buf[13] == PP2_FAM_UNSPEC);
+    assert(buf[14] == 0 && buf[15] == 3 + 11);
+    assert(buf[16] == PP2_TYPE_AUTHORITY);
+}
+
+static void
+test_v2_too_small() {
+    struct sockaddr_storage src = { .ss_family = AF_INET };
+    struct sockaddr_storage dst = { .ss_family = AF_INET };
+    char buf[32];
+
+    size_t len = proxy_v2_header(buf, sizeof(buf), &src, &dst,
+            "example.com", 11, NULL, 0);
+    assert(len == 0);
+
+    len = proxy_v2_header(buf, sizeof(buf), &src, &dst, NULL, 0, NULL, 0);
+    assert(len == 28);
+}
+
+static void
+test_parse_v1() {
+    struct sockaddr_storage src, dst;
+    static const char header[] =
+        "PROXY TCP4 192.0.2.1 198.51.100.2 56324 443\r\nGET / HTTP/1.1\r\n";
+    size_t header_len = strlen("PROXY TCP4 192.0.2.1 198.51.100.2 56324 443\r\n");
+
+    int result = parse_proxy_header(header, sizeof(header) - 1, &src, &dst);
+    assert(result == (int)header_len);
+    assert(src.ss_family == AF_INET);
+    assert(ntohs(((struct sockaddr_in *)&src)->sin_port) == 56324);
+    assert(ntohl(((struct sockaddr_in *)&src)->sin_addr.s_addr) == 0xc0000201);
+    assert(dst.ss_family == AF_INET);
+    assert(ntohs(((struct sockaddr_in *)&dst)->sin_port) == 443);
+
+    /* every prefix is incomplete */
+    for (size_t i = 0; i < header_len; i++)
+        assert(parse_proxy_header(header, i, &src, &dst) == -1);
+
+    static const char v6[] = "PROXY TCP6 2001:db8::1 2001:db8::2 1234 443\r\n";
+    result = parse_proxy_header(v6, sizeof(v6) - 1, &src, &dst);
+    assert(result == (int)sizeof(v6) - 1);
+    assert(src.ss_family == AF_INET6);
+    assert(ntohs(((struct sockaddr_in6 *)&dst)->sin6_port) == 443);
+
+    static const char unknown[] = "PROXY UNKNOWN\r\n";
+    result = parse_proxy_header(unknown, sizeof(unknown) - 1, &src, &dst);
+    assert(result == (int)sizeof(unknown) - 1);
+    assert(src.ss_family == AF_UNSPEC);
+}
+
+static void
+test_parse_v2() {
+    struct sockaddr_storage client = { .ss_family = AF_INET6 };
+    struct sockaddr_storage server = { .ss_family = AF_INET6 };
+    struct sockaddr_storage src, dst;
+    char buf[PROXY_V2_HEADER_MAX];
+
+    inet_pton(AF_INET6, "2001:db8::1", &((struct sockaddr_in6 *)&client)->sin6_addr);
+    ((struct sockaddr_in6 *)&client)->sin6_port = htons(1234);
+    inet_pton(AF_INET6, "2001:db8::2", &((struct sockaddr_in6 *)&server)->sin6_addr);
+    ((struct sockaddr_in6 *)&server)->sin6_port = htons(443);
+
+    /* round trip, the TLVs are skipped */
+    size_t len = proxy_v2_header(buf, sizeof(buf), &client, &server,
+            "example.com", 11, "h2", 2);
+    int result = parse_proxy_header(buf, len, &src, &dst);
+    assert(result == (int)len);
+    assert(src.ss_family == AF_INET6);
+    assert(memcmp(&((struct sockaddr_in6 *)&src)->sin6_addr,
+                &((struct sockaddr_in6 *)&client)->sin6_addr, 16) == 0);
+    assert(((struct sockaddr_in6 *)&src)->sin6_port == htons(1234));
+    assert(memcmp(&((struct sockaddr_in6 *)&dst)->sin6_addr,
+                &((struct sockaddr_in6 *)&server)->sin6_addr, 16) == 0);
+    assert(((struct sockaddr_in6 *)&dst)->sin6_port == htons(443));
+
+    for (size_t i = 0; i < len; i++)
+        assert(parse_proxy_header(buf, i, &src, &dst) == -1);
+
+    /* LOCAL connections, such as health checks, carry no addresses */
+    static const char local[] = "\r\n\r\n\0\r\nQUIT\n\x20\x00\x00\x00";
+    result = parse_proxy_header(local, sizeof(local) - 1, &src, &dst);
+    assert(result == 16);
+    assert(src.ss_family == AF_UNSPEC);
+}
+
+static void
+test_parse_invalid() {
+    struct sockaddr_storage src, dst;
+
+    static const char request[] = "GET / HTTP/1.1\r\n";
+    assert(parse_proxy_header(request, sizeof(request) - 1, &src, &dst) == -2);
+
+    static const char truncated[] = "PROXY TCP4 192.0.2.1\r\n";
+    assert(parse_proxy_header(truncated, sizeof(truncated) - 1, &src, &dst) == -3);
+
+    static const char port[] = "PROXY TCP4 192.0.2.1 192.0.2.2 65536 443\r\n";
+    assert(parse_proxy_header(port, sizeof(port) - 1, &src, &dst) == -3);
+    assert(src.ss_family == AF_UNSPEC);
+
+    static const char family[] = "PROXY TCP4 2001:db8::1 192.0.2.2 1 443\r\n";
+    assert(parse_proxy_header(family, sizeof(family) - 1, &src, &dst) == -3);
+
+    char line[PROXY_V1_HEADER_MAX + 1];
+    memset(line, 'x', sizeof(line));
+    memcpy(line, "PROXY ", 6);
+    assert(parse_proxy_header(line, sizeof(line), &src, &dst) == -3);
+
+    static const char command[] = "\r\n\r\n\0\r\nQUIT\n\x22\x11\x00\x0c"
+        "\xc0\x00\x02\x01\xc0\x00\x02\x02\x00\x01\x00\x02";
+    assert(parse_proxy_header(command, sizeof(command) - 1, &src, &dst) == -3);
+
+    static const char short_addr[] = "\r\n\r\n\0\r\nQUIT\n\x21\x11\x00\x04"
+        "\xc0\x00\x02\x01";
+    assert(parse_proxy_header(short_addr, sizeof(short_addr) - 1, &src, &dst) == -3);
+}
@@ -0,0 +1,478 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#ifdef HAVE_LIBCRYPTO
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#endif
+#include "quic.h"
+#include "tls.h"
+
+#define DATAGRAM_LEN 1200
+
+#ifdef HAVE_LIBCRYPTO
+
+/* A ClientHello for localhost offering h3, in a single Initial packet */
+static const unsigned char captured_initial[] = {
+    0xc3, 0x00, 0x00, 0x00, 0x01, 0x08, 0xc0, 0xff, 0xee, 0x0d, 0xd1, 0x5e,
+    0xa5, 0xe5, 0x04, 0x5c, 0xa1, 0xab, 0x1e, 0x00, 0x44, 0x9a, 0x8b, 0x81,
+    0x2f, 0x6b, 0x35, 0x8f, 0xee, 0x31, 0xf4, 0x76, 0xd9, 0x54, 0x06, 0x50,
+    0xe3, 0xb1, 0xf7, 0xff, 0x78, 0x91, 0x0a, 0x67, 0xfa, 0x74, 0x51, 0x8c,
+    0xda, 0x39, 0x69, 0x4f, 0xd6, 0xef, 0x60, 0x40, 0xbd, 0xc4, 0x35, 0xe1,
+    0x39, 0x67, 0xc6, 0x76, 0x3a, 0x70, 0x40, 0x29, 0xf6, 0xca, 0xa3, 0xdc,
+    0x85, 0x8d, 0xb1, 0x2b, 0x91, 0xd9, 0x79, 0x3b, 0x69, 0xbf, 0xb8, 0x82,
+    0x35, 0x08, 0x0d, 0x26, 0x76, 0xcb, 0xcf, 0x41, 0x81, 0x85, 0x03, 0x38,
+    0xea, 0xc5, 0xb9, 0xd2, 0x49, 0xe0, 0x24, 0x4f, 0x21, 0x23, 0xfc, 0xf3,
+    0x70, 0x9f, 0x70, 0x0b, 0xf3, 0xc6, 0x27, 0x74, 0x55, 0x04, 0x54, 0xbc,
+    0xc1, 0xec, 0x24, 0x60, 0xd4, 0x37, 0xf3, 0x1b, 0x28, 0xa2, 0x88, 0x4e,
+    0x7f, 0xc8, 0x35, 0xa3, 0xd3, 0xf2, 0x1f, 0xaa, 0x17, 0xa5, 0xc8, 0x6c,
+    0x4d, 0xbf, 0x4f, 0xd7, 0x44, 0x47, 0x0c, 0x08, 0x1d, 0x6b, 0xa2, 0x23,
+    0x93, 0x93, 0xd3, 0x00, 0xb6, 0x5a, 0xdc, 0x90, 0x35, 0x30, 0xc9, 0x6e,
+    0xff, 0x54, 0x60, 0x3b, 0xcb, 0xf4, 0x4e, 0x2c, 0x9b, 0x37, 0x07, 0x2b,
+    0xa5, 0xe9, 0x4f, 0xdd, 0x21, 0x4b, 0xc7, 0x21, 0xa4, 0x04, 0xe4, 0x64,
+    0x65, 0xe2, 0xb4, 0xe7, 0x3a, 0x39, 0xab, 0x2e, 0xda, 0xeb, 0x1d, 0xf4,
+    0x80, 0x8a, 0x9f, 0xbb, 0x21, 0x4c, 0x47, 0x94, 0xfd, 0x24, 0x69, 0x86,
+    0xd4, 0xb0, 0xa4, 0xff, 0xbe, 0xfd, 0xa2, 0xb4, 0x44, 0x83, 0xb0, 0xa1,
+    0x81, 0x1a, 0xaf, 0x3b, 0xf0, 0x2b, 0xc1, 0xda, 0xaf, 0x0c, 0x85, 0x63,
+    0x88, 0x7c, 0xac, 0xf5, 0x45, 0xa6, 0x53, 0x27, 0x6d, 0xa4, 0xef, 0x10,
+    0x8a, 0x99, 0x66, 0x3e, 0x05, 0x5f, 0xf9, 0x10, 0xbd, 0xdd, 0xfe, 0x33,
+    0x12, 0xf5, 0xcb, 0x85, 0x03, 0x2c, 0xd8, 0x96, 0x75, 0xad, 0x01, 0xed,
+    0xbd, 0x7c, 0xd7, 0x79, 0xeb, 0x10, 0x47, 0xc2, 0x55, 0x20, 0x50, 0x42,
+    0x61, 0x9a, 0xfe, 0x5c, 0xad, 0x15, 0x56, 0xf8, 0xbe, 0xa0, 0xae, 0x68,
+    0x34, 0x72, 0x0f, 0x78, 0x9f, 0xad, 0x23, 0x91, 0x3a, 0xb5, 0xe7, 0xad,
+    0xa1, 0xb6, 0xc3, 0x5a, 0xb2, 0x60, 0xed, 0x60, 0xe2, 0x65, 0xcc, 0x87,
+    0xb7, 0xe9, 0xb1, 0x0d, 0x3d, 0x77, 0x4a, 0x18, 0x26, 0xd0, 0x87, 0x68,
+    0xe7, 0x2c, 0xdd, 0xa4, 0x17, 0xe6, 0x9a, 0xfa, 0x18, 0xdc, 0x88, 0x1e,
+    0xb6, 0xde, 0x6a, 0xad, 0x2c, 0x6a, 0xc0, 0x46, 0x40, 0xea, 0x40, 0x6b,
+    0x3d, 0x64, 0x75, 0x1f, 0x4f, 0xba, 0x55, 0x6c, 0x72, 0xef, 0x96, 0xdb,
+    0x10, 0x68, 0xe4, 0x55, 0x73, 0x81, 0xa1, 0xe7, 0xd9, 0x48, 0x4f, 0x47,
+    0x85, 0xe2, 0x7b, 0x00, 0xb3, 0x6c, 0x02, 0x6a, 0xc9, 0xc8, 0xa4, 0x1e,
+    0x91, 0x14, 0x24, 0xa8, 0x3c, 0xa1, 0xd4, 0xf6, 0x0f, 0x6a, 0x8d, 0x1c,
+    0x18, 0xce, 0xfb, 0xce, 0x20, 0x01, 0x7e, 0xb2, 0x61, 0x52, 0x31, 0xa9,
+    0x23, 0xd2, 0xa7, 0xfc, 0x08, 0xcf, 0xd3, 0x71, 0x92, 0x5b, 0xdc, 0xc6,
+    0xb9, 0x53, 0x5c, 0xf5, 0x88, 0x89, 0xf4, 0x22, 0x95, 0xc7, 0x68, 0xf4,
+    0x53, 0x2f, 0x82, 0x29, 0x41, 0x4d, 0x44, 0x20, 0x71, 0xef, 0x26, 0x45,
+    0x4a, 0x98, 0x21, 0x8c, 0x53, 0x8c, 0x14, 0xec, 0x34, 0xb0, 0xae, 0xed,
+    0xf8, 0xf4, 0x1b, 0x28, 0x76, 0xc4, 0x7f, 0xdb, 0xf4, 0x9e, 0xf4, 0x0a,
+    0xff, 0xa1, 0xec, 0xfe, 0xb3, 0x23, 0x8d, 0xbc, 0xb0, 0x6e, 0x7c, 0x7a,
+    0xd7, 0xd3, 0xbb, 0x84, 0x29, 0x9d, 0xe7, 0x39, 0x29, 0x89, 0x2b, 0xe8,
+    0xbe, 0x7e, 0x29, 0x68, 0x49, 0xbe, 0xd9, 0x51, 0x66, 0x16, 0xf6, 0xdc,
+    0x49, 0x10, 0x1b, 0xc0, 0x83, 0x26, 0x0a, 0x94, 0x78, 0x8d, 0x4b, 0x19,
+    0x79, 0xbc, 0xf5, 0xb9, 0x4b, 0x39, 0x0d, 0x99, 0x28, 0x2a, 0x5b, 0xcc,
+    0xef, 0xdb, 0x22, 0x5d, 0xf6, 0x8d, 0x59, 0x24, 0xfe, 0xaa, 0xb9, 0xc7,
+    0x71, 0xf5, 0x5c, 0xab, 0x35, 0x8d, 0x4a, 0x67, 0x9a, 0xcb, 0xd0, 0x37,
+    0xae, 0x33, 0x18, 0x95, 0x9f, 0x06, 0xb8, 0xe9, 0xff, 0x29, 0xf3, 0x91,
+    0x27, 0x46, 0x52, 0x5c, 0xb0, 0x45, 0x9c, 0x15, 0x19, 0xb8, 0x42, 0xb9,
+    0x91, 0x09, 0x03, 0xfa, 0xd8, 0x0b, 0xe3, 0xf9, 0x1d, 0xac, 0x4e, 0x28,
+    0x44, 0x1f, 0x6b, 0x87, 0x02, 0x24, 0x3b, 0x92, 0x72, 0x93, 0x7d, 0x61,
+    0x71, 0x45, 0xba, 0xbc, 0x44, 0x1b, 0xc8, 0xa3, 0xd8, 0xd7, 0xa3, 0xa6,
+    0xdd, 0x0c, 0x78, 0xfa, 0x66, 0xfe, 0x0d, 0xb8, 0xc4, 0x2f, 0xf7, 0xe2,
+    0x7e, 0xb9, 0xa9, 0x73, 0xc9, 0xd4, 0xa4, 0x45, 0x62, 0x8a, 0xc9, 0x30,
+    0xca, 0x1d, 0xe3, 0xa4, 0x08, 0x61, 0x18, 0x5f, 0x1c, 0x1e, 0x7b, 0x0a,
+    0x4b, 0xad, 0xcf, 0xdc, 0xe5, 0x17, 0xcd, 0xef, 0x83, 0xab, 0xea, 0x1e,
+    0xd6, 0xdf, 0x46, 0x1b, 0xe7, 0x5e, 0xa4, 0xdd, 0x99, 0xd4, 0x9f, 0x25,
+    0x0c, 0x41, 0x82, 0x75, 0xa2, 0x47, 0xab, 0xcc, 0xbd, 0x3c, 0xaa, 0xde,
+    0x02, 0xdf, 0x98, 0x4d, 0xad, 0x04, 0x5e, 0xe5, 0xe3, 0x4c, 0x8b, 0xf3,
+    0x55, 0xb5, 0x7b, 0xcf, 0x29, 0xd0, 0x2b, 0x0e, 0xca, 0xef, 0x4b, 0xbd,
+    0x71, 0x47, 0x50, 0xad, 0xdd, 0x16, 0x20, 0x11, 0x13, 0xc9, 0xce, 0x02,
+    0x96, 0x28, 0x05, 0x34, 0x51, 0x55, 0x67, 0x01, 0x0a, 0xed, 0x66, 0xcd,
+    0x8d, 0xb2, 0xd0, 0x92, 0xf9, 0x02, 0x44, 0xa4, 0x8e, 0x7b, 0x79, 0x11,
+    0x7a, 0x53, 0x12, 0x14, 0xdd, 0x35, 0x43, 0xf7, 0x08, 0x90, 0x40, 0x3e,
+    0xc7, 0x9b, 0xc1, 0x81, 0x0c, 0x9c, 0x56, 0xa6, 0x30, 0x3a, 0x86, 0xf5,
+    0x21, 0xa8, 0xf4, 0x85, 0x3b, 0x9c, 0x83, 0xd5, 0x31, 0x0c, 0xba, 0xcc,
+    0x3e, 0x0a, 0x31, 0xcf, 0x27, 0xd9, 0x59, 0xa1, 0x15, 0x08, 0x75, 0xe4,
+    0x63, 0x7d, 0x30, 0x2e, 0xf7, 0x95, 0xfa, 0xe5, 0xfe, 0x5e, 0xab, 0xae,
+    0xbc, 0x68, 0xdb, 0x4b, 0xa1, 0x2a, 0xe8, 0xc3, 0x26, 0x05, 0xfc, 0x45,
+    0x03, 0x6e, 0xfb, 0x44, 0x79, 0x92, 0x76, 0xaf, 0x52, 0x04, 0x7e, 0x32,
+    0x8c, 0x91, 0x9a, 0x0d, 0xab, 0x1f, 0x7f, 0x1c, 0x7b, 0x09, 0x80, 0xe7,
+    0x4b, 0xb2, 0x33, 0xe3, 0x1a, 0xb9, 0xae, 0xf7, 0xfb, 0xc8, 0x14, 0x15,
+    0x33, 0x48, 0x05, 0x51, 0x6e, 0x10, 0x08, 0x2f, 0x3b, 0xf9, 0xed, 0xc9,
+    0xa0, 0x45, 0xef, 0xae, 0xd1, 0xea, 0xe9, 0xc3, 0x81, 0xf3, 0x95, 0x10,
+    0x04, 0x35, 0xbe, 0x6f, 0x8c, 0xae, 0x4e, 0x13, 0x54, 0x87, 0x9c, 0x0a,
+    0x80, 0x8f, 0x74, 0xa5, 0x9b, 0xa8, 0x6e, 0xfd, 0x8a, 0xcb, 0x31, 0x59,
+    0x77, 0x43, 0xab, 0xc4, 0x97, 0xc5, 0x49, 0x77, 0xb3, 0xeb, 0x89, 0xc2,
+    0x60, 0xe3, 0xdd, 0x2d, 0x47, 0x5a, 0x1c, 0x64, 0xd7, 0x87, 0xeb, 0x98,
+    0xa3, 0x1b, 0x44, 0x0d, 0x88, 0xc0, 0x93, 0xa5, 0x09, 0x1c, 0x0b, 0x06,
+    0x1c, 0xf9, 0xb1, 0x9b, 0xa3, 0x40, 0x26, 0x84, 0xd1, 0x3c, 0x96, 0x7c,
+    0xfa, 0x22, 0x04, 0xcc, 0xbb, 0x9d, 0x07, 0x82, 0xa9, 0x82, 0x34, 0x09,
+    0x04, 0x62, 0x9b, 0xe7, 0x3b, 0xa0, 0x7d, 0x2f, 0x26, 0x37, 0x17, 0x79,
+    0x95, 0x3c, 0x26, 0xea, 0xcd, 0x77, 0x5d, 0x3e, 0xc0, 0x83, 0xb5, 0x1e,
+    0xdc, 0xf5, 0x23, 0x05, 0x2a, 0xcb, 0x7c, 0x71, 0xcb, 0x7e, 0xd4, 0x0a,
+    0x18, 0xb4, 0x3c, 0x70, 0x9b, 0x89, 0x40, 0x34, 0x2e, 0x1f, 0x1e, 0xb2,
+    0x54, 0x27, 0x87, 0xad, 0x36, 0xb1, 0x67, 0x7f, 0xd3, 0x28, 0x64, 0xa8,
+    0xc3, 0x41, 0x4a, 0xa0, 0x6b, 0x79, 0x2d, 0xd2, 0xaa, 0x8a, 0x42, 0xa1,
+    0x40, 0xce, 0x27, 0x08, 0xa3, 0xd1, 0xdd, 0x48, 0x56, 0x0a, 0xcd, 0xcf,
+    0x02, 0xc3, 0xfc, 0x23, 0xa6, 0xf9, 0x74, 0x34, 0x3c, 0x38, 0xf9, 0x3e,
+    0x8d, 0xa0, 0x71, 0xc0, 0x85, 0xf7, 0xc3, 0x92, 0xb6, 0x63, 0xd4, 0x3b,
+    0xc6, 0x34, 0x14, 0xd6, 0xd4, 0xdd, 0x46, 0x55, 0xfc, 0x54, 0x7d, 0x41,
+    0x7f, 0x97, 0x77, 0xe0, 0x22, 0xa3, 0xeb, 0xce, 0x80, 0x9c, 0xe4, 0x60,
+    0xaf, 0x8d, 0x53, 0x46, 0x0d, 0x11, 0x4f, 0x33, 0xb6, 0xd4, 0xcb, 0xce,
+    0xcd, 0x6b, 0x5b, 0x17, 0x75, 0xdd, 0x12, 0xd5, 0xe3, 0x6f, 0xfe, 0x6d,
+    0x5e, 0x4b, 0x3c, 0xe7, 0x30, 0xff, 0x7f, 0x7a, 0x13, 0xef, 0xf2, 0x41,
+    0xda, 0xed, 0x95, 0xf4, 0x4e, 0xd3, 0xd0, 0xf4, 0xc1, 0x98, 0xf7, 0xc3,
+    0x71, 0x40, 0x63, 0x51, 0x24, 0x79, 0x49, 0x6a, 0x48, 0xfd, 0x5f, 0xb8,
+    0x04, 0x7d, 0xff, 0xae, 0xb1, 0xa3, 0x34, 0x69, 0xad, 0xf5, 0x9d, 0x17,
+    0x14, 0x98, 0x78, 0x4d, 0xb1, 0x63, 0xf7, 0xf2, 0x4b, 0xa2, 0xd1, 0x53,
+    0x6c, 0xbe, 0xba, 0x44, 0x03, 0x88, 0xa8, 0xc7, 0x70, 0xd8, 0x5d, 0xb5,
+};
+
+struct InitialKeys {
+    uint8_t secret[32];
+    uint8_t key[16];
+    uint8_t iv[12];
+    uint8_t hp[16];
+};
+
+static const uint8_t test_dcid[] = {
+    0xc0, 0xff, 0xee, 0x0d, 0xd1, 0x5e, 0xa5, 0xe5
+};
+
+
+static void
+expand_label(const uint8_t *secret, const char *label, uint8_t *out, size_t out_len) {
+    uint8_t info[64], block[32];
+    unsigned int block_len;
+    size_t pos = 0;
+
+    info[pos++] = 0;
+    info[pos++] = (uint8_t)out_len;
+    info[pos++] = (uint8_t)(6 + strlen(label));
+    pos += (size_t)sprintf((char *)info + pos, "tls13 %s", label);
+    info[pos++] = 0;
+    info[pos++] = 1;
+
+    assert(HMAC(EVP_sha256(), secret, 32, info, pos, block, &block_len) != NULL);
+    memcpy(out, block, out_len);
+}
+
+static void
+initial_keys(const uint8_t *dcid, size_t dcid_len, struct InitialKeys *keys) {
+    static const uint8_t salt[] = {
+        0x38, 0x76, 0x2c, 0xf7, 0xf5, 0x59, 0x34, 0xb3, 0x4d, 0x17,
+        0x9a, 0xe6, 0xa4, 0xc8, 0x0c, 0xad, 0xcc, 0xbb, 0x7f, 0x0a,
+    };
+    uint8_t initial_secret[32];
+    unsigned int len;
+
+    assert(HMAC(EVP_sha256(), salt, sizeof(salt), dcid, dcid_len,
+                initial_secret, &len) != NULL);
+    expand_label(initial_secret, "client in", keys->secret, 32);
+    expand_label(keys->secret, "quic key", keys->key, 16);
+    expand_label(keys->secret, "quic iv", keys->iv, 12);
+    expand_label(keys->secret, "quic hp", keys->hp, 16);
+}
+
+static void
+hp_mask(const struct InitialKeys *keys, const uint8_t *sample, uint8_t *mask) {
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len;
+
+    assert(ctx != NULL);
+    assert(EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, keys->hp, NULL));
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    assert(EVP_EncryptUpdate(ctx, mask, &len, sample, 16));
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+/*
+ * Protect frames as a client Initial packet with packet number pn, padded to
+ * fill a DATAGRAM_LEN datagram. Returns the packet length.
+ */
+static size_t
+protect_initial(const uint8_t *dcid, size_t dcid_len, uint32_t pn, const uint8_t *frames, size_t frames_len, uint8_t *packet) {
+    struct InitialKeys keys;
+    size_t pos = 0;
+
+    initial_keys(dcid, dcid_len, &keys);
+
+    packet[pos++] = 0xc3;                       /* Initial, 4 byte pn */
+    memcpy(packet + pos, "\x00\x00\x00\x01", 4);  /* version 1 */
+    pos += 4;
+    packet[pos++] = (uint8_t)dcid_len;
+    memcpy(packet + pos, dcid, dcid_len);
+    pos += dcid_len;
+    packet[pos++] = 0;                          /* source connection ID */
+    packet[pos++] = 0;                          /* token */
+
+    size_t payload_len = DATAGRAM_LEN - pos - 2 - 4;
+    assert(frames_len + 16 <= payload_len);
+    packet[pos++] = (uint8_t)(0x40 | ((payload_len + 4) >> 8));
+    packet[pos++] = (uint8_t)((payload_len + 4) & 0xff);
+    size_t pn_pos = pos;
+    for (int i = 3; i >= 0; i--)
+        packet[pos++] = (uint8_t)(pn >> (8 * i));
+
+    uint8_t plaintext[DATAGRAM_LEN] = { 0 };    /* PADDING frames */
+    memcpy(plaintext, frames, frames_len);
+
+    uint8_t nonce[12];
+    memcpy(nonce, keys.iv, sizeof(nonce));
+    for (int i = 0; i < 4; i++)
+        nonce[11 - i] ^= (uint8_t)(pn >> (8 * i));
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len;
+    assert(ctx != NULL);
+    assert(EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, keys.key, nonce));
+    assert(EVP_EncryptUpdate(ctx, NULL, &len, packet, (int)pos));
+    assert(EVP_EncryptUpdate(ctx, packet + pos, &len, plaintext,
+                (int)(payload_len - 16)));
+    assert(EVP_EncryptFinal_ex(ctx, packet + pos + len, &len));
+    assert(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16,
+                packet + DATAGRAM_LEN - 16));
+    EVP_CIPHER_CTX_free(ctx);
+
+    uint8_t mask[16];
+    hp_mask(&keys, packet + pn_pos + 4, mask);
+    packet[0] ^= mask[0] & 0x0f;
+    for (int i = 0; i < 4; i++)
+        packet[pn_pos + i] ^= mask[1 + i];
+
+    return DATAGRAM_LEN;
+}
+
+static size_t
+crypto_frame(size_t offset, const char *data, size_t len, uint8_t *frame) {
+    frame[0] = 0x06;
+    frame[1] = (uint8_t)(0x40 | (offset >> 8));
+    frame[2] = (uint8_t)(offset & 0xff);
+    frame[3] = (uint8_t)(0x40 | (len >> 8));
+    frame[4] = (uint8_t)(len & 0xff);
+    memcpy(frame + 5, data, len);
+
+    return 5 + len;
+}
+
+/* A ClientHello with a padding extension, from a TLS record */
+static size_t
+padded_client_hello(char *hello, size_t padding_len) {
+    char record[4096];
+    size_t len = build_tls_client_hello(record, sizeof(record), "localhost");
+    assert(len > 0);
+
+    len -= 5;
+    memcpy(hello, record + 5, len);
+    hello[len++] = 0x00;
+    hello[len++] = 0x15;
+    hello[len++] = (char)(padding_len >> 8);
+    hello[len++] = (char)(padding_len & 0xff);
+    memset(hello + len, 0, padding_len);
+    len += padding_len;
+
+    /* Extensions length sits at the start of the unpadded extensions */
+    size_t pos = 4 + 2 + 32;
+    pos += 1 + (uint8_t)hello[pos];
+    pos += 2 + ((size_t)(uint8_t)hello[pos] << 8) + (uint8_t)hello[pos + 1];
+    pos += 1 + (uint8_t)hello[pos];
+    size_t extensions_len = len - pos - 2;
+    hello[pos] = (char)(extensions_len >> 8);
+    hello[pos + 1] = (char)(extensions_len & 0xff);
+
+    size_t body_len = len - 4;
+    hello[1] = (char)(body_len >> 16);
+    hello[2] = (char)(body_len >> 8);
+    hello[3] = (char)(body_len & 0xff);
+
+    return len;
+}
+
+static void
+test_rfc9001_keys() {
+    /* RFC 9001 A.1 */
+    static const uint8_t dcid[] = {
+        0x83, 0x94, 0xc8, 0xf0, 0x3e, 0x51, 0x57, 0x08
+    };
+    static const uint8_t secret[] = {
+        0xc0, 0x0c, 0xf1, 0x51, 0xca, 0x5b, 0xe0, 0x75,
+        0xed, 0x0e, 0xbf, 0xb5, 0xc8, 0x03, 0x23, 0xc4,
+        0x2d, 0x6b, 0x7d, 0xb6, 0x78, 0x81, 0x28, 0x9a,
+        0xf4, 0x00, 0x8f, 0x1f, 0x6c, 0x35, 0x7a, 0xea,
+    };
+    static const uint8_t key[] = {
+        0x1f, 0x36, 0x96, 0x13, 0xdd, 0x76, 0xd5, 0x46,
+        0x77, 0x30, 0xef, 0xcb, 0xe3, 0xb1, 0xa2, 0x2d,
+    };
+    static const uint8_t iv[] = {
+        0xfa, 0x04, 0x4b, 0x2f, 0x42, 0xa3, 0xfd, 0x3b,
+        0x46, 0xfb, 0x25, 0x5c,
+    };
+    static const uint8_t hp[] = {
+        0x9f, 0x50, 0x44, 0x9e, 0x04, 0xa0, 0xe8, 0x10,
+        0x28, 0x3a, 0x1e, 0x99, 0x33, 0xad, 0xed, 0xd2,
+    };
+    /* RFC 9001 A.2 header protection sample and mask */
+    static const uint8_t sample[] = {
+        0xd1, 0xb1, 0xc9, 0x8d, 0xd7, 0x68, 0x9f, 0xb8,
+        0xec, 0x11, 0xd2, 0x42, 0xb1, 0x23, 0xdc, 0x9b,
+    };
+    static const uint8_t mask[] = { 0x43, 0x7b, 0x9a, 0xec, 0x36 };
+    struct InitialKeys keys;
+    uint8_t computed_mask[16];
+
+    initial_keys(dcid, sizeof(dcid), &keys);
+    assert(memcmp(keys.secret, secret, sizeof(secret)) == 0);
+    assert(memcmp(keys.key, key, sizeof(key)) == 0);
+    assert(memcmp(keys.iv, iv, sizeof(iv)) == 0);
+    assert(memcmp(keys.hp, hp, sizeof(hp)) == 0);
+
+    hp_mask(&keys, sample, computed_mask);
+    assert(memcmp(computed_mask, mask, sizeof(mask)) == 0);
+}
+
+static void
+test_captured_initial() {
+    const char *hostname = NULL;
+    struct RequestInfo info;
+    char datagram[DATAGRAM_LEN];
+
+    assert(sizeof(captured_initial) == DATAGRAM_LEN);
+    assert(quic_client_initial((const char *)captured_initial,
+                sizeof(captured_initial)));
+
+    int result = quic_protocol->parse_packet((const char *)captured_initial,
+            sizeof(captured_initial), &hostname, &info);
+    assert(result == 9);
+    assert(0 == strncmp("localhost", hostname, 9));
+    assert(info.alpn_len == 3 && 0 == memcmp("\x02h3", info.alpn, 3));
+
+    result = quic_protocol->parse_packet((const char *)captured_initial,
+            sizeof(captured_initial), NULL, &info);
+    assert(result == -3);
+
+    /* Clients must pad Initial datagrams */
+    result = quic_protocol->parse_packet((const char *)captured_initial,
+            1199, &hostname, &info);
+    assert(result < -4);
+    assert(!quic_client_initial((const char *)captured_initial, 1199));
+
+    /* Any change to the protected packet fails authentication */
+    memcpy(datagram, captured_initial, sizeof(datagram));
+    datagram[600] ^= 0x01;
+    result = quic_protocol->parse_packet(datagram, sizeof(datagram),
+            &hostname, &info);
+    assert(result < -4);
+
+    /* Other versions */
+    memcpy(datagram, captured_initial, sizeof(datagram));
+    datagram[4] = 0x02;
+    result = quic_protocol->parse_packet(datagram, sizeof(datagram),
+            &hostname, &info);
+    assert(result < -4);
+    assert(!quic_client_initial(datagram, sizeof(datagram)));
+
+    /* Not QUIC */
+    memset(datagram, 0x16, sizeof(datagram));
+    result = quic_protocol->parse_packet(datagram, sizeof(datagram),
+            &hostname, &info);
+    assert(result < -4);
+
+    /* The source connection ID of a long header */
+    const char *cid = NULL;
+    assert(quic_source_cid((const char *)captured_initial,
+                sizeof(captured_initial), &cid) == 4);
+    assert(0 == memcmp(cid, "\x5c\xa1\xab\x1e", 4));
+    assert(quic_source_cid("\x40\x01\x02\x03", 4, &cid) == 0);
+}
+
+static void
+test_multiple_datagrams() {
+    static char hello[4096];
+    uint8_t frames[DATAGRAM_LEN];
+    uint8_t datagrams[3][DATAGRAM_LEN];
+    const char *hostname;
+    struct RequestInfo info;
+
+    size_t hello_len = padded_client_hello(hello, 1500);
+    assert(hello_len > 1600);
+
+    /* Second and first parts of the ClientHello, as browsers shuffle
+     * CRYPTO frames, then the remainder in a second datagram */
+    size_t frames_len = crypto_frame(500, hello + 500, 500, frames);
+    frames[frames_len++] = 0x01; /* PING */
+    frames_len += crypto_frame(0, hello, 500, frames + frames_len);
+    protect_initial(test_dcid, sizeof(test_dcid), 0, frames, frames_len,
+            datagrams[0]);
+
+    frames_len = crypto_frame(1000, hello + 1000, hello_len - 1000, frames);
+    protect_initial(test_dcid, sizeof(test_dcid), 1, frames, frames_len,
+            datagrams[1]);
+
+    /* ACK frames may accompany a retransmission */
+    frames_len = 0;
+    memcpy(frames, "\x02\x00\x00\x00\x00", 5);
+    frames_len += 5;
+    frames_len += crypto_frame(0, hello, 500, frames + frames_len);
+    protect_initial(test_dcid, sizeof(test_dcid), 2, frames, frames_len,
+            datagrams[2]);
+
+    /* Alone the first datagram is incomplete */
+    hostname = NULL;
+    int result = quic_protocol->parse_packet((char *)datagrams[0],
+            DATAGRAM_LEN, &hostname, &info);
+    assert(result == -1);
+    assert(hostname == NULL);
+
+    /* In order, with a retransmission in between, and in reverse order */
+    const int orders[][3] = { { 0, 1, -1 }, { 0, 2, 1 }, { 1, 0, -1 } };
+    for (size_t i = 0; i < sizeof(orders) / sizeof(orders[0]); i++) {
+        void *parser = quic_protocol->new_parser(16384);
+        assert(parser != NULL);
+
+        result = -1;
+        for (size_t j = 0; j < 3 && orders[i][j] >= 0; j++) {
+            assert(result == -1);
+            result = quic_protocol->parse_more(parser,
+                    (char *)datagrams[orders[i][j]], DATAGRAM_LEN,
+                    &hostname, &info);
+        }
+        assert(result == 9);
+        assert(0 == strncmp("localhost", hostname, 9));
+
+        quic_protocol->free_parser(parser);
+    }
+
+    /* Datagrams for another connection ID are ignored */
+    uint8_t other_dcid[sizeof(test_dcid)];
+    memcpy(other_dcid, test_dcid, sizeof(other_dcid));
+    other_dcid[0] ^= 0xff;
+    frames_len = crypto_frame(1000, hello + 1000, hello_len - 1000, frames);
+    protect_initial(other_dcid, sizeof(other_dcid), 1, frames, frames_len,
+            datagrams[2]);
+
+    void *parser = quic_protocol->new_parser(16384);
+    assert(parser != NULL);
+    assert(quic_protocol->parse_more(parser, (char *)datagrams[0],
+                DATAGRAM_LEN, &hostname, &info) == -1);
+    assert(quic_protocol->parse_more(parser, (char *)datagrams[2],
+                DATAGRAM_LEN, &hostname, &info) == -1);
+    assert(quic_protocol->parse_more(parser, (char *)datagrams[1],
+                DATAGRAM_LEN, &hostname, &info) == 9);
+    quic_protocol->free_parser(parser);
+
+    /* ClientHellos larger than the parser limit */
+    parser = quic_protocol->new_parser(1024);
+    assert(parser != NULL);
+    result = quic_protocol->parse_more(parser, (char *)datagrams[0],
+            DATAGRAM_LEN, &hostname, &info);
+    assert(result == -6);
+    quic_protocol->free_parser(parser);
+}
+
+int main() {
+    test_rfc9001_keys();
+    test_captured_initial();
+    test_multiple_datagrams();
+
+    return 0;
+}
+
+#else
+
+int main() {
+    /* Built without libcrypto */
+    return 77;
+}
+
+#endif
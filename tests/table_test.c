@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <arpa/inet.h>
 #include "table.h"
 #include "backend.h"
 
@@ -9,9 +10,14 @@
 static void test_empty_table();
 static void test_single_entry_table();
 static void append_entry(struct Table *, const char *, const char *);
+static void append_alpn_entry(struct Table *, const char *, const char *,
+        const char *);
 static void add_new_table(struct Table_head *, const char *, const char **);
 static void test_add_table();
 static void test_tables_reload();
+static void test_backend_pool();
+static void test_backend_pool_health();
+static void test_alpn_backend();
 static int count_tables(const struct Table_head *);
 
 
@@ -20,6 +26,9 @@ int main() {
     test_single_entry_table();
     test_add_table();
     test_tables_reload();
+    test_backend_pool();
+    test_backend_pool_health();
+    test_alpn_backend();
 }
 
 static void
@@ -36,8 +45,8 @@ test_empty_table() {
     assert(name != table->name);
 
     const char *server_query = "example.com";
-    struct LookupResult result = table_lookup_server_address(table,
-            server_query, strlen(server_query));
+    struct LookupResult result = table_lookup_server_address(table, NULL,
+            server_query, strlen(server_query), NULL, 0);
     assert(result.address == NULL);
 
     table_ref_put(table);
@@ -73,8 +82,8 @@ test_single_entry_table() {
     init_table(table);
 
     const char *server_query = "example.com";
-    struct LookupResult result = table_lookup_server_address(table,
-            server_query, strlen(server_query));
+    struct LookupResult result = table_lookup_server_address(table, NULL,
+            server_query, strlen(server_query), NULL, 0);
     assert(result.address != NULL);
 
     table_ref_put(table);
@@ -187,3 +196,181 @@ test_tables_reload() {
     free_tables(&existing);
     table_ref_put(bar);
 }
+
+static void
+test_backend_pool() {
+    struct Table *table = new_table();
+    assert(table != NULL);
+
+    table_ref_get(table);
+
+    append_entry(table, "^example\\.com$", "192.0.2.10");
+    append_entry(table, "^example\\.com$", "192.0.2.11");
+    append_entry(table, "^example\\.com$", "192.0.2.12");
+    append_entry(table, "^example\\.net$", "192.0.2.20");
+
+    init_table(table);
+    /* initializing a table again must not rebuild the pools */
+    init_table(table);
+
+    const struct Address *seen[3] = { NULL };
+    size_t seen_len = 0;
+    const char *server_query = "example.com";
+
+    for (int i = 1; i < 255; i++) {
+        struct sockaddr_in client = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = htonl(0xc6336400 | i), /* 198.51.100.i */
+        };
+
+        struct LookupResult result = table_lookup_server_address(table,
+                (struct sockaddr *)&client,
+                server_query, strlen(server_query), NULL, 0);
+        assert(result.address != NULL);
+
+        /* Same client always lands on the same backend */
+        client.sin_port = htons(1024 + i);
+        struct LookupResult again = table_lookup_server_address(table,
+                (struct sockaddr *)&client,
+                server_query, strlen(server_query), NULL, 0);
+        assert(again.address == result.address);
+
+        size_t j;
+        for (j = 0; j < seen_len; j++)
+            if (seen[j] == result.address)
+                break;
+        if (j == seen_len) {
+            assert(seen_len < 3);
+            seen[seen_len++] = result.address;
+        }
+    }
+
+    /* 254 clients are spread over all pool members */
+    assert(seen_len == 3);
+
+    /* Backends outside of a pool are unaffected */
+    server_query = "example.net";
+    struct LookupResult result = table_lookup_server_address(table, NULL,
+            server_query, strlen(server_query), NULL, 0);
+    assert(result.address != NULL);
+
+    table_ref_put(table);
+}
+
+static void
+test_backend_pool_health() {
+    struct Table *table = new_table();
+    assert(table != NULL);
+
+    table_ref_get(table);
+
+    append_entry(table, "^example\\.com$", "192.0.2.10");
+    append_entry(table, "^example\\.com$", "192.0.2.11");
+    append_entry(table, "^example\\.com$", "192.0.2.12");
+
+    init_table(table);
+
+    struct Backend *ejected = STAILQ_NEXT(STAILQ_FIRST(&table->backends), entries);
+    assert(ejected->health != NULL);
+    assert(ejected->health->healthy);
+
+    /* Consecutive connect failures eject the address */
+    backend_health_report(ejected->health, 0);
+    backend_health_report(ejected->health, 0);
+    assert(ejected->health->healthy);
+    backend_health_report(ejected->health, 0);
+    assert(!ejected->health->healthy);
+
+    const char *server_query = "example.com";
+    int used[2] = { 0, 0 };
+
+    for (int i = 1; i < 255; i++) {
+        struct sockaddr_in client = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = htonl(0xc6336400 | i), /* 198.51.100.i */
+        };
+
+        struct LookupResult result = table_lookup_server_address(table,
+                (struct sockaddr *)&client,
+                server_query, strlen(server_query), NULL, 0);
+        assert(result.address != NULL);
+        assert(result.address != ejected->address);
+        assert(result.health != NULL && result.health->healthy);
+
+        used[result.address == STAILQ_FIRST(&table->backends)->address ? 0 : 1]++;
+    }
+
+    /* The ejected member's clients are spread over both remaining members */
+    assert(used[0] > 0 && used[1] > 0);
+
+    /* A success restores it */
+    backend_health_report(ejected->health, 1);
+    assert(ejected->health->healthy);
+
+    table_ref_put(table);
+}
+
+static void
+append_alpn_entry(struct Table *table, const char *pattern,
+        const char *address, const char *alpn_arg) {
+    struct Backend *backend = new_backend();
+    assert(backend != NULL);
+    assert(accept_backend_arg(backend, pattern) == 1);
+    assert(accept_backend_arg(backend, address) == 1);
+    assert(accept_backend_arg(backend, alpn_arg) == 1);
+
+    add_backend(&table->backends, backend);
+}
+
+static void
+test_alpn_backend() {
+    struct Table *table = new_table();
+    assert(table != NULL);
+
+    table_ref_get(table);
+
+    append_alpn_entry(table, "^example\\.com$", "192.0.2.10", "alpn=h2");
+    append_alpn_entry(table, "^example\\.com$", "192.0.2.11", "alpn=acme-tls/1");
+    append_entry(table, "^example\\.com$", "192.0.2.12");
+
+    init_table(table);
+
+    /* Entries for different protocols do not form a pool */
+    struct Backend *h2 = STAILQ_FIRST(&table->backends);
+    struct Backend *acme = STAILQ_NEXT(h2, entries);
+    struct Backend *other = STAILQ_NEXT(acme, entries);
+    assert(h2->pool == NULL && acme->pool == NULL && other->pool == NULL);
+
+    const char *server_query = "example.com";
+    const struct {
+        const char *alpn;
+        size_t alpn_len;
+        const struct Backend *expected;
+    } cases[] = {
+        { "\x02h2\x08http/1.1", 12, h2 },
+        { "\x08http/1.1\x02h2", 12, h2 },
+        { "\x0a" "acme-tls/1", 11, acme },
+        { "\x08http/1.1", 9, other },
+        { "\x02H2", 3, other },  /* protocol names are case sensitive */
+        { NULL, 0, other },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        struct LookupResult result = table_lookup_server_address(table, NULL,
+                server_query, strlen(server_query),
+                cases[i].alpn, cases[i].alpn_len);
+        assert(result.address == cases[i].expected->address);
+    }
+
+    /* Only one protocol per entry */
+    struct Backend *backend = new_backend();
+    assert(backend != NULL);
+    assert(accept_backend_arg(backend, "^example\\.org$") == 1);
+    assert(accept_backend_arg(backend, "192.0.2.30") == 1);
+    assert(accept_backend_arg(backend, "alpn=") == -1);
+    assert(accept_backend_arg(backend, "alpn=h2") == 1);
+    assert(accept_backend_arg(backend, "alpn=http/1.1") == -1);
+    add_backend(&table->backends, backend);
+
+    table_ref_put(table);
+}
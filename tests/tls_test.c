@@ -1,8 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <assert.h>
+#include <ev.h>
 #include "tls.h"
+#include "buffer.h"
+
+#define BENCHMARK_HELLOS 1000000
 
 struct test_packet {
     const char *packet;
@@ -405,6 +412,45 @@ const unsigned char bad_data_4[] = {
             0x00, 0x01, // Length
             0x01 // Mode: Peer allows to send requests
 };
+/* Server name followed by an ALPN extension offering h2 and http/1.1 */
+const unsigned char alpn_data[] = {
+    // TLS record
+    0x16, // Content Type: Handshake
+    0x03, 0x01, // Version: TLS 1.0
+    0x00, 0x53, // Length
+        // Handshake
+        0x01, // Handshake Type: Client Hello
+        0x00, 0x00, 0x4f, // Length
+        0x03, 0x03, // Version: TLS 1.2
+        // Random
+        0x73, 0x6e, 0x69, 0x70, 0x72, 0x6f, 0x78, 0x79,
+        0x73, 0x6e, 0x69, 0x70, 0x72, 0x6f, 0x78, 0x79,
+        0x73, 0x6e, 0x69, 0x70, 0x72, 0x6f, 0x78, 0x79,
+        0x73, 0x6e, 0x69, 0x70, 0x72, 0x6f, 0x78, 0x79,
+        0x00, // Session ID Length
+        0x00, 0x02, // Cipher Suites Length
+            0xc0, 0x2f,
+        0x01, // Compression Methods
+            0x00,
+        0x00, 0x24, // Extensions Length
+            0x00, 0x00, // Extension Type: Server Name
+            0x00, 0x0e, // Length
+            0x00, 0x0c, // Server Name Indication Length
+                0x00, // Server Name Type: host_name
+                0x00, 0x09, // Length
+                // "localhost"
+                0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x68, 0x6f, 0x73, 0x74,
+            0x00, 0x10, // Extension Type: ALPN
+            0x00, 0x0e, // Length
+            0x00, 0x0c, // Protocol Name List Length
+                0x02, // Length
+                // "h2"
+                0x68, 0x32,
+                0x08, // Length
+                // "http/1.1"
+                0x68, 0x74, 0x74, 0x70, 0x2f, 0x31, 0x2e, 0x31
+};
+
 static struct test_packet good[] = {
     { (char *)good_data_1, sizeof(good_data_1) },
     { (char *)good_data_2, sizeof(good_data_2) },
@@ -421,41 +467,396 @@ static struct test_packet bad[] = {
     { (char *)bad_data_3, sizeof(bad_data_3) }
 };
 
+static void test_build_client_hello() {
+    char packet[512];
+    const char *hostname = NULL;
+    struct RequestInfo info;
+
+    size_t len = build_tls_client_hello(packet, sizeof(packet), "localhost");
+    assert(len > 0);
+
+    int result = tls_protocol->parse_packet(packet, len, &hostname, &info);
+    assert(result == 9);
+    assert(0 == strncmp("localhost", hostname, 9));
+    /* a view into the request, not a copy */
+    assert(hostname > packet && hostname + result <= packet + len);
+    hostname = NULL;
+
+    /* Without a hostname the hello is still well formed */
+    len = build_tls_client_hello(packet, sizeof(packet), NULL);
+    assert(len > 0);
+    result = tls_protocol->parse_packet(packet, len, &hostname, &info);
+    assert(result == -2);
+    assert(hostname == NULL);
+
+    /* Incomplete hello */
+    result = tls_protocol->parse_packet(packet, len - 1, &hostname, &info);
+    assert(result == -1);
+
+    /* Too small a destination */
+    assert(build_tls_client_hello(packet, 16, "localhost") == 0);
+}
+
+/* The record split as it used to be done: grow the content by five bytes in
+ * place and memmove the tail of the hello to make room for the new header */
+static size_t
+memmove_split(struct Buffer *buffer, size_t modify_pos) {
+    char *data;
+    buffer_coalesce(buffer, (const void **)&data);
+    buffer_resize(buffer, buffer_len(buffer) + 5);
+    buffer->len += 5;
+    size_t data_len = buffer_coalesce(buffer, (const void **)&data);
+
+    size_t sni_split_pos = 5 + modify_pos + 1;
+    memmove(data + 5 + sni_split_pos, data + sni_split_pos, data_len - 5 - sni_split_pos);
+    memcpy(data + sni_split_pos, data, 5);
+    size_t part1_len = sni_split_pos - 5;
+    size_t record_len = ((size_t)(uint8_t)data[3] << 8) + (uint8_t)data[4];
+    size_t part2_len = record_len - part1_len;
+    data[3] = (char)(part1_len >> 8);
+    data[4] = (char)(part1_len & 0xff);
+    data[sni_split_pos + 3] = (char)(part2_len >> 8);
+    data[sni_split_pos + 4] = (char)(part2_len & 0xff);
+
+    return data_len;
+}
+
+static size_t
+iovec_split(struct Buffer *buffer, size_t modify_pos) {
+    char *data;
+    char header[BUFFER_SPLICE_MAX];
+    size_t header_len = 0;
+    size_t data_len = buffer_coalesce(buffer, (const void **)&data);
+
+    size_t split = tls_protocol->split_packet(data, data_len, modify_pos,
+            header, &header_len);
+    assert(split > 0);
+    assert(buffer_splice(buffer, split, header, header_len));
+
+    return data_len + header_len;
+}
+
+/* Both ways of splitting the record must put the same bytes on the wire */
+static void test_split_record() {
+    int fds[2];
+    char expected[1024], output[1024];
+
+    assert(pipe(fds) == 0);
+
+    for (unsigned int i = 0; i < sizeof(good) / sizeof(struct test_packet); i++) {
+        const char *hostname = NULL;
+        struct RequestInfo info;
+        int result = tls_protocol->parse_packet(good[i].packet, good[i].len,
+                &hostname, &info);
+        assert(result == 9);
+
+        struct Buffer *buffer = new_buffer(4096, EV_DEFAULT);
+        buffer_push(buffer, good[i].packet, good[i].len);
+        size_t len = memmove_split(buffer, info.modify_pos);
+        assert(len == good[i].len + 5);
+        assert(buffer_write(buffer, fds[1]) == (ssize_t)len);
+        assert(read(fds[0], expected, sizeof(expected)) == (ssize_t)len);
+        free_buffer(buffer);
+
+        /* Split a copy, so the spliced content can be left wrapped around
+         * the end of the ring */
+        char packet[512];
+        char header[BUFFER_SPLICE_MAX];
+        size_t header_len = 0;
+        memcpy(packet, good[i].packet, good[i].len);
+        size_t split = tls_protocol->split_packet(packet, good[i].len,
+                info.modify_pos, header, &header_len);
+        assert(split == 5 + info.modify_pos + 1);
+        assert(header_len == 5);
+
+        buffer = new_buffer(256, EV_DEFAULT);
+        buffer_push(buffer, output, 200);
+        buffer_pop(buffer, NULL, 200);
+        buffer_push(buffer, packet, good[i].len);
+        assert(buffer_splice(buffer, split, header, header_len));
+        assert(!buffer_splice(buffer, split, header, header_len));
+        assert(buffer_size(buffer) == 256);
+        assert(buffer_write(buffer, fds[1]) == (ssize_t)len);
+        assert(buffer_len(buffer) == 0);
+        assert(buffer->tx_bytes == 200 + len);
+        assert(read(fds[0], output, sizeof(output)) == (ssize_t)len);
+        free_buffer(buffer);
+
+        assert(memcmp(expected, output, len) == 0);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* Re-frame the handshake message of a single record client hello into records
+ * of at most record_len bytes */
+static size_t
+fragment_hello(const char *packet, size_t len, size_t record_len, char *dst) {
+    size_t pos = 0;
+
+    for (size_t i = 5; i < len; i += record_len) {
+        size_t fragment_len = len - i < record_len ? len - i : record_len;
+        memcpy(dst + pos, packet, 3);
+        dst[pos + 3] = (char)(fragment_len >> 8);
+        dst[pos + 4] = (char)(fragment_len & 0xff);
+        memcpy(dst + pos + 5, packet + i, fragment_len);
+        pos += 5 + fragment_len;
+    }
+
+    return pos;
+}
+
+/* Append a padding extension, so the hello spans several full size records */
+static size_t
+pad_hello(char *packet, size_t len, size_t padding_len) {
+    uint8_t *data = (uint8_t *)packet;
+    size_t pos = 5 + 38;
+
+    pos += 1 + data[pos];                                   /* Session ID */
+    pos += 2 + ((size_t)data[pos] << 8) + data[pos + 1];    /* Cipher Suites */
+    pos += 1 + data[pos];                                   /* Compression */
+
+    size_t extensions_len = ((size_t)data[pos] << 8) + data[pos + 1];
+    assert(pos + 2 + extensions_len == len);
+
+    packet[len] = 0x00;
+    packet[len + 1] = 0x15; /* padding */
+    packet[len + 2] = (char)(padding_len >> 8);
+    packet[len + 3] = (char)(padding_len & 0xff);
+    memset(packet + len + 4, 0, padding_len);
+
+    extensions_len += 4 + padding_len;
+    data[pos] = (uint8_t)(extensions_len >> 8);
+    data[pos + 1] = (uint8_t)(extensions_len & 0xff);
+
+    size_t handshake_len = len + 4 + padding_len - 5 - 4;
+    data[6] = (uint8_t)(handshake_len >> 16);
+    data[7] = (uint8_t)(handshake_len >> 8);
+    data[8] = (uint8_t)(handshake_len & 0xff);
+
+    return len + 4 + padding_len;
+}
+
+static void test_fragmented_hello() {
+    static char packet[8192], fragmented[65536];
+    const size_t record_lens[] = { 1, 7, 100, 1400 };
+    const char *hostname;
+    struct RequestInfo info;
+
+    size_t len = build_tls_client_hello(packet, sizeof(packet), "localhost");
+    len = pad_hello(packet, len, 6000);
+    assert(len > 6000);
+
+    for (size_t i = 0; i < sizeof(record_lens) / sizeof(record_lens[0]); i++) {
+        size_t fragmented_len = fragment_hello(packet, len, record_lens[i], fragmented);
+
+        /* The whole request at once */
+        hostname = NULL;
+        int result = tls_protocol->parse_packet(fragmented, fragmented_len,
+                &hostname, &info);
+        assert(result == 9);
+        assert(0 == strncmp("localhost", hostname, 9));
+
+        /* Anything short of the whole hello is incomplete */
+        hostname = NULL;
+        result = tls_protocol->parse_packet(fragmented, fragmented_len - 1,
+                &hostname, &info);
+        assert(result == -1);
+
+        /* A byte at a time */
+        void *parser = tls_protocol->new_parser(16384);
+        assert(parser != NULL);
+        hostname = NULL;
+        for (size_t j = 0; j < fragmented_len; j++) {
+            result = tls_protocol->parse_more(parser, fragmented + j, 1,
+                    &hostname, &info);
+            assert(result == (j + 1 == fragmented_len ? 9 : -1));
+        }
+        assert(0 == strncmp("localhost", hostname, 9));
+        tls_protocol->free_parser(parser);
+
+        /* Splitting the record holding the server name leaves a hello which
+         * still parses */
+        char header[BUFFER_SPLICE_MAX];
+        size_t header_len = 0;
+        size_t split = tls_protocol->split_packet(fragmented, fragmented_len,
+                info.modify_pos, header, &header_len);
+        if (record_lens[i] == 1) {
+            assert(split == 0); /* the record can not be split any further */
+        } else {
+            assert(split > 0 && header_len == 5);
+            memmove(fragmented + split + header_len, fragmented + split,
+                    fragmented_len - split);
+            memcpy(fragmented + split, header, header_len);
+            hostname = NULL;
+            result = tls_protocol->parse_packet(fragmented,
+                    fragmented_len + header_len, &hostname, &info);
+            assert(result == 9);
+            assert(0 == strncmp("localhost", hostname, 9));
+        }
+    }
+
+    /* Hellos larger than the parser limit are rejected as soon as their
+     * length is known */
+    void *parser = tls_protocol->new_parser(4096);
+    assert(parser != NULL);
+    hostname = NULL;
+    int result = tls_protocol->parse_more(parser, packet, 9, &hostname, &info);
+    assert(result == -6);
+    assert(hostname == NULL);
+    tls_protocol->free_parser(parser);
+
+    /* As are non handshake records in the middle of a hello */
+    size_t fragmented_len = fragment_hello(packet, len, 1400, fragmented);
+    fragmented[1405] = 0x17;
+    hostname = NULL;
+    result = tls_protocol->parse_packet(fragmented, fragmented_len, &hostname, &info);
+    assert(result < -4);
+    assert(hostname == NULL);
+}
+
+static void test_alpn() {
+    static char packet[8192], fragmented[16384];
+    const char expected[] = "\x02h2\x08http/1.1";
+    const char *hostname = NULL;
+    struct RequestInfo info;
+
+    memcpy(packet, alpn_data, sizeof(alpn_data));
+
+    /* Found in the same pass as the server name, as a view */
+    int result = tls_protocol->parse_packet(packet, sizeof(alpn_data),
+            &hostname, &info);
+    assert(result == 9);
+    assert(0 == strncmp("localhost", hostname, 9));
+    assert(info.alpn_len == sizeof(expected) - 1);
+    assert(0 == memcmp(expected, info.alpn, info.alpn_len));
+    assert(info.alpn > packet &&
+            info.alpn + info.alpn_len <= packet + sizeof(alpn_data));
+
+    /* Hellos without one */
+    result = tls_protocol->parse_packet(good[0].packet, good[0].len,
+            &hostname, &info);
+    assert(result == 9);
+    assert(info.alpn == NULL && info.alpn_len == 0);
+
+    /* Reassembled from several records, statelessly and incrementally */
+    size_t fragmented_len = fragment_hello(packet, sizeof(alpn_data), 7,
+            fragmented);
+    result = tls_protocol->parse_packet(fragmented, fragmented_len,
+            &hostname, &info);
+    assert(result == 9);
+    assert(info.alpn_len == sizeof(expected) - 1);
+    assert(0 == memcmp(expected, info.alpn, info.alpn_len));
+
+    void *parser = tls_protocol->new_parser(16384);
+    assert(parser != NULL);
+    for (size_t i = 0; i < fragmented_len; i++)
+        result = tls_protocol->parse_more(parser, fragmented + i, 1,
+                &hostname, &info);
+    assert(result == 9);
+    assert(info.alpn_len == sizeof(expected) - 1);
+    assert(0 == memcmp(expected, info.alpn, info.alpn_len));
+    tls_protocol->free_parser(parser);
+
+    /* A malformed protocol list is ignored, the server name is still used */
+    packet[sizeof(alpn_data) - 9] = 0x09;
+    result = tls_protocol->parse_packet(packet, sizeof(alpn_data),
+            &hostname, &info);
+    assert(result == 9);
+    assert(info.alpn == NULL);
+
+    /* Only whole protocol names are kept when truncating */
+    assert(alpn_list_prefix(expected, sizeof(expected) - 1, 128) == 12);
+    assert(alpn_list_prefix(expected, sizeof(expected) - 1, 11) == 3);
+    assert(alpn_list_prefix(expected, sizeof(expected) - 1, 2) == 0);
+}
+
+static double
+benchmark_split(const char *label, size_t (*split)(struct Buffer *, size_t), int null_fd) {
+    struct timespec start, end;
+    size_t bytes = 0;
+    struct Buffer *buffer = new_buffer(4096, EV_DEFAULT);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCHMARK_HELLOS; i++) {
+        const struct test_packet *packet = &good[i % (sizeof(good) / sizeof(good[0]))];
+        const char *hostname = NULL;
+        struct RequestInfo info;
+
+        buffer_push(buffer, packet->packet, packet->len);
+        assert(tls_protocol->parse_packet(packet->packet, packet->len,
+                    &hostname, &info) == 9);
+
+        bytes += split(buffer, info.modify_pos);
+        buffer_write(buffer, null_fd);
+        assert(buffer_len(buffer) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    free_buffer(buffer);
+
+    double elapsed = (double)(end.tv_sec - start.tv_sec) +
+        (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s: %d client hellos in %.3f seconds, %.0f per second (%zu bytes)\n",
+            label, BENCHMARK_HELLOS, elapsed, BENCHMARK_HELLOS / elapsed, bytes);
+
+    return elapsed;
+}
+
+static void benchmark_split_record() {
+    int null_fd = open("/dev/null", O_WRONLY);
+    assert(null_fd >= 0);
+
+    benchmark_split("memmove split", memmove_split, null_fd);
+    benchmark_split("iovec split", iovec_split, null_fd);
+
+    close(null_fd);
+}
+
 int main() {
     unsigned int i;
     int result;
-    char *hostname;
+    const char *hostname;
+    struct RequestInfo info;
 
     for (i = 0; i < sizeof(good) / sizeof(struct test_packet); i++) {
         hostname = NULL;
 
-        result = tls_protocol->parse_packet(good[i].packet, good[i].len, &hostname);
+        result = tls_protocol->parse_packet(good[i].packet, good[i].len, &hostname, &info);
 
         assert(result == 9);
 
         assert(NULL != hostname);
 
-        assert(0 == strcmp("localhost", hostname));
+        assert(0 == strncmp("localhost", hostname, 9));
 
-        free(hostname);
     }
 
-    result = tls_protocol->parse_packet(good[0].packet, good[0].len, NULL);
+    result = tls_protocol->parse_packet(good[0].packet, good[0].len, NULL, &info);
     assert(result == -3);
 
     for (i = 0; i < sizeof(bad) / sizeof(struct test_packet); i++) {
         hostname = NULL;
 
-        result = tls_protocol->parse_packet(bad[i].packet, bad[i].len, &hostname);
+        result = tls_protocol->parse_packet(bad[i].packet, bad[i].len, &hostname, &info);
 
         // parse failure or not "localhost"
-        assert(result < 0 ||
+        assert(result != 9 ||
                hostname == NULL ||
-               strcmp("localhost", hostname) != 0);
-
-        free(hostname);
+               strncmp("localhost", hostname, 9) != 0);
     }
 
+    test_build_client_hello();
+
+    test_split_record();
+
+    test_fragmented_hello();
+
+    test_alpn();
+
+    benchmark_split_record();
+
     return 0;
 }
 
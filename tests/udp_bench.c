@@ -0,0 +1,297 @@
+/*
+ * Loopback throughput benchmark for datagram listeners
+ *
+ * Runs an echo server on server_port and sends windows of datagrams to
+ * sniproxy on proxy_port, which should forward them to the echo server, see
+ * bench_udp. Reports the datagrams per second forwarded in both directions.
+ * With -g each batch is sent as one buffer split by the kernel (UDP GSO),
+ * which sniproxy may receive still coalesced (UDP GRO).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+
+#define BATCH 64
+#define MAX_SIZE 1500
+
+
+static int segment_offload;
+
+
+static int udp_socket(int, int);
+static int send_batch(int, size_t, unsigned int);
+static void echo_server(int);
+static void run_client(int, long, size_t, unsigned int);
+static int receive_replies(int);
+static double elapsed(const struct timespec *);
+
+
+int main(int argc, char **argv) {
+    long datagrams = 1000000;
+    size_t size = 1200;
+    unsigned int window = 256;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "gn:s:w:")) != -1) {
+        switch (opt) {
+            case 'g':
+                segment_offload = 1;
+                break;
+            case 'n':
+                datagrams = atol(optarg);
+                break;
+            case 's':
+                size = (size_t)atol(optarg);
+                break;
+            case 'w':
+                window = (unsigned int)atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-g] [-n datagrams] [-s size] "
+                        "[-w window] proxy_port server_port\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (argc - optind != 2 || size == 0 || size > MAX_SIZE || window == 0) {
+        fprintf(stderr, "usage: %s [-g] [-n datagrams] [-s size] "
+                "[-w window] proxy_port server_port\n", argv[0]);
+        return 1;
+    }
+
+    int proxy_port = atoi(argv[optind]);
+    int server_port = atoi(argv[optind + 1]);
+
+    int server = udp_socket(server_port, 0);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    } else if (pid == 0) {
+        echo_server(server);
+        return 0;
+    }
+    close(server);
+
+    run_client(udp_socket(0, proxy_port), datagrams, size, window);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    return 0;
+}
+
+/* Bound to local_port or connected to remote_port on the loopback address */
+static int
+udp_socket(int local_port, int remote_port) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    int buffer_size = 4 * 1024 * 1024;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+    if (local_port) {
+        addr.sin_port = htons((uint16_t)local_port);
+        if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("bind");
+            exit(1);
+        }
+    } else {
+        addr.sin_port = htons((uint16_t)remote_port);
+        if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("connect");
+            exit(1);
+        }
+    }
+
+    return sockfd;
+}
+
+static void
+echo_server(int sockfd) {
+    static char buffers[BATCH][MAX_SIZE];
+    struct sockaddr_storage addrs[BATCH];
+    struct iovec iovs[BATCH];
+    struct mmsghdr msgs[BATCH];
+
+    for (;;) {
+        for (int i = 0; i < BATCH; i++) {
+            iovs[i] = (struct iovec){ buffers[i], MAX_SIZE };
+            msgs[i].msg_hdr = (struct msghdr){
+                .msg_name = &addrs[i],
+                .msg_namelen = sizeof(addrs[i]),
+                .msg_iov = &iovs[i],
+                .msg_iovlen = 1,
+            };
+        }
+
+        int count = recvmmsg(sockfd, msgs, BATCH, MSG_WAITFORONE, NULL);
+        if (count < 0)
+            continue;
+
+        for (int i = 0; i < count; i++)
+            iovs[i].iov_len = msgs[i].msg_len;
+
+        sendmmsg(sockfd, msgs, (unsigned int)count, 0);
+    }
+}
+
+/*
+ * Keep up to window datagrams in flight, counting those which come back,
+ * until the requested number have been sent
+ */
+static void
+run_client(int sockfd, long datagrams, size_t size, unsigned int window) {
+    struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+    struct timespec start;
+    long sent = 0, received = 0, lost = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (sent < datagrams) {
+        /* Top up the window */
+        while (sent - received - lost < (long)window && sent < datagrams) {
+            unsigned int in_flight = (unsigned int)(sent - received - lost);
+            unsigned int count = BATCH;
+            if (count > window - in_flight)
+                count = window - in_flight;
+            if (count > datagrams - sent)
+                count = (unsigned int)(datagrams - sent);
+
+            sent += send_batch(sockfd, size, count);
+        }
+
+        /* Datagrams not back within 100ms are taken as lost */
+        if (poll(&pfd, 1, 100) <= 0) {
+            lost = sent - received;
+            continue;
+        }
+
+        received += receive_replies(sockfd);
+    }
+
+    /* Collect the last window */
+    while (sent - received - lost > 0 && poll(&pfd, 1, 100) > 0) {
+        received += receive_replies(sockfd);
+    }
+
+    double seconds = elapsed(&start);
+    printf("%ld datagrams of %zu bytes sent, %ld returned in %.3f seconds\n",
+            sent, size, received, seconds);
+    printf("%.0f datagrams/sec forwarded in each direction\n",
+            (double)received / seconds);
+}
+
+/* Returns the number of datagrams sent */
+static int
+send_batch(int sockfd, size_t size, unsigned int count) {
+    static char buffer[BATCH * MAX_SIZE];
+    struct iovec iovs[BATCH];
+    struct mmsghdr msgs[BATCH];
+    int result;
+
+    if (buffer[0] == '\0')
+        memset(buffer, 'x', sizeof(buffer));
+
+    if (segment_offload) {
+#ifdef UDP_SEGMENT
+        union {
+            char buf[CMSG_SPACE(sizeof(uint16_t))];
+            size_t align;
+        } control;
+        uint16_t gso_size = (uint16_t)size;
+
+        /* Largest UDP payload */
+        if (count * size > 65507)
+            count = (unsigned int)(65507 / size);
+
+        iovs[0] = (struct iovec){ buffer, count * size };
+        struct msghdr msg = {
+            .msg_iov = &iovs[0],
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf),
+        };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = IPPROTO_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+        memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+
+        if (sendmsg(sockfd, &msg, 0) < 0) {
+            perror("sendmsg");
+            exit(1);
+        }
+
+        return (int)count;
+#else
+        fprintf(stderr, "UDP_SEGMENT not supported\n");
+        exit(1);
+#endif
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        iovs[i] = (struct iovec){ buffer + i * size, size };
+        msgs[i].msg_hdr = (struct msghdr){
+            .msg_iov = &iovs[i],
+            .msg_iovlen = 1,
+        };
+    }
+
+    result = sendmmsg(sockfd, msgs, count, 0);
+    if (result < 0) {
+        perror("sendmmsg");
+        exit(1);
+    }
+
+    return result;
+}
+
+static int
+receive_replies(int sockfd) {
+    static char buffers[BATCH][MAX_SIZE];
+    struct iovec iovs[BATCH];
+    struct mmsghdr msgs[BATCH];
+
+    for (int i = 0; i < BATCH; i++) {
+        iovs[i] = (struct iovec){ buffers[i], MAX_SIZE };
+        msgs[i].msg_hdr = (struct msghdr){
+            .msg_iov = &iovs[i],
+            .msg_iovlen = 1,
+        };
+    }
+
+    int count = recvmmsg(sockfd, msgs, BATCH, MSG_DONTWAIT, NULL);
+
+    return count > 0 ? count : 0;
+}
+
+static double
+elapsed(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)(now.tv_sec - start->tv_sec) +
+        (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}